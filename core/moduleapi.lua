@@ -24,7 +24,7 @@ local jid_resource = require "prosody.util.jid".resource;
 local human_io = require "prosody.util.human.io";
 
 local t_insert, t_remove, t_concat = table.insert, table.remove, table.concat;
-local error, setmetatable, type = error, setmetatable, type;
+local error, pcall, setmetatable, type = error, pcall, setmetatable, type;
 local ipairs, pairs, select = ipairs, pairs, select;
 local tonumber, tostring = tonumber, tostring;
 local require = require;
@@ -82,14 +82,46 @@ function api:fire_event(...)
 	return (hosts[self.host] or prosody).events.fire_event(...);
 end
 
+local memtag, new_memtag;
+if prosody.memory_accounting then
+	local pposix = require "prosody.util.pposix";
+	memtag, new_memtag = pposix.memtag, pposix.new_memtag;
+end
+
+local function restore_memtag(previous, ok, ...)
+	memtag(previous);
+	if not ok then
+		error((...), 0);
+	end
+	return ...;
+end
+
+-- With memory_accounting enabled, what f allocates is counted towards this
+-- module in pposix.meminfo().tags. Errors thrown by f are passed on once the
+-- previous tag is back.
+function api:account_memory(f)
+	if not memtag then return f; end
+	local tag = self.memtag;
+	if not tag then
+		tag = new_memtag("mod_"..self.name);
+		if not tag then return f; end
+		self.memtag = tag;
+	end
+	return function (...)
+		return restore_memtag(memtag(tag), pcall(f, ...));
+	end
+end
+
 function api:hook_object_event(object, event, handler, priority)
-	self.event_handlers:set(object, event, handler, true);
-	return object.add_handler(event, handler, priority);
+	local wrapped = self.event_handlers:get(object, event, handler) or self:account_memory(handler);
+	self.event_handlers:set(object, event, handler, wrapped);
+	return object.add_handler(event, wrapped, priority);
 end
 
 function api:unhook_object_event(object, event, handler)
+	local wrapped = self.event_handlers:get(object, event, handler);
 	self.event_handlers:set(object, event, handler, nil);
-	return object.remove_handler(event, handler);
+	return object.remove_handler(event, wrapped or handler);
 end
 
 function api:hook(event, handler, priority)
@@ -607,7 +639,7 @@ end
 function api:add_timer(delay, callback, ...)
 	local t = pack(...)
 	t.module_env = self;
-	t.callback = callback;
+	t.callback = self:account_memory(callback);
 	t.id = timer.add_task(delay, timer_callback, t);
 	return setmetatable(t, timer_mt);
 end
@@ -170,8 +170,8 @@ local function do_unload_module(host, name)
 		end
 	end
 
-	for object, event, handler in mod.module.event_handlers:iter(nil, nil, nil) do
-		object.remove_handler(event, handler);
+	for object, event, handler, wrapped in mod.module.event_handlers:iter(nil, nil, nil) do
+		object.remove_handler(event, wrapped or handler);
 	end
 
 	if mod.module.items then -- remove items
@@ -288,7 +288,7 @@ local function do_load_module(host, module_name, state)
 	end
 
 	modulemap[host][module_name] = pluginenv;
-	local ok, err = xpcall(mod, debug_traceback);
+	local ok, err = xpcall(api_instance:account_memory(mod), debug_traceback);
 	if ok then
 		-- Call module's "load"
 		if module_has_method(pluginenv, "load") then
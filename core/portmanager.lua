@@ -135,6 +135,8 @@ local function activate(service_name)
 						tls_ctx = ssl,
 						tls_direct = service_info.encryption == "ssl";
 						sni_hosts = {},
+						-- Every worker process binds its own socket for the kernel to balance between
+						reuseport = prosody.worker_id ~= nil;
 					});
 					if not handler then
 						log("error", "Failed to open server port %d on %s, %s", port_number, interface,
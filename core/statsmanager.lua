@@ -209,6 +209,43 @@ if stats then
 		local mark_collection_start = measure("times", "stats.collection");
 		local mark_processing_start = measure("times", "stats.processing");
 
+		local stringprep_cache_stats = require "prosody.util.encodings".stringprep.cache_stats;
+		local stringprep_cache = metric("counter", "prosody_stringprep_cache", "", "Lookups in the cache of prepped JID parts", {"result"});
+		prosody.events.add_handler("stats-update", function ()
+			local hits, misses = stringprep_cache_stats();
+			stringprep_cache:with_labels("hit"):set(hits);
+			stringprep_cache:with_labels("miss"):set(misses);
+		end);
+
+		-- Recorded by net.server_epoll with network_settings = { loop_stats = true }
+		local network_settings = config.get("*", "network_settings");
+		local have_loopstats, loopstats = pcall(require, "prosody.util.loopstats");
+		local registry = stats.metric_registry;
+		if have_loopstats and type(network_settings) == "table" and network_settings.loop_stats
+		and registry and registry.external_histogram then
+			local function loop_histogram(name, unit, description)
+				local id = loopstats.histograms[name];
+				registry:external_histogram("prosody_loop_"..name, unit, description, loopstats.bounds(id), function ()
+					return loopstats.histogram(id);
+				end);
+			end
+			loop_histogram("wait", "seconds", "Time spent waiting for network events");
+			loop_histogram("events", "", "Network events returned by each wait");
+			loop_histogram("onreadable", "seconds", "Time spent handling readable sockets");
+			loop_histogram("onwritable", "seconds", "Time spent handling writable sockets");
+			loop_histogram("timer", "seconds", "Time spent in timer callbacks");
+
+			local counters = loopstats.counters;
+			local bytes_read = metric("counter", "prosody_loop_read", "bytes", "Bytes read from sockets"):with_labels();
+			local bytes_written = metric("counter", "prosody_loop_written", "bytes", "Bytes written to sockets"):with_labels();
+			local short_writes = metric("counter", "prosody_loop_short_writes", "", "Writes that left data in the buffer"):with_labels();
+			prosody.events.add_handler("stats-update", function ()
+				bytes_read:set(loopstats.counter(counters.bytes_read));
+				bytes_written:set(loopstats.counter(counters.bytes_written));
+				short_writes:set(loopstats.counter(counters.short_writes));
+			end);
+		end
+
 		function collect()
 			local mark_collection_done = mark_collection_start();
 			fire_event("stats-update");
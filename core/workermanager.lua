@@ -0,0 +1,769 @@
+-- Prosody IM
+--
+-- This project is MIT/X11 licensed. Please see the
+-- COPYING file in the source package for more information.
+--
+-- With workers = N in the config, the main process becomes a supervisor that
+-- forks N workers and restarts them when they exit. Each worker runs its own
+-- event loop and opens its own SO_REUSEPORT listeners, so the kernel spreads
+-- connections across them. All storage must use a driver that several
+-- processes can write to at once, i.e. sql.
+--
+-- Workers tell the supervisor which full JIDs they hold sessions for, and the
+-- supervisor tells all the others. Stanzas are relayed between workers
+-- through the supervisor over a unix socket:
+--
+-- - stanzas to a full JID go to the worker holding that session;
+-- - stanzas to a bare JID are processed by the worker owning the account,
+--   the lowest numbered worker with sessions for it, so that archiving,
+--   offline storage and roster changes happen once. It then hands messages
+--   and presence that end up delivered to sessions to the other workers;
+-- - probes go to every worker with sessions, each answers for its own;
+-- - roster changes make the other workers reload the item and push it to
+--   their sessions.
+
+local config = require "prosody.core.configmanager";
+local server = require "prosody.net.server";
+local rostermanager = require "prosody.core.rostermanager";
+local sessionmanager = require "prosody.core.sessionmanager";
+local storagemanager = require "prosody.core.storagemanager";
+local log = require "prosody.util.logger".init("workermanager");
+local struct = require "prosody.util.struct";
+local dbuffer = require "prosody.util.dbuffer";
+local xml_parse = require "prosody.util.xml".parse;
+local jid_bare = require "prosody.util.jid".bare;
+local jid_host = require "prosody.util.jid".host;
+local jid_split = require "prosody.util.jid".split;
+local monotonic = require "prosody.util.time".monotonic;
+local resolve_relative_path = require "prosody.util.paths".resolve_relative_path;
+
+local have_pposix, pposix = pcall(require, "prosody.util.pposix");
+local have_signal, signal = pcall(require, "prosody.util.signal");
+local have_net, net = pcall(require, "prosody.util.net");
+local have_unix, unix = pcall(require, "socket.unix");
+if have_unix and type(unix) == "function" then
+	-- COMPAT #1717, see mod_admin_socket
+	unix = { stream = unix };
+end
+
+local prosody = prosody;
+local hosts = prosody.hosts;
+local full_sessions, bare_sessions = prosody.full_sessions, prosody.bare_sessions;
+
+local pairs, ipairs, next, type, tonumber, tostring = pairs, ipairs, next, type, tonumber, tostring;
+local pcall = pcall;
+local os_remove = os.remove;
+
+local _ENV = nil;
+-- luacheck: std none
+
+-- Frames are a 4 byte length followed by a payload, of which the first byte
+-- is the type:
+--   H<id>                  a worker introducing itself
+--   B<id>\0<jid>           worker <id> bound a session
+--   U<id>\0<jid>           worker <id> lost a session
+--   K<id>\0<jid>           worker <id> bound <jid> too, close the session here
+--   S<id>\0<xml>           a stanza to route on worker <id>
+--   M<id>\0<bare>\0<xml>   a message to deliver to the sessions of <bare>
+--   D<id>\0<bare>\0<xml>   a stanza for the available sessions of <bare>
+--   I<id>\0<bare>\0<xml>   a stanza for the sessions of <bare> that fetched the roster
+--   R<id>\0<bare>\0<jid>   worker <id> changed the roster item <jid> of <bare>
+-- Workers leave out <id> in B, U and R, the supervisor fills it in.
+local length_prefix = struct.compile(">I4");
+local max_frame_size = 16*1024*1024;
+
+-- Don't respawn a worker more often than this
+local respawn_delay = 10;
+
+local function frame(payload)
+	return length_prefix:pack(#payload) .. payload;
+end
+
+-- Returns a function taking data as it arrives, calling handler(payload) per frame
+local function framer(handler)
+	-- Enough chunks for a frame of the largest size in 8k reads, so that
+	-- reassembling it doesn't keep collapsing the buffer
+	local buffer = dbuffer.new(nil, 2048);
+	local len; -- of the frame being read, once its prefix is in
+	return function (data)
+		if not buffer:write(data) then
+			return nil, "buffer full";
+		end
+		while true do
+			if not len then
+				if buffer:length() < 4 then break; end
+				len = length_prefix:unpack(buffer:read(4));
+				if len > max_frame_size then
+					return nil, "frame too large";
+				end
+			end
+			if len == 0 then
+				handler("");
+			elseif buffer:length() < len then
+				break;
+			else
+				handler(buffer:read(len));
+			end
+			len = nil;
+		end
+		return true;
+	end;
+end
+
+local function split_payload(payload)
+	local id, data = payload:match("^.(%d+)\0(.*)$");
+	if not id then return nil; end
+	return tonumber(id), data;
+end
+
+--- Worker side
+
+local worker_id; -- set in workers
+local supervisor; -- connection to the supervisor
+local supervisor_read; -- framer for data from the supervisor
+local remote_full = {}; -- full JID -> worker id
+local remote_bare = {}; -- bare JID -> { [full JID] = worker id }
+local relaying = false; -- true while posting a stanza relayed from another worker
+
+local send_to_available_resources = sessionmanager.send_to_available_resources;
+local send_to_interested_resources = sessionmanager.send_to_interested_resources;
+local roster_push = rostermanager.roster_push;
+
+local function send_supervisor(payload)
+	if supervisor then
+		supervisor:write(frame(payload));
+	end
+end
+
+local function relay(id, stanza)
+	send_supervisor("S" .. id .. "\0" .. tostring(stanza));
+end
+
+local function remote_bound(id, jid)
+	local bare = jid_bare(jid);
+	remote_full[jid] = id;
+	local sessions = remote_bare[bare];
+	if not sessions then
+		sessions = {};
+		remote_bare[bare] = sessions;
+	end
+	sessions[jid] = id;
+end
+
+local function remote_unbound(id, jid)
+	if remote_full[jid] ~= id then return; end
+	local bare = jid_bare(jid);
+	remote_full[jid] = nil;
+	local sessions = remote_bare[bare];
+	sessions[jid] = nil;
+	if next(sessions) == nil then
+		remote_bare[bare] = nil;
+	end
+end
+
+-- The other workers with sessions for a bare JID
+local function remote_workers(bare)
+	local ids = {};
+	local sessions = remote_bare[bare];
+	if sessions then
+		for _, id in pairs(sessions) do
+			ids[id] = true;
+		end
+	end
+	return ids;
+end
+
+-- The worker that processes stanzas for an account
+local function owner_of(bare)
+	local owner = bare_sessions[bare] and worker_id or nil;
+	for id in pairs(remote_workers(bare)) do
+		if not owner or id < owner then
+			owner = id;
+		end
+	end
+	return owner or worker_id;
+end
+
+local function deliver_remote(kind, bare, stanza)
+	local ids = remote_workers(bare);
+	if next(ids) == nil then return; end
+	local payload = bare .. "\0" .. tostring(stanza);
+	for id in pairs(ids) do
+		send_supervisor(kind .. id .. "\0" .. payload);
+	end
+end
+
+-- Final delivery of a stanza from the owning worker to the sessions here,
+-- following mod_message and mod_presence
+local function deliver_local(kind, bare, stanza)
+	local user = bare_sessions[bare];
+	if not user then return; end
+	if kind == "M" and stanza.attr.type ~= "headline" then
+		local recipients = user.top_resources;
+		if recipients then
+			for i = 1, #recipients do
+				recipients[i].send(stanza);
+			end
+		end
+		return;
+	end
+	for _, session in pairs(user.sessions) do
+		if (kind == "I" and session.interested)
+		or (kind == "D" and session.presence)
+		or (kind == "M" and session.presence and session.priority >= 0) then
+			session.send(stanza);
+		end
+	end
+end
+
+-- Another worker changed a roster item in storage
+local function roster_changed(bare, contact)
+	local username, host = jid_split(bare);
+	if not hosts[host] then return; end
+	local roster_cache = hosts[host].roster_cache;
+	if roster_cache then
+		roster_cache:set(bare, nil);
+	end
+	local user = bare_sessions[bare];
+	local roster = user and user.roster;
+	if not roster then return; end
+	-- Sessions share the roster table, so update it in place
+	local roster_store = storagemanager.open(host, "roster", "map");
+	local item, err = roster_store:get(username, contact);
+	local metadata = not err and roster_store:get(username, false);
+	if err then
+		log("warn", "Could not reload roster item %s of %s: %s", contact, bare, err);
+		return;
+	end
+	roster[contact] = item;
+	if metadata then
+		roster[false] = metadata;
+	end
+	return roster_push(username, host, contact);
+end
+
+local function handle_from_supervisor(payload)
+	local t = payload:sub(1, 1);
+	local id, data = split_payload(payload);
+	if not id then
+		log("warn", "Malformed message from the supervisor");
+	elseif t == "B" then
+		remote_bound(id, data);
+	elseif t == "U" then
+		remote_unbound(id, data);
+	elseif t == "K" then
+		local session = full_sessions[data];
+		if session then
+			log("debug", "Session %s was replaced by one on worker %d", data, id);
+			session:close{ condition = "conflict", text = "Replaced by new connection" };
+		end
+	elseif t == "R" then
+		local bare, contact = data:match("^([^\0]*)\0(.*)$");
+		if bare then
+			roster_changed(bare, contact);
+		end
+	elseif t == "S" or t == "M" or t == "D" or t == "I" then
+		local bare;
+		if t ~= "S" then
+			bare, data = data:match("^([^\0]*)\0(.*)$");
+			if not bare then
+				log("warn", "Malformed message from the supervisor");
+				return;
+			end
+		end
+		local stanza, err = xml_parse(data);
+		if not stanza then
+			log("warn", "Could not parse stanza relayed from worker %d: %s", id, err);
+			return;
+		end
+		if bare then
+			return deliver_local(t, bare, stanza);
+		end
+		local host = hosts[jid_host(stanza.attr.to)];
+		if not host then
+			log("warn", "Worker %d relayed a stanza for a host that's not here: %s", id, stanza.attr.to);
+			return;
+		end
+		relaying = true;
+		local ok, ret = pcall(prosody.core_post_stanza, host, stanza);
+		relaying = false;
+		if not ok then
+			log("error", "Error processing stanza relayed from worker %d: %s", id, ret);
+		end
+	end
+end
+
+local worker_listeners = {};
+
+function worker_listeners.ondisconnect()
+	supervisor, supervisor_read = nil, nil;
+	if prosody.state ~= "stopping" and prosody.state ~= "stopped" then
+		prosody.shutdown("Lost connection to the worker supervisor", 1);
+	end
+end
+
+-- Stanzas for a full JID held by another worker go straight there, and
+-- messages for a resource that isn't online anywhere go to the owner
+local function route_full(event)
+	if not worker_id or relaying then return; end
+	local stanza = event.stanza;
+	local to = stanza.attr.to;
+	if full_sessions[to] then return; end
+	local id = remote_full[to];
+	if not id and stanza.name == "message" then
+		id = owner_of(jid_bare(to));
+		if id == worker_id then return; end
+	end
+	if id then
+		relay(id, stanza);
+		return true;
+	end
+end
+
+-- Stanzas for a bare JID are processed by the worker owning the account,
+-- except probes, which every worker with sessions answers
+local function route_bare(event)
+	if not worker_id or relaying then return; end
+	local stanza = event.stanza;
+	local to = stanza.attr.to;
+	if not to then return; end
+	if stanza.name == "presence" and stanza.attr.type == "probe" then
+		local ids = remote_workers(to);
+		for id in pairs(ids) do
+			relay(id, stanza);
+		end
+		if next(ids) and not bare_sessions[to] then
+			-- Answered elsewhere, don't reply as if unavailable
+			return true;
+		end
+		return;
+	end
+	local owner = owner_of(to);
+	if owner ~= worker_id then
+		relay(owner, stanza);
+		return true;
+	end
+end
+
+-- On the owning worker, after blocking and privacy checks, hand messages
+-- and presence broadcasts on to the sessions on other workers
+local function deliver_bare(event)
+	if not worker_id then return; end
+	local stanza = event.stanza;
+	local to, t = stanza.attr.to, stanza.attr.type;
+	if not to then return; end
+	if stanza.name == "message" then
+		if t == "error" or t == "groupchat" then return; end
+		local bare = jid_bare(to);
+		if bare ~= to and (full_sessions[to] or remote_full[to]) then return; end
+		deliver_remote("M", bare, stanza);
+	elseif t == nil or t == "unavailable" or t == "error" then
+		-- Subscriptions go through send_to_*_resources() below
+		deliver_remote("D", to, stanza);
+	end
+end
+
+local function hook_host(host)
+	local events = hosts[host].events;
+	events.add_handler("resource-bind", function (event)
+		if worker_id then
+			send_supervisor("B" .. event.session.full_jid);
+		end
+	end);
+	events.add_handler("resource-unbind", function (event)
+		if worker_id and event.session.full_jid then
+			send_supervisor("U" .. event.session.full_jid);
+		end
+	end);
+	for _, name in ipairs({ "message", "presence", "iq" }) do
+		events.add_handler(name .. "/full", route_full, 1000);
+	end
+	events.add_handler("message/bare", route_bare, 1000);
+	events.add_handler("presence/bare", route_bare, 1000);
+	-- Below mod_blocklist, above mod_mam, mod_carbons and mod_message
+	events.add_handler("message/bare", deliver_bare, 10);
+	events.add_handler("message/full", deliver_bare, 10);
+	events.add_handler("presence/bare", deliver_bare, 10);
+end
+
+-- Sessions for an account may be on any worker, so deliveries and roster
+-- pushes made through these reach the other workers too
+local function hook_managers()
+	function sessionmanager.send_to_available_resources(username, host, stanza)
+		if worker_id then
+			deliver_remote("D", username .. "@" .. host, stanza);
+		end
+		return send_to_available_resources(username, host, stanza);
+	end
+	function sessionmanager.send_to_interested_resources(username, host, stanza)
+		if worker_id then
+			deliver_remote("I", username .. "@" .. host, stanza);
+		end
+		return send_to_interested_resources(username, host, stanza);
+	end
+	function rostermanager.roster_push(username, host, jid)
+		if worker_id and jid then
+			send_supervisor("R" .. username .. "@" .. host .. "\0" .. jid);
+		end
+		return roster_push(username, host, jid);
+	end
+end
+
+--- Supervisor side
+
+local worker_count;
+local socket_path;
+local listener; -- the supervisor's unix socket
+local workers = {}; -- id -> { pid, conn, jids, started }
+local connections = {}; -- conn -> { id, pid, read }
+local owners = {}; -- full JID -> id of the worker holding it
+local stopping = false;
+
+local function broadcast(from, payload)
+	local data = frame(payload);
+	for id, worker in pairs(workers) do
+		if id ~= from and worker.conn then
+			worker.conn:write(data);
+		end
+	end
+end
+
+local function forget_sessions(id)
+	local worker = workers[id];
+	if not worker then return; end
+	for jid in pairs(worker.jids) do
+		if owners[jid] == id then
+			owners[jid] = nil;
+			broadcast(id, "U" .. id .. "\0" .. jid);
+		end
+	end
+	worker.jids = {};
+end
+
+local function bound(id, jid)
+	local old = owners[jid];
+	if old == id then return; end
+	if old then
+		-- The same resource bound on two workers, the newer session wins
+		local worker = workers[old];
+		worker.jids[jid] = nil;
+		if worker.conn then
+			worker.conn:write(frame("K" .. id .. "\0" .. jid));
+		end
+		broadcast(old, "U" .. old .. "\0" .. jid);
+	end
+	owners[jid] = id;
+	workers[id].jids[jid] = true;
+	broadcast(id, "B" .. id .. "\0" .. jid);
+end
+
+local function unbound(id, jid)
+	workers[id].jids[jid] = nil;
+	if owners[jid] ~= id then return; end -- already replaced
+	owners[jid] = nil;
+	broadcast(id, "U" .. id .. "\0" .. jid);
+end
+
+local function handle_from_worker(conn, payload)
+	local state = connections[conn];
+	local t = payload:sub(1, 1);
+	if t == "H" then
+		local id = tonumber(payload:sub(2));
+		local worker = workers[id];
+		if not worker or state.id then
+			log("warn", "Connection from unknown worker %s", id);
+			conn:close();
+			return;
+		elseif state.pid ~= worker.pid then
+			-- Only the process we forked may speak for a worker
+			log("warn", "Connection claiming to be worker %d from PID %s, expected %d", id, state.pid, worker.pid);
+			conn:close();
+			return;
+		end
+		state.id, worker.conn = id, conn;
+		-- Catch it up with the sessions on the others
+		for jid, other_id in pairs(owners) do
+			if other_id ~= id then
+				conn:write(frame("B" .. other_id .. "\0" .. jid));
+			end
+		end
+		return;
+	end
+	local id = state.id;
+	if not id then
+		conn:close();
+		return;
+	end
+	local worker = workers[id];
+	if not worker or worker.conn ~= conn then
+		return; -- reaped while data was still coming in
+	elseif t == "B" then
+		bound(id, payload:sub(2));
+	elseif t == "U" then
+		unbound(id, payload:sub(2));
+	elseif t == "R" then
+		broadcast(id, "R" .. id .. "\0" .. payload:sub(2));
+	elseif t == "S" or t == "M" or t == "D" or t == "I" then
+		local to, data = split_payload(payload);
+		local target = workers[to];
+		if not to then
+			log("warn", "Malformed message from worker %d", id);
+		elseif target and target.conn then
+			target.conn:write(frame(t .. id .. "\0" .. data));
+		else
+			log("debug", "Dropping stanza from worker %d for worker %s, which is gone", id, to);
+		end
+	end
+end
+
+local supervisor_listeners = {};
+
+function supervisor_listeners.onconnect(conn)
+	local read = framer(function (payload)
+		return handle_from_worker(conn, payload);
+	end);
+	local pid = net.peercred(conn:getfd());
+	connections[conn] = { pid = pid, read = read };
+end
+
+function supervisor_listeners.onincoming(conn, data)
+	local state = connections[conn];
+	local ok, err = state.read(data);
+	if not ok then
+		log("error", "Closing connection from worker %s: %s", state.id, err);
+		conn:close();
+	end
+end
+
+function supervisor_listeners.ondisconnect(conn)
+	local state = connections[conn];
+	connections[conn] = nil;
+	if worker_id or not state then return; end -- inherited by a worker
+	local worker = workers[state.id];
+	if worker and worker.conn == conn then
+		worker.conn = nil;
+		forget_sessions(state.id);
+	end
+end
+
+function worker_listeners.onincoming(conn, data)
+	local ok, err = supervisor_read(data);
+	if not ok then
+		log("error", "Closing connection to the supervisor: %s", err);
+		conn:close();
+	end
+end
+
+-- Close the copies of the supervisor's sockets a new worker starts out with
+local function drop_inherited(conn)
+	conn:del();
+	conn.conn:close();
+end
+
+local function become_worker(id)
+	worker_id = id;
+	prosody.worker_id = id;
+	server.forked();
+
+	if listener then
+		drop_inherited(listener);
+		listener = nil;
+	end
+	for conn in pairs(connections) do
+		drop_inherited(conn);
+	end
+	connections, workers, owners = {}, {}, {};
+
+	prosody.events.fire_event("worker-started", { id = id });
+
+	local sock = unix.stream();
+	local ok, err = sock:connect(socket_path);
+	if not ok then
+		log("error", "Worker %d could not connect to the supervisor: %s", id, err);
+		return prosody.shutdown("Could not connect to the worker supervisor", 1);
+	end
+	supervisor_read = framer(handle_from_supervisor);
+	supervisor = server.wrapclient(sock, "unix", 0, worker_listeners, "*a");
+	send_supervisor("H" .. id);
+	log("info", "Worker %d started with PID %d", id, pposix.getpid());
+end
+
+-- Returns true in the new worker
+local function spawn(id)
+	local pid, err = pposix.fork();
+	if not pid then
+		log("error", "Could not start worker %d: %s", id, err);
+		return false;
+	elseif pid == 0 then
+		become_worker(id);
+		return true;
+	end
+	workers[id] = { pid = pid; jids = {}; started = monotonic() };
+	return false;
+end
+
+-- Workers started from the running supervisor go through startup themselves
+local function start_respawned()
+	prosody.main_thread:run(function ()
+		prosody.events.fire_event("server-starting");
+		prosody.events.fire_event("server-started");
+	end);
+end
+
+local pending_respawn = {};
+
+local function respawn(id)
+	pending_respawn[id] = nil;
+	if stopping or worker_id then return; end
+	if spawn(id) then
+		start_respawned();
+	end
+end
+
+local function reap()
+	if worker_id then return; end -- a timer inherited by a worker
+	while true do
+		local pid, how, code = pposix.waitpid(-1, true);
+		if not pid then break; end
+		for id, worker in pairs(workers) do
+			if worker.pid == pid then
+				log(stopping and "debug" or "warn", "Worker %d (PID %d) %s with %d", id, pid, how, code);
+				forget_sessions(id);
+				workers[id] = nil;
+				if not stopping and not pending_respawn[id] then
+					local delay = worker.started + respawn_delay - monotonic();
+					pending_respawn[id] = true;
+					if delay > 0 then
+						server.add_task(delay, function () return respawn(id); end);
+					elseif spawn(id) then
+						pending_respawn[id] = nil;
+						start_respawned();
+						return;
+					else
+						pending_respawn[id] = nil;
+					end
+				end
+				break;
+			end
+		end
+	end
+	if not stopping then
+		return 1;
+	end
+end
+
+local function signal_workers(signame)
+	if worker_id or not have_signal then return; end
+	for _, worker in pairs(workers) do
+		signal.kill(worker.pid, signame);
+	end
+end
+
+local function start_supervisor()
+	if worker_id then return; end
+	for id = 1, worker_count do
+		if spawn(id) then
+			return; -- in a worker, carry on starting up
+		end
+	end
+	log("info", "Started %d workers", worker_count);
+	server.add_task(1, reap);
+	-- Keep the hosts out of the supervisor
+	return true;
+end
+
+-- Storage drivers that cope with several processes writing at once, the
+-- file based ones keep caches, mappings and pending appends per process
+local multi_writer_drivers = { sql = true };
+
+-- The first store driver on any host that isn't safe to share between workers
+local function unshared_storage()
+	for host in pairs(config.getconfig()) do
+		local storage = config.get(host, "storage");
+		local default_driver = config.get(host, "default_storage") or "internal";
+		if type(storage) == "string" then
+			default_driver = storage;
+		elseif type(storage) == "table" then
+			for store, driver_name in pairs(storage) do
+				if not multi_writer_drivers[driver_name] then
+					return host, store, driver_name;
+				end
+			end
+		end
+		if not multi_writer_drivers[default_driver] then
+			return host, "*", default_driver;
+		end
+	end
+end
+
+local function start()
+	worker_count = tonumber(config.get("*", "workers")) or 1;
+	if worker_count <= 1 then return; end
+
+	if prosody.platform ~= "posix" or not have_pposix or not pposix.fork then
+		log("error", "Multiple workers need util.pposix with fork(), running a single process");
+		return;
+	elseif not server.forked then
+		log("error", "Multiple workers need the epoll network backend, running a single process");
+		return;
+	elseif not have_unix or type(unix) ~= "table" then
+		log("error", "Multiple workers need LuaSocket unix socket support, running a single process");
+		return;
+	elseif not have_net or not net.peercred then
+		log("error", "Multiple workers need SO_PEERCRED to check connections from workers, running a single process");
+		return;
+	end
+
+	local host, store, driver_name = unshared_storage();
+	if host then
+		log("error", "Multiple workers need storage shared between processes such as 'sql', %s storage on %s uses '%s', running a single process",
+			store == "*" and "default" or store, host, driver_name);
+		return;
+	end
+
+	socket_path = resolve_relative_path(prosody.paths.data, config.get("*", "worker_socket") or "workers.sock");
+	local sock = unix.stream();
+	os_remove(socket_path);
+	local ok, err = sock:bind(socket_path);
+	if ok then
+		ok, err = sock:listen();
+	end
+	if not ok then
+		log("error", "Unable to listen on worker socket %s: %s", socket_path, err);
+		sock:close();
+		return;
+	end
+	listener = server.wrapserver(sock, socket_path, 0, supervisor_listeners);
+
+	hook_managers();
+	prosody.events.add_handler("host-activated", hook_host);
+	prosody.events.add_handler("server-starting", start_supervisor, 1000);
+	prosody.events.add_handler("server-stopping", function ()
+		if worker_id then return; end
+		stopping = true;
+		signal_workers("SIGTERM");
+		os_remove(socket_path);
+	end);
+	prosody.events.add_handler("config-reloaded", function ()
+		signal_workers("SIGHUP");
+	end);
+	prosody.events.add_handler("signal/SIGUSR1", function ()
+		signal_workers("SIGUSR1");
+	end);
+	prosody.events.add_handler("signal/SIGUSR2", function ()
+		signal_workers("SIGUSR2");
+	end);
+	return true;
+end
+
+return {
+	start = start;
+	get_worker_id = function ()
+		return worker_id;
+	end;
+
+	-- Exported for tests
+	frame = frame;
+	framer = framer;
+	split_payload = split_payload;
+};
@@ -9,6 +9,7 @@
 local server = require "prosody.net.server";
 local new_resolver = require "prosody.net.dns".resolver;
 local promise = require "prosody.util.promise";
+local have_net, net = pcall(require, "prosody.util.net");
 
 local log = require "prosody.util.logger".init("adns");
 
@@ -20,6 +21,9 @@ local setmetatable = setmetatable;
 
 local function dummy_send(sock, data, i, j) return (j-i)+1; end -- luacheck: ignore 212
 
+-- Shared by all DNS sockets, replies are read in batches of up to 16
+local datagrams = have_net and net.datagrams and net.datagrams(16, 4096);
+
 local _ENV = nil;
 -- luacheck: std none
 
@@ -61,6 +65,10 @@ local function new_async_socket(sock, resolver)
 		-- avoids sending empty packet on first 'onwritable' event
 		handler:set(true, false);
 	end
+	if datagrams and handler.setdatagrams then
+		-- server_epoll: read every waiting reply with one system call
+		handler:setdatagrams(datagrams);
+	end
 
 	handler.settimeout = function () end
 	handler.setsockname = function (_, ...) return sock:setsockname(...); end
@@ -0,0 +1,139 @@
+-- Prosody IM
+--
+-- This project is MIT/X11 licensed. Please see the
+-- COPYING file in the source package for more information.
+--
+-- Runs key derivation and signatures on worker threads while the calling
+-- async runner waits, and synchronously everywhere else.
+--
+-- luacheck: ignore prosody
+
+local async = require "prosody.util.async";
+local promise = require "prosody.util.promise";
+local hashes = require "prosody.util.hashes";
+local crypto = require "prosody.util.crypto";
+local log = require "prosody.util.logger".init("cryptopool");
+
+local have_pool, cryptopool = pcall(require, "prosody.util.cryptopool");
+
+local threads = 2;
+if prosody then
+	local config = require "prosody.core.configmanager";
+	local function read_config()
+		threads = tonumber(config.get("*", "crypto_threads")) or 2;
+	end
+	read_config();
+	prosody.events.add_handler("config-reloaded", read_config);
+end
+
+local pool;
+local pending = {};
+
+local function dispatch()
+	while true do
+		local id, result, err = pool:pop();
+		if not id then break end
+		local callbacks = pending[id];
+		pending[id] = nil;
+		if result ~= nil then
+			callbacks[1](result);
+		else
+			callbacks[2](err);
+		end
+	end
+end
+
+local function get_pool()
+	if pool then return pool; end
+	if not have_pool or threads < 1 then return nil; end
+	local err;
+	pool, err = cryptopool.new(threads);
+	if not pool then
+		log("error", "Could not start crypto worker threads: %s", err);
+		have_pool = false;
+		return nil;
+	end
+	require "prosody.net.server".watchfd(pool:getfd(), dispatch);
+	log("debug", "Started %d crypto worker threads", threads);
+	return pool;
+end
+
+local function submit(method, ...)
+	local id = pool[method](pool, ...);
+	return promise.new(function (resolve, reject)
+		pending[id] = { resolve, reject };
+	end);
+end
+
+local function usable()
+	return async.ready() and get_pool() ~= nil;
+end
+
+-- Same interface as the util.hashes functions, which raise on failure
+local function pbkdf2(digest, fallback)
+	return function (password, salt, iterations)
+		if not usable() then
+			return fallback(password, salt, iterations);
+		end
+		local ret, err = async.wait_for(submit("pbkdf2", digest, password, salt, iterations));
+		if ret == nil then
+			error(err);
+		end
+		return ret;
+	end
+end
+
+local function hkdf(digest, fallback)
+	return function (length, input, salt, info)
+		if not usable() then
+			return fallback(length, input, salt, info);
+		end
+		local ret, err = async.wait_for(submit("hkdf", digest, length, input, salt, info));
+		if ret == nil then
+			error(err);
+		end
+		return ret;
+	end
+end
+
+-- Same interface as the util.crypto functions, which return nil on failure
+local function sign(algorithm, fallback)
+	return function (key, message)
+		if not usable() then
+			return fallback(key, message);
+		end
+		return (async.wait_for(submit("sign", algorithm, key, message)));
+	end
+end
+
+local function verify(algorithm, fallback)
+	return function (key, message, signature)
+		if not usable() then
+			return fallback(key, message, signature);
+		end
+		local ret, err = async.wait_for(submit("verify", algorithm, key, message, signature));
+		if ret == nil and err == nil then
+			-- wait_for() does not tell false apart from nil
+			return false;
+		end
+		return ret;
+	end
+end
+
+return {
+	pbkdf2_hmac_sha1 = pbkdf2("sha1", hashes.pbkdf2_hmac_sha1);
+	pbkdf2_hmac_sha256 = pbkdf2("sha256", hashes.pbkdf2_hmac_sha256);
+	hkdf_hmac_sha256 = hkdf("sha256", hashes.hkdf_hmac_sha256);
+	hkdf_hmac_sha384 = hkdf("sha384", hashes.hkdf_hmac_sha384);
+	ed25519_sign = sign("ed25519", crypto.ed25519_sign);
+	ed25519_verify = verify("ed25519", crypto.ed25519_verify);
+	ecdsa_sha256_sign = sign("ecdsa_sha256", crypto.ecdsa_sha256_sign);
+	ecdsa_sha256_verify = verify("ecdsa_sha256", crypto.ecdsa_sha256_verify);
+	ecdsa_sha384_sign = sign("ecdsa_sha384", crypto.ecdsa_sha384_sign);
+	ecdsa_sha384_verify = verify("ecdsa_sha384", crypto.ecdsa_sha384_verify);
+	ecdsa_sha512_sign = sign("ecdsa_sha512", crypto.ecdsa_sha512_sign);
+	ecdsa_sha512_verify = verify("ecdsa_sha512", crypto.ecdsa_sha512_verify);
+	pending = function ()
+		return pool and pool:pending() or 0;
+	end;
+};
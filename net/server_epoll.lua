@@ -18,9 +18,11 @@ local log = logger.init("server_epoll");
 local socket = require "socket";
 local realtime = require "prosody.util.time".now;
 local monotonic = require "prosody.util.time".monotonic;
-local indexedbheap = require "prosody.util.indexedbheap";
+local tick = require "prosody.util.time".tick;
+local cached_now = require "prosody.util.time".cached_now;
+local timerwheel = require "prosody.util.timerwheel";
 local createtable = require "prosody.util.table".create;
-local dbuffer = require "prosody.util.dbuffer";
+local writequeue = require "prosody.util.writequeue";
 local inet = require "prosody.util.net";
 local inet_pton = inet.pton;
 local _SOCKETINVALID = socket._SOCKETINVALID or -1;
@@ -29,10 +31,24 @@ local xpcall = require "prosody.util.xpcall".xpcall;
 local sslconfig = require "prosody.util.sslconfig";
 local tls_impl = require "prosody.net.tls_luasec";
 local have_signal, signal = pcall(require, "prosody.util.signal");
+local have_loopstats, loopstats = pcall(require, "prosody.util.loopstats");
+
+local stats_clock, stats_duration, stats_observe, stats_add;
+local WAIT_TIME, WAIT_EVENTS, READABLE_TIME, WRITABLE_TIME, TIMER_TIME;
+local BYTES_READ, BYTES_WRITTEN, SHORT_WRITES;
+if have_loopstats then
+	stats_clock, stats_duration = loopstats.clock, loopstats.duration;
+	stats_observe, stats_add = loopstats.observe, loopstats.add;
+	local histograms, counters = loopstats.histograms, loopstats.counters;
+	WAIT_TIME, WAIT_EVENTS = histograms.wait, histograms.events;
+	READABLE_TIME, WRITABLE_TIME, TIMER_TIME = histograms.onreadable, histograms.onwritable, histograms.timer;
+	BYTES_READ, BYTES_WRITTEN, SHORT_WRITES = counters.bytes_read, counters.bytes_written, counters.short_writes;
+end
 
 local poller = require "prosody.util.poll"
 local EEXIST = poller.EEXIST;
 local ENOENT = poller.ENOENT;
+local EPOLLEXCLUSIVE = poller.EPOLLEXCLUSIVE;
 
 -- systemd socket activation
 local SD_LISTEN_FDS_START = 3;
@@ -66,6 +82,7 @@ local inherited_sockets = setmetatable({}, {
 	end;
 });
 
+local poll_size = nil; -- nil means the default of util.poll
 local poll = assert(poller.new());
 
 local _ENV = nil;
@@ -131,6 +148,9 @@ local default_config = { __index = {
 	-- Reuse write buffer tables
 	keep_buffers = true;
 
+	-- Write plain (non-TLS) connections straight from the write buffer with writev(2)
+	writev = true;
+
 	--- How long to wait after getting the shutdown signal before forcefully tearing down every socket
 	shutdown_deadline = 5;
 
@@ -139,24 +159,38 @@ local default_config = { __index = {
 
 	-- Defer accept until incoming data is available
 	tcp_defer_accept = false;
+
+	-- Maximum number of events to retrieve from the poller at once
+	max_poll_events = nil;
+
+	-- Only wake one of the processes sharing a listening socket (EPOLLEXCLUSIVE)
+	exclusive_accept = false;
+
+	-- Use the low resolution clocks (CLOCK_*_COARSE) for the time cached after
+	-- polling, timers still use the precise ones
+	coarse_clock = false;
+
+	-- Open listening sockets with SO_REUSEPORT, letting processes each bind their own
+	reuseport = false;
+
+	-- Record loop timings and traffic with util.loopstats, exported by statsmanager
+	loop_stats = false;
 }};
 local cfg = default_config.__index;
 
+-- Whether to record into util.loopstats, checked on every event
+local instrument = false;
+
 local fds = createtable(10, 0); -- FD -> conn
 
 -- Timer and scheduling --
 
-local timers = indexedbheap.create();
+local timers = timerwheel.new(monotonic());
 
 local function noop() end
 
--- Keep track of recently closed timers to avoid re-adding them
-local closedtimers = {};
-
 local function closetimer(id)
-	if timers:remove(id) then
-		closedtimers[id] = true;
-	end
+	timers:remove(id);
 end
 
 local function reschedule(id, time)
@@ -181,46 +215,31 @@ end
 -- Run callbacks of expired timers
 -- Return time until next timeout
 local function runtimers(next_delay, min_wait)
-	-- Any timers at all?
-	local elapsed = monotonic();
-	local now = realtime();
-	local peek = timers:peek();
-	local readd;
-	while peek do
-
-		if peek > elapsed then
-			break;
-		end
-
-		local _, timer, id = timers:pop();
+	-- Always the precise clocks, so that timers don't fire early
+	local now, elapsed = tick(false);
+	-- Timers stay reserved between pop and insert/remove, so one closed by
+	-- its own callback is not re-added, and re-added ones wait until the
+	-- next tick
+	local id, timer = timers:pop(elapsed);
+	while id do
+		local started = instrument and stats_clock();
 		local ok, ret = xpcall(timer, traceback, now, id);
-		if ok and type(ret) == "number" and not closedtimers[id] then
-			local next_time = elapsed+ret;
-			-- Delay insertion of timers to be re-added
-			-- so they don't get called again this tick
-			if readd then
-				readd[id] = { timer, next_time };
-			else
-				readd = { [id] = { timer, next_time } };
-			end
-		elseif not ok then
-			log("error", "Error in timer: %s", ret);
+		if started then
+			stats_duration(TIMER_TIME, started);
 		end
-
-		peek = timers:peek();
-	end
-
-	if readd then
-		for id, timer in pairs(readd) do
-			timers:insert(timer[1], timer[2], id);
+		if ok and type(ret) == "number" then
+			timers:insert(timer, elapsed+ret, id);
+		else
+			if not ok then
+				log("error", "Error in timer: %s", ret);
+			end
+			timers:remove(id);
 		end
-		peek = timers:peek();
-	end
 
-	if next(closedtimers) ~= nil then
-		closedtimers = {};
+		id, timer = timers:pop(elapsed);
 	end
 
+	local peek = timers:peek();
 	if peek == nil then
 		return next_delay;
 	else
@@ -419,7 +438,7 @@ function interface:add(r, w)
 	end
 	if r == nil then r = self._wantread; end
 	if w == nil then w = self._wantwrite; end
-	local ok, err, errno = poll:add(fd, r, w);
+	local ok, err, errno = poll:add(fd, r, w, self._pollflags);
 	if not ok then
 		if errno == EEXIST then
 			self:debug("FD already registered in poller! (EEXIST)");
@@ -444,7 +463,14 @@ function interface:set(r, w)
 	if r  == self._wantread and w == self._wantwrite then
 		return true
 	end
-	local ok, err, errno = poll:set(fd, r, w);
+	local ok, err, errno;
+	if self._exclusive then
+		-- Exclusive registrations can't be modified, only replaced
+		poll:del(fd);
+		ok, err, errno = poll:add(fd, r, w, EPOLLEXCLUSIVE);
+	else
+		ok, err, errno = poll:set(fd, r, w, self._pollflags);
+	end
 	if not ok then
 		self:debug("Could not update poller state: %s(%d)", err, errno);
 		return ok, err;
@@ -485,9 +511,46 @@ function interface:setflags(r, w)
 	return self:set(r, w);
 end
 
+-- Use a util.net datagram set to read every datagram waiting on the socket
+-- with one system call
+function interface:setdatagrams(batch)
+	self._datagrams = batch;
+	self._packets = batch and {} or nil;
+end
+
+-- Returns false if nothing was read, so that a plain receive can report why
+function interface:ondatagrams()
+	local packets = self._packets;
+	local n = self._datagrams:recv(self:getfd(), packets);
+	if not n or n == 0 then
+		return false;
+	end
+	self:onconnect();
+	for i = 1, n do
+		local packet = packets[i];
+		packets[i] = nil;
+		if instrument then
+			stats_add(BYTES_READ, #packet);
+		end
+		if self.conn then
+			self:onincoming(packet);
+		end
+	end
+	if self.conn then
+		self:setreadtimeout();
+	end
+	return true;
+end
+
 -- Called when socket is readable
 function interface:onreadable()
+	if self._datagrams and self:ondatagrams() then
+		return;
+	end
 	local data, err, partial = self.conn:receive(self.read_size or cfg.read_size);
+	if instrument and (data or partial) then
+		stats_add(BYTES_READ, #(data or partial));
+	end
 	if data then
 		self:onconnect();
 		self:onincoming(data);
@@ -542,21 +605,42 @@ function interface:onwritable()
 	self:onconnect();
 	if not self.conn then return nil, "no-conn"; end -- could have been closed in onconnect
 	self:on("predrain");
-	local buffer = self.writebuffer or "";
-	-- Naming things ... s/data/slice/ ?
-	local data = buffer:sub(1, cfg.max_send_chunk);
-	local ok, err, partial = self.conn:send(data);
+	local buffer = self.writebuffer;
+	local buffered = buffer and #buffer or 0;
+	local ok, err, partial;
+	if buffered == 0 then
+		ok, err, partial = self.conn:send("");
+	elseif self._rawfd and cfg.writev then
+		ok, err = buffer:flush(self:getfd(), cfg.max_send_chunk);
+		if ok == 0 then
+			ok, err, partial = nil, "timeout", 0;
+		end
+	else
+		local data, i, j = buffer:peek(cfg.max_send_chunk);
+		ok, err, partial = self.conn:send(data, i, j);
+		-- LuaSocket returns the index of the last byte sent
+		if ok then
+			ok = ok - i + 1;
+		elseif partial then
+			partial = partial - i + 1;
+		end
+		buffer:discard(ok or partial or 0);
+	end
 	self._writable = ok;
-	if ok and #data < #buffer then
-		-- Sent the whole 'data' but there's more in the buffer
+	if instrument then
+		stats_add(BYTES_WRITTEN, ok or partial or 0);
+	end
+	if ok and ok < buffered then
+		-- Sent the whole chunk but there's more in the buffer
 		ok, err, partial = nil, "timeout", ok;
 	end
-	self:debug("Sent %d out of %d buffered bytes", ok and #data or partial or 0, #buffer);
+	if instrument and partial then
+		stats_add(SHORT_WRITES);
+	end
+	self:debug("Sent %d out of %d buffered bytes", ok or partial or 0, buffered);
 	if ok then -- all the data we had was sent successfully
 		self:set(nil, false);
-		if cfg.keep_buffers and type(buffer) == "table" then
-			buffer:discard(ok);
-		else -- string or don't keep buffers
+		if not cfg.keep_buffers then
 			self.writebuffer = nil;
 		end
 		self._writing = nil;
@@ -564,11 +648,6 @@ function interface:onwritable()
 		self:ondrain(); -- Be aware of writes in ondrain
 		return ok;
 	elseif partial then
-		if type(buffer) == "table" then
-			buffer:discard(partial);
-		else
-			self.writebuffer = data:sub(partial + 1);
-		end
 		self:set(nil, true);
 		self:setwritetimeout();
 	end
@@ -595,45 +674,15 @@ end
 -- Add data to write buffer and set flag for wanting to write
 function interface:write(data)
 	local buffer = self.writebuffer;
-	-- (nil)    -> save string
-	-- (string) -> convert to buffer (3 tables!)
-	-- (buffer) -> write to buffer
 	if not buffer then
-		self.writebuffer = data;
-	elseif type(buffer) == "string" then
-		local prev_buffer = buffer;
-		buffer = dbuffer.new(cfg.max_send_buffer_size, cfg.send_buffer_chunks);
+		buffer = writequeue.new(cfg.max_send_buffer_size, cfg.send_buffer_chunks);
 		self.writebuffer = buffer;
-		if prev_buffer then
-			-- TODO refactor, there's 3 copies of these lines
-			if not buffer:write(prev_buffer) then
-				if self._write_lock then
-					return false;
-				end
-				-- Try to flush buffer to make room
-				self:onwritable();
-				if not buffer:write(prev_buffer) then
-					self:on("disconnect", "no space left in buffer");
-					self:destroy();
-					return false;
-				end
-			end
-		end
-		if not buffer:write(data) then
-			if self._write_lock then
-				return false;
-			end
-			self:onwritable();
-			if not buffer:write(data) then
-				self:on("disconnect", "no space left in buffer");
-				self:destroy();
-				return false;
-			end
-		end
-	elseif not buffer:write(data) then
+	end
+	if not buffer:write(data) then
 		if self._write_lock then
 			return false;
 		end
+		-- Try to flush buffer to make room
 		self:onwritable();
 		if not buffer:write(data) then
 			self:on("disconnect", "no space left in buffer");
@@ -781,6 +830,7 @@ function interface:inittls(tls_ctx, now)
 	if self._tls then return end
 	if tls_ctx then self.tls_ctx = tls_ctx; end
 	self._tls = true;
+	self._rawfd = nil;
 	self.starttls = false;
 	self:debug("Starting TLS now");
 	self:updatenames(); -- Can't getpeer/sockname after wrap()
@@ -863,10 +913,11 @@ local function wrapsocket(client, server, read_size, listeners, tls_ctx, extra)
 	local conn = setmetatable({
 		conn = client;
 		_server = server;
-		created = realtime();
+		created = cached_now();
 		listeners = listeners;
 		read_size = read_size or (server and server.read_size);
 		writebuffer = nil;
+		_rawfd = client.dohandshake == nil; -- not already wrapped by LuaSec
 		tls_ctx = tls_ctx or (server and server.tls_ctx);
 		tls_direct = server and server.tls_direct;
 		id = conn_id;
@@ -1012,7 +1063,7 @@ end
 local function wrapserver(conn, addr, port, listeners, config)
 	local server = setmetatable({
 		conn = conn;
-		created = realtime();
+		created = cached_now();
 		listeners = listeners;
 		read_size = config and config.read_size;
 		onreadable = interface.onacceptable;
@@ -1030,10 +1081,43 @@ local function wrapserver(conn, addr, port, listeners, config)
 	if type(cfg.tcp_defer_accept) == "number" then
 		server:setoption("tcp-defer-accept", cfg.tcp_defer_accept);
 	end
+	if cfg.exclusive_accept and EPOLLEXCLUSIVE then
+		server._exclusive = true;
+		server._pollflags = EPOLLEXCLUSIVE;
+	end
 	server:add(true, false);
 	return server;
 end
 
+-- Like socket.bind(), with SO_REUSEPORT set before binding
+local function bind_reuseport(addr, port, backlog)
+	if addr == "*" then addr = "0.0.0.0"; end
+	local conn, err = (addr:find(":", 1, true) and socket.tcp6 or socket.tcp4 or socket.tcp)();
+	if not conn then return conn, err; end
+	local ok;
+	ok, err = conn:setoption("reuseaddr", true);
+	if ok then
+		-- Older LuaSocket raises an error for options it doesn't know
+		local supported, ret, opt_err = pcall(conn.setoption, conn, "reuseport", true);
+		if not supported then
+			ok, err = nil, "SO_REUSEPORT not supported by LuaSocket";
+		else
+			ok, err = ret, opt_err;
+		end
+	end
+	if ok then
+		ok, err = conn:bind(addr, port);
+	end
+	if ok then
+		ok, err = conn:listen(backlog);
+	end
+	if not ok then
+		conn:close();
+		return nil, err;
+	end
+	return conn;
+end
+
 local function listen(addr, port, listeners, config)
 	local inherited = inherited_sockets[addr .. ":" .. port];
 	if inherited then
@@ -1043,12 +1127,28 @@ local function listen(addr, port, listeners, config)
 		conn.destroy = interface.del;
 		return conn;
 	end
-	local conn, err = socket.bind(addr, port, cfg.tcp_backlog);
+	local conn, err;
+	if cfg.reuseport or (config and config.reuseport) then
+		conn, err = bind_reuseport(addr, port, cfg.tcp_backlog);
+	else
+		conn, err = socket.bind(addr, port, cfg.tcp_backlog);
+	end
 	if not conn then return conn, err; end
 	conn:settimeout(0);
 	return wrapserver(conn, addr, port, listeners, config);
 end
 
+-- Give a forked process a poller of its own, with the same registrations
+local function forked()
+	poll = assert(poller.new(poll_size));
+	for fd, conn in pairs(fds) do
+		local ok, err = poll:add(fd, conn._wantread, conn._wantwrite, conn._exclusive and EPOLLEXCLUSIVE or conn._pollflags);
+		if not ok then
+			conn:debug("Could not register in new poller: %s", err);
+		end
+	end
+end
+
 -- COMPAT
 local function addserver(addr, port, listeners, read_size, tls_ctx)
 	return listen(addr, port, listeners, {
@@ -1190,27 +1290,44 @@ local function setquitting(quit)
 	end
 end
 
+-- Dispatch readiness of an FD to its connection
+local function onready(fd, r, w)
+	local conn = fds[fd];
+	if conn then
+		if r then
+			local started = instrument and stats_clock();
+			conn:onreadable();
+			if started then
+				stats_duration(READABLE_TIME, started);
+			end
+		end
+		if w then
+			local started = instrument and stats_clock();
+			conn:onwritable();
+			if started then
+				stats_duration(WRITABLE_TIME, started);
+			end
+		end
+	else
+		log("debug", "Removing unknown fd %d", fd);
+		poll:del(fd);
+	end
+end
+
 local function loop_once()
 	runtimers(); -- Ignore return value because we only do this once
 	local fd, r, w = poll:wait(0);
 	if fd then
-		local conn = fds[fd];
-		if conn then
-			if r then
-				conn:onreadable();
-			end
-			if w then
-				conn:onwritable();
-			end
-		else
-			log("debug", "Removing unknown fd %d", fd);
-			poll:del(fd);
-		end
+		tick(cfg.coarse_clock);
+		onready(fd, r, w);
 	else
 		return fd, r;
 	end
 end
 
+-- Reused between turns of the main loop, holds (fd, r, w) triples
+local events = createtable(3 * 64, 0);
+
 -- Main loop
 local function loop(once)
 	if once then
@@ -1219,20 +1336,17 @@ local function loop(once)
 
 	local t = 0;
 	while not quitting do
-		local fd, r, w = poll:wait(t);
-		if fd then
+		local started = instrument and stats_clock();
+		local n, r, w = poll:waitmany(t, events);
+		if started then
+			stats_duration(WAIT_TIME, started);
+			stats_observe(WAIT_EVENTS, n or 0);
+		end
+		if n then
 			t = 0;
-			local conn = fds[fd];
-			if conn then
-				if r then
-					conn:onreadable();
-				end
-				if w then
-					conn:onwritable();
-				end
-			else
-				log("debug", "Removing unknown fd %d", fd);
-				poll:del(fd);
+			tick(cfg.coarse_clock);
+			for i = 1, n * 3, 3 do
+				onready(events[i], events[i + 1], events[i + 2]);
 			end
 		elseif r == "timeout" then
 			t = runtimers(cfg.max_wait, cfg.min_wait);
@@ -1285,8 +1399,18 @@ return {
 	wrapserver = wrapserver;
 	watchfd = watchfd;
 	link = link;
+	forked = forked;
 	set_config = function (newconfig)
 		cfg = setmetatable(newconfig, default_config);
+		instrument = have_loopstats and cfg.loop_stats or false;
+		if cfg.max_poll_events ~= poll_size then
+			if next(fds) == nil then
+				poll = assert(poller.new(cfg.max_poll_events));
+				poll_size = cfg.max_poll_events;
+			else
+				log("warn", "Changing max_poll_events requires a restart");
+			end
+		end
 	end;
 	hook_signal = hook_signal;
 
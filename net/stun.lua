@@ -7,6 +7,11 @@ local bit32 = require"prosody.util.bitcompat";
 local sxor = require"prosody.util.strbitop".sxor;
 local new_ip = require "prosody.util.ip".new_ip;
 
+local packet_header = struct.compile(">I2I2I4");
+local type_length = struct.compile(">I2I2");
+local attribute_type = struct.compile(">I2");
+local family_port = struct.compile("x>BI2");
+
 --- Public helpers
 
 -- Following draft-uberti-behave-turn-rest-00, convert a 'secret' string
@@ -95,7 +100,7 @@ local attribute_lookup = lookup_table(attributes);
 
 function packet_methods:serialize_header(length)
 	assert(#self.transaction_id == 12, "invalid transaction id length");
-	local header = struct.pack(">I2I2",
+	local header = type_length:pack(
 		self.type,
 		length
 	)..magic_cookie..self.transaction_id;
@@ -159,7 +164,7 @@ end
 local function _serialize_attribute(attr_type, value)
 	local len = #value;
 	local padding = string.rep("\0", (4 - len)%4);
-	return struct.pack(">I2I2",
+	return type_length:pack(
 		attr_type, len
 	)..value..padding;
 end
@@ -172,7 +177,7 @@ function packet_methods:add_attribute(attr_type, value)
 end
 
 function packet_methods:deserialize(bytes)
-	local type, len, cookie = struct.unpack(">I2I2I4", bytes);
+	local type, len, cookie = packet_header:unpack(bytes);
 	assert(#bytes == (len + 20), "incorrect packet length");
 	assert(cookie == 0x2112A442, "invalid magic cookie");
 	self.type = type;
@@ -182,7 +187,7 @@ function packet_methods:deserialize(bytes)
 	while pos < #bytes do
 		local attr_hdr = bytes:sub(pos, pos+3);
 		assert(#attr_hdr == 4, "packet truncated in attribute header");
-		local attr_type, attr_len = struct.unpack(">I2I2", attr_hdr); --luacheck: ignore 211/attr_type
+		local attr_type, attr_len = type_length:unpack(attr_hdr); --luacheck: ignore 211/attr_type
 		if attr_len == 0 then
 			table.insert(self.attributes, attr_hdr);
 			pos = pos + 20;
@@ -203,7 +208,7 @@ function packet_methods:get_attribute(attr_type, idx)
 		attr_type = assert(attribute_lookup[attr_type:lower()], "unknown attribute: "..attr_type);
 	end
 	for _, attribute in ipairs(self.attributes) do
-		if struct.unpack(">I2", attribute) == attr_type then
+		if attribute_type:unpack(attribute) == attr_type then
 			if idx == 1 then
 				return attribute:sub(5);
 			else
@@ -214,7 +219,7 @@ function packet_methods:get_attribute(attr_type, idx)
 end
 
 function packet_methods:_unpack_address(data, xor)
-	local family, port = struct.unpack("x>BI2", data);
+	local family, port = family_port:unpack(data);
 	local addr = data:sub(5);
 	if xor then
 		port = bit32.bxor(port, 0x2112);
@@ -232,8 +237,7 @@ function packet_methods:_pack_address(family, addr, port, xor)
 		port = bit32.bxor(port, 0x2112);
 		addr = sxor(addr, magic_cookie..self.transaction_id);
 	end
-	local family_port = struct.pack("x>BI2", family, port);
-	return family_port..addr
+	return family_port:pack(family, port)..addr
 end
 
 function packet_methods:get_mapped_address()
@@ -9,76 +9,42 @@
 local random_bytes = require "prosody.util.random".bytes;
 
 local bit = require "prosody.util.bitcompat";
-local band = bit.band;
 local bor = bit.bor;
-local sbit = require "prosody.util.strbitop";
-local sxor = sbit.sxor;
+local wsframe = require "prosody.util.wsframe";
+local native_parse_header = wsframe.parse_header;
+local native_mask = wsframe.mask;
+local native_build = wsframe.build;
 
-local s_char = string.char;
-local s_pack = require"prosody.util.struct".pack;
-local s_unpack = require"prosody.util.struct".unpack;
+local uint16be = require"prosody.util.struct".compile(">I2");
 
 local function pack_uint16be(x)
-	return s_pack(">I2", x);
-end
-local function pack_uint64be(x)
-	return s_pack(">I8", x);
+	return uint16be:pack(x);
 end
 
 local function read_uint16be(str, pos)
 	if type(str) ~= "string" then
 		str, pos = str:sub(pos, pos+1), 1;
 	end
-	return s_unpack(">I2", str, pos);
-end
-local function read_uint64be(str, pos)
-	if type(str) ~= "string" then
-		str, pos = str:sub(pos, pos+7), 1;
-	end
-	return s_unpack(">I8", str, pos);
+	return uint16be:unpack(str, pos);
 end
 
-local function parse_frame_header(frame)
-	if frame:len() < 2 then return; end
-
-	local byte1, byte2 = frame:byte(1, 2);
-	local result = {
-		FIN = band(byte1, 0x80) > 0;
-		RSV1 = band(byte1, 0x40) > 0;
-		RSV2 = band(byte1, 0x20) > 0;
-		RSV3 = band(byte1, 0x10) > 0;
-		opcode = band(byte1, 0x0F);
-
-		MASK = band(byte2, 0x80) > 0;
-		length = band(byte2, 0x7F);
-	};
-
-	local length_bytes = 0;
-	if result.length == 126 then
-		length_bytes = 2;
-	elseif result.length == 127 then
-		length_bytes = 8;
-	end
+-- Longest possible header: 2 bytes, 8 bytes of length and the masking key
+local max_header_length = 14;
 
-	local header_length = 2 + length_bytes + (result.MASK and 4 or 0);
-	if frame:len() < header_length then return; end
-
-	if length_bytes == 2 then
-		result.length = read_uint16be(frame, 3);
-	elseif length_bytes == 8 then
-		result.length = read_uint64be(frame, 3);
-	end
-
-	if result.MASK then
-		result.key = frame:sub(length_bytes+3, length_bytes+6);
+local function parse_frame_header(frame)
+	if type(frame) ~= "string" then
+		-- dbuffer or ringbuffer
+		frame = frame:sub(1, max_header_length);
 	end
-
-	return result, header_length;
+	return native_parse_header(frame);
 end
 
--- XORs the string `str` with the array of bytes `key`
+-- XORs the string `str` with the 4 byte `key`
 local function apply_mask(str, key, from, to)
-	return sxor(str:sub(from or 1, to or -1), key);
+	if type(str) ~= "string" then
+		return native_mask(str:sub(from or 1, to or -1), key);
+	end
+	return native_mask(str, key, from, to);
 end
 
 local function parse_frame_body(frame, header, pos)
@@ -111,29 +77,17 @@ local function build_frame(desc)
 		desc.RSV2 and 0x20 or 0,
 		desc.RSV3 and 0x10 or 0);
 
-	local b2 = #data;
-	local length_extra;
-	if b2 <= 125 then -- 7-bit length
-		length_extra = "";
-	elseif b2 <= 0xFFFF then -- 2-byte length
-		b2 = 126;
-		length_extra = pack_uint16be(#data);
-	else -- 8-byte length
-		b2 = 127;
-		length_extra = pack_uint64be(#data);
-	end
-
-	local key = ""
+	local key;
 	if desc.MASK then
-		key = desc.key
+		key = desc.key;
 		if not key then
 			key = random_bytes(4);
+		else
+			assert(#key == 4, "WebSocket masking key must be 4 bytes");
 		end
-		b2 = bor(b2, 0x80);
-		data = apply_mask(data, key);
 	end
 
-	return s_char(b1, b2) .. length_extra .. key .. data
+	return native_build(b1, data, key);
 end
 
 local function parse_close(data)
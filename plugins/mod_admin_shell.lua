@@ -669,9 +669,22 @@ function def_env.server:memory()
 	end
 	local mem, lua_mem = pposix.meminfo(), collectgarbage("count");
 	local print = self.session.print;
-	print("Process: "..human((mem.allocated+mem.allocated_mmap)/1024));
-	print("   Used: "..human(mem.used/1024).." ("..human(lua_mem).." by Lua)");
-	print("   Free: "..human(mem.unused/1024).." ("..human(mem.returnable/1024).." returnable)");
+	if mem.allocated then
+		print("Process: "..human((mem.allocated+mem.allocated_mmap)/1024));
+		print("   Used: "..human(mem.used/1024).." ("..human(lua_mem).." by Lua)");
+		print("   Free: "..human(mem.unused/1024).." ("..human(mem.returnable/1024).." returnable)");
+	else
+		print("    Lua: "..human(lua_mem));
+	end
+	if mem.pool then
+		print("   Pool: "..human(mem.pool.used/1024).." used of "..human(mem.pool.allocated/1024));
+	end
+	if mem.tags and next(mem.tags) then
+		local tags = array.collect(keys(mem.tags)):sort(function (a, b) return mem.tags[a] > mem.tags[b]; end);
+		for _, tag in ipairs(tags) do
+			print(("%24s: %s"):format(tag, human(mem.tags[tag]/1024)));
+		end
+	end
 	return true, "OK";
 end
 
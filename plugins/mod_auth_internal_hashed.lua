@@ -9,13 +9,15 @@
 
 local max = math.max;
 
-local scram_hashers = require "prosody.util.sasl.scram".hashers;
+local get_scram_hasher = require "prosody.util.sasl.scram".get_hash;
+local hashes = require "prosody.util.hashes";
+local cryptopool = require "prosody.net.cryptopool";
 local generate_uuid = require "prosody.util.uuid".generate;
 local new_sasl = require "prosody.util.sasl".new;
 local hex = require"prosody.util.hex";
 local to_hex, from_hex = hex.encode, hex.decode;
 local saslprep = require "prosody.util.encodings".stringprep.saslprep;
-local secure_equals = require "prosody.util.hashes".equals;
+local secure_equals = hashes.equals;
 
 local log = module._log;
 local host = module.host;
@@ -23,6 +25,11 @@ local host = module.host;
 local accounts = module:open_store("accounts");
 
 local hash_name = module:get_option_enum("password_hash", "SHA-1", "SHA-256");
+-- PBKDF2 runs on worker threads when called from an async runner
+local scram_hashers = {
+	["SHA-1"] = get_scram_hasher(hashes.sha1, hashes.hmac_sha1, cryptopool.pbkdf2_hmac_sha1);
+	["SHA-256"] = get_scram_hasher(hashes.sha256, hashes.hmac_sha256, cryptopool.pbkdf2_hmac_sha256);
+};
 local get_auth_db = assert(scram_hashers[hash_name], "SCRAM-"..hash_name.." not supported by SASL library");
 local scram_name = "scram_"..hash_name:gsub("%-","_"):lower();
 
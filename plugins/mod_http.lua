@@ -22,8 +22,7 @@ local array = require "prosody.util.array";
 
 local ip_util = require "prosody.util.ip";
 local new_ip = ip_util.new_ip;
-local match_ip = ip_util.match;
-local parse_cidr = ip_util.parse_cidr;
+local new_ip_set = ip_util.new_set;
 
 local server = require "prosody.net.http.server";
 
@@ -327,7 +326,9 @@ end
 
 module.add_host(module); -- set up handling on global context too
 
-local trusted_proxies = module:get_option_set("trusted_proxies", { "127.0.0.1", "::1" })._items;
+local trusted_proxies_set = module:get_option_set("trusted_proxies", { "127.0.0.1", "::1" });
+local trusted_proxies = trusted_proxies_set._items;
+local trusted_proxy_ranges = new_ip_set(trusted_proxies_set);
 
 --- deal with [ipv6]:port / ip:port format
 local function normal_ip(ip)
@@ -341,12 +342,7 @@ local function is_trusted_proxy(ip)
 	end
 	local parsed_ip, err = new_ip(ip);
 	if not parsed_ip then return nil, err; end
-	for trusted_proxy in trusted_proxies do
-		if match_ip(parsed_ip, parse_cidr(trusted_proxy)) then
-			return true;
-		end
-	end
-	return false
+	return trusted_proxy_ranges:contains(parsed_ip);
 end
 
 local function get_forwarded_connection_info(request) --> ip:string, secure:boolean
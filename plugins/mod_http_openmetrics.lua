@@ -18,11 +18,12 @@ local get_metrics;
 
 local permitted_ips = module:get_option_set("openmetrics_allow_ips", { "::1", "127.0.0.1" });
 local permitted_cidr = module:get_option_string("openmetrics_allow_cidr");
+local permitted_ranges = permitted_cidr and ip.new_set({ permitted_cidr });
 
 local function is_permitted(request)
 	local ip_raw = request.ip;
 	if permitted_ips:contains(ip_raw) or
-	   (permitted_cidr and ip.match(ip.new_ip(ip_raw), ip.parse_cidr(permitted_cidr))) then
+	   (permitted_ranges and permitted_ranges:contains(ip_raw)) then
 		return true;
 	end
 	return false;
@@ -34,7 +34,7 @@ local rm_load_roster = require "prosody.core.rostermanager".load_roster;
 
 local is_stanza = st.is_stanza;
 local tostring = tostring;
-local time_now = require "prosody.util.time".now;
+local time_now = require "prosody.util.time".cached_now;
 local m_min = math.min;
 local timestamp, datestamp = import( "util.datetime", "datetime", "date");
 local default_max_items, max_max_items = 20, module:get_option_integer("max_archive_query_results", 50, 0);
@@ -10,16 +10,16 @@
 local create_throttle = require "prosody.util.throttle".create;
 local new_cache = require "prosody.util.cache".new;
 local ip_util = require "prosody.util.ip";
-local new_ip = ip_util.new_ip;
-local match_ip = ip_util.match;
-local parse_cidr = ip_util.parse_cidr;
+local new_ip_set = ip_util.new_set;
 local errors = require "prosody.util.error";
 
 -- COMPAT drop old option names
 local min_seconds_between_registrations = module:get_option_period("min_seconds_between_registrations");
 local allowlist_only = module:get_option_boolean("allowlist_registration_only", module:get_option_boolean("whitelist_registration_only"));
-local allowlisted_ips = module:get_option_set("registration_allowlist", module:get_option("registration_whitelist", { "127.0.0.1", "::1" }))._items;
-local blocklisted_ips = module:get_option_set("registration_blocklist", module:get_option_set("registration_blacklist", {}))._items;
+local allowlist = module:get_option_set("registration_allowlist", module:get_option("registration_whitelist", { "127.0.0.1", "::1" }));
+local blocklist = module:get_option_set("registration_blocklist", module:get_option_set("registration_blacklist", {}));
+local allowlisted_ips, allowlisted_ranges = allowlist._items, new_ip_set(allowlist);
+local blocklisted_ips, blocklisted_ranges = blocklist._items, new_ip_set(blocklist);
 
 local throttle_max = module:get_option_number("registration_throttle_max", min_seconds_between_registrations and 1, 0);
 local throttle_period = module:get_option_period("registration_throttle_period", min_seconds_between_registrations);
@@ -44,17 +44,12 @@ local function check_throttle(ip)
 	return throttle:poll(1);
 end
 
-local function ip_in_set(set, ip)
+-- Addresses blocklisted at runtime only go into the table of exact matches
+local function ip_in_set(set, ranges, ip)
 	if set[ip] then
 		return true;
 	end
-	ip = new_ip(ip);
-	for in_set in pairs(set) do
-		if match_ip(ip, parse_cidr(in_set)) then
-			return true;
-		end
-	end
-	return false;
+	return ranges:contains(ip) or false;
 end
 
 local err_registry = {
@@ -81,15 +76,15 @@ module:hook("user-registering", function (event)
 	local log = session and session.log or module._log;
 	if not ip then
 		log("warn", "IP not known; can't apply blocklist/allowlist");
-	elseif ip_in_set(blocklisted_ips, ip) then
+	elseif ip_in_set(blocklisted_ips, blocklisted_ranges, ip) then
 		log("debug", "Registration disallowed by blocklist");
 		event.allowed = false;
 		event.error = errors.new("blocklisted", event, err_registry);
-	elseif (allowlist_only and not ip_in_set(allowlisted_ips, ip)) then
+	elseif (allowlist_only and not ip_in_set(allowlisted_ips, allowlisted_ranges, ip)) then
 		log("debug", "Registration disallowed by allowlist");
 		event.allowed = false;
 		event.error = errors.new("not_allowlisted", event, err_registry);
-	elseif throttle_max and not ip_in_set(allowlisted_ips, ip) then
+	elseif throttle_max and not ip_in_set(allowlisted_ips, allowlisted_ranges, ip) then
 		if not check_throttle(ip) then
 			log("debug", "Registrations over limit for ip %s", ip or "?");
 			event.allowed = false;
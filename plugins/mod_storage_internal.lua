@@ -3,7 +3,7 @@ local datamanager = require "prosody.core.storagemanager".olddm;
 local array = require "prosody.util.array";
 local datetime = require "prosody.util.datetime";
 local st = require "prosody.util.stanza";
-local now = require "prosody.util.time".now;
+local now = require "prosody.util.time".cached_now;
 local uuid_v7 = require "prosody.util.uuid".v7;
 local jid_join = require "prosody.util.jid".join;
 local set = require "prosody.util.set";
@@ -16,6 +16,55 @@ local archive_item_count_cache = cache.new(module:get_option_integer("storage_ar
 
 local use_shift = module:get_option_boolean("storage_archive_experimental_fast_delete", false);
 
+-- Group commit: hold appended archive items for a short while and write them
+-- out together, so that a burst of messages costs one write (and one fsync)
+local commit_delay = module:get_option_period("storage_archive_commit_delay", 0);
+local use_fsync = module:get_option_boolean("storage_archive_fsync", false);
+
+local pending_appends = {};
+
+local function flush_appends(cache_key)
+	local pending = pending_appends[cache_key];
+	if not pending then return true; end
+	pending_appends[cache_key] = nil;
+	local ok, err = datamanager.list_append_batch(pending.username, host, pending.store, pending.items, use_fsync);
+	if not ok then
+		-- The callers were told the items were stored, all we can do is complain
+		module:log("error", "Could not write %d items to archive %s of %s: %s",
+			#pending.items, pending.store, pending.username, err);
+		archive_item_count_cache:set(cache_key, nil);
+	end
+	return ok, err;
+end
+
+local function flush_all_appends(store)
+	for cache_key, pending in pairs(pending_appends) do
+		if store == nil or pending.store == store then
+			flush_appends(cache_key);
+		end
+	end
+end
+
+local function queue_append(cache_key, username, store, value)
+	local pending = pending_appends[cache_key];
+	if not pending then
+		pending = { username = username, store = store, items = {} };
+		pending_appends[cache_key] = pending;
+		module:add_timer(commit_delay, function ()
+			flush_appends(cache_key);
+		end);
+	end
+	table.insert(pending.items, value);
+end
+
+module:hook_global("server-stopped", function ()
+	flush_all_appends();
+end);
+
+function module.unload()
+	flush_all_appends();
+end
+
 local driver = {};
 
 function driver:open(store, typ)
@@ -31,6 +80,11 @@ function driver:stores(username) -- luacheck: ignore 212/self
 end
 
 function driver:purge(user) -- luacheck: ignore 212/self
+	for cache_key, pending in pairs(pending_appends) do
+		if pending.username == user then
+			pending_appends[cache_key] = nil;
+		end
+	end
 	return datamanager.purge(user, host);
 end
 
@@ -74,6 +128,7 @@ function archive:append(username, key, value, when, with)
 	local item_count = archive_item_count_cache:get(cache_key);
 
 	if key then
+		flush_appends(cache_key);
 		local items, err = datamanager.list_load(username, host, self.store);
 		if not items and err then return items, err; end
 
@@ -101,6 +156,7 @@ function archive:append(username, key, value, when, with)
 		end
 	else
 		if not item_count then -- Item count not cached?
+			flush_appends(cache_key);
 			-- We need to load the list to get the number of items currently stored
 			local items, err = datamanager.list_load(username, host, self.store);
 			if not items and err then return items, err; end
@@ -118,7 +174,13 @@ function archive:append(username, key, value, when, with)
 
 	value.key = key;
 
-	local ok, err = datamanager.list_append(username, host, self.store, value);
+	if commit_delay > 0 then
+		queue_append(cache_key, username, self.store, value);
+		archive_item_count_cache:set(cache_key, item_count+1);
+		return key;
+	end
+
+	local ok, err = datamanager.list_append_batch(username, host, self.store, { value }, use_fsync);
 	if not ok then return ok, err; end
 	archive_item_count_cache:set(cache_key, item_count+1);
 	return key;
@@ -150,6 +212,7 @@ local function binary_search(haystack, test, min, max)
 end
 
 function archive:find(username, query)
+	flush_appends(jid_join(username, host, self.store));
 	local list, err = datamanager.list_open(username, host, self.store);
 	if not list then
 		if err then
@@ -282,6 +345,7 @@ function archive:get(username, wanted_key)
 end
 
 function archive:set(username, key, new_value, new_when, new_with)
+	flush_appends(jid_join(username, host, self.store));
 	local items, err = datamanager.list_load(username, host, self.store);
 	if not items then
 		if err then
@@ -310,6 +374,7 @@ function archive:set(username, key, new_value, new_when, new_with)
 end
 
 function archive:dates(username)
+	flush_appends(jid_join(username, host, self.store));
 	local items, err = datamanager.list_load(username, host, self.store);
 	if not items then return items, err; end
 	return array(items):pluck("when"):map(datetime.date):unique();
@@ -339,11 +404,13 @@ function archive:summary(username, query)
 end
 
 function archive:users()
+	flush_all_appends(self.store);
 	return datamanager.users(host, self.store, "list");
 end
 
 function archive:trim(username, to_when)
 	local cache_key = jid_join(username, host, self.store);
+	flush_appends(cache_key);
 	local list, err = datamanager.list_open(username, host, self.store);
 	if not list then
 		if err == nil then
@@ -381,6 +448,7 @@ end
 function archive:delete(username, query)
 	local cache_key = jid_join(username, host, self.store);
 	if not query or next(query) == nil then
+		pending_appends[cache_key] = nil;
 		archive_item_count_cache:set(cache_key, nil); -- nil because we don't check if the following succeeds
 		return datamanager.list_store(username, host, self.store, nil);
 	end
@@ -389,6 +457,7 @@ function archive:delete(username, query)
 		return self:trim(username, query["end"]);
 	end
 
+	flush_appends(cache_key);
 	local items, err = datamanager.list_load(username, host, self.store);
 	if not items then
 		if err then
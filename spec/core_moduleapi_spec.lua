@@ -73,4 +73,43 @@ describe("core.moduleapi", function()
 			test_option_value({0, 1, 2, 3}, { boolean = false, string = "0", number = 0, array = {0, 1, 2, 3}, set = {0, 1, 2, 3} });
 		end);
 	end)
+
+	describe("#account_memory()", function()
+		local pposix = require "util.pposix";
+		local accounting_api;
+
+		setup(function ()
+			-- Whether to account is decided when the module is loaded
+			local prefixed = rawget(package.loaded, "prosody.core.moduleapi");
+			prosody.memory_accounting = true;
+			package.loaded["core.moduleapi"] = nil;
+			package.loaded["prosody.core.moduleapi"] = nil;
+			accounting_api = require "core.moduleapi";
+			package.loaded["core.moduleapi"] = api;
+			package.loaded["prosody.core.moduleapi"] = prefixed;
+			prosody.memory_accounting = nil;
+		end);
+
+		it("sets the tag while the function runs", function()
+			local m = setmetatable({ name = "account_memory_spec" }, { __index = accounting_api });
+			local seen;
+			local f = m:account_memory(function (...)
+				seen = pposix.memtag();
+				pposix.memtag(seen);
+				return ...;
+			end);
+			assert.same({ 1, 2 }, { f(1, 2) });
+			assert.equal(m.memtag, seen);
+			assert.equal(0, pposix.memtag());
+		end);
+
+		it("restores the tag when the function throws", function()
+			local m = setmetatable({ name = "account_memory_spec" }, { __index = accounting_api });
+			local f = m:account_memory(function ()
+				error("oops", 0);
+			end);
+			assert.has_error(f, "oops");
+			assert.equal(0, pposix.memtag());
+		end);
+	end)
 end)
@@ -20,6 +20,12 @@ local configs = {
 	internal = {
 		storage = "internal";
 	};
+	internal_group_commit = {
+		storage = "internal";
+		-- Long enough that only flushes write anything during the tests
+		storage_archive_commit_delay = 3600;
+		storage_archive_fsync = true;
+	};
 	sqlite = {
 		storage = "sql";
 		sql = { driver = "SQLite3", database = "prosody-tests.sqlite" };
@@ -787,6 +793,46 @@ describe("storagemanager", function ()
 					end
 				end);
 
+				if backend_config.storage_archive_commit_delay then
+					describe("with group commit", function ()
+						local dm = sm.olddm;
+
+						it("writes queued items together", function ()
+							local username = "user-group-commit";
+							assert(archive:delete(username));
+							local list_append_batch = spy.on(dm, "list_append_batch");
+							finally(function () list_append_batch:revert(); end);
+
+							for i = 1, 3 do
+								assert(archive:append(username, nil, test_stanza, test_time+i, "contact@example.com"));
+							end
+							assert.spy(list_append_batch).was_called(0);
+
+							local data = assert(archive:find(username, {}));
+							assert.spy(list_append_batch).was_called(1);
+							assert.spy(list_append_batch).was_called_with(username, test_host, "test-archive", match.is_table(), true);
+							local count = 0;
+							for _ in data do
+								count = count + 1;
+							end
+							assert.equal(3, count);
+						end);
+
+						it("writes queued items when the server stops", function ()
+							local username = "user-group-commit-stop";
+							assert(archive:delete(username));
+							assert(archive:append(username, nil, test_stanza, test_time, "contact@example.com"));
+							assert(archive:append(username, nil, test_stanza, test_time+1, "contact@example.com"));
+							assert.is_nil(dm.list_load(username, test_host, "test-archive"));
+
+							_G.prosody.events.fire_event("server-stopped");
+							local items = dm.list_load(username, test_host, "test-archive");
+							assert.is_table(items);
+							assert.equal(2, #items);
+						end);
+					end);
+				end
+
 			end);
 		end);
 	end
@@ -0,0 +1,72 @@
+package.loaded["net.server"] = {};
+package.loaded["core.rostermanager"] = {};
+package.loaded["core.sessionmanager"] = {};
+package.loaded["core.storagemanager"] = {};
+
+_G.prosody = { hosts = {}, full_sessions = {}, bare_sessions = {} };
+
+local workermanager = require "core.workermanager";
+
+describe("core.workermanager", function ()
+	describe("framer()", function ()
+		local frame, framer = workermanager.frame, workermanager.framer;
+
+		it("splits a stream into frames", function ()
+			local got = {};
+			local read = framer(function (payload) table.insert(got, payload); end);
+			assert.truthy(read(frame("Hello") .. frame("") .. frame("B1\0user@example.com/x")));
+			assert.same({ "Hello", "", "B1\0user@example.com/x" }, got);
+		end);
+
+		it("reassembles frames from any split", function ()
+			local stream = frame("S1\0<message/>") .. frame("H2") .. frame(("x"):rep(1000));
+			for size = 1, 7 do
+				local got = {};
+				local read = framer(function (payload) table.insert(got, payload); end);
+				for i = 1, #stream, size do
+					assert.truthy(read(stream:sub(i, i + size - 1)));
+				end
+				assert.same({ "S1\0<message/>", "H2", ("x"):rep(1000) }, got);
+			end
+		end);
+
+		it("waits for the rest of a frame", function ()
+			local got = {};
+			local read = framer(function (payload) table.insert(got, payload); end);
+			local f = frame("partial");
+			assert.truthy(read(f:sub(1, 6)));
+			assert.same({}, got);
+			assert.truthy(read(f:sub(7)));
+			assert.same({ "partial" }, got);
+		end);
+
+		it("rejects huge frames", function ()
+			local read = framer(function () error("should not be called"); end);
+			local ok, err = read("\127\255\255\255" .. "x");
+			assert.falsy(ok);
+			assert.equal("frame too large", err);
+		end);
+	end);
+
+	describe("split_payload()", function ()
+		local split_payload = workermanager.split_payload;
+
+		it("returns the worker id and the data", function ()
+			assert.same({ 12, "user@example.com/res" }, { split_payload("B12\0user@example.com/res") });
+		end);
+
+		it("keeps NUL bytes after the first", function ()
+			assert.same({ 3, "user@example.com\0<message/>" }, { split_payload("M3\0user@example.com\0<message/>") });
+		end);
+
+		it("allows empty data", function ()
+			assert.same({ 1, "" }, { split_payload("U1\0") });
+		end);
+
+		it("rejects malformed payloads", function ()
+			assert.is_nil(split_payload("H1"));
+			assert.is_nil(split_payload("Sx\0data"));
+			assert.is_nil(split_payload(""));
+		end);
+	end);
+end);
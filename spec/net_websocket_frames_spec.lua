@@ -97,6 +97,37 @@ describe("net.websocket.frames", function ()
 			assert.same(test_frames.ping, parse("\137\4ping"));
 			assert.same(test_frames.pong, parse("\138\4pong"));
 		end);
+		it("works with a dbuffer", function ()
+			local dbuffer = require "util.dbuffer";
+			local buf = dbuffer.new(1024);
+			buf:write("\128\133 \0");
+			assert.is_nil(parse(buf));
+			buf:write(" \0HeL");
+			local frame, length, partial = parse(buf);
+			assert.is_nil(frame);
+			assert.is_nil(length);
+			assert.equal(5, partial.length);
+			buf:write("lO\0\5hello");
+			frame, length = parse(buf);
+			assert.same(test_frames.with_mask, frame);
+			assert.equal(11, length);
+			buf:discard(length);
+			assert.same(test_frames.simple_data, parse(buf));
+		end);
+		it("works with masked empty frames", function ()
+			local frame, length = parse("\137\128 \0 \0");
+			assert.equal(0x9, frame.opcode);
+			assert.is_true(frame.MASK);
+			assert.equal(0, frame.length);
+			assert.equal("", frame.data);
+			assert.equal(6, length);
+		end);
+		it("round-trips long masked frames", function ()
+			local data = string.rep("hello world ", 10000);
+			local frame = nwf.parse(nwf.build({ opcode = 0x2; FIN = true; MASK = true; data = data }));
+			assert.equal(#data, frame.length);
+			assert.equal(data, frame.data);
+		end);
 	end);
 
 end);
@@ -0,0 +1,34 @@
+local ok, crand = pcall(require, "util.crand");
+
+describe("util.crand", function()
+	if not ok then
+		pending("util.crand is not available", function () end);
+		return;
+	end
+
+	describe("#bytes()", function()
+		it("should return the requested number of bytes from the pool and beyond it", function()
+			for _, n in ipairs({ 0, 1, 8, 16, 255, 256, 257, 4096, 5000 }) do
+				assert.are.equal(n, #crand.bytes(n));
+			end
+		end);
+
+		it("should not repeat itself across refills", function()
+			local seen = {};
+			for _ = 1, 1000 do
+				local b = crand.bytes(16);
+				assert.is_nil(seen[b]);
+				seen[b] = true;
+			end
+		end);
+	end);
+
+	describe("#pool()", function()
+		it("should switch buffering off and on", function()
+			assert.is_true(crand.pool(false));
+			assert.are.equal(16, #crand.bytes(16));
+			assert.is_false(crand.pool(true));
+			assert.are.equal(16, #crand.bytes(16));
+		end);
+	end);
+end);
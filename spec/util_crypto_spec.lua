@@ -202,4 +202,72 @@ describe("util.crypto", function ()
 			end
 		end);
 	end);
+
+	describe("cipher objects", function ()
+		it("match the one-shot functions", function ()
+			local message = "foo\0bar hello world";
+			local test_cases = {
+				{ crypto.aes_128_gcm, crypto.aes_128_gcm_encrypt, crypto.aes_128_gcm_decrypt, key = random.bytes(16), iv_len = 12 };
+				{ crypto.aes_256_gcm, crypto.aes_256_gcm_encrypt, crypto.aes_256_gcm_decrypt, key = random.bytes(32), iv_len = 12 };
+				{ crypto.aes_256_ctr, crypto.aes_256_ctr_encrypt, crypto.aes_256_ctr_decrypt, key = random.bytes(32), iv_len = 16 };
+			};
+			for _, params in ipairs(test_cases) do
+				local cipher = params[1](params.key);
+				for _ = 1, 3 do
+					local iv = random.bytes(params.iv_len);
+					local encrypted = cipher:encrypt(iv, message);
+					assert.equal(params[2](params.key, iv, message), encrypted);
+					assert.equal(message, cipher:decrypt(iv, encrypted));
+					assert.equal(message, params[3](params.key, iv, encrypted));
+				end
+			end
+		end);
+
+		it("detect tampering", function ()
+			local cipher = crypto.aes_256_gcm(random.bytes(32));
+			local iv = random.bytes(12);
+			local encrypted = cipher:encrypt(iv, "hello");
+			local tampered = string.char((encrypted:byte(1) + 1) % 256)..encrypted:sub(2);
+			assert.equal(nil, (cipher:decrypt(iv, tampered)));
+		end);
+
+		it("check key and iv sizes", function ()
+			assert.has_error(function () crypto.aes_256_gcm(random.bytes(16)); end);
+			local cipher = crypto.aes_128_gcm(random.bytes(16));
+			assert.has_error(function () cipher:encrypt(random.bytes(16), "hello"); end);
+		end);
+	end);
+
+	describe("signers and verifiers", function ()
+		it("work with ed25519", function ()
+			local key = crypto.generate_ed25519_keypair();
+			local signer, verifier = key:signer("ed25519"), key:verifier("ed25519");
+			for _, message in ipairs({ "hello", "world", "" }) do
+				local sig = signer:sign(message);
+				assert.equal(crypto.ed25519_sign(key, message), sig);
+				assert.is_true(crypto.ed25519_verify(key, message, sig));
+				assert.is_true(verifier:verify(message, sig));
+				assert.is_false(verifier:verify(message.."!", sig));
+			end
+		end);
+
+		it("work with ecdsa", function ()
+			local private = crypto.import_private_pem(crypto.generate_p256_keypair():private_pem());
+			local public = crypto.import_public_pem(private:public_pem());
+			local signer, verifier = private:signer("ecdsa_sha256"), public:verifier("ecdsa_sha256");
+			local sig = signer:sign("hello");
+			assert.is_true(crypto.ecdsa_sha256_verify(public, "hello", sig));
+			assert.is_true(verifier:verify("hello", sig));
+			assert.is_false(verifier:verify("hello!", sig));
+			assert.is_true(verifier:verify("hello", crypto.ecdsa_sha256_sign(private, "hello")));
+		end);
+
+		it("check the key type", function ()
+			local key = crypto.generate_ed25519_keypair();
+			assert.has_error(function () key:signer("ecdsa_sha256"); end);
+			assert.has_error(function () key:signer("nope"); end);
+			local public = crypto.import_public_pem(key:public_pem());
+			assert.has_error(function () public:signer("ed25519"); end);
+		end);
+	end);
 end);
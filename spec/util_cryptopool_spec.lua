@@ -0,0 +1,67 @@
+local cryptopool = require "util.cryptopool";
+local hashes = require "util.hashes";
+local crypto = require "util.crypto";
+local poll = require "util.poll";
+
+describe("util.cryptopool", function ()
+	local pool, watcher;
+
+	-- Wait for the next completed job
+	local function collect()
+		for _ = 1, 100 do
+			local id, result, err = pool:pop();
+			if id then return id, result, err; end
+			watcher:wait(0.1);
+		end
+		error("timed out");
+	end
+
+	setup(function ()
+		pool = assert(cryptopool.new(2));
+		watcher = poll.new();
+		watcher:add(pool:getfd(), true, false);
+	end);
+
+	teardown(function ()
+		pool:close();
+	end);
+
+	it("rejects bad arguments", function ()
+		assert.has_error(function () cryptopool.new(0); end);
+		assert.has_error(function () pool:pbkdf2("md4", "pass", "salt", 4096); end);
+		assert.has_error(function () pool:pbkdf2("sha1", "pass", "salt", 0); end);
+	end);
+
+	it("derives keys like util.hashes", function ()
+		local a = pool:pbkdf2("sha1", "password", "salt", 4096);
+		local b = pool:pbkdf2("sha256", "password", "salt", 4096);
+		local c = pool:hkdf("sha256", 42, "input", "salt", "info");
+		local results = {};
+		for _ = 1, 3 do
+			local id, result = collect();
+			results[id] = result;
+		end
+		assert.equal(hashes.pbkdf2_hmac_sha1("password", "salt", 4096), results[a]);
+		assert.equal(hashes.pbkdf2_hmac_sha256("password", "salt", 4096), results[b]);
+		assert.equal(hashes.hkdf_hmac_sha256(42, "input", "salt", "info"), results[c]);
+		assert.equal(0, pool:pending());
+	end);
+
+	it("signs and verifies", function ()
+		local key = crypto.generate_ed25519_keypair();
+		local id = pool:sign("ed25519", key, "hello");
+		local done, signature = collect();
+		assert.equal(id, done);
+		assert.is_true(crypto.ed25519_verify(key, "hello", signature));
+
+		pool:verify("ed25519", key, "hello", signature);
+		assert.is_true(select(2, collect()));
+		pool:verify("ed25519", key, "goodbye", signature);
+		assert.is_false(select(2, collect()));
+	end);
+
+	it("checks key types", function ()
+		local key = crypto.generate_p256_keypair();
+		assert.has_error(function () pool:sign("ed25519", key, "hello"); end);
+	end);
+end);
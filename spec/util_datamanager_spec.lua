@@ -73,4 +73,144 @@ describe("util.datamanager", function()
 		end
 
 	end)
+
+	describe("list batches", function()
+		do
+			local ok, err = dm.list_append_batch("batch-user", "datamanager.test", "testdata", {{id = 1}; {id = 2}});
+			assert.truthy(ok, err);
+		end
+
+		do
+			local ok, err = dm.list_append("batch-user", "datamanager.test", "testdata", {id = 3});
+			assert.truthy(ok, err);
+		end
+
+		do
+			local ok, err = dm.list_append_batch("batch-user", "datamanager.test", "testdata", {{id = 4}; {id = 5}}, true);
+			assert.truthy(ok, err);
+		end
+
+		do
+			local list, err = dm.list_load("batch-user", "datamanager.test", "testdata");
+			assert.same({{id = 1}; {id = 2}; {id = 3}; {id = 4}; {id = 5}}, list, err);
+		end
+
+		do
+			local list, err = dm.list_open("batch-user", "datamanager.test", "testdata");
+			assert.truthy(list, err);
+			assert.equal(5, #list);
+			assert.same({id = 4}, list[4]);
+
+			-- Items appended while the list is open show up
+			assert.truthy(dm.list_append("batch-user", "datamanager.test", "testdata", {id = 6}));
+			assert.equal(6, #list);
+			assert.same({id = 6}, list[6]);
+			assert.is_nil(list[7]);
+			list:close();
+		end
+
+		do
+			local ok, err = dm.list_store("batch-user", "datamanager.test", "testdata", {});
+			assert.truthy(ok, err);
+		end
+	end)
+
+	describe("shifting lists", function()
+		local items = {};
+		for i = 1, 6 do
+			-- Large enough that removing a few items frees whole blocks
+			items[i] = {id = i; padding = string.rep("x", 3000)};
+		end
+
+		do
+			local ok, err = dm.list_append_batch("shift-user", "datamanager.test", "testdata", items);
+			assert.truthy(ok, err);
+		end
+
+		do
+			local ok, err = dm.list_shift("shift-user", "datamanager.test", "testdata", 2);
+			assert.truthy(ok, err);
+		end
+
+		do
+			local ok, err = dm.list_shift("shift-user", "datamanager.test", "testdata", 3);
+			assert.truthy(ok, err);
+		end
+
+		do
+			local list, err = dm.list_load("shift-user", "datamanager.test", "testdata");
+			assert.same({items[4]; items[5]; items[6]}, list, err);
+		end
+
+		do
+			local list, err = dm.list_open("shift-user", "datamanager.test", "testdata");
+			assert.truthy(list, err);
+			assert.equal(3, #list);
+			assert.same(items[4], list[1]);
+			assert.same(items[6], list[3]);
+			list:close();
+		end
+
+		do
+			local ok, err = dm.list_append("shift-user", "datamanager.test", "testdata", {id = 7});
+			assert.truthy(ok, err);
+			local list = dm.list_open("shift-user", "datamanager.test", "testdata");
+			assert.equal(4, #list);
+			assert.same({id = 7}, list[4]);
+			list:close();
+		end
+
+		do
+			local ok, err = dm.list_store("shift-user", "datamanager.test", "testdata", items);
+			assert.truthy(ok, err);
+			local list = dm.list_open("shift-user", "datamanager.test", "testdata");
+			assert.same(items[6], list[6]);
+
+			-- A handle opened before the list shrunk in place must neither
+			-- read past the new end of the file nor return items that moved
+			ok, err = dm.list_shift("shift-user", "datamanager.test", "testdata", 4);
+			assert.truthy(ok, err);
+			local item = list[6];
+			assert.truthy(not item or item.id == 6);
+			list:close();
+		end
+
+		do
+			-- Items smaller than a block, so that the new first item shares its
+			-- block with removed ones and the collapse leaves blanked bytes
+			local small = {};
+			for i = 1, 20 do
+				small[i] = {id = i; padding = string.rep("y", 700)};
+			end
+			local ok, err = dm.list_store("shift-user", "datamanager.test", "testdata", small);
+			assert.truthy(ok, err);
+			ok, err = dm.list_shift("shift-user", "datamanager.test", "testdata", 9);
+			assert.truthy(ok, err);
+
+			local loaded = dm.list_load("shift-user", "datamanager.test", "testdata");
+			assert.equal(12, #loaded);
+			assert.same(small[9], loaded[1]);
+
+			local list = dm.list_open("shift-user", "datamanager.test", "testdata");
+			assert.equal(#loaded, #list);
+			for i = 1, #loaded do
+				assert.same(loaded[i], list[i]);
+			end
+			list:close();
+
+			-- Same as an index rebuilt from the list itself
+			os.remove(dm.getpath("shift-user", "datamanager.test", "testdata", "lidx"));
+			list = dm.list_open("shift-user", "datamanager.test", "testdata");
+			assert.equal(#loaded, #list);
+			for i = 1, #loaded do
+				assert.same(loaded[i], list[i]);
+			end
+			list:close();
+		end
+
+		do
+			local ok, err = dm.list_store("shift-user", "datamanager.test", "testdata", {});
+			assert.truthy(ok, err);
+		end
+	end)
 end)
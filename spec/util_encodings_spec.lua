@@ -19,6 +19,21 @@ describe("util.encodings", function ()
 			assert.is.equal(encodings.base64.decode("AAAA"), "\0\0\0");
 			assert.is.equal(encodings.base64.decode("////"), "\255\255\255");
 		end);
+		it("skips whitespace and handles padding", function ()
+			assert.is.equal(encodings.base64.decode("Y291\r\nY291"), "coucou");
+			assert.is.equal(encodings.base64.decode("Y2 91\tY2\n91"), "coucou");
+			assert.is.equal(encodings.base64.decode("Yw==Yw=="), "cc");
+		end);
+		it("rejects invalid characters", function ()
+			assert.is_nil((encodings.base64.decode("Y29!")));
+		end);
+		it("round-trips", function ()
+			local s = "";
+			for i = 0, 255 do
+				s = s .. string.char(i);
+				assert.is.equal(s, encodings.base64.decode(encodings.base64.encode(s)));
+			end
+		end);
 	end);
 end);
 describe("util.encodings.utf8", function()
@@ -38,4 +53,70 @@ describe("util.encodings.utf8", function()
 
 		end);
 	end);
+	describe("#valid_xml_cdata()", function()
+		it("accepts text", function()
+			assert.is_true(utf8.valid_xml_cdata("hello\tworld\r\n"));
+			assert.is_true(utf8.valid_xml_cdata("caf\195\169 \226\130\172"));
+			assert.is_true(utf8.valid_xml_cdata("urn:example\1name", true));
+		end);
+		it("rejects control characters", function()
+			assert.same({ false, "control characters" }, { utf8.valid_xml_cdata("hello\0world") });
+			assert.same({ false, "control characters" }, { utf8.valid_xml_cdata("urn:example\1name") });
+		end);
+		it("rejects invalid utf8", function()
+			assert.same({ false, "invalid utf8" }, { utf8.valid_xml_cdata("caf\195") });
+		end);
+		it("reports control characters before invalid utf8", function()
+			assert.same({ false, "control characters" }, { utf8.valid_xml_cdata("\195 hello world\5") });
+		end);
+	end);
+end);
+
+describe("util.encodings.stringprep", function()
+	local stringprep = encodings.stringprep;
+	describe("#nodeprep()", function()
+		it("should work", function()
+			assert.equal("user", stringprep.nodeprep("user"));
+			assert.equal("user", stringprep.nodeprep("UsEr"));
+			assert.equal("caf\195\169", stringprep.nodeprep("CAF\195\137"));
+			assert.equal("", stringprep.nodeprep(""));
+		end);
+		it("rejects prohibited characters", function()
+			assert.is_nil(stringprep.nodeprep("us er"));
+			assert.is_nil(stringprep.nodeprep("user@host"));
+			assert.is_nil(stringprep.nodeprep("a\"b"));
+			assert.is_nil(stringprep.nodeprep("a\1b"));
+		end);
+		it("gives the same result when repeated", function()
+			for _ = 1, 3 do
+				assert.equal("user", stringprep.nodeprep("USER"));
+				assert.is_nil(stringprep.nodeprep("user@host"));
+			end
+		end);
+	end);
+	describe("#nameprep()", function()
+		it("should work", function()
+			assert.equal("example.com", stringprep.nameprep("example.com"));
+			assert.equal("example.com", stringprep.nameprep("Example.COM"));
+		end);
+	end);
+	describe("#resourceprep()", function()
+		it("keeps case and spaces", function()
+			assert.equal("My Laptop", stringprep.resourceprep("My Laptop"));
+			assert.equal("a/b@c", stringprep.resourceprep("a/b@c"));
+		end);
+		it("rejects control characters", function()
+			assert.is_nil(stringprep.resourceprep("a\1b"));
+		end);
+	end);
+	describe("#cache_stats()", function()
+		it("counts lookups", function()
+			local hits, misses = stringprep.cache_stats();
+			assert.equal("cached", stringprep.nodeprep("CACHED"));
+			assert.equal("cached", stringprep.nodeprep("CACHED"));
+			local hits2, misses2 = stringprep.cache_stats();
+			assert.equal(hits + 1, hits2);
+			assert.equal(misses + 1, misses2);
+		end);
+	end);
 end);
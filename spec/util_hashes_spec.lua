@@ -108,3 +108,34 @@ describe("HKDF", function ()
 		end);
 	end);
 end);
+
+describe("incremental hashing", function ()
+	it("works like the one-shot functions", function ()
+		local h = hashes.new("sha256");
+		h:update("a"):update("b");
+		h:update("c");
+		assert.equal("ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad", h:final(true));
+	end);
+
+	it("starts over after final()", function ()
+		local h = hashes.new("sha1");
+		h:update("partial");
+		assert.equal(hashes.sha1("partial"), h:final());
+		h:update("abc");
+		assert.equal(hashes.sha1("abc"), h:final());
+		assert.equal(hashes.sha1(""), h:final());
+	end);
+
+	it("handles HMAC", function ()
+		local h = hashes.hmac_new("sha256", "Jefe");
+		h:update("what do ya want "):update("for nothing?");
+		assert.equal("5bdcc146bf60754e6a042426089575c75a003f089d2739839dec58b964ec3843", h:final(true));
+		h:update("what do ya want for nothing?");
+		assert.equal(hashes.hmac_sha256("Jefe", "what do ya want for nothing?", true), h:final(true));
+	end);
+
+	it("rejects unknown algorithms", function ()
+		assert.has_error(function () hashes.new("sha0"); end);
+		assert.has_error(function () hashes.hmac_new("sha0", "key"); end);
+	end);
+end);
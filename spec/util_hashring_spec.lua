@@ -90,4 +90,27 @@ describe("util.hashring", function ()
 		assert.is_equal("node1", node);
 		assert.same({ a = 1 }, value);
 	end);
+
+	it("should use its own hash without a hash function", function ()
+		if not pcall(require, "util.ring") then
+			pending("util.ring is not available");
+			return;
+		end
+		local r = hashring.new(128);
+		r:add_nodes({ "node1", "node2", "node3" });
+		local before = {};
+		for i = 1, 1000 do
+			before[i] = r:get_node(tostring(i));
+			assert.is_string(before[i]);
+		end
+		r:remove_node("node3");
+		for i = 1, 1000 do
+			local node = r:get_node(tostring(i));
+			if before[i] ~= "node3" then
+				assert.is_equal(before[i], node);
+			else
+				assert.is_not_equal("node3", node);
+			end
+		end
+	end);
 end);
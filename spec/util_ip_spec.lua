@@ -126,4 +126,67 @@ describe("util.ip", function()
 			assert.equal("127.0.0.0", ip.truncate("127.0.0.1", 8).normal);
 		end);
 	end);
+
+	describe("#new_set()", function ()
+		it("matches addresses and ranges", function ()
+			local set = ip.new_set({ "10.0.0.0/8", "192.168.1.1", "2001:db8::/32", "fe80::1" });
+			assert.equal(4, #set);
+			assert.is_true(set:contains("10.20.30.40"));
+			assert.is_true(set:contains(ip.new_ip("10.0.0.1")));
+			assert.is_false(set:contains("11.0.0.1"));
+			assert.is_true(set:contains("192.168.1.1"));
+			assert.is_false(set:contains("192.168.1.2"));
+			assert.is_true(set:contains("2001:db8:1::1"));
+			assert.is_false(set:contains("2001:db9::1"));
+			assert.is_true(set:contains("fe80::1"));
+			assert.is_false(set:contains("fe80::2"));
+		end);
+
+		it("agrees with match() across address families", function ()
+			local set = ip.new_set({ "10.0.0.0/8" });
+			assert.is_true(set:contains("::ffff:10.1.2.3"));
+			set = ip.new_set({ "::ffff:0:0/96" });
+			assert.is_true(set:contains("1.2.3.4"));
+			set = ip.new_set({ "::/0" });
+			assert.is_true(set:contains("1.2.3.4"));
+			assert.is_true(set:contains("2001:db8::1"));
+		end);
+
+		it("agrees with match() on odd prefix lengths", function ()
+			local addrs = { "1.2.3.4", "10.0.0.1", "10.128.0.1", "2001:db8::1", "::ffff:10.1.2.3" };
+			for _, cidr in ipairs({ "10.0.0.0/0", "10.0.0.0/-1", "10.0.0.0/8.5", "10.0.0.0/40", "2001:db8::/0", "2001:db8::/200" }) do
+				local set = ip.new_set({ cidr });
+				local net_ip, bits = ip.parse_cidr(cidr);
+				for _, addr in ipairs(addrs) do
+					local a = ip.new_ip(addr);
+					assert.equal(ip.match(a, net_ip, bits), set:contains(a), addr.." in "..cidr);
+				end
+			end
+		end);
+
+		it("accepts a util.set", function ()
+			local set = ip.new_set(require "util.set".new({ "127.0.0.1", "::1" }));
+			assert.is_true(set:contains("127.0.0.1"));
+			assert.is_true(set:contains("::1"));
+			assert.is_false(set:contains("127.0.0.2"));
+		end);
+
+		it("handles many ranges", function ()
+			local ranges = {};
+			for i = 0, 255 do
+				for j = 0, 199 do
+					table.insert(ranges, ("%d.%d.0.0/16"):format(i, j));
+				end
+			end
+			local set = ip.new_set(ranges);
+			assert.is_true(set:contains("255.199.1.1"));
+			assert.is_false(set:contains("255.200.1.1"));
+		end);
+
+		it("rejects invalid ranges and addresses", function ()
+			local set = ip.new_set();
+			assert.is_nil(set:add("not an address"));
+			assert.is_nil(set:contains("not an address"));
+		end);
+	end);
 end);
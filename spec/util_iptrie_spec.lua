@@ -0,0 +1,33 @@
+local iptrie = require "util.iptrie";
+local pton = require "util.net".pton;
+
+describe("util.iptrie", function ()
+	it("finds the longest matching prefix", function ()
+		local trie = iptrie.new();
+		trie:add(pton("10.0.0.0"), 8);
+		trie:add(pton("10.1.0.0"), 16);
+		trie:add(pton("10.1.2.3"));
+		assert.equal(3, #trie);
+		assert.equal(8, trie:lookup(pton("10.2.0.1")));
+		assert.equal(16, trie:lookup(pton("10.1.0.1")));
+		assert.equal(32, trie:lookup(pton("10.1.2.3")));
+		assert.is_nil(trie:lookup(pton("11.0.0.1")));
+	end);
+
+	it("keeps IPv4 prefixes as IPv4-mapped IPv6", function ()
+		local trie = iptrie.new();
+		trie:add(pton("192.168.0.0"), 16);
+		assert.equal(16, trie:lookup(pton("::ffff:192.168.1.1")));
+		assert.is_nil(trie:lookup(pton("::192.168.1.1")));
+		trie:add(pton("2001:db8::"), 32);
+		assert.equal(32, trie:lookup(pton("2001:db8::1")));
+		assert.is_nil(trie:lookup(pton("2001:db9::1")));
+	end);
+
+	it("checks its arguments", function ()
+		local trie = iptrie.new();
+		assert.has_error(function () trie:add("abc", 8); end);
+		assert.has_error(function () trie:add(pton("10.0.0.0"), 33); end);
+		assert.has_error(function () trie:lookup("abc"); end);
+	end);
+end);
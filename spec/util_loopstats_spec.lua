@@ -0,0 +1,63 @@
+describe("util.loopstats", function ()
+	local loopstats;
+	setup(function ()
+		loopstats = require "util.loopstats";
+	end);
+	before_each(function ()
+		loopstats.reset();
+	end);
+
+	describe("histograms", function ()
+		it("count samples into cumulative buckets", function ()
+			local id = loopstats.histograms.events;
+			local bounds = loopstats.bounds(id);
+			assert.same({ 0, 1, 2, 4, 8, 16, 32, 64, 128, 256 }, bounds);
+			for _, v in ipairs({ 0, 1, 3, 300, 5 }) do
+				loopstats.observe(id, v);
+			end
+			local count, sum, buckets = loopstats.histogram(id);
+			assert.equal(5, count);
+			assert.equal(309, sum);
+			assert.same({ 1, 2, 2, 3, 4, 4, 4, 4, 4, 4, 5 }, buckets);
+		end);
+
+		it("record durations", function ()
+			local id = loopstats.histograms.onreadable;
+			loopstats.duration(id, loopstats.clock());
+			local count, sum, buckets = loopstats.histogram(id);
+			assert.equal(1, count);
+			assert.truthy(sum >= 0);
+			assert.equal(1, buckets[#buckets]);
+		end);
+
+		it("reject unknown ids", function ()
+			assert.has_error(function ()
+				loopstats.observe(100, 1);
+			end);
+		end);
+	end);
+
+	describe("counters", function ()
+		it("add up", function ()
+			local id = loopstats.counters.bytes_read;
+			loopstats.add(id, 100);
+			loopstats.add(id, 23);
+			assert.equal(123, loopstats.counter(id));
+			loopstats.add(loopstats.counters.short_writes);
+			assert.equal(1, loopstats.counter(loopstats.counters.short_writes));
+		end);
+
+		it("are zeroed by reset()", function ()
+			local id = loopstats.counters.bytes_written;
+			loopstats.add(id, 5);
+			loopstats.reset();
+			assert.equal(0, loopstats.counter(id));
+		end);
+
+		it("only go up", function ()
+			assert.has_error(function ()
+				loopstats.add(loopstats.counters.bytes_read, -1);
+			end);
+		end);
+	end);
+end);
@@ -0,0 +1,97 @@
+local net = require "util.net";
+local socket = require "socket";
+
+describe("util.net", function ()
+	describe("#pton()", function ()
+		it("round trips with ntop()", function ()
+			assert.equal("127.0.0.1", net.ntop(net.pton("127.0.0.1")));
+			assert.equal("::1", net.ntop(net.pton("::1")));
+		end);
+	end);
+
+	describe("#datagrams()", function ()
+		if not net.datagrams then
+			pending("not available on this platform");
+			return;
+		end
+
+		local function udp()
+			local sock = assert(socket.udp());
+			assert(sock:setsockname("127.0.0.1", 0));
+			local _, port = sock:getsockname();
+			return sock, tonumber(port);
+		end
+
+		local a, a_port, b, b_port;
+		before_each(function ()
+			a, a_port = udp();
+			b, b_port = udp();
+		end);
+		after_each(function ()
+			a:close();
+			b:close();
+		end);
+
+		it("rejects silly sizes", function ()
+			assert.has_error(function () net.datagrams(0); end);
+			assert.has_error(function () net.datagrams(8, 1e6); end);
+		end);
+
+		it("has a length", function ()
+			assert.equal(8, #net.datagrams(8));
+		end);
+
+		it("returns 0 when nothing is waiting", function ()
+			assert.equal(0, net.datagrams():recv(b:getfd(), {}));
+		end);
+
+		it("sends and receives batches", function ()
+			local batch = net.datagrams(8, 100);
+			local ip, port = {}, {};
+			for i = 1, 3 do ip[i], port[i] = "127.0.0.1", b_port; end
+			assert.equal(3, batch:send(a:getfd(), { "one", "", "three" }, ip, port));
+			socket.sleep(0.01);
+
+			local data, from, from_port = {}, {}, {};
+			assert.equal(3, batch:recv(b:getfd(), data, from, from_port));
+			assert.same({ "one", "", "three" }, data);
+			assert.same({ "127.0.0.1", "127.0.0.1", "127.0.0.1" }, from);
+			assert.same({ a_port, a_port, a_port }, from_port);
+		end);
+
+		it("sends no more than it has room for", function ()
+			local batch = net.datagrams(2);
+			assert(a:setpeername("127.0.0.1", b_port));
+			assert.equal(2, batch:send(a:getfd(), { "x", "y", "z" }));
+			assert.equal(1, batch:send(a:getfd(), { "x", "y", "z" }, nil, nil, 1));
+		end);
+
+		it("truncates long datagrams", function ()
+			assert(a:sendto(("x"):rep(300), "127.0.0.1", b_port));
+			socket.sleep(0.01);
+			local data = {};
+			assert.equal(1, net.datagrams(4, 100):recv(b:getfd(), data));
+			assert.equal(100, #data[1]);
+		end);
+
+		it("rejects invalid addresses", function ()
+			assert.has_error(function ()
+				net.datagrams():send(a:getfd(), { "x" }, { "example.com" }, { 53 });
+			end);
+		end);
+
+		it("only sends strings", function ()
+			assert(a:setpeername("127.0.0.1", b_port));
+			assert.has_error(function ()
+				net.datagrams():send(a:getfd(), { "x", 42 });
+			end);
+		end);
+
+		it("fails on bad file descriptors", function ()
+			local ok, err, errno = net.datagrams():recv(-1, {});
+			assert.is_nil(ok);
+			assert.string(err);
+			assert.number(errno);
+		end);
+	end);
+end);
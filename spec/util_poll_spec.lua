@@ -30,6 +30,65 @@ describe("util.poll", function()
 			assert.truthy(w);
 			assert.truthy(p:del(1));
 		end);
+		it("returns many events at once", function()
+			local events = {};
+			assert.truthy(p:add(1, false, true));
+			assert.truthy(p:add(2, false, true));
+			local n = p:waitmany(1, events);
+			assert.equal(2, n);
+			local seen = {};
+			for i = 1, n * 3, 3 do
+				assert.is_number(events[i]);
+				assert.falsy(events[i + 1]);
+				assert.truthy(events[i + 2]);
+				seen[events[i]] = true;
+			end
+			assert.same({ [1] = true; [2] = true }, seen);
+			assert.truthy(p:del(1));
+			assert.truthy(p:del(2));
+		end);
+		it("times out in batch mode", function()
+			local n, err = p:waitmany(0, {});
+			assert.falsy(n);
+			assert.equal("timeout", err);
+		end);
+	end)
+	describe("new with a size", function()
+		it("limits events per wait", function()
+			local p = poll.new(1);
+			local events = {};
+			assert.truthy(p:add(1, false, true));
+			assert.truthy(p:add(2, false, true));
+			if poll.api == "epoll" or poll.api == "io_uring" then
+				assert.equal(1, p:waitmany(1, events));
+			end
+			assert.truthy(p:del(1));
+			assert.truthy(p:del(2));
+		end);
+		it("rejects silly sizes", function()
+			if poll.api ~= "epoll" and poll.api ~= "io_uring" then return end
+			assert.has_error(function()
+				poll.new(0);
+			end);
+		end);
+	end)
+	describe("flags", function()
+		it("accepts edge triggered mode", function()
+			if not poll.EPOLLET then return end
+			local p = poll.new();
+			assert.truthy(p:add(1, false, true, poll.EPOLLET));
+			assert.equal(1, (p:wait(1)));
+			-- changing the registration re-arms it
+			assert.truthy(p:set(1, false, true, poll.EPOLLET));
+			assert.equal(1, (p:wait(1)));
+			assert.truthy(p:del(1));
+		end);
+		it("rejects unknown flags", function()
+			local p = poll.new();
+			assert.has_error(function()
+				p:add(1, false, true, 1);
+			end);
+		end);
 	end)
 end);
 
@@ -0,0 +1,58 @@
+local pposix = require "util.pposix";
+
+describe("util.pposix", function()
+	describe("pool_allocator()", function()
+		-- There is no way back, so everything after this runs on the pool
+		it("switches the allocator", function()
+			assert.truthy(pposix.pool_allocator());
+			assert.truthy(pposix.pool_allocator());
+			local info = pposix.meminfo();
+			assert.is_table(info.pool);
+			assert.truthy(info.pool.used <= info.pool.allocated);
+			assert.is_table(info.tags);
+		end);
+
+		it("accounts memory to tags until it is collected", function()
+			assert.truthy(pposix.pool_allocator());
+			local tag = assert(pposix.new_memtag("util_pposix_spec"));
+			assert.equal(tag, pposix.new_memtag("util_pposix_spec"));
+
+			collectgarbage();
+			collectgarbage();
+			local before = pposix.meminfo().tags.util_pposix_spec;
+			assert.is_number(before);
+
+			local previous = pposix.memtag(tag);
+			local t = {};
+			for i = 1, 1000 do
+				t[i] = { i, tostring(i) };
+			end
+			assert.equal(tag, pposix.memtag(previous));
+
+			local during = pposix.meminfo().tags.util_pposix_spec;
+			assert.truthy(during - before > 1000 * 16);
+
+			t = nil; -- luacheck: ignore 311
+			collectgarbage();
+			collectgarbage();
+			local after = pposix.meminfo().tags.util_pposix_spec;
+			-- Some of it may be the string table having grown
+			assert.truthy(after - before < (during - before) / 2);
+		end);
+	end);
+
+	describe("memtag()", function()
+		it("returns the previous tag", function()
+			local tag = assert(pposix.new_memtag("util_pposix_spec"));
+			local previous = pposix.memtag(tag);
+			assert.equal(tag, pposix.memtag());
+			assert.equal(0, pposix.memtag(previous));
+		end);
+
+		it("rejects unknown tags", function()
+			assert.has_error(function ()
+				pposix.memtag(1000);
+			end);
+		end);
+	end);
+end);
@@ -35,6 +35,61 @@ describe("util.ringbuffer", function ()
 		end);
 	end);
 
+	describe(":find", function ()
+		it("finds a match that wraps around", function ()
+			local b = rb.new(8);
+			assert.truthy(b:write("xxxxxx"));
+			assert.truthy(b:discard(5));
+			assert.truthy(b:write("a\r\nc"));
+			assert.equal(4, b:find("\r\n"));
+			assert.equal("xa\r\n", b:readuntil("\r\n"));
+			assert.equal("c", b:read(1));
+		end);
+
+		it("keeps finding matches as the buffer grows", function ()
+			local b = rb.new(16);
+			assert.truthy(b:write("hello"));
+			assert.is_nil((b:readuntil("\n")));
+			assert.truthy(b:write(" world"));
+			assert.is_nil((b:readuntil("\n")));
+			assert.equal(5, b:find("o"));
+			assert.truthy(b:write("\nbye"));
+			assert.equal("hello world\n", b:readuntil("\n"));
+			assert.is_nil((b:readuntil("\n")));
+			assert.truthy(b:write("\n"));
+			assert.equal("bye\n", b:readuntil("\n"));
+		end);
+
+		it("works on a full buffer", function ()
+			local b = rb.new(4);
+			assert.truthy(b:write("ab\nc"));
+			assert.equal(3, b:find("\n"));
+		end);
+	end);
+
+	describe(":recv and :send", function ()
+		local pposix = require "util.pposix";
+		it("move data through a file descriptor across the wrap point", function ()
+			local r, w = pposix.pipe();
+			local b = rb.new(8);
+			assert.truthy(b:write("xxxxxx"));
+			assert.truthy(b:discard(5));
+			assert.truthy(b:write("hello"));
+			assert.equal(6, b:send(w));
+			assert.equal(0, #b);
+			assert.equal(6, b:recv(r));
+			assert.equal("xhello", b:read(6));
+			pposix.fdopen(w, "w"):close();
+			assert.equal(0, b:recv(r));
+			pposix.fdopen(r, "r"):close();
+		end);
+		it("fails when the buffer is full", function ()
+			local b = rb.new(4);
+			assert.truthy(b:write("full"));
+			assert.is_nil((b:recv(0)));
+		end);
+	end);
+
 	describe(":sub", function ()
 		-- Helper function to compare buffer:sub() with string:sub()
 		local function test_sub(b, x, y)
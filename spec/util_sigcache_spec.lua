@@ -0,0 +1,39 @@
+local sigcache = require "util.sigcache";
+
+describe("util.sigcache", function()
+	describe("new()", function()
+		it("creates one context per key", function()
+			local created = 0;
+			local key = {
+				signer = function (_, algorithm)
+					assert.equal("ed25519", algorithm);
+					created = created + 1;
+					return { n = created };
+				end;
+			};
+			local get_signer = sigcache.new("signer", "ed25519");
+			local ctx = get_signer(key);
+			assert.equal(1, ctx.n);
+			assert.equal(ctx, get_signer(key));
+			assert.equal(1, created);
+		end);
+
+		it("passes on and does not cache failures", function()
+			local fail = true;
+			local key = {
+				verifier = function ()
+					if fail then
+						return nil, "verify-init-failed";
+					end
+					return {};
+				end;
+			};
+			local get_verifier = sigcache.new("verifier", "ed25519");
+			local ctx, err = get_verifier(key);
+			assert.is_nil(ctx);
+			assert.equal("verify-init-failed", err);
+			fail = false;
+			assert.is_table(get_verifier(key));
+		end);
+	end);
+end);
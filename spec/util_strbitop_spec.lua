@@ -30,6 +30,19 @@ describe("util.strbitop", function ()
 		it("works", function ()
 			assert.equal(string.rep("Aa", 100), strbitop.sxor(string.rep("a", 200), " \0"));
 		end);
+		it("works with keys of any length", function ()
+			local bxor = require "util.bitcompat".bxor;
+			local data = string.rep("The quick brown fox jumps over the lazy dog. ", 100);
+			for _, key in ipairs({ "\1\2\3", string.rep("\1\2\3\4\5", 60), string.rep("\7", 5000) }) do
+				local out = strbitop.sxor(data, key);
+				assert.equal(#data, #out);
+				for i = 1, #data, 97 do
+					local k = (i - 1) % #key + 1;
+					assert.equal(bxor(data:byte(i), key:byte(k)), out:byte(i));
+				end
+				assert.equal(data, strbitop.sxor(out, key));
+			end
+		end);
 		it("returns empty string if first argument is empty", function ()
 			assert.equal("", strbitop.sxor("", ""));
 			assert.equal("", strbitop.sxor("", "key"));
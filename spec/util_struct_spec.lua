@@ -0,0 +1,51 @@
+local struct = require "util.struct";
+
+describe("util.struct", function ()
+	describe("compile()", function ()
+		it("packs like pack()", function ()
+			local fmt = struct.compile(">I2I2I4");
+			assert.equal(struct.pack(">I2I2I4", 1, 2, 3), fmt:pack(1, 2, 3));
+			assert.equal("\0\1\0\2\0\0\0\3", fmt:pack(1, 2, 3));
+		end);
+
+		it("unpacks like unpack()", function ()
+			local fmt = struct.compile("x>BI2");
+			local family, port, pos = fmt:unpack("\0\1\20\102");
+			assert.equal(1, family);
+			assert.equal(5222, port);
+			assert.equal(5, pos);
+			assert.same({ struct.unpack("x>BI2", "xx\0\1\20\102", 3) }, { fmt:unpack("xx\0\1\20\102", 3) });
+		end);
+
+		it("handles variable length items", function ()
+			local fmt = struct.compile(">I2c0s");
+			local packed = fmt:pack(5, "hello", "world");
+			assert.equal("\0\5helloworld\0", packed);
+			local s1, s2 = fmt:unpack(packed);
+			assert.equal("hello", s1);
+			assert.equal("world", s2);
+		end);
+
+		it("knows its size", function ()
+			assert.equal(8, struct.compile(">I2I2I4"):size());
+			assert.equal(16, struct.compile("!4 b i4 d"):size());
+			assert.has_error(function () struct.compile("s"):size(); end);
+		end);
+
+		it("rejects invalid formats", function ()
+			assert.has_error(function () struct.compile("q"); end);
+			assert.has_error(function () struct.compile("!3"); end);
+		end);
+	end);
+
+	describe("unpack_into()", function ()
+		it("fills a table", function ()
+			local fmt = struct.compile("<I2 c0 B");
+			local t = {};
+			local ret, pos = fmt:unpack_into(t, "\3\0abc\7");
+			assert.equal(t, ret);
+			assert.equal(7, pos);
+			assert.same({ "abc", 7 }, t);
+		end);
+	end);
+end);
@@ -13,6 +13,70 @@ describe("util.table", function ()
 		end);
 	end);
 
+	describe("clear()", function ()
+		it("works", function ()
+			local t = { "lorem", "ipsum", foo = "bar", [true] = false };
+			assert.equal(t, u_table.clear(t));
+			assert.same({}, t);
+		end);
+		it("does not touch the metatable", function ()
+			local mt = {};
+			local t = setmetatable({ 1, 2, 3 }, mt);
+			u_table.clear(t);
+			assert.equal(mt, getmetatable(t));
+		end);
+	end);
+
+	describe("pool()", function ()
+		it("hands back tables that were put", function ()
+			local pool = u_table.pool(2, 2);
+			local t = pool:get();
+			assert.is.table(t);
+			t[1], t.x = "a", "b";
+			assert.is_true(pool:put(t));
+			assert.equal(1, #pool);
+			local t2 = pool:get();
+			assert.equal(t, t2);
+			assert.same({}, t2);
+			assert.equal(0, #pool);
+			assert.not_equal(t, pool:get());
+		end);
+		it("clears the metatable", function ()
+			local pool = u_table.pool();
+			local t = setmetatable({}, {});
+			pool:put(t);
+			assert.is_nil(getmetatable(pool:get()));
+		end);
+		it("respects the limit", function ()
+			local pool = u_table.pool(0, 0, 1);
+			assert.is_true(pool:put({}));
+			local t = { "keep" };
+			assert.is_false(pool:put(t));
+			assert.same({ "keep" }, t);
+			assert.equal(1, #pool);
+		end);
+	end);
+
+	describe("concat_range()", function ()
+		it("works", function ()
+			local t = { "lorem", "ipsum", 3, "sit" };
+			assert.equal("loremipsum3sit", u_table.concat_range(t));
+			assert.equal("ipsum, 3", u_table.concat_range(t, 2, 3, ", "));
+			assert.equal("", u_table.concat_range(t, 3, 2));
+		end);
+		it("does not consult __index", function ()
+			local t = setmetatable({ "a" }, { __index = function () return "b"; end });
+			assert.has_error(function ()
+				u_table.concat_range(t, 1, 2);
+			end);
+		end);
+		it("rejects non-strings", function ()
+			assert.has_error(function ()
+				u_table.concat_range({ "a", {}, "c" });
+			end);
+		end);
+	end);
+
 	describe("move()", function ()
 		it("works", function ()
 			local t1 = { "apple", "banana", "carrot" };
@@ -24,8 +24,23 @@ describe("util.time", function ()
 			assert.truthy(a <= b);
 		end);
 	end);
+	describe("tick()", function ()
+		it("returns the current time", function ()
+			local now, monotonic = time.tick();
+			assert.is_number(now);
+			assert.truthy(monotonic <= time.monotonic());
+		end);
+		it("takes the coarse clocks", function ()
+			local now, monotonic = time.tick(true);
+			assert.is_number(now);
+			assert.is_number(monotonic);
+		end);
+	end);
+	describe("cached_now() and cached_monotonic()", function ()
+		it("return what tick() read", function ()
+			local now, monotonic = time.tick();
+			assert.equal(now, time.cached_now());
+			assert.equal(monotonic, time.cached_monotonic());
+		end);
+	end);
 end);
-
-
-
-
@@ -0,0 +1,91 @@
+local timerwheel = require "util.timerwheel";
+describe("util.timerwheel", function ()
+	describe("#new", function ()
+		it("has a constructor", function ()
+			assert.Function(timerwheel.new);
+		end);
+		it("can be created", function ()
+			assert.truthy(timerwheel.new(0));
+		end);
+		it("won't accept a zero resolution", function ()
+			assert.has_error(function ()
+				timerwheel.new(0, 0);
+			end);
+		end);
+	end);
+
+	describe(":peek", function ()
+		it("returns nil when empty", function ()
+			local w = timerwheel.new(0);
+			assert.is_nil(w:peek());
+		end);
+		it("never returns a time after the next expiry", function ()
+			local w = timerwheel.new(0);
+			w:insert("a", 30);
+			w:insert("b", 5);
+			assert.truthy(w:peek() <= 5);
+		end);
+	end);
+
+	describe(":pop", function ()
+		it("returns timers once due, in order", function ()
+			local w = timerwheel.new(0);
+			local a = w:insert("a", 2);
+			local b = w:insert("b", 1);
+			local c = w:insert("c", 300);
+			assert.equal(3, #w);
+			assert.is_nil((w:pop(0.5)));
+			local id, item = w:pop(2);
+			assert.equal(b, id);
+			assert.equal("b", item);
+			id, item = w:pop(2);
+			assert.equal(a, id);
+			assert.equal("a", item);
+			assert.is_nil((w:pop(2)));
+			id, item = w:pop(1000);
+			assert.equal(c, id);
+			assert.equal("c", item);
+		end);
+		it("keeps popped timers until re-inserted or removed", function ()
+			local w = timerwheel.new(0);
+			local id = w:insert("a", 1);
+			assert.equal(id, w:pop(1));
+			assert.is_nil(w:reprioritize(id, 5));
+			assert.equal(id, w:insert("a", 5, id));
+			assert.is_nil((w:pop(4)));
+			assert.equal(id, w:pop(5));
+			assert.equal("a", w:remove(id));
+			assert.is_nil(w:insert("a", 6, id));
+			assert.equal(0, #w);
+		end);
+	end);
+
+	describe(":remove", function ()
+		it("cancels a timer", function ()
+			local w = timerwheel.new(0);
+			local id = w:insert("a", 1);
+			assert.equal("a", w:remove(id));
+			assert.is_nil(w:remove(id));
+			assert.is_nil((w:pop(10)));
+		end);
+		it("does not match a reused slot", function ()
+			local w = timerwheel.new(0);
+			local old = w:insert("a", 1);
+			w:remove(old);
+			local new = w:insert("b", 1);
+			assert.not_equal(old, new);
+			assert.is_nil(w:remove(old));
+			assert.equal("b", w:remove(new));
+		end);
+	end);
+
+	describe(":reprioritize", function ()
+		it("moves a timer", function ()
+			local w = timerwheel.new(0);
+			local id = w:insert("a", 1);
+			assert.truthy(w:reprioritize(id, 100000));
+			assert.is_nil((w:pop(99999)));
+			assert.equal(id, w:pop(100000));
+		end);
+	end);
+end);
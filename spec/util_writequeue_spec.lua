@@ -0,0 +1,116 @@
+local writequeue = require "util.writequeue";
+describe("util.writequeue", function ()
+	describe("#new", function ()
+		it("has a constructor", function ()
+			assert.Function(writequeue.new);
+		end);
+		it("can be created", function ()
+			assert.truthy(writequeue.new());
+		end);
+		it("won't accept a negative size", function ()
+			assert.has_error(function ()
+				writequeue.new(-1);
+			end);
+		end);
+	end);
+
+	describe(":write", function ()
+		it("works", function ()
+			local q = writequeue.new();
+			assert.truthy(q:write("hello"));
+			assert.truthy(q:write(" world"));
+			assert.equal(11, #q);
+		end);
+		it("respects the size limit", function ()
+			local q = writequeue.new(8);
+			assert.truthy(q:write("hello"));
+			assert.falsy(q:write(" world"));
+			assert.equal(5, #q);
+		end);
+		it("collapses when the chunk limit is reached", function ()
+			local q = writequeue.new(nil, 2);
+			assert.truthy(q:write("a"));
+			assert.truthy(q:write("b"));
+			assert.truthy(q:write("c"));
+			assert.equal("abc", q:peek());
+		end);
+	end);
+
+	describe(":peek", function ()
+		it("returns a large first chunk as is, with the range to send", function ()
+			local q = writequeue.new();
+			local big = ("x"):rep(100000);
+			q:write(big);
+			q:write("tail");
+			q:discard(10);
+			local s, i, j = q:peek(1000);
+			assert.equal(big, s);
+			assert.equal(11, i);
+			assert.equal(1010, j);
+		end);
+		it("combines small chunks", function ()
+			local q = writequeue.new();
+			q:write("hello");
+			q:write(" ");
+			q:write("world");
+			q:discard(1);
+			assert.same({ "ello wo", 1, 7 }, { q:peek(7) });
+		end);
+		it("returns nothing when empty", function ()
+			local q = writequeue.new();
+			assert.equal(0, select("#", q:peek()));
+			assert.equal(0, select("#", q:peek(100)));
+		end);
+		it("returns nothing when emptied", function ()
+			local q = writequeue.new();
+			q:write("hello");
+			q:discard(5);
+			assert.equal(0, select("#", q:peek()));
+		end);
+	end);
+
+	describe(":flush", function ()
+		local pposix = require "util.pposix";
+		it("writes everything to a file descriptor", function ()
+			local r, w = pposix.pipe();
+			local q = writequeue.new();
+			q:write("hello");
+			q:write(" world");
+			q:discard(2);
+			assert.equal(9, q:flush(w));
+			assert.equal(0, #q);
+			pposix.fdopen(w, "w"):close();
+			local f = pposix.fdopen(r, "r");
+			assert.equal("llo world", f:read("*a"));
+			f:close();
+		end);
+		it("stops at the given limit", function ()
+			local r, w = pposix.pipe();
+			local q = writequeue.new();
+			q:write("hello world");
+			assert.equal(5, q:flush(w, 5));
+			assert.equal(6, #q);
+			assert.same({ "hello world", 6, 11 }, { q:peek() });
+			pposix.fdopen(w, "w"):close();
+			pposix.fdopen(r, "r"):close();
+		end);
+		it("writes nothing when empty", function ()
+			local r, w = pposix.pipe();
+			local q = writequeue.new();
+			assert.equal(0, q:flush(w));
+			pposix.fdopen(w, "w"):close();
+			pposix.fdopen(r, "r"):close();
+		end);
+		it("reports a closed peer like LuaSocket", function ()
+			require "socket"; -- ignores SIGPIPE
+			local r, w = pposix.pipe();
+			pposix.fdopen(r, "r"):close();
+			local q = writequeue.new();
+			q:write("hello");
+			local ok, err = q:flush(w);
+			assert.falsy(ok);
+			assert.equal("closed", err);
+			pposix.fdopen(w, "w"):close();
+		end);
+	end);
+end);
@@ -0,0 +1,69 @@
+local wsframe = require "util.wsframe";
+describe("util.wsframe", function ()
+	describe("parse_header()", function ()
+		it("works", function ()
+			local header, header_length = wsframe.parse_header("\129\133 \0 \0HeLlO");
+			assert.equal(6, header_length);
+			assert.same({
+				FIN = true; RSV1 = false; RSV2 = false; RSV3 = false;
+				opcode = 1; MASK = true; length = 5; key = " \0 \0";
+			}, header);
+		end);
+		it("reads extended lengths", function ()
+			assert.equal(300, (wsframe.parse_header("\1\126\1\44")).length);
+			assert.equal(2^32, (wsframe.parse_header("\1\127\0\0\0\1\0\0\0\0")).length);
+		end);
+		it("returns nothing if the header is incomplete", function ()
+			assert.is_nil(wsframe.parse_header(""));
+			assert.is_nil(wsframe.parse_header("\1"));
+			assert.is_nil(wsframe.parse_header("\1\126\1"));
+			assert.is_nil(wsframe.parse_header("\1\133 \0"));
+		end);
+		it("starts at the given position", function ()
+			assert.equal(4, (wsframe.parse_header("xx\1\4ping", 3)).length);
+		end);
+	end);
+
+	describe("mask()", function ()
+		it("works", function ()
+			assert.equal("HeLlO", wsframe.mask("hello", " \0 \0"));
+			assert.equal("eLl", wsframe.mask("xhellox", " \0 \0", 3, 5));
+			assert.equal("", wsframe.mask("hello", " \0 \0", 3, 2));
+			assert.equal("", wsframe.mask("hello", " \0 \0", 6, 5));
+			assert.equal("", wsframe.mask("hello", " \0 \0", 10));
+			assert.equal("", wsframe.mask("", " \0 \0"));
+			assert.equal("lO", wsframe.mask("hello", " \0 \0", -2));
+		end);
+		it("matches strbitop.sxor() on longer data", function ()
+			local sxor = require "util.strbitop".sxor;
+			local data = string.rep("The quick brown fox jumps over the lazy dog. ", 100);
+			for len = 0, 40 do
+				assert.equal(sxor(data:sub(1, len), "\1\2\3\4"), wsframe.mask(data:sub(1, len), "\1\2\3\4"));
+			end
+			assert.equal(sxor(data, "\1\2\3\4"), wsframe.mask(data, "\1\2\3\4"));
+		end);
+		it("requires a 4 byte key", function ()
+			assert.has_error(function () wsframe.mask("hello", "key"); end);
+		end);
+	end);
+
+	describe("build()", function ()
+		it("works", function ()
+			assert.equal("\129\5hello", wsframe.build(0x81, "hello"));
+			assert.equal("\129\133 \0 \0HeLlO", wsframe.build(0x81, "hello", " \0 \0"));
+		end);
+		it("uses extended lengths", function ()
+			local data = string.rep("x", 300);
+			assert.equal("\1\126\1\44"..data, wsframe.build(0x01, data));
+			data = string.rep("x", 0x10000);
+			assert.equal("\1\127\0\0\0\0\0\1\0\0"..data, wsframe.build(0x01, data));
+		end);
+		it("builds what parse_header() reads", function ()
+			local data = string.rep("abc", 1000);
+			local frame = wsframe.build(0x82, data, "\9\8\7\6");
+			local header, header_length = wsframe.parse_header(frame);
+			assert.equal(#data, header.length);
+			assert.equal(data, wsframe.mask(frame, header.key, header_length + 1));
+		end);
+	end);
+end);
@@ -0,0 +1,69 @@
+local xmlserialize = require "util.xmlserialize";
+local st = require "util.stanza";
+describe("util.xmlserialize", function ()
+	describe("escape()", function ()
+		it("works", function ()
+			assert.equal("plain text", xmlserialize.escape("plain text"));
+			assert.equal("&lt;a href=&quot;x&quot;&gt;Tom &amp; Jerry&apos;s&lt;/a&gt;", xmlserialize.escape("<a href=\"x\">Tom & Jerry's</a>"));
+			assert.equal("", xmlserialize.escape(""));
+			assert.equal("a\0b&amp;", xmlserialize.escape("a\0b&"));
+		end);
+		it("only takes strings and numbers", function ()
+			assert.equal("42", xmlserialize.escape(42));
+			assert.has_error(function () xmlserialize.escape({}); end);
+			assert.has_error(function () xmlserialize.escape(); end);
+		end);
+	end);
+
+	describe("serialize()", function ()
+		it("works", function ()
+			local s = st.message({ xmlns = "jabber:client", to = "juliet@example.com" })
+				:text_tag("body", "Wherefore art thou, <Romeo>?"):up()
+				:tag("x", { xmlns = "urn:example" }):tag("y", { xmlns = "urn:example" });
+			local expected = "<message to='juliet@example.com' xmlns='jabber:client'>"
+				.. "<body>Wherefore art thou, &lt;Romeo&gt;?</body>"
+				.. "<x xmlns='urn:example'><y/></x></message>";
+			local xml = xmlserialize.serialize(s);
+			-- Attribute order follows the hash table
+			assert.equal(#expected, #xml);
+			assert.truthy(xml:find("<body>Wherefore art thou, &lt;Romeo&gt;?</body><x xmlns='urn:example'><y/></x></message>$"));
+			assert.truthy(xml:find(" to='juliet@example.com'", 1, true));
+		end);
+		it("handles namespaced attributes", function ()
+			local s = st.stanza("a", { ["urn:example\1b"] = "'c'" });
+			assert.equal("<a xmlns:ns1='urn:example' ns1:b='&apos;c&apos;'/>", xmlserialize.serialize(s));
+		end);
+		insulate("compared to util.stanza without it", function ()
+			-- Load a copy of util.stanza that falls back to its own serializer
+			package.loaded["util.stanza"] = nil;
+			package.loaded["prosody.util.stanza"] = nil;
+			package.loaded["util.xmlserialize"] = nil;
+			package.loaded["prosody.util.xmlserialize"] = nil;
+			package.preload["prosody.util.xmlserialize"] = function () error("disabled for testing"); end;
+			local lua_st = require "util.stanza";
+			package.preload["prosody.util.xmlserialize"] = nil;
+
+			it("matches the Lua serializer", function ()
+				local s = lua_st.stanza("iq", { type = "result", id = "1" })
+					:tag("query", { xmlns = "jabber:iq:roster", ver = "&\"" });
+				for i = 1, 20 do
+					s:tag("item", { jid = "user"..i.."@example.com", name = "<"..i..">" }):text_tag("group", "Friends & Family"):up():up();
+				end
+				s:tag("x", { xmlns = "urn:example", ["urn:example\1y"] = "'z'" }):text("a\0b"):up();
+				s:reset();
+				assert.equal(tostring(s), xmlserialize.serialize(s));
+			end);
+
+			it("escapes like the Lua serializer", function ()
+				for _, text in ipairs({ "", "plain", "<&>\"'", "a\0b", ("x&"):rep(100) }) do
+					assert.equal(lua_st.xml_escape(text), xmlserialize.escape(text));
+				end
+			end);
+		end);
+		it("rejects invalid stanzas", function ()
+			assert.has_error(function () xmlserialize.serialize({ attr = {} }); end);
+			assert.has_error(function () xmlserialize.serialize({ name = "a" }); end);
+			assert.has_error(function () xmlserialize.serialize({ name = "a", attr = { b = true } }); end);
+		end);
+	end);
+end);
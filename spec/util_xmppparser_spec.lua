@@ -0,0 +1,131 @@
+local ok, xmppparser = pcall(require, "util.xmppparser");
+local st = require "util.stanza";
+
+describe("util.xmppparser", function()
+	if not ok then
+		pending("util.xmppparser is not available", function () end);
+		return;
+	end
+
+	local stream_open = "<stream:stream xmlns:stream='streamns' xmlns='stanzans'>";
+
+	local function new(callbacks, size_limit)
+		local session = { notopen = true };
+		local events = {};
+		local parser = xmppparser.new(session, {
+			stanza_mt = st.stanza_mt;
+			stream_tag = "streamns\1stream";
+			error_tag = "streamns\1error";
+			default_ns = "stanzans";
+			stanza_size_limit = size_limit;
+			streamopened = callbacks.streamopened or function (s)
+				assert.equal(session, s);
+				s.notopen = nil;
+				table.insert(events, "open");
+			end;
+			handlestanza = callbacks.handlestanza or function (s, stanza)
+				assert.equal(session, s);
+				table.insert(events, stanza);
+			end;
+			streamclosed = callbacks.streamclosed or function (s)
+				assert.equal(session, s);
+				table.insert(events, "close");
+			end;
+			error = callbacks.error or function (_, e)
+				table.insert(events, "error:"..e);
+			end;
+		});
+		return parser, events, session;
+	end
+
+	describe("#feed()", function()
+		it("builds stanzas", function()
+			local parser, events = new({});
+			assert.truthy(parser:feed(stream_open));
+			assert.truthy(parser:feed("<message to='a@b'><body>hel"));
+			assert.truthy(parser:feed("lo</body><x xmlns='urn:example'/></message>"));
+			assert.truthy(parser:feed("</stream:stream>"));
+			assert.equal(3, #events);
+			assert.equal("open", events[1]);
+			assert.equal("close", events[3]);
+
+			local stanza = events[2];
+			assert.truthy(st.is_stanza(stanza));
+			assert.equal("message", stanza.name);
+			assert.equal("a@b", stanza.attr.to);
+			assert.is_nil(stanza.attr.xmlns);
+			assert.equal("en", stanza.attr["xml:lang"]);
+			assert.equal("hello", stanza:get_child_text("body"));
+			assert.truthy(stanza:get_child("x", "urn:example"));
+		end);
+
+		it("reports the stream language on stanzas", function()
+			local parser, events = new({});
+			assert.truthy(parser:feed("<stream:stream xmlns:stream='streamns' xmlns='stanzans' xml:lang='sv'><iq/>"));
+			assert.equal("sv", events[2].attr["xml:lang"]);
+		end);
+
+		it("rejects restricted XML", function()
+			local parser, events = new({});
+			assert.truthy(parser:feed(stream_open));
+			assert.falsy(parser:feed("<!-- comment -->"));
+			assert.equal("error:parse-error", events[2]);
+		end);
+
+		it("enforces the stanza size limit", function()
+			local parser = new({}, 64);
+			assert.truthy(parser:feed(stream_open));
+			local ret, err = parser:feed("<message><body>"..string.rep("x", 100));
+			assert.falsy(ret);
+			assert.equal("stanza-too-large", err);
+		end);
+
+		it("passes on errors from callbacks and can be fed again", function()
+			local parser, events, session = new({
+				handlestanza = function (_, stanza)
+					if stanza.name == "iq" then
+						error("no thanks");
+					end
+				end;
+			});
+			assert.truthy(parser:feed(stream_open));
+			assert.has_error(function ()
+				parser:feed("<iq/>");
+			end);
+			-- Not stuck thinking it's still running
+			session.notopen = true;
+			parser:reset();
+			assert.truthy(parser:feed(stream_open));
+			assert.equal("open", events[2]);
+		end);
+
+		it("refuses being fed from a callback", function()
+			local parser;
+			parser = new({
+				handlestanza = function ()
+					parser:feed("<iq/>");
+				end;
+			});
+			assert.truthy(parser:feed(stream_open));
+			assert.has_error(function ()
+				parser:feed("<message/>");
+			end, "parser is already running");
+		end);
+	end);
+
+	describe("#reset()", function()
+		it("can be called from a callback", function()
+			local parser, events;
+			parser, events = new({
+				handlestanza = function (session, stanza)
+					table.insert(events, stanza.name);
+					session.notopen = true;
+					parser:reset();
+				end;
+			});
+			assert.truthy(parser:feed(stream_open.."<iq/>"));
+			assert.truthy(parser:feed(stream_open.."<presence/>"));
+			assert.same({ "open", "iq", "open", "presence" }, events);
+		end);
+	end);
+end);
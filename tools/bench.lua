@@ -0,0 +1,707 @@
+#!/usr/bin/env lua
+
+-- bench.lua [--time SECONDS] [--save FILE] [--compare FILE] [--pool-allocator] [PATTERN...]
+--
+-- Times the native modules from util-src on XMPP-shaped inputs. Each benchmark
+-- is calibrated to run for about the given time (default 0.2s), the best of
+-- three rounds is reported as ops/s and ns/op, along with the Lua heap
+-- allocated per op. That is counted with the GC stopped and does not include
+-- memory the C libraries allocate themselves.
+--
+-- --save writes the results to a file, --compare shows the change against
+-- results saved earlier. --pool-allocator switches to the pooling allocator
+-- from util.pposix first. Patterns select benchmarks by name.
+
+if not pcall(require, "prosody.loader") then
+	pcall(require, "loader");
+end
+
+local monotonic = require "prosody.util.time".monotonic;
+local serialization = require "prosody.util.serialization";
+
+local s_format, s_char, t_concat = string.format, string.char, table.concat;
+local function printf(fmt, ...) return io.write(s_format(fmt, ...), "\n"); end
+
+local benchmarks = {};
+
+-- setup() returns the function to time, or nil and the reason to skip it
+local function bench(name, setup)
+	table.insert(benchmarks, { name = name; setup = setup });
+end
+
+local function try(name)
+	local ok, lib = pcall(require, name);
+	if ok then return lib; end
+	return nil, name .. " not available";
+end
+
+--- Inputs
+
+-- Deterministic filler, so runs are comparable
+local function bytes(n, seed)
+	local out, x = {}, seed or 1;
+	for i = 1, n do
+		x = (x * 1103515245 + 12345) % 2147483648;
+		out[i] = s_char(x % 256);
+	end
+	return t_concat(out);
+end
+
+local jids = {
+	"juliet@capulet.lit/balcony";
+	"romeo@montague.lit";
+	"Benvolio@Montague.LIT/Orchard";
+	"nurse+kitchen@capulet.lit/6f1c2a0e-73b5-4e4b-9d1a-6f0a5b1fe9b2";
+	"Ünïcødé@Exämple.org/Résumé";
+	"balcony@conference.capulet.lit/Juliet the Second";
+	"pubsub.montague.lit";
+};
+
+local nodes, hosts, resources = {}, {}, {};
+for _, jid in ipairs(jids) do
+	local node, host, resource = jid:match("^([^@/]+)@([^/]+)/?(.*)$");
+	table.insert(nodes, node or "juliet");
+	table.insert(hosts, host or jid);
+	table.insert(resources, resource ~= "" and resource or "balcony");
+end
+
+local body = ("Wherefore art thou Romeo? Deny thy father and refuse thy name. "
+	.. "Что в имени? То, что зовём мы розой, — и под другим названьем сохраняло б свой сладкий запах! "
+	.. "名前が何だというの？ <3 & ok "):rep(4);
+
+local message_xml = "<message to='juliet@capulet.lit/balcony' from='romeo@montague.lit/orchard' type='chat' id='b4a8e7c1'>"
+	.. "<body>" .. body:gsub("&", "&amp;"):gsub("<", "&lt;") .. "</body>"
+	.. "<active xmlns='http://jabber.org/protocol/chatstates'/>"
+	.. "<stanza-id xmlns='urn:xmpp:sid:0' id='7d9ef0a8-0e4b-4a86-a2c9-55d1e23c4a10' by='juliet@capulet.lit'/>"
+	.. "<delay xmlns='urn:xmpp:delay' from='capulet.lit' stamp='2002-09-10T23:08:25Z'/>"
+	.. "</message>";
+
+local avatar = bytes(8192, 42);
+local avatar_b64 = (try("prosody.util.encodings") or { base64 = { encode = function () return ""; end } }).base64.encode(avatar);
+
+-- Cycle through a list, one item per call
+local function cycle(list)
+	local i, n = 0, #list;
+	return function ()
+		i = i % n + 1;
+		return list[i];
+	end;
+end
+
+--- util.encodings
+
+bench("encodings.base64.encode avatar", function ()
+	local encodings, err = try("prosody.util.encodings");
+	if not encodings then return nil, err; end
+	local encode = encodings.base64.encode;
+	return function () return encode(avatar); end;
+end);
+
+bench("encodings.base64.decode avatar", function ()
+	local encodings, err = try("prosody.util.encodings");
+	if not encodings then return nil, err; end
+	local decode = encodings.base64.decode;
+	return function () return decode(avatar_b64); end;
+end);
+
+bench("encodings.utf8.valid body", function ()
+	local encodings, err = try("prosody.util.encodings");
+	if not encodings then return nil, err; end
+	local valid = encodings.utf8.valid;
+	return function () return valid(body); end;
+end);
+
+bench("encodings.utf8.valid_xml_cdata body", function ()
+	local encodings, err = try("prosody.util.encodings");
+	if not encodings then return nil, err; end
+	local valid = encodings.utf8.valid_xml_cdata;
+	if not valid then return nil, "no valid_xml_cdata()"; end
+	return function () return valid(body); end;
+end);
+
+for _, prep in ipairs({
+	{ "nodeprep", nodes };
+	{ "nameprep", hosts };
+	{ "resourceprep", resources };
+}) do
+	bench("encodings.stringprep." .. prep[1] .. " jids", function ()
+		local encodings, err = try("prosody.util.encodings");
+		if not encodings then return nil, err; end
+		local f, next_input = encodings.stringprep[prep[1]], cycle(prep[2]);
+		return function () return f(next_input()); end;
+	end);
+end
+
+bench("encodings.idna.to_ascii hosts", function ()
+	local encodings, err = try("prosody.util.encodings");
+	if not encodings then return nil, err; end
+	local to_ascii, next_host = encodings.idna.to_ascii, cycle(hosts);
+	return function () return to_ascii(next_host()); end;
+end);
+
+--- util.hashes
+
+bench("hashes.sha1 stream id", function ()
+	local hashes, err = try("prosody.util.hashes");
+	if not hashes then return nil, err; end
+	local sha1 = hashes.sha1;
+	return function () return sha1("a3f6e1c2d0b9" .. "s3cr3t", true); end;
+end);
+
+bench("hashes.sha256 stanza", function ()
+	local hashes, err = try("prosody.util.hashes");
+	if not hashes then return nil, err; end
+	local sha256 = hashes.sha256;
+	return function () return sha256(message_xml); end;
+end);
+
+bench("hashes.hmac_sha256 dialback key", function ()
+	local hashes, err = try("prosody.util.hashes");
+	if not hashes then return nil, err; end
+	local hmac_sha256 = hashes.hmac_sha256;
+	local key = hashes.sha256("secret");
+	return function () return hmac_sha256(key, "capulet.lit montague.lit a3f6e1c2d0b9", true); end;
+end);
+
+bench("hashes.pbkdf2_hmac_sha256 scram 4096", function ()
+	local hashes, err = try("prosody.util.hashes");
+	if not hashes then return nil, err; end
+	local pbkdf2 = hashes.pbkdf2_hmac_sha256;
+	return function () return pbkdf2("pencil", "W22ZaJ0SNY7soEsUEjb6gQ==", 4096); end;
+end);
+
+--- util.crypto
+
+bench("crypto.ed25519_sign stanza", function ()
+	local crypto, err = try("prosody.util.crypto");
+	if not crypto then return nil, err; end
+	local key, sign = crypto.generate_ed25519_keypair(), crypto.ed25519_sign;
+	return function () return sign(key, message_xml); end;
+end);
+
+bench("crypto signer:sign ed25519 stanza", function ()
+	local crypto, err = try("prosody.util.crypto");
+	if not crypto then return nil, err; end
+	local key = crypto.generate_ed25519_keypair();
+	if not key.signer then return nil, "no signer()"; end
+	local signer = assert(key:signer("ed25519"));
+	return function () return signer:sign(message_xml); end;
+end);
+
+bench("crypto.ecdsa_sha256_verify jwt", function ()
+	local crypto, err = try("prosody.util.crypto");
+	if not crypto then return nil, err; end
+	local key, verify = crypto.generate_p256_keypair(), crypto.ecdsa_sha256_verify;
+	local signature = crypto.ecdsa_sha256_sign(key, message_xml);
+	return function () return verify(key, message_xml, signature); end;
+end);
+
+bench("crypto verifier:verify ecdsa_sha256 jwt", function ()
+	local crypto, err = try("prosody.util.crypto");
+	if not crypto then return nil, err; end
+	local key = crypto.generate_p256_keypair();
+	if not key.verifier then return nil, "no verifier()"; end
+	local verifier = assert(key:verifier("ecdsa_sha256"));
+	local signature = crypto.ecdsa_sha256_sign(key, message_xml);
+	return function () return verifier:verify(message_xml, signature); end;
+end);
+
+bench("crypto.aes_256_gcm_encrypt stanza", function ()
+	local crypto, err = try("prosody.util.crypto");
+	if not crypto then return nil, err; end
+	local encrypt, key, iv = crypto.aes_256_gcm_encrypt, bytes(32, 3), bytes(12, 4);
+	return function () return encrypt(key, iv, message_xml); end;
+end);
+
+bench("crypto cipher:encrypt aes_256_gcm stanza", function ()
+	local crypto, err = try("prosody.util.crypto");
+	if not crypto then return nil, err; end
+	if not crypto.aes_256_gcm then return nil, "no cipher objects"; end
+	local cipher, iv = crypto.aes_256_gcm(bytes(32, 3)), bytes(12, 4);
+	return function () return cipher:encrypt(iv, message_xml); end;
+end);
+
+--- util.cryptopool
+
+-- Jobs are submitted in batches and all results collected before returning,
+-- so ns/op is per batch and comparable to the same batch done inline. The
+-- pool runs 2 threads, its default.
+local batch_size = 8;
+
+local function cryptopool_bench(name, submit)
+	bench(name, function ()
+		local cryptopool, err = try("prosody.util.cryptopool");
+		if not cryptopool then return nil, err; end
+		local poll, perr = try("prosody.util.poll");
+		if not poll then return nil, perr; end
+		local pool, pool_err = cryptopool.new(2);
+		if not pool then return nil, pool_err; end
+		local watcher = poll.new();
+		watcher:add(pool:getfd(), true, false);
+		local job = submit(pool);
+		return function ()
+			for _ = 1, batch_size do job(); end
+			local done = 0;
+			while done < batch_size do
+				if pool:pop() then
+					done = done + 1;
+				else
+					watcher:wait(1);
+				end
+			end
+		end;
+	end);
+end
+
+cryptopool_bench("cryptopool.pbkdf2 scram 4096 x8", function (pool)
+	return function () return pool:pbkdf2("sha256", "pencil", "W22ZaJ0SNY7soEsUEjb6gQ==", 4096, 32); end;
+end);
+
+cryptopool_bench("cryptopool.sign ed25519 x8", function (pool)
+	local key = require "prosody.util.crypto".generate_ed25519_keypair();
+	return function () return pool:sign("ed25519", key, message_xml); end;
+end);
+
+bench("hashes.pbkdf2 scram 4096 x8 inline", function ()
+	local hashes, err = try("prosody.util.hashes");
+	if not hashes then return nil, err; end
+	local pbkdf2 = hashes.pbkdf2_hmac_sha256;
+	return function ()
+		for _ = 1, batch_size do pbkdf2("pencil", "W22ZaJ0SNY7soEsUEjb6gQ==", 4096); end
+	end;
+end);
+
+--- util.strbitop
+
+bench("strbitop.sxor scram proof", function ()
+	local strbitop, err = try("prosody.util.strbitop");
+	if not strbitop then return nil, err; end
+	local sxor = strbitop.sxor;
+	local a, b = bytes(32, 1), bytes(32, 2);
+	return function () return sxor(a, b); end;
+end);
+
+--- util.ringbuffer
+
+bench("ringbuffer write+find+read stanza", function ()
+	local ringbuffer, err = try("prosody.util.ringbuffer");
+	if not ringbuffer then return nil, err; end
+	local buf = ringbuffer.new(65536);
+	return function ()
+		buf:write(message_xml);
+		local pos = buf:find("</message>");
+		return buf:read(pos + 9);
+	end;
+end);
+
+--- util.writequeue
+
+bench("writequeue write*8+peek+discard", function ()
+	local writequeue, err = try("prosody.util.writequeue");
+	if not writequeue then return nil, err; end
+	local q = writequeue.new();
+	return function ()
+		for _ = 1, 8 do q:write(message_xml); end
+		q:peek(65536);
+		return q:discard(q:length());
+	end;
+end);
+
+--- util.struct
+
+bench("struct.pack+unpack frame header", function ()
+	local struct, err = try("prosody.util.struct");
+	if not struct then return nil, err; end
+	local pack, unpack = struct.pack, struct.unpack;
+	return function () return unpack(">BBI2I4", pack(">BBI2I4", 0x81, 126, 4096, 0x12345678)); end;
+end);
+
+bench("struct.compile pack+unpack frame header", function ()
+	local struct, err = try("prosody.util.struct");
+	if not struct then return nil, err; end
+	if not struct.compile then return nil, "no compile()"; end
+	local fmt = struct.compile(">BBI2I4");
+	return function () return fmt:unpack(fmt:pack(0x81, 126, 4096, 0x12345678)); end;
+end);
+
+--- util.poll
+
+bench("poll.wait ready fd", function ()
+	local poll, err = try("prosody.util.poll");
+	if not poll then return nil, err; end
+	local pposix, perr = try("prosody.util.pposix");
+	if not pposix then return nil, perr; end
+	local r, w = pposix.pipe();
+	if not r then return nil, w; end
+	local out = pposix.fdopen(w, "w");
+	out:write("x");
+	out:flush();
+	local state = poll.new();
+	state:add(r, true, false);
+	-- keep the pipe open as long as the benchmark
+	return function () return state:wait(0), out; end;
+end);
+
+--- util.time
+
+bench("time.now", function ()
+	local time, err = try("prosody.util.time");
+	if not time then return nil, err; end
+	return time.now;
+end);
+
+bench("time.monotonic", function ()
+	local time, err = try("prosody.util.time");
+	if not time then return nil, err; end
+	return time.monotonic;
+end);
+
+bench("time.cached_now", function ()
+	local time, err = try("prosody.util.time");
+	if not time then return nil, err; end
+	if not time.cached_now then return nil, "no cached_now()"; end
+	time.tick();
+	return time.cached_now;
+end);
+
+--- util.crand
+
+bench("crand.bytes id", function ()
+	local crand, err = try("prosody.util.crand");
+	if not crand then return nil, err; end
+	local random_bytes = crand.bytes;
+	return function () return random_bytes(16); end;
+end);
+
+--- util.table
+
+bench("table.create attr", function ()
+	local tbl, err = try("prosody.util.table");
+	if not tbl then return nil, err; end
+	local create = tbl.create;
+	return function () return create(0, 4); end;
+end);
+
+bench("table.pool get+put attr", function ()
+	local tbl, err = try("prosody.util.table");
+	if not tbl then return nil, err; end
+	local pool = tbl.pool(0, 4);
+	return function ()
+		local t = pool:get();
+		t.to, t.from, t.type = "user@example.com", "example.com", "chat";
+		pool:put(t);
+	end;
+end);
+
+--- util.wsframe
+
+bench("wsframe.parse_header", function ()
+	local wsframe, err = try("prosody.util.wsframe");
+	if not wsframe then return nil, err; end
+	local frame = wsframe.build(0x81, message_xml, "\1\2\3\4");
+	local parse_header = wsframe.parse_header;
+	return function () return parse_header(frame); end;
+end);
+
+bench("wsframe.build masked stanza", function ()
+	local wsframe, err = try("prosody.util.wsframe");
+	if not wsframe then return nil, err; end
+	local build = wsframe.build;
+	return function () return build(0x81, message_xml, "\1\2\3\4"); end;
+end);
+
+bench("wsframe.mask avatar", function ()
+	local wsframe, err = try("prosody.util.wsframe");
+	if not wsframe then return nil, err; end
+	local mask = wsframe.mask;
+	return function () return mask(avatar_b64, "\1\2\3\4"); end;
+end);
+
+--- util.net and util.iptrie
+
+bench("net.pton+ntop", function ()
+	local net, err = try("prosody.util.net");
+	if not net then return nil, err; end
+	local pton, ntop, next_ip = net.pton, net.ntop, cycle({ "192.0.2.17", "2001:db8::f00:1", "::ffff:198.51.100.3" });
+	return function () return ntop(pton(next_ip())); end;
+end);
+
+bench("net.datagrams send+recv 16 DNS replies", function ()
+	local net, err = try("prosody.util.net");
+	if not net then return nil, err; end
+	if not net.datagrams then return nil, "no datagrams()"; end
+	local socket, serr = try("socket");
+	if not socket then return nil, serr; end
+	local a, b = assert(socket.udp()), assert(socket.udp());
+	assert(b:setsockname("127.0.0.1", 0));
+	assert(a:setpeername(b:getsockname()));
+	local batch, replies, received = net.datagrams(16, 512), {}, {};
+	for i = 1, 16 do replies[i] = bytes(120, i); end
+	return function ()
+		batch:send(a:getfd(), replies);
+		local n = 0;
+		while n < 16 do
+			-- Loopback delivery is synchronous, this only loops if it isn't
+			n = n + assert(batch:recv(b:getfd(), received));
+		end
+		return n, a, b;
+	end;
+end);
+
+bench("socket.udp send+receive 16 DNS replies", function ()
+	local socket, serr = try("socket");
+	if not socket then return nil, serr; end
+	local a, b = assert(socket.udp()), assert(socket.udp());
+	assert(b:setsockname("127.0.0.1", 0));
+	assert(a:setpeername(b:getsockname()));
+	b:settimeout(1);
+	local replies = {};
+	for i = 1, 16 do replies[i] = bytes(120, i); end
+	return function ()
+		for i = 1, 16 do a:send(replies[i]); end
+		for _ = 1, 16 do assert(b:receive()); end
+		return a, b;
+	end;
+end);
+
+bench("iptrie.lookup 1000 prefixes", function ()
+	local iptrie, err = try("prosody.util.iptrie");
+	if not iptrie then return nil, err; end
+	local trie = iptrie.new();
+	for i = 1, 1000 do
+		trie:add(bytes(4, i), 8 + i % 25);
+	end
+	local next_ip = cycle({ bytes(4, 7), bytes(16, 8), bytes(4, 9) });
+	return function () return trie:lookup(next_ip()); end;
+end);
+
+--- util.timerwheel
+
+bench("timerwheel.insert+pop", function ()
+	local timerwheel, err = try("prosody.util.timerwheel");
+	if not timerwheel then return nil, err; end
+	local wheel, t = timerwheel.new(0), 0;
+	local function noop() end
+	for i = 1, 10000 do
+		wheel:insert(noop, i % 600);
+	end
+	return function ()
+		t = t + 0.001;
+		wheel:insert(noop, t + 60);
+		return wheel:pop(t);
+	end;
+end);
+
+--- util.ring
+
+bench("hashring.get_node 64 nodes", function ()
+	local hashring, err = try("prosody.util.hashring");
+	if not hashring then return nil, err; end
+	local ok, ring = pcall(hashring.new, 128);
+	if not ok then return nil, ring; end
+	for i = 1, 64 do
+		ring:add_node("node" .. i .. ".cluster.example");
+	end
+	local next_jid = cycle(jids);
+	return function () return ring:get_node(next_jid()); end;
+end);
+
+--- util.loopstats
+
+bench("loopstats.clock+duration", function ()
+	local loopstats, err = try("prosody.util.loopstats");
+	if not loopstats then return nil, err; end
+	local clock, duration, id = loopstats.clock, loopstats.duration, loopstats.histograms.onreadable;
+	return function () return duration(id, clock()); end;
+end);
+
+bench("loopstats.add bytes_read", function ()
+	local loopstats, err = try("prosody.util.loopstats");
+	if not loopstats then return nil, err; end
+	local add, id = loopstats.add, loopstats.counters.bytes_read;
+	return function () return add(id, 1500); end;
+end);
+
+--- util.pposix allocator
+-- Run once plainly and once with --pool-allocator, with --save/--compare, to
+-- compare the allocators
+
+bench("alloc attr tables", function ()
+	local t_create = (try("prosody.util.table") or {}).create or function () return {}; end;
+	return function ()
+		for _ = 1, 16 do
+			local t = t_create(0, 4);
+			t.to, t.from = "user@example.com", "example.com";
+		end
+	end;
+end);
+
+bench("alloc strings", function ()
+	local n = 0;
+	return function ()
+		for _ = 1, 16 do
+			n = n + 1;
+			local _ = s_format("%d@%s", n, "capulet.lit");
+		end
+	end;
+end);
+
+bench("pposix.memtag switch", function ()
+	local pposix, err = try("prosody.util.pposix");
+	if not pposix then return nil, err; end
+	if not pposix.memtag then return nil, "no memtag()"; end
+	local memtag, tag = pposix.memtag, assert(pposix.new_memtag("bench"));
+	return function () return memtag(memtag(tag)); end;
+end);
+
+--- util.xmlserialize and util.xmppparser
+
+bench("stanza tostring message", function ()
+	local xml, err = try("prosody.util.xml");
+	if not xml then return nil, err; end
+	local stanza = xml.parse(message_xml);
+	return function () return tostring(stanza); end;
+end);
+
+bench("xmppstream.feed message", function ()
+	local xmppstream, err = try("prosody.util.xmppstream");
+	if not xmppstream then return nil, err; end
+	local session = { notopen = true };
+	local stream = xmppstream.new(session, {
+		stream_ns = "http://etherx.jabber.org/streams";
+		default_ns = "jabber:client";
+		streamopened = function (s) s.notopen = nil; end;
+		handlestanza = function () end;
+		error = function (_, e) error(e); end;
+	});
+	assert(stream:feed("<stream:stream xmlns='jabber:client' xmlns:stream='http://etherx.jabber.org/streams' to='capulet.lit' version='1.0'>"));
+	return function () return assert(stream:feed(message_xml)); end;
+end);
+
+--- Runner
+
+local function measure(f, target, rounds)
+	-- Find an iteration count that takes about the target time
+	local n = 1;
+	while true do
+		local start = monotonic();
+		for _ = 1, n do f(); end
+		local elapsed = monotonic() - start;
+		if elapsed >= target / 10 then
+			n = math.max(1, math.ceil(n * target / elapsed));
+			break;
+		end
+		n = n * 10;
+	end
+
+	local best, allocated = math.huge, math.huge;
+	for _ = 1, rounds do
+		collectgarbage();
+		collectgarbage("stop");
+		local before = collectgarbage("count");
+		local start = monotonic();
+		for _ = 1, n do f(); end
+		local elapsed = monotonic() - start;
+		local after = collectgarbage("count");
+		collectgarbage("restart");
+		best = math.min(best, elapsed / n);
+		allocated = math.min(allocated, (after - before) * 1024 / n);
+	end
+	return best * 1e9, allocated;
+end
+
+local function load_results(filename)
+	local f, err = io.open(filename);
+	if not f then return nil, err; end
+	local data = f:read("*a");
+	f:close();
+	local chunk, load_err = load("return " .. data, "=" .. filename, "t", {});
+	if not chunk then return nil, load_err; end
+	return chunk();
+end
+
+local function save_results(filename, results)
+	local f, err = io.open(filename, "w");
+	if not f then return nil, err; end
+	f:write(serialization.serialize(results), "\n");
+	return f:close();
+end
+
+local function main(arg)
+	local target, save, compare, patterns = 0.2, nil, nil, {};
+	local i = 1;
+	while arg[i] do
+		local a = arg[i];
+		if a == "--time" then
+			i = i + 1;
+			target = assert(tonumber(arg[i]), "--time takes a number of seconds");
+		elseif a == "--save" then
+			i = i + 1;
+			save = assert(arg[i], "--save takes a filename");
+		elseif a == "--compare" then
+			i = i + 1;
+			compare = assert(arg[i], "--compare takes a filename");
+		elseif a == "--pool-allocator" then
+			local pposix = require "prosody.util.pposix";
+			assert(pposix.pool_allocator, "no pool allocator in util.pposix");
+			assert(pposix.pool_allocator());
+		else
+			table.insert(patterns, a);
+		end
+		i = i + 1;
+	end
+
+	local baseline;
+	if compare then
+		local err;
+		baseline, err = load_results(compare);
+		if not baseline then
+			printf("Could not read baseline: %s", err);
+		end
+	end
+
+	local function selected(name)
+		if not patterns[1] then return true; end
+		for _, pattern in ipairs(patterns) do
+			if name:find(pattern, 1, true) then return true; end
+		end
+		return false;
+	end
+
+	printf("%-42s %14s %12s %10s %s", "benchmark", "ops/s", "ns/op", "B/op", baseline and "vs baseline" or "");
+	local results = {};
+	for _, b in ipairs(benchmarks) do
+		if selected(b.name) then
+			local ok, f, reason = pcall(b.setup);
+			if not ok or not f then
+				printf("%-42s skipped: %s", b.name, ok and reason or f);
+			else
+				local measured, ns, allocated = pcall(measure, f, target, 3);
+				if not measured then
+					collectgarbage("restart");
+					printf("%-42s failed: %s", b.name, ns);
+				else
+					results[b.name] = { ns = ns; bytes = allocated };
+					local change = "";
+					local base = baseline and baseline[b.name];
+					if base then
+						change = s_format("%+.1f%%", (ns - base.ns) / base.ns * 100);
+					end
+					printf("%-42s %14.0f %12.1f %10.0f %s", b.name, 1e9 / ns, ns, allocated, change);
+				end
+			end
+		end
+	end
+
+	if save then
+		local ok, err = save_results(save, results);
+		if not ok then
+			printf("Could not save results: %s", err);
+			return 1;
+		end
+		printf("Saved results to %s", save);
+	end
+	return 0;
+end
+
+os.exit(main(arg));
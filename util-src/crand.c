@@ -24,6 +24,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <unistd.h>
 
 #include "lualib.h"
 #include "lauxlib.h"
@@ -66,36 +67,58 @@ static int getrandom(void *buf, size_t buflen, unsigned int flags) {
 #define SMALLBUFSIZ 32
 #endif
 
-static int Lrandom(lua_State *L) {
-	char smallbuf[SMALLBUFSIZ];
-	char *buf = &smallbuf[0];
-	const lua_Integer l = luaL_checkinteger(L, 1);
-	const size_t len = l;
-	luaL_argcheck(L, l >= 0, 1, "must be > 0");
+/*
+ * Small requests are served from a pool that is refilled from the random
+ * source a few KB at a time, saving a syscall per identifier. Requests larger
+ * than POOL_MAX_REQUEST go straight to the source.
+ */
+#ifndef POOL_SIZE
+#define POOL_SIZE 4096
+#endif
 
-	if(len == 0) {
-		lua_pushliteral(L, "");
-		return 1;
-	}
+#ifndef POOL_MAX_REQUEST
+#define POOL_MAX_REQUEST 256
+#endif
 
-	if(len > SMALLBUFSIZ) {
-		buf = lua_newuserdata(L, len);
+static unsigned char pool[POOL_SIZE];
+static size_t pool_avail = 0; /* unused bytes at the end of the pool */
+static int pool_enabled = 1;
+static pid_t pool_pid; /* process the pool was filled in */
+
+/* Not optimized away like a memset() of memory that is never read again */
+static void wipe(void *p, size_t len) {
+	volatile unsigned char *v = p;
+
+	while(len--) {
+		*v++ = 0;
 	}
+}
 
+/* A child must not hand out the same bytes as its parent */
+static void pool_discard(void) {
+	wipe(pool, sizeof(pool));
+	pool_avail = 0;
+}
+
+/* Fill a buffer from the random source, returns an error message or NULL */
+static const char *fill_random(char *buf, size_t len) {
 #if defined(WITH_GETRANDOM)
 	/*
 	 * This acts like a read from /dev/urandom with the exception that it
 	 * *does* block if the entropy pool is not yet initialized.
 	 */
-	int left = len;
+	size_t left = len;
 	char *p = buf;
 
 	do {
 		int ret = getrandom(p, left, 0);
 
 		if(ret < 0) {
-			lua_pushstring(L, strerror(errno));
-			return lua_error(L);
+			if(errno == EINTR) {
+				continue;
+			}
+
+			return strerror(errno);
 		}
 
 		p += ret;
@@ -107,28 +130,114 @@ static int Lrandom(lua_State *L) {
 #elif defined(WITH_OPENSSL)
 
 	if(!RAND_status()) {
-		lua_pushliteral(L, "OpenSSL PRNG not seeded");
-		return lua_error(L);
+		return "OpenSSL PRNG not seeded";
 	}
 
 	if(RAND_bytes((unsigned char *)buf, len) != 1) {
 		/* TODO ERR_get_error() */
-		lua_pushstring(L, "RAND_bytes() failed");
-		return lua_error(L);
+		return "RAND_bytes() failed";
 	}
 
 #endif
+	return NULL;
+}
+
+static const char *pool_take(char *buf, size_t len) {
+	unsigned char *p;
+
+	/*
+	 * Covers util.pposix.daemonize() and anything else that forks. Checked
+	 * here rather than with pthread_atfork() since this module may be
+	 * unloaded, which would leave the handler dangling.
+	 */
+	if(pool_avail > 0 && pool_pid != getpid()) {
+		pool_discard();
+	}
+
+	if(len > pool_avail) {
+		const char *err;
+
+		/* Never mix old and new bytes, the remainder is dropped */
+		pool_discard();
+		err = fill_random((char *)pool, sizeof(pool));
+
+		if(err != NULL) {
+			pool_discard();
+			return err;
+		}
+
+		pool_avail = sizeof(pool);
+		pool_pid = getpid();
+	}
+
+	p = pool + sizeof(pool) - pool_avail;
+	memcpy(buf, p, len);
+	wipe(p, len);
+	pool_avail -= len;
+	return NULL;
+}
+
+static int Lrandom(lua_State *L) {
+	char smallbuf[SMALLBUFSIZ];
+	char *buf = &smallbuf[0];
+	const lua_Integer l = luaL_checkinteger(L, 1);
+	const size_t len = l;
+	const char *err;
+	luaL_argcheck(L, l >= 0, 1, "must be > 0");
+
+	if(len == 0) {
+		lua_pushliteral(L, "");
+		return 1;
+	}
+
+	if(len > SMALLBUFSIZ) {
+		buf = lua_newuserdata(L, len);
+	}
+
+	if(pool_enabled && len <= POOL_MAX_REQUEST) {
+		err = pool_take(buf, len);
+	} else {
+		err = fill_random(buf, len);
+	}
+
+	if(err != NULL) {
+		lua_pushstring(L, err);
+		return lua_error(L);
+	}
 
 	lua_pushlstring(L, buf, len);
+	wipe(buf, len);
+	return 1;
+}
+
+/*
+ * Turn the pool on or off
+ * (boolean) -> boolean
+ *
+ * Returns whether it was on before. Turning it off erases it.
+ */
+static int Lpool(lua_State *L) {
+	int was_enabled = pool_enabled;
+
+	luaL_checktype(L, 1, LUA_TBOOLEAN);
+	pool_enabled = lua_toboolean(L, 1);
+
+	if(!pool_enabled) {
+		pool_discard();
+	}
+
+	lua_pushboolean(L, was_enabled);
 	return 1;
 }
 
 int luaopen_prosody_util_crand(lua_State *L) {
 	luaL_checkversion(L);
 
-	lua_createtable(L, 0, 2);
+	lua_createtable(L, 0, 3);
 	lua_pushcfunction(L, Lrandom);
 	lua_setfield(L, -2, "bytes");
+	lua_pushcfunction(L, Lpool);
+	lua_setfield(L, -2, "pool");
 
 #if defined(WITH_GETRANDOM)
 	lua_pushstring(L, "Linux");
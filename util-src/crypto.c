@@ -397,41 +397,11 @@ static int Led25519_verify(lua_State *L) {
 	return base_evp_verify(L, NID_ED25519, NULL);
 }
 
-/* encrypt(key, iv, plaintext) */
-static int Levp_encrypt(lua_State *L, const EVP_CIPHER *cipher, const unsigned char expected_key_len, const unsigned char expected_iv_len, const size_t tag_len) {
-	EVP_CIPHER_CTX *ctx;
+/* Encrypt with a context that has the cipher, key and IV set up */
+static int evp_encrypt_ctx(lua_State *L, EVP_CIPHER_CTX *ctx, const unsigned char *plaintext, size_t plaintext_len, const size_t tag_len) {
 	luaL_Buffer ciphertext_buffer;
-
-	size_t key_len, iv_len, plaintext_len;
 	int ciphertext_len, final_len;
 
-	const unsigned char *key = (unsigned char*)luaL_checklstring(L, 1, &key_len);
-	const unsigned char *iv = (unsigned char*)luaL_checklstring(L, 2, &iv_len);
-	const unsigned char *plaintext = (unsigned char*)luaL_checklstring(L, 3, &plaintext_len);
-
-	if(key_len != expected_key_len) {
-		return luaL_error(L, "key must be %d bytes", expected_key_len);
-	}
-	if(iv_len != expected_iv_len) {
-		return luaL_error(L, "iv must be %d bytes", expected_iv_len);
-	}
-	if(lua_gettop(L) > 3) {
-		return luaL_error(L, "Expected 3 arguments, got %d", lua_gettop(L));
-	}
-
-	// Create and initialise the context
-	ctx = new_managed_EVP_CIPHER_CTX(L);
-
-	// Initialise the encryption operation
-	if(1 != EVP_EncryptInit_ex(ctx, cipher, NULL, NULL, NULL)) {
-		return luaL_error(L, "Error while initializing encryption engine");
-	}
-
-	// Initialise key and IV
-	if(1 != EVP_EncryptInit_ex(ctx, NULL, NULL, key, iv)) {
-		return luaL_error(L, "Error while initializing key/iv");
-	}
-
 	luaL_buffinit(L, &ciphertext_buffer);
 	unsigned char *ciphertext = (unsigned char*)luaL_prepbuffsize(&ciphertext_buffer, plaintext_len+tag_len);
 
@@ -465,29 +435,15 @@ static int Levp_encrypt(lua_State *L, const EVP_CIPHER *cipher, const unsigned c
 	return 1;
 }
 
-static int Laes_128_gcm_encrypt(lua_State *L) {
-	return Levp_encrypt(L, EVP_aes_128_gcm(), 16, 12, 16);
-}
-
-static int Laes_256_gcm_encrypt(lua_State *L) {
-	return Levp_encrypt(L, EVP_aes_256_gcm(), 32, 12, 16);
-}
-
-static int Laes_256_ctr_encrypt(lua_State *L) {
-	return Levp_encrypt(L, EVP_aes_256_ctr(), 32, 16, 0);
-}
-
-/* decrypt(key, iv, ciphertext) */
-static int Levp_decrypt(lua_State *L, const EVP_CIPHER *cipher, const unsigned char expected_key_len, const unsigned char expected_iv_len, const size_t tag_len) {
+/* encrypt(key, iv, plaintext) */
+static int Levp_encrypt(lua_State *L, const EVP_CIPHER *cipher, const unsigned char expected_key_len, const unsigned char expected_iv_len, const size_t tag_len) {
 	EVP_CIPHER_CTX *ctx;
-	luaL_Buffer plaintext_buffer;
 
-	size_t key_len, iv_len, ciphertext_len;
-	int plaintext_len, final_len;
+	size_t key_len, iv_len, plaintext_len;
 
 	const unsigned char *key = (unsigned char*)luaL_checklstring(L, 1, &key_len);
 	const unsigned char *iv = (unsigned char*)luaL_checklstring(L, 2, &iv_len);
-	const unsigned char *ciphertext = (unsigned char*)luaL_checklstring(L, 3, &ciphertext_len);
+	const unsigned char *plaintext = (unsigned char*)luaL_checklstring(L, 3, &plaintext_len);
 
 	if(key_len != expected_key_len) {
 		return luaL_error(L, "key must be %d bytes", expected_key_len);
@@ -495,26 +451,43 @@ static int Levp_decrypt(lua_State *L, const EVP_CIPHER *cipher, const unsigned c
 	if(iv_len != expected_iv_len) {
 		return luaL_error(L, "iv must be %d bytes", expected_iv_len);
 	}
-	if(ciphertext_len <= tag_len) {
-		return luaL_error(L, "ciphertext must be at least %d bytes (including tag)", tag_len);
-	}
 	if(lua_gettop(L) > 3) {
 		return luaL_error(L, "Expected 3 arguments, got %d", lua_gettop(L));
 	}
 
-	/* Create and initialise the context */
+	// Create and initialise the context
 	ctx = new_managed_EVP_CIPHER_CTX(L);
 
-	/* Initialise the decryption operation. */
-	if(!EVP_DecryptInit_ex(ctx, cipher, NULL, NULL, NULL)) {
-		return luaL_error(L, "Error while initializing decryption engine");
+	// Initialise the encryption operation
+	if(1 != EVP_EncryptInit_ex(ctx, cipher, NULL, NULL, NULL)) {
+		return luaL_error(L, "Error while initializing encryption engine");
 	}
 
-	/* Initialise key and IV */
-	if(!EVP_DecryptInit_ex(ctx, NULL, NULL, key, iv)) {
+	// Initialise key and IV
+	if(1 != EVP_EncryptInit_ex(ctx, NULL, NULL, key, iv)) {
 		return luaL_error(L, "Error while initializing key/iv");
 	}
 
+	return evp_encrypt_ctx(L, ctx, plaintext, plaintext_len, tag_len);
+}
+
+static int Laes_128_gcm_encrypt(lua_State *L) {
+	return Levp_encrypt(L, EVP_aes_128_gcm(), 16, 12, 16);
+}
+
+static int Laes_256_gcm_encrypt(lua_State *L) {
+	return Levp_encrypt(L, EVP_aes_256_gcm(), 32, 12, 16);
+}
+
+static int Laes_256_ctr_encrypt(lua_State *L) {
+	return Levp_encrypt(L, EVP_aes_256_ctr(), 32, 16, 0);
+}
+
+/* Decrypt with a context that has the cipher, key and IV set up */
+static int evp_decrypt_ctx(lua_State *L, EVP_CIPHER_CTX *ctx, const unsigned char *ciphertext, size_t ciphertext_len, const size_t tag_len) {
+	luaL_Buffer plaintext_buffer;
+	int plaintext_len, final_len;
+
 	luaL_buffinit(L, &plaintext_buffer);
 	unsigned char *plaintext = (unsigned char*)luaL_prepbuffsize(&plaintext_buffer, ciphertext_len);
 
@@ -551,6 +524,45 @@ static int Levp_decrypt(lua_State *L, const EVP_CIPHER *cipher, const unsigned c
 	return 1;
 }
 
+/* decrypt(key, iv, ciphertext) */
+static int Levp_decrypt(lua_State *L, const EVP_CIPHER *cipher, const unsigned char expected_key_len, const unsigned char expected_iv_len, const size_t tag_len) {
+	EVP_CIPHER_CTX *ctx;
+
+	size_t key_len, iv_len, ciphertext_len;
+
+	const unsigned char *key = (unsigned char*)luaL_checklstring(L, 1, &key_len);
+	const unsigned char *iv = (unsigned char*)luaL_checklstring(L, 2, &iv_len);
+	const unsigned char *ciphertext = (unsigned char*)luaL_checklstring(L, 3, &ciphertext_len);
+
+	if(key_len != expected_key_len) {
+		return luaL_error(L, "key must be %d bytes", expected_key_len);
+	}
+	if(iv_len != expected_iv_len) {
+		return luaL_error(L, "iv must be %d bytes", expected_iv_len);
+	}
+	if(ciphertext_len <= tag_len) {
+		return luaL_error(L, "ciphertext must be at least %d bytes (including tag)", tag_len);
+	}
+	if(lua_gettop(L) > 3) {
+		return luaL_error(L, "Expected 3 arguments, got %d", lua_gettop(L));
+	}
+
+	/* Create and initialise the context */
+	ctx = new_managed_EVP_CIPHER_CTX(L);
+
+	/* Initialise the decryption operation. */
+	if(!EVP_DecryptInit_ex(ctx, cipher, NULL, NULL, NULL)) {
+		return luaL_error(L, "Error while initializing decryption engine");
+	}
+
+	/* Initialise key and IV */
+	if(!EVP_DecryptInit_ex(ctx, NULL, NULL, key, iv)) {
+		return luaL_error(L, "Error while initializing key/iv");
+	}
+
+	return evp_decrypt_ctx(L, ctx, ciphertext, ciphertext_len, tag_len);
+}
+
 static int Laes_128_gcm_decrypt(lua_State *L) {
 	return Levp_decrypt(L, EVP_aes_128_gcm(), 16, 12, 16);
 }
@@ -563,6 +575,277 @@ static int Laes_256_ctr_decrypt(lua_State *L) {
 	return Levp_decrypt(L, EVP_aes_256_ctr(), 32, 16, 0);
 }
 
+/*
+ * Cipher and signature contexts that keep a key set up between calls
+ */
+
+#define CIPHER_MT_TAG "util.crypto cipher"
+#define SIGNER_MT_TAG "util.crypto signer"
+#define VERIFIER_MT_TAG "util.crypto verifier"
+
+typedef struct {
+	EVP_CIPHER_CTX *enc;
+	EVP_CIPHER_CTX *dec;
+	unsigned char iv_len;
+	unsigned char tag_len;
+} cipher_state;
+
+/* cipher = aes_256_gcm(key) */
+static int new_cipher(lua_State *L, const EVP_CIPHER *cipher, const unsigned char expected_key_len, const unsigned char expected_iv_len, const unsigned char tag_len) {
+	size_t key_len;
+	const unsigned char *key = (unsigned char*)luaL_checklstring(L, 1, &key_len);
+	cipher_state *c;
+
+	if(key_len != expected_key_len) {
+		return luaL_error(L, "key must be %d bytes", expected_key_len);
+	}
+
+	c = lua_newuserdata(L, sizeof(cipher_state));
+	c->enc = c->dec = NULL;
+	c->iv_len = expected_iv_len;
+	c->tag_len = tag_len;
+	luaL_getmetatable(L, CIPHER_MT_TAG);
+	lua_setmetatable(L, -2);
+
+	c->enc = EVP_CIPHER_CTX_new();
+	c->dec = EVP_CIPHER_CTX_new();
+
+	if(c->enc == NULL || c->dec == NULL) {
+		return luaL_error(L, "not enough memory");
+	}
+
+	/* The IV is set on each use, the expanded key stays */
+	if(1 != EVP_EncryptInit_ex(c->enc, cipher, NULL, key, NULL)) {
+		return luaL_error(L, "Error while initializing encryption engine");
+	}
+
+	if(1 != EVP_DecryptInit_ex(c->dec, cipher, NULL, key, NULL)) {
+		return luaL_error(L, "Error while initializing decryption engine");
+	}
+
+	return 1;
+}
+
+static int Laes_128_gcm(lua_State *L) {
+	return new_cipher(L, EVP_aes_128_gcm(), 16, 12, 16);
+}
+
+static int Laes_256_gcm(lua_State *L) {
+	return new_cipher(L, EVP_aes_256_gcm(), 32, 12, 16);
+}
+
+static int Laes_256_ctr(lua_State *L) {
+	return new_cipher(L, EVP_aes_256_ctr(), 32, 16, 0);
+}
+
+/* cipher:encrypt(iv, plaintext) */
+static int Lcipher_encrypt(lua_State *L) {
+	cipher_state *c = luaL_checkudata(L, 1, CIPHER_MT_TAG);
+	size_t iv_len, plaintext_len;
+	const unsigned char *iv = (unsigned char*)luaL_checklstring(L, 2, &iv_len);
+	const unsigned char *plaintext = (unsigned char*)luaL_checklstring(L, 3, &plaintext_len);
+
+	if(iv_len != c->iv_len) {
+		return luaL_error(L, "iv must be %d bytes", c->iv_len);
+	}
+	if(lua_gettop(L) > 3) {
+		return luaL_error(L, "Expected 2 arguments, got %d", lua_gettop(L) - 1);
+	}
+
+	if(1 != EVP_EncryptInit_ex(c->enc, NULL, NULL, NULL, iv)) {
+		return luaL_error(L, "Error while initializing key/iv");
+	}
+
+	return evp_encrypt_ctx(L, c->enc, plaintext, plaintext_len, c->tag_len);
+}
+
+/* cipher:decrypt(iv, ciphertext) */
+static int Lcipher_decrypt(lua_State *L) {
+	cipher_state *c = luaL_checkudata(L, 1, CIPHER_MT_TAG);
+	size_t iv_len, ciphertext_len;
+	const unsigned char *iv = (unsigned char*)luaL_checklstring(L, 2, &iv_len);
+	const unsigned char *ciphertext = (unsigned char*)luaL_checklstring(L, 3, &ciphertext_len);
+
+	if(iv_len != c->iv_len) {
+		return luaL_error(L, "iv must be %d bytes", c->iv_len);
+	}
+	if(ciphertext_len <= c->tag_len) {
+		return luaL_error(L, "ciphertext must be at least %d bytes (including tag)", c->tag_len);
+	}
+	if(lua_gettop(L) > 3) {
+		return luaL_error(L, "Expected 2 arguments, got %d", lua_gettop(L) - 1);
+	}
+
+	if(!EVP_DecryptInit_ex(c->dec, NULL, NULL, NULL, iv)) {
+		return luaL_error(L, "Error while initializing key/iv");
+	}
+
+	return evp_decrypt_ctx(L, c->dec, ciphertext, ciphertext_len, c->tag_len);
+}
+
+static int Lcipher_finalizer(lua_State *L) {
+	cipher_state *c = luaL_checkudata(L, 1, CIPHER_MT_TAG);
+	EVP_CIPHER_CTX_free(c->enc);
+	EVP_CIPHER_CTX_free(c->dec);
+	c->enc = c->dec = NULL;
+	return 0;
+}
+
+typedef struct {
+	EVP_MD_CTX *init; /* set up with the key, copied for each use */
+	EVP_MD_CTX *work;
+} sign_state;
+
+static const struct {
+	const char *name;
+	int key_type;
+	const EVP_MD *(*digest)(void);
+} sign_algorithms[] = {
+	{ "ed25519",                NID_ED25519,              NULL       },
+	{ "ecdsa_sha256",           NID_X9_62_id_ecPublicKey, EVP_sha256 },
+	{ "ecdsa_sha384",           NID_X9_62_id_ecPublicKey, EVP_sha384 },
+	{ "ecdsa_sha512",           NID_X9_62_id_ecPublicKey, EVP_sha512 },
+	{ "rsassa_pkcs1_sha256",    NID_rsaEncryption,        EVP_sha256 },
+	{ "rsassa_pkcs1_sha384",    NID_rsaEncryption,        EVP_sha384 },
+	{ "rsassa_pkcs1_sha512",    NID_rsaEncryption,        EVP_sha512 },
+	{ "rsassa_pss_sha256",      NID_rsassaPss,            EVP_sha256 },
+	{ "rsassa_pss_sha384",      NID_rsassaPss,            EVP_sha384 },
+	{ "rsassa_pss_sha512",      NID_rsassaPss,            EVP_sha512 },
+	{ NULL,                     0,                        NULL       }
+};
+
+/* key:signer(algorithm), key:verifier(algorithm) */
+static int new_sign_state(lua_State *L, const int verify) {
+	const char *name = luaL_checkstring(L, 2);
+	const EVP_MD *digest_type = NULL;
+	EVP_PKEY *pkey;
+	sign_state *st;
+	int key_type, i, ret;
+
+	for(i = 0; sign_algorithms[i].name != NULL; i++) {
+		if(strcmp(sign_algorithms[i].name, name) == 0) {
+			break;
+		}
+	}
+
+	if(sign_algorithms[i].name == NULL) {
+		return luaL_argerror(L, 2, lua_pushfstring(L, "unknown algorithm '%s'", name));
+	}
+
+	key_type = sign_algorithms[i].key_type;
+	pkey = pkey_from_arg(L, 1, (key_type!=NID_rsassaPss)?key_type:NID_rsaEncryption, !verify);
+
+	if(sign_algorithms[i].digest != NULL) {
+		digest_type = sign_algorithms[i].digest();
+	}
+
+	st = lua_newuserdata(L, sizeof(sign_state));
+	st->init = st->work = NULL;
+	luaL_getmetatable(L, verify ? VERIFIER_MT_TAG : SIGNER_MT_TAG);
+	lua_setmetatable(L, -2);
+
+	st->init = EVP_MD_CTX_new();
+	st->work = EVP_MD_CTX_new();
+
+	if(st->init == NULL || st->work == NULL) {
+		return luaL_error(L, "not enough memory");
+	}
+
+	if(verify) {
+		ret = EVP_DigestVerifyInit(st->init, NULL, digest_type, NULL, pkey);
+	} else {
+		ret = EVP_DigestSignInit(st->init, NULL, digest_type, NULL, pkey);
+	}
+
+	if(ret != 1) {
+		lua_pushnil(L);
+		lua_pushstring(L, verify ? "verify-init-failed" : "sign-init-failed");
+		return 2;
+	}
+	if(key_type == NID_rsassaPss) {
+		EVP_PKEY_CTX_set_rsa_padding(EVP_MD_CTX_pkey_ctx(st->init), RSA_PKCS1_PSS_PADDING);
+	}
+
+	return 1;
+}
+
+static int Lpkey_meth_signer(lua_State *L) {
+	return new_sign_state(L, 0);
+}
+
+static int Lpkey_meth_verifier(lua_State *L) {
+	return new_sign_state(L, 1);
+}
+
+/* signer:sign(message) */
+static int Lsigner_sign(lua_State *L) {
+	sign_state *st = luaL_checkudata(L, 1, SIGNER_MT_TAG);
+	luaL_Buffer sigbuf;
+
+	size_t msg_len;
+	const unsigned char* msg = (unsigned char*)luaL_checklstring(L, 2, &msg_len);
+
+	size_t sig_len;
+	unsigned char *sig = NULL;
+
+	if(EVP_MD_CTX_copy_ex(st->work, st->init) != 1) {
+		lua_pushnil(L);
+		return 1;
+	}
+	if(EVP_DigestSign(st->work, NULL, &sig_len, msg, msg_len) != 1) {
+		lua_pushnil(L);
+		return 1;
+	}
+
+	luaL_buffinit(L, &sigbuf);
+	sig = memset(luaL_prepbuffsize(&sigbuf, sig_len), 0, sig_len);
+
+	if(EVP_DigestSign(st->work, sig, &sig_len, msg, msg_len) != 1) {
+		lua_pushnil(L);
+	}
+	else {
+		luaL_addsize(&sigbuf, sig_len);
+		luaL_pushresult(&sigbuf);
+	}
+
+	return 1;
+}
+
+/* verifier:verify(message, signature) */
+static int Lverifier_verify(lua_State *L) {
+	sign_state *st = luaL_checkudata(L, 1, VERIFIER_MT_TAG);
+
+	size_t msg_len;
+	const unsigned char *msg = (unsigned char*)luaL_checklstring(L, 2, &msg_len);
+
+	size_t sig_len;
+	const unsigned char *sig = (unsigned char*)luaL_checklstring(L, 3, &sig_len);
+
+	if(EVP_MD_CTX_copy_ex(st->work, st->init) != 1) {
+		lua_pushnil(L);
+		return 1;
+	}
+
+	int result = EVP_DigestVerify(st->work, sig, sig_len, msg, msg_len);
+	if(result == 0) {
+		lua_pushboolean(L, 0);
+	} else if(result != 1) {
+		lua_pushnil(L);
+	}
+	else {
+		lua_pushboolean(L, 1);
+	}
+	return 1;
+}
+
+static int Lsign_state_finalizer(lua_State *L) {
+	sign_state *st = lua_touserdata(L, 1);
+	EVP_MD_CTX_free(st->init);
+	EVP_MD_CTX_free(st->work);
+	st->init = st->work = NULL;
+	return 0;
+}
+
 /* r, s = parse_ecdsa_sig(sig_der) */
 static int Lparse_ecdsa_signature(lua_State *L) {
 	ECDSA_SIG *sig;
@@ -682,6 +965,10 @@ static const luaL_Reg Reg[] = {
 	{ "aes_256_ctr_encrypt",         Laes_256_ctr_encrypt      },
 	{ "aes_256_ctr_decrypt",         Laes_256_ctr_decrypt      },
 
+	{ "aes_128_gcm",                 Laes_128_gcm              },
+	{ "aes_256_gcm",                 Laes_256_gcm              },
+	{ "aes_256_ctr",                 Laes_256_ctr              },
+
 	{ "generate_ed25519_keypair",    Lgenerate_ed25519_keypair },
 	{ "generate_p256_keypair",       Lgenerate_p256_keypair    },
 
@@ -700,6 +987,8 @@ static const luaL_Reg KeyMethods[] = {
 	{ "public_raw",             Lpkey_meth_public_raw        },
 	{ "get_type",               Lpkey_meth_get_type          },
 	{ "derive",                 Lpkey_meth_derive            },
+	{ "signer",                 Lpkey_meth_signer            },
+	{ "verifier",               Lpkey_meth_verifier          },
 	{ NULL,                     NULL                         }
 };
 
@@ -708,6 +997,32 @@ static const luaL_Reg KeyMetatable[] = {
 	{ NULL,                 NULL            }
 };
 
+static const luaL_Reg CipherMethods[] = {
+	{ "encrypt",                Lcipher_encrypt              },
+	{ "decrypt",                Lcipher_decrypt              },
+	{ NULL,                     NULL                         }
+};
+
+static const luaL_Reg CipherMetatable[] = {
+	{ "__gc",               Lcipher_finalizer },
+	{ NULL,                 NULL              }
+};
+
+static const luaL_Reg SignerMethods[] = {
+	{ "sign",                   Lsigner_sign                 },
+	{ NULL,                     NULL                         }
+};
+
+static const luaL_Reg VerifierMethods[] = {
+	{ "verify",                 Lverifier_verify             },
+	{ NULL,                     NULL                         }
+};
+
+static const luaL_Reg SignStateMetatable[] = {
+	{ "__gc",               Lsign_state_finalizer },
+	{ NULL,                 NULL                  }
+};
+
 LUALIB_API int luaopen_prosody_util_crypto(lua_State *L) {
 #if (LUA_VERSION_NUM > 501)
 	luaL_checkversion(L);
@@ -721,6 +1036,28 @@ LUALIB_API int luaopen_prosody_util_crypto(lua_State *L) {
 	lua_setfield(L, -2, "__index");
 	lua_pop(L, 1);
 
+	/* Initialize cipher and signature context metatables */
+	luaL_newmetatable(L, CIPHER_MT_TAG);
+	luaL_setfuncs(L, CipherMetatable, 0);
+	lua_newtable(L);
+	luaL_setfuncs(L, CipherMethods, 0);
+	lua_setfield(L, -2, "__index");
+	lua_pop(L, 1);
+
+	luaL_newmetatable(L, SIGNER_MT_TAG);
+	luaL_setfuncs(L, SignStateMetatable, 0);
+	lua_newtable(L);
+	luaL_setfuncs(L, SignerMethods, 0);
+	lua_setfield(L, -2, "__index");
+	lua_pop(L, 1);
+
+	luaL_newmetatable(L, VERIFIER_MT_TAG);
+	luaL_setfuncs(L, SignStateMetatable, 0);
+	lua_newtable(L);
+	luaL_setfuncs(L, VerifierMethods, 0);
+	lua_setfield(L, -2, "__index");
+	lua_pop(L, 1);
+
 	/* Initialize lib table */
 	lua_newtable(L);
 	luaL_setfuncs(L, Reg, 0);
@@ -0,0 +1,662 @@
+/* Prosody IM
+--
+-- This project is MIT/X11 licensed. Please see the
+-- COPYING file in the source package for more information.
+--
+*/
+
+/*
+* cryptopool.c
+* Worker threads for CPU heavy cryptographic operations
+*
+* Jobs are submitted from Lua and return an id. Workers run them with
+* OpenSSL and put them on a completed list, then signal a file descriptor
+* that the event loop watches so the results can be collected with :pop().
+*/
+
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#define USE_EVENTFD
+#endif
+
+#include "lua.h"
+#include "lauxlib.h"
+#include <openssl/crypto.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/kdf.h>
+#include <openssl/obj_mac.h>
+
+#if (LUA_VERSION_NUM < 504)
+#define luaL_pushfail lua_pushnil
+#endif
+
+#define POOL_MT "util.cryptopool"
+/* Defined in crypto.c */
+#define PKEY_MT_TAG "util.crypto key"
+
+#define MAX_THREADS 64
+/* Same limit as util.hashes */
+#define MAX_HKDF_OUTPUT 256
+#define MAX_OUTPUT 1024
+
+enum { JOB_PBKDF2, JOB_HKDF, JOB_SIGN, JOB_VERIFY };
+
+static const char *const digest_names[] = { "sha1", "sha256", "sha384", "sha512", NULL };
+static const char *const sign_names[] = { "ed25519", "ecdsa_sha256", "ecdsa_sha384", "ecdsa_sha512", NULL };
+
+static const EVP_MD *get_digest(int which) {
+	switch(which) {
+		case 0:
+			return EVP_sha1();
+		case 1:
+			return EVP_sha256();
+		case 2:
+			return EVP_sha384();
+		default:
+			return EVP_sha512();
+	}
+}
+
+typedef struct job {
+	struct job *next;
+	lua_Integer id;
+	int type;
+	const EVP_MD *md;
+	EVP_PKEY *key;
+	/* Inputs, in one allocation: a, then b, then c */
+	unsigned char *data;
+	size_t a_len, b_len, c_len;
+	int iterations;
+	/* Result */
+	int ok;
+	size_t out_len;
+	unsigned char out[MAX_OUTPUT];
+	char error[128];
+} job;
+
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	job *queue, *queue_tail;
+	job *done, *done_tail;
+	int nthreads;
+	int stopping;
+	int fds[2]; /* read and write end, the same eventfd twice with USE_EVENTFD */
+	lua_Integer next_id;
+	lua_Integer pending;
+	pthread_t threads[MAX_THREADS];
+} pool;
+
+static void job_free(job *j) {
+	if(j->data != NULL) {
+		OPENSSL_cleanse(j->data, j->a_len + j->b_len + j->c_len);
+		free(j->data);
+	}
+
+	if(j->key != NULL) {
+		EVP_PKEY_free(j->key);
+	}
+
+	OPENSSL_cleanse(j->out, sizeof(j->out));
+	free(j);
+}
+
+static void job_error(job *j) {
+	unsigned long err = ERR_get_error();
+	j->ok = 0;
+
+	if(err) {
+		ERR_error_string_n(err, j->error, sizeof(j->error));
+	} else {
+		strcpy(j->error, "operation failed");
+	}
+
+	ERR_clear_error();
+}
+
+static void job_run(job *j) {
+	unsigned char *a = j->data, *b = a + j->a_len, *c = b + j->b_len;
+	EVP_MD_CTX *ctx;
+	EVP_PKEY_CTX *pctx;
+
+	j->ok = 1;
+
+	switch(j->type) {
+		case JOB_PBKDF2:
+			if(PKCS5_PBKDF2_HMAC((const char *)a, j->a_len, b, j->b_len, j->iterations, j->md, j->out_len, j->out) == 0) {
+				job_error(j);
+			}
+
+			break;
+
+		case JOB_HKDF:
+			pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, NULL);
+
+			if(pctx == NULL
+			   || EVP_PKEY_derive_init(pctx) <= 0
+			   || EVP_PKEY_CTX_set_hkdf_md(pctx, j->md) <= 0
+			   || (j->b_len > 0 && EVP_PKEY_CTX_set1_hkdf_salt(pctx, b, j->b_len) <= 0)
+			   || EVP_PKEY_CTX_set1_hkdf_key(pctx, a, j->a_len) <= 0
+			   || EVP_PKEY_CTX_add1_hkdf_info(pctx, c, j->c_len) <= 0
+			   || EVP_PKEY_derive(pctx, j->out, &j->out_len) <= 0) {
+				job_error(j);
+			}
+
+			EVP_PKEY_CTX_free(pctx);
+			break;
+
+		case JOB_SIGN:
+			ctx = EVP_MD_CTX_new();
+			j->out_len = sizeof(j->out);
+
+			if(ctx == NULL
+			   || EVP_DigestSignInit(ctx, NULL, j->md, NULL, j->key) != 1
+			   || EVP_DigestSign(ctx, j->out, &j->out_len, a, j->a_len) != 1) {
+				job_error(j);
+			}
+
+			EVP_MD_CTX_free(ctx);
+			break;
+
+		case JOB_VERIFY:
+			ctx = EVP_MD_CTX_new();
+			j->out_len = 0;
+
+			if(ctx == NULL || EVP_DigestVerifyInit(ctx, NULL, j->md, NULL, j->key) != 1) {
+				job_error(j);
+			} else {
+				int r = EVP_DigestVerify(ctx, b, j->b_len, a, j->a_len);
+
+				if(r == 1 || r == 0) {
+					j->out[0] = r;
+					ERR_clear_error();
+				} else {
+					job_error(j);
+				}
+			}
+
+			EVP_MD_CTX_free(ctx);
+			break;
+	}
+}
+
+static int open_signal(pool *p) {
+#ifdef USE_EVENTFD
+	p->fds[0] = p->fds[1] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	return p->fds[0];
+#else
+	int i;
+
+	if(pipe(p->fds) == -1) {
+		return -1;
+	}
+
+	for(i = 0; i < 2; i++) {
+		if(fcntl(p->fds[i], F_SETFL, O_NONBLOCK) == -1 || fcntl(p->fds[i], F_SETFD, FD_CLOEXEC) == -1) {
+			int err = errno;
+			close(p->fds[0]);
+			close(p->fds[1]);
+			errno = err;
+			return -1;
+		}
+	}
+
+	return 0;
+#endif
+}
+
+static void pool_signal(pool *p) {
+#ifdef USE_EVENTFD
+	uint64_t one = 1;
+	ssize_t r = write(p->fds[1], &one, sizeof(one));
+#else
+	char one = 1;
+	ssize_t r = write(p->fds[1], &one, sizeof(one));
+#endif
+	/* EAGAIN means it is already readable */
+	(void)r;
+}
+
+static void pool_drain_signal(pool *p) {
+	char buf[64];
+
+	while(read(p->fds[0], buf, sizeof(buf)) > 0) {
+#ifdef USE_EVENTFD
+		break;
+#endif
+	}
+}
+
+static void *worker(void *arg) {
+	pool *p = arg;
+
+	pthread_mutex_lock(&p->lock);
+
+	while(1) {
+		job *j;
+
+		while(p->queue == NULL && !p->stopping) {
+			pthread_cond_wait(&p->wake, &p->lock);
+		}
+
+		if(p->stopping) {
+			break;
+		}
+
+		j = p->queue;
+		p->queue = j->next;
+
+		if(p->queue == NULL) {
+			p->queue_tail = NULL;
+		}
+
+		pthread_mutex_unlock(&p->lock);
+
+		job_run(j);
+
+		pthread_mutex_lock(&p->lock);
+		j->next = NULL;
+
+		if(p->done_tail != NULL) {
+			p->done_tail->next = j;
+		} else {
+			p->done = j;
+		}
+
+		p->done_tail = j;
+		pool_signal(p);
+	}
+
+	pthread_mutex_unlock(&p->lock);
+	return NULL;
+}
+
+static void free_list(job *j) {
+	while(j != NULL) {
+		job *next = j->next;
+		job_free(j);
+		j = next;
+	}
+}
+
+/* Release everything but the threads, which must have been joined */
+static void pool_free(pool *p) {
+	free_list(p->queue);
+	free_list(p->done);
+	p->queue = p->queue_tail = p->done = p->done_tail = NULL;
+
+	close(p->fds[0]);
+
+	if(p->fds[1] != p->fds[0]) {
+		close(p->fds[1]);
+	}
+
+	pthread_cond_destroy(&p->wake);
+	pthread_mutex_destroy(&p->lock);
+}
+
+static void pool_stop(pool *p) {
+	int i;
+
+	if(p->nthreads == 0) {
+		return;
+	}
+
+	pthread_mutex_lock(&p->lock);
+	p->stopping = 1;
+	pthread_cond_broadcast(&p->wake);
+	pthread_mutex_unlock(&p->lock);
+
+	for(i = 0; i < p->nthreads; i++) {
+		pthread_join(p->threads[i], NULL);
+	}
+
+	p->nthreads = 0;
+	pool_free(p);
+}
+
+static pool *check_pool(lua_State *L) {
+	pool *p = luaL_checkudata(L, 1, POOL_MT);
+
+	if(p->nthreads == 0) {
+		luaL_error(L, "attempt to use a closed pool");
+	}
+
+	return p;
+}
+
+/* Allocate a job holding copies of up to three input strings */
+static job *new_job(lua_State *L, int type, const char *a, size_t a_len, const char *b, size_t b_len, const char *c, size_t c_len) {
+	job *j = calloc(1, sizeof(job));
+
+	if(j == NULL) {
+		luaL_error(L, "not enough memory");
+		return NULL;
+	}
+
+	j->type = type;
+	j->a_len = a_len;
+	j->b_len = b_len;
+	j->c_len = c_len;
+	j->data = malloc(a_len + b_len + c_len + 1);
+
+	if(j->data == NULL) {
+		free(j);
+		luaL_error(L, "not enough memory");
+		return NULL;
+	}
+
+	if(a_len) {
+		memcpy(j->data, a, a_len);
+	}
+
+	if(b_len) {
+		memcpy(j->data + a_len, b, b_len);
+	}
+
+	if(c_len) {
+		memcpy(j->data + a_len + b_len, c, c_len);
+	}
+
+	return j;
+}
+
+static int submit(lua_State *L, pool *p, job *j) {
+	j->id = ++p->next_id;
+	j->next = NULL;
+
+	pthread_mutex_lock(&p->lock);
+
+	if(p->queue_tail != NULL) {
+		p->queue_tail->next = j;
+	} else {
+		p->queue = j;
+	}
+
+	p->queue_tail = j;
+	pthread_cond_signal(&p->wake);
+	pthread_mutex_unlock(&p->lock);
+
+	p->pending++;
+	lua_pushinteger(L, j->id);
+	return 1;
+}
+
+/*
+ * Derive a key with PBKDF2-HMAC
+ * (pool, digest, password, salt, iterations, length?) -> id
+ */
+static int Lpbkdf2(lua_State *L) {
+	pool *p = check_pool(L);
+	const EVP_MD *md = get_digest(luaL_checkoption(L, 2, NULL, digest_names));
+	size_t pass_len, salt_len;
+	const char *pass = luaL_checklstring(L, 3, &pass_len);
+	const char *salt = luaL_checklstring(L, 4, &salt_len);
+	lua_Integer iterations = luaL_checkinteger(L, 5);
+	lua_Integer length = luaL_optinteger(L, 6, EVP_MD_size(md));
+	job *j;
+
+	luaL_argcheck(L, iterations > 0 && iterations <= 0x7fffffff, 5, "out of range");
+	luaL_argcheck(L, length > 0 && length <= MAX_OUTPUT, 6, "out of range");
+
+	j = new_job(L, JOB_PBKDF2, pass, pass_len, salt, salt_len, NULL, 0);
+	j->md = md;
+	j->iterations = (int)iterations;
+	j->out_len = length;
+	return submit(L, p, j);
+}
+
+/*
+ * Derive a key with HKDF, arguments as for util.hashes
+ * (pool, digest, length, input, salt?, info) -> id
+ */
+static int Lhkdf(lua_State *L) {
+	pool *p = check_pool(L);
+	const EVP_MD *md = get_digest(luaL_checkoption(L, 2, NULL, digest_names));
+	lua_Integer length = luaL_checkinteger(L, 3);
+	size_t input_len, salt_len = 0, info_len;
+	const char *input = luaL_checklstring(L, 4, &input_len);
+	const char *salt = luaL_optlstring(L, 5, NULL, &salt_len);
+	const char *info = luaL_checklstring(L, 6, &info_len);
+	job *j;
+
+	luaL_argcheck(L, length > 0 && length <= MAX_HKDF_OUTPUT, 3, "out of range");
+
+	j = new_job(L, JOB_HKDF, input, input_len, salt, salt_len, info, info_len);
+	j->md = md;
+	j->out_len = length;
+	return submit(L, p, j);
+}
+
+static EVP_PKEY *check_key(lua_State *L, int idx, int algorithm) {
+	EVP_PKEY *key = *(EVP_PKEY **)luaL_checkudata(L, idx, PKEY_MT_TAG);
+	int want = algorithm == 0 ? NID_ED25519 : NID_X9_62_id_ecPublicKey;
+
+	if(key == NULL || EVP_PKEY_id(key) != want) {
+		luaL_argerror(L, idx, "unexpected key type");
+	}
+
+	return key;
+}
+
+static const EVP_MD *sign_digest(int algorithm) {
+	return algorithm == 0 ? NULL : get_digest(algorithm);
+}
+
+/*
+ * Sign a message with a key from util.crypto
+ * (pool, algorithm, key, message) -> id
+ */
+static int Lsign(lua_State *L) {
+	pool *p = check_pool(L);
+	int algorithm = luaL_checkoption(L, 2, NULL, sign_names);
+	EVP_PKEY *key = check_key(L, 3, algorithm);
+	size_t msg_len;
+	const char *msg = luaL_checklstring(L, 4, &msg_len);
+	job *j = new_job(L, JOB_SIGN, msg, msg_len, NULL, 0, NULL, 0);
+
+	j->md = sign_digest(algorithm);
+	EVP_PKEY_up_ref(key);
+	j->key = key;
+	return submit(L, p, j);
+}
+
+/*
+ * Verify a signature with a key from util.crypto
+ * (pool, algorithm, key, message, signature) -> id
+ */
+static int Lverify(lua_State *L) {
+	pool *p = check_pool(L);
+	int algorithm = luaL_checkoption(L, 2, NULL, sign_names);
+	EVP_PKEY *key = check_key(L, 3, algorithm);
+	size_t msg_len, sig_len;
+	const char *msg = luaL_checklstring(L, 4, &msg_len);
+	const char *sig = luaL_checklstring(L, 5, &sig_len);
+	job *j = new_job(L, JOB_VERIFY, msg, msg_len, sig, sig_len, NULL, 0);
+
+	j->md = sign_digest(algorithm);
+	EVP_PKEY_up_ref(key);
+	j->key = key;
+	return submit(L, p, j);
+}
+
+/*
+ * Take one completed job
+ * (pool) -> id, result | id, nil, error | nothing
+ *
+ * Results are strings, except for verify jobs which give a boolean.
+ */
+static int Lpop(lua_State *L) {
+	pool *p = check_pool(L);
+	job *j;
+
+	pthread_mutex_lock(&p->lock);
+
+	j = p->done;
+
+	if(j != NULL) {
+		p->done = j->next;
+	}
+
+	if(p->done == NULL) {
+		/* Nothing more to collect, reset the signal. Workers only add and
+		 * signal while holding the lock, so no wakeup is lost. */
+		p->done_tail = NULL;
+		pool_drain_signal(p);
+	}
+
+	pthread_mutex_unlock(&p->lock);
+
+	if(j == NULL) {
+		return 0;
+	}
+
+	p->pending--;
+	lua_pushinteger(L, j->id);
+
+	if(!j->ok) {
+		luaL_pushfail(L);
+		lua_pushstring(L, j->error);
+		job_free(j);
+		return 3;
+	}
+
+	if(j->type == JOB_VERIFY) {
+		lua_pushboolean(L, j->out[0]);
+	} else {
+		lua_pushlstring(L, (const char *)j->out, j->out_len);
+	}
+
+	job_free(j);
+	return 2;
+}
+
+/* File descriptor that becomes readable when jobs complete */
+static int Lgetfd(lua_State *L) {
+	pool *p = check_pool(L);
+	lua_pushinteger(L, p->fds[0]);
+	return 1;
+}
+
+/* Number of jobs submitted but not yet collected */
+static int Lpending(lua_State *L) {
+	pool *p = check_pool(L);
+	lua_pushinteger(L, p->pending);
+	return 1;
+}
+
+static int Lclose(lua_State *L) {
+	pool *p = luaL_checkudata(L, 1, POOL_MT);
+	pool_stop(p);
+	return 0;
+}
+
+static int Ltostring(lua_State *L) {
+	pool *p = luaL_checkudata(L, 1, POOL_MT);
+	lua_pushfstring(L, "cryptopool: %p %d threads", p, p->nthreads);
+	return 1;
+}
+
+/*
+ * Start a pool
+ * (number) -> pool | nil, strerror, errno
+ */
+static int Lnew(lua_State *L) {
+	lua_Integer nthreads = luaL_optinteger(L, 1, 1);
+	pool *p;
+	int i;
+
+	luaL_argcheck(L, nthreads > 0 && nthreads <= MAX_THREADS, 1, "out of range");
+
+	p = lua_newuserdata(L, sizeof(pool));
+	memset(p, 0, sizeof(pool));
+
+	if(open_signal(p) == -1) {
+		luaL_pushfail(L);
+		lua_pushstring(L, strerror(errno));
+		lua_pushinteger(L, errno);
+		return 3;
+	}
+
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->wake, NULL);
+
+	luaL_getmetatable(L, POOL_MT);
+	lua_setmetatable(L, -2);
+
+	for(i = 0; i < nthreads; i++) {
+		int err = pthread_create(&p->threads[i], NULL, worker, p);
+
+		if(err != 0) {
+			if(p->nthreads > 0) {
+				pool_stop(p);
+			} else {
+				/* Nothing to stop, but the rest must still go */
+				pool_free(p);
+			}
+
+			luaL_pushfail(L);
+			lua_pushstring(L, strerror(err));
+			lua_pushinteger(L, err);
+			return 3;
+		}
+
+		p->nthreads++;
+	}
+
+	return 1;
+}
+
+int luaopen_prosody_util_cryptopool(lua_State *L) {
+	luaL_checkversion(L);
+
+	if(luaL_newmetatable(L, POOL_MT)) {
+		lua_pushcfunction(L, Ltostring);
+		lua_setfield(L, -2, "__tostring");
+		lua_pushcfunction(L, Lclose);
+		lua_setfield(L, -2, "__gc");
+
+		lua_createtable(L, 0, 8); /* __index */
+		{
+			lua_pushcfunction(L, Lpbkdf2);
+			lua_setfield(L, -2, "pbkdf2");
+			lua_pushcfunction(L, Lhkdf);
+			lua_setfield(L, -2, "hkdf");
+			lua_pushcfunction(L, Lsign);
+			lua_setfield(L, -2, "sign");
+			lua_pushcfunction(L, Lverify);
+			lua_setfield(L, -2, "verify");
+			lua_pushcfunction(L, Lpop);
+			lua_setfield(L, -2, "pop");
+			lua_pushcfunction(L, Lgetfd);
+			lua_setfield(L, -2, "getfd");
+			lua_pushcfunction(L, Lpending);
+			lua_setfield(L, -2, "pending");
+			lua_pushcfunction(L, Lclose);
+			lua_setfield(L, -2, "close");
+		}
+		lua_setfield(L, -2, "__index");
+	}
+
+	lua_createtable(L, 0, 1);
+	lua_pushcfunction(L, Lnew);
+	lua_setfield(L, -2, "new");
+	return 1;
+}
+
+int luaopen_util_cryptopool(lua_State *L) {
+	return luaopen_prosody_util_cryptopool(L);
+}
@@ -18,6 +18,7 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include "lua.h"
 #include "lauxlib.h"
 
@@ -30,132 +31,147 @@
 static const char code[] =
     "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 
-static void base64_encode(luaL_Buffer *b, unsigned int c1, unsigned int c2, unsigned int c3, int n) {
-	unsigned long tuple = c3 + 256UL * (c2 + 256UL * c1);
-	int i;
-	char s[4];
-
-	for(i = 0; i < 4; i++) {
-		s[3 - i] = code[tuple % 64];
-		tuple /= 64;
-	}
-
-	for(i = n + 1; i < 4; i++) {
-		s[i] = '=';
-	}
-
-	luaL_addlstring(b, s, 4);
-}
-
 static int Lbase64_encode(lua_State *L) {	/** encode(s) */
-	size_t l;
+	size_t l, i, o = 0;
 	const unsigned char *s = (const unsigned char *)luaL_checklstring(L, 1, &l);
 	luaL_Buffer b;
-	int n;
-	luaL_buffinit(L, &b);
-
-	for(n = l / 3; n--; s += 3) {
-		base64_encode(&b, s[0], s[1], s[2], 3);
+	char *out;
+	unsigned long tuple;
+
+	luaL_argcheck(L, l / 3 < ((size_t)-1) / 4 - 1, 1, "string too long");
+	out = luaL_buffinitsize(L, &b, (l + 2) / 3 * 4);
+
+	for(i = 0; i + 3 <= l; i += 3) {
+		tuple = s[i] << 16 | s[i + 1] << 8 | s[i + 2];
+		out[o++] = code[tuple >> 18];
+		out[o++] = code[(tuple >> 12) & 63];
+		out[o++] = code[(tuple >> 6) & 63];
+		out[o++] = code[tuple & 63];
 	}
 
-	switch(l % 3) {
+	switch(l - i) {
 		case 1:
-			base64_encode(&b, s[0], 0, 0, 1);
+			tuple = s[i] << 16;
+			out[o++] = code[tuple >> 18];
+			out[o++] = code[(tuple >> 12) & 63];
+			out[o++] = '=';
+			out[o++] = '=';
 			break;
 
 		case 2:
-			base64_encode(&b, s[0], s[1], 0, 2);
+			tuple = s[i] << 16 | s[i + 1] << 8;
+			out[o++] = code[tuple >> 18];
+			out[o++] = code[(tuple >> 12) & 63];
+			out[o++] = code[(tuple >> 6) & 63];
+			out[o++] = '=';
 			break;
 	}
 
-	luaL_pushresult(&b);
+	luaL_pushresultsize(&b, o);
 	return 1;
 }
 
-static void base64_decode(luaL_Buffer *b, int c1, int c2, int c3, int c4, int n) {
-	unsigned long tuple = c4 + 64L * (c3 + 64L * (c2 + 64L * c1));
-	char s[3];
-
-	switch(--n) {
-		case 3:
-			s[2] = (char) tuple;
-			/* Falls through. */
-
-		case 2:
-			s[1] = (char)(tuple >> 8);
-			/* Falls through. */
-
-		case 1:
-			s[0] = (char)(tuple >> 16);
-	}
-
-	luaL_addlstring(b, s, n);
-}
+/* Decoding table, values of base64 digits and how to treat other bytes */
+#define SKP 64 /* whitespace, ignored */
+#define PAD 65 /* '=', terminates a group */
+#define END 66 /* '\0', ends the input */
+#define BAD 255
+
+static const unsigned char decode_table[256] = {
+	END, BAD, BAD, BAD, BAD, BAD, BAD, BAD, SKP, SKP, SKP, BAD, SKP, SKP, BAD, BAD,
+	BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD,
+	SKP, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD,  62, BAD, BAD, BAD,  63,
+	 52,  53,  54,  55,  56,  57,  58,  59,  60,  61, BAD, BAD, BAD, PAD, BAD, BAD,
+	BAD,   0,   1,   2,   3,   4,   5,   6,   7,   8,   9,  10,  11,  12,  13,  14,
+	 15,  16,  17,  18,  19,  20,  21,  22,  23,  24,  25, BAD, BAD, BAD, BAD, BAD,
+	BAD,  26,  27,  28,  29,  30,  31,  32,  33,  34,  35,  36,  37,  38,  39,  40,
+	 41,  42,  43,  44,  45,  46,  47,  48,  49,  50,  51, BAD, BAD, BAD, BAD, BAD,
+	BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD,
+	BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD,
+	BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD,
+	BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD,
+	BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD,
+	BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD,
+	BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD,
+	BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD,
+};
 
 static int Lbase64_decode(lua_State *L) {	/** decode(s) */
-	size_t l;
-	const char *s = luaL_checklstring(L, 1, &l);
+	size_t l, o = 0;
+	const unsigned char *s = (const unsigned char *)luaL_checklstring(L, 1, &l);
+	const unsigned char *e = s + l;
 	luaL_Buffer b;
+	char *out = luaL_buffinitsize(L, &b, l / 4 * 3 + 3);
+	unsigned long tuple = 0;
 	int n = 0;
-	char t[4];
-	luaL_buffinit(L, &b);
-
-	for(;;) {
-		int c = *s++;
 
-		switch(c) {
-				const char *p;
+	while(s < e) {
+		unsigned int c;
 
-			default:
-				p = strchr(code, c);
+		/* Groups of four digits without whitespace or padding */
+		if(n == 0) {
+			while(e - s >= 4) {
+				unsigned int c1 = decode_table[s[0]], c2 = decode_table[s[1]],
+				             c3 = decode_table[s[2]], c4 = decode_table[s[3]];
 
-				if(p == NULL) {
-					return 0;
+				if((c1 | c2 | c3 | c4) >= SKP) {
+					break;
 				}
 
-				t[n++] = (char)(p - code);
-
-				if(n == 4) {
-					base64_decode(&b, t[0], t[1], t[2], t[3], 4);
-					n = 0;
-				}
+				tuple = c1 << 18 | c2 << 12 | c3 << 6 | c4;
+				out[o++] = (char)(tuple >> 16);
+				out[o++] = (char)(tuple >> 8);
+				out[o++] = (char) tuple;
+				s += 4;
+			}
 
+			if(s == e) {
 				break;
+			}
+		}
 
-			case '=':
-
-				switch(n) {
-					case 1:
-						base64_decode(&b, t[0], 0, 0, 0, 1);
-						break;
+		c = decode_table[*s++];
 
-					case 2:
-						base64_decode(&b, t[0], t[1], 0, 0, 2);
-						break;
-
-					case 3:
-						base64_decode(&b, t[0], t[1], t[2], 0, 3);
-						break;
-				}
+		if(c < SKP) {
+			tuple = tuple << 6 | c;
 
+			if(++n == 4) {
+				out[o++] = (char)(tuple >> 16);
+				out[o++] = (char)(tuple >> 8);
+				out[o++] = (char) tuple;
+				tuple = 0;
 				n = 0;
-				break;
-
-			case 0:
-				luaL_pushresult(&b);
-				return 1;
+			}
+		} else if(c == PAD) {
+			switch(n) {
+				case 2:
+					out[o++] = (char)(tuple >> 4);
+					break;
+
+				case 3:
+					out[o++] = (char)(tuple >> 10);
+					out[o++] = (char)(tuple >> 2);
+					break;
+			}
 
-			case '\n':
-			case '\r':
-			case '\t':
-			case ' ':
-			case '\f':
-			case '\b':
-				break;
+			tuple = 0;
+			n = 0;
+		} else if(c == END) {
+			break;
+		} else if(c != SKP) {
+			return 0;
 		}
 	}
+
+	luaL_pushresultsize(&b, o);
+	return 1;
 }
 
+#undef SKP
+#undef PAD
+#undef END
+#undef BAD
+
 static const luaL_Reg Reg_base64[] = {
 	{ "encode",	Lbase64_encode	},
 	{ "decode",	Lbase64_decode	},
@@ -212,23 +228,52 @@ static const char *utf8_decode(const char *o, int *val) {
 	return (const char *)s + 1;  /* +1 to include first byte */
 }
 
+/* Word-at-a-time helpers for skipping over runs of plain ASCII */
+#define WORD_ONES ((uint64_t)-1 / 255)
+#define WORD_HIGH (WORD_ONES * 0x80)
+/* Any byte below n, for n <= 128 */
+#define WORD_HAS_LESS(w, n) (((w) - WORD_ONES * (n)) & ~(w) & WORD_HIGH)
+
+static uint64_t load_word(const char *s) {
+	uint64_t w;
+	memcpy(&w, s, sizeof(w));
+	return w;
+}
+
+/*
+ * Check that a buffer is valid UTF-8
+ * Relies on the terminating NUL of Lua strings to stop at truncated sequences
+ */
+static int utf8_valid(const char *s, size_t len) {
+	const char *e = s + len;
+
+	while(s < e) {
+		if(e - s >= 8 && !(load_word(s) & WORD_HIGH)) {
+			s += 8;
+		} else if((unsigned char)*s < 0x80) {
+			s++;
+		} else {
+			s = utf8_decode(s, NULL);
+
+			if(s == NULL) {
+				return 0;
+			}
+		}
+	}
+
+	return 1;
+}
+
 /*
  * Check that a string is valid UTF-8
  * Returns NULL if not
  */
 static const char *check_utf8(lua_State *L, int idx, size_t *l) {
-	size_t pos, len;
+	size_t len;
 	const char *s = luaL_checklstring(L, idx, &len);
-	pos = 0;
 
-	while(pos <= len) {
-		const char *s1 = utf8_decode(s + pos, NULL);
-
-		if(s1 == NULL) {   /* conversion error? */
-			return NULL;
-		}
-
-		pos = s1 - s;
+	if(!utf8_valid(s, len)) {
+		return NULL;
 	}
 
 	if(l != NULL) {
@@ -256,13 +301,206 @@ static int Lutf8_length(lua_State *L) {
 	return 1;
 }
 
+/*
+ * Check that a string is valid UTF-8 and free of control characters other
+ * than tab, newline and carriage return, in a single pass.
+ * With attr set, the \1 separator between namespace and name is allowed too.
+ * (string, boolean?) -> true | false, "control characters" | "invalid utf8"
+ */
+static int Lutf8_valid_xml_cdata(lua_State *L) {
+	size_t len;
+	const char *s = luaL_checklstring(L, 1, &len);
+	const char *e = s + len;
+	int attr = lua_toboolean(L, 2);
+	int utf8_ok = 1;
+
+	while(s < e) {
+		unsigned char c = *s;
+
+		if(e - s >= 8) {
+			uint64_t w = load_word(s);
+
+			if(!(w & WORD_HIGH) && !WORD_HAS_LESS(w, 20)) {
+				s += 8;
+				continue;
+			}
+		}
+
+		if(c < 20) {
+			if(c != '\t' && c != '\n' && c != '\r' && !(attr && c == 1)) {
+				lua_pushboolean(L, 0);
+				lua_pushliteral(L, "control characters");
+				return 2;
+			}
+
+			s++;
+		} else if(c < 0x80 || !utf8_ok) {
+			/* after invalid UTF-8, keep looking for control characters */
+			s++;
+		} else {
+			const char *next = utf8_decode(s, NULL);
+
+			if(next == NULL) {
+				utf8_ok = 0;
+				s++;
+			} else {
+				s = next;
+			}
+		}
+	}
+
+	if(!utf8_ok) {
+		lua_pushboolean(L, 0);
+		lua_pushliteral(L, "invalid utf8");
+		return 2;
+	}
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
 static const luaL_Reg Reg_utf8[] = {
 	{ "valid",	Lutf8_valid	},
 	{ "length",	Lutf8_length	},
+	{ "valid_xml_cdata",	Lutf8_valid_xml_cdata	},
 	{ NULL,		NULL	}
 };
 
 /***************** STRINGPREP *****************/
+
+/*
+ * The same few host names, user names and resources get prepped over and
+ * over, so results of nameprep, nodeprep and resourceprep are remembered in
+ * a small set-associative cache with LRU replacement within each set.
+ * saslprep is used on passwords and is never cached.
+ */
+#define PREP_CACHE_SETS 256
+#define PREP_CACHE_WAYS 4
+#define PREP_CACHE_MAXLEN 64
+#define PREP_FAILED 0xff
+
+enum { PREP_NAMEPREP, PREP_NODEPREP, PREP_RESOURCEPREP, PREP_NOCACHE };
+
+typedef struct {
+	uint32_t hash;
+	uint32_t used; /* tick of the last lookup, 0 if empty */
+	unsigned char key; /* profile and strict flag */
+	unsigned char in_len;
+	unsigned char out_len; /* PREP_FAILED if the input was rejected */
+	char in[PREP_CACHE_MAXLEN];
+	char out[PREP_CACHE_MAXLEN];
+} prep_cache_entry;
+
+static prep_cache_entry prep_cache[PREP_CACHE_SETS][PREP_CACHE_WAYS];
+static uint32_t prep_cache_tick;
+static lua_Integer prep_cache_hits, prep_cache_misses;
+
+static uint32_t prep_cache_hash(unsigned char key, const char *s, size_t len) {
+	uint32_t h = 2166136261u ^ key; /* FNV-1a */
+	size_t i;
+
+	for(i = 0; i < len; i++) {
+		h = (h ^ (unsigned char)s[i]) * 16777619u;
+	}
+
+	return h;
+}
+
+static uint32_t prep_cache_touch(void) {
+	if(++prep_cache_tick == 0) {
+		/* wrapped around, forget the order rather than the entries */
+		int i, j;
+
+		for(i = 0; i < PREP_CACHE_SETS; i++) {
+			for(j = 0; j < PREP_CACHE_WAYS; j++) {
+				if(prep_cache[i][j].used) {
+					prep_cache[i][j].used = 1;
+				}
+			}
+		}
+
+		prep_cache_tick = 2;
+	}
+
+	return prep_cache_tick;
+}
+
+static prep_cache_entry *prep_cache_find(unsigned char key, uint32_t hash, const char *s, size_t len) {
+	prep_cache_entry *set = prep_cache[hash % PREP_CACHE_SETS];
+	int i;
+
+	for(i = 0; i < PREP_CACHE_WAYS; i++) {
+		prep_cache_entry *e = &set[i];
+
+		if(e->used && e->hash == hash && e->key == key && e->in_len == len && memcmp(e->in, s, len) == 0) {
+			e->used = prep_cache_touch();
+			return e;
+		}
+	}
+
+	return NULL;
+}
+
+static void prep_cache_store(unsigned char key, uint32_t hash, const char *s, size_t len, const char *out, int out_len) {
+	prep_cache_entry *set = prep_cache[hash % PREP_CACHE_SETS];
+	prep_cache_entry *e = &set[0];
+	int i;
+
+	if(out_len >= PREP_CACHE_MAXLEN) {
+		return;
+	}
+
+	for(i = 1; i < PREP_CACHE_WAYS && e->used; i++) {
+		if(set[i].used < e->used) {
+			e = &set[i];
+		}
+	}
+
+	e->hash = hash;
+	e->used = prep_cache_touch();
+	e->key = key;
+	e->in_len = (unsigned char)len;
+	memcpy(e->in, s, len);
+
+	if(out_len < 0) {
+		e->out_len = PREP_FAILED;
+	} else {
+		e->out_len = (unsigned char)out_len;
+		memcpy(e->out, out, out_len);
+	}
+}
+
+/*
+ * Printable ASCII that every profile leaves alone: nothing is mapped or
+ * prohibited, and no bidi rules apply. Upper case is folded by nameprep and
+ * nodeprep, nodeprep also prohibits space and "&'/:<>@.
+ */
+static int prep_ascii_unchanged(int which, const char *s, size_t len) {
+	size_t i;
+
+	for(i = 0; i < len; i++) {
+		unsigned char c = (unsigned char)s[i];
+
+		if(c < 0x20 || c > 0x7e) {
+			return 0;
+		}
+
+		if(which == PREP_RESOURCEPREP) {
+			continue;
+		}
+
+		if(c == ' ' || (c >= 'A' && c <= 'Z')) {
+			return 0;
+		}
+
+		if(which == PREP_NODEPREP && strchr("\"&'/:<>@", c) != NULL) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
 #ifdef USE_STRINGPREP_ICU
 
 #include <unicode/usprep.h>
@@ -271,56 +509,37 @@ static const luaL_Reg Reg_utf8[] = {
 #include <unicode/uspoof.h>
 #include <unicode/uidna.h>
 
-static int icu_stringprep_prep(lua_State *L, const UStringPrepProfile *profile) {
-	size_t input_len;
+typedef UStringPrepProfile prep_profile;
+
+/* Returns the length of the result in `output`, or -1 */
+static int32_t do_prep(const UStringPrepProfile *profile, const char *input, size_t input_len, int strict, char *output) {
 	int32_t unprepped_len, prepped_len, output_len;
-	const char *input;
-	char output[1024];
-	int flags = USPREP_ALLOW_UNASSIGNED;
+	int flags = strict ? 0 : USPREP_ALLOW_UNASSIGNED;
 
 	UChar unprepped[1024]; /* Temporary unicode buffer (1024 characters) */
 	UChar prepped[1024];
 
 	UErrorCode err = U_ZERO_ERROR;
 
-	input = luaL_checklstring(L, 1, &input_len);
-
-	if(input_len >= 1024) {
-		luaL_pushfail(L);
-		return 1;
-	}
-
-	/* strict */
-	if(!lua_isnoneornil(L, 2)) {
-		luaL_checktype(L, 2, LUA_TBOOLEAN);
-		if(lua_toboolean(L, 2)) {
-			flags = 0;
-		}
-	}
-
 	u_strFromUTF8(unprepped, 1024, &unprepped_len, input, input_len, &err);
 
 	if(U_FAILURE(err)) {
-		luaL_pushfail(L);
-		return 1;
+		return -1;
 	}
 
 	prepped_len = usprep_prepare(profile, unprepped, unprepped_len, prepped, 1024, flags, NULL, &err);
 
 	if(U_FAILURE(err)) {
-		luaL_pushfail(L);
-		return 1;
-	} else {
-		u_strToUTF8(output, 1024, &output_len, prepped, prepped_len, &err);
+		return -1;
+	}
 
-		if(U_SUCCESS(err) && output_len < 1024) {
-			lua_pushlstring(L, output, output_len);
-		} else {
-			luaL_pushfail(L);
-		}
+	u_strToUTF8(output, 1024, &output_len, prepped, prepped_len, &err);
 
-		return 1;
+	if(U_SUCCESS(err) && output_len < 1024) {
+		return output_len;
 	}
+
+	return -1;
 }
 
 static UStringPrepProfile *icu_nameprep;
@@ -375,77 +594,134 @@ static void init_icu(void) {
 	}
 }
 
-#define MAKE_PREP_FUNC(myFunc, prep) \
-static int myFunc(lua_State *L) { return icu_stringprep_prep(L, prep); }
-
-MAKE_PREP_FUNC(Lstringprep_nameprep, icu_nameprep)		/** stringprep.nameprep(s) */
-MAKE_PREP_FUNC(Lstringprep_nodeprep, icu_nodeprep)		/** stringprep.nodeprep(s) */
-MAKE_PREP_FUNC(Lstringprep_resourceprep, icu_resourceprep)		/** stringprep.resourceprep(s) */
-MAKE_PREP_FUNC(Lstringprep_saslprep, icu_saslprep)		/** stringprep.saslprep(s) */
-
-static const luaL_Reg Reg_stringprep[] = {
-	{ "nameprep",	Lstringprep_nameprep	},
-	{ "nodeprep",	Lstringprep_nodeprep	},
-	{ "resourceprep",	Lstringprep_resourceprep	},
-	{ "saslprep",	Lstringprep_saslprep	},
-	{ NULL,		NULL	}
-};
+#define PREP_NAMEPREP_PROFILE icu_nameprep
+#define PREP_NODEPREP_PROFILE icu_nodeprep
+#define PREP_RESOURCEPREP_PROFILE icu_resourceprep
+#define PREP_SASLPREP_PROFILE icu_saslprep
 #else /* USE_STRINGPREP_ICU */
 
 /****************** libidn ********************/
 
 #include <stringprep.h>
 
-static int stringprep_prep(lua_State *L, const Stringprep_profile *profile) {
+typedef Stringprep_profile prep_profile;
+
+/* Returns the length of the result in `output`, or -1 */
+static int do_prep(const Stringprep_profile *profile, const char *input, size_t input_len, int strict, char *output) {
+	Stringprep_profile_flags flags = strict ? STRINGPREP_NO_UNASSIGNED : 0;
+
+	if(!utf8_valid(input, input_len) || input_len != strlen(input)) {
+		return -1; /* TODO return error message */
+	}
+
+	memcpy(output, input, input_len + 1);
+
+	if(stringprep(output, 1024, flags, profile) != STRINGPREP_OK) {
+		return -1; /* TODO return error message */
+	}
+
+	return strlen(output);
+}
+
+#define PREP_NAMEPREP_PROFILE stringprep_nameprep
+#define PREP_NODEPREP_PROFILE stringprep_xmpp_nodeprep
+#define PREP_RESOURCEPREP_PROFILE stringprep_xmpp_resourceprep
+#define PREP_SASLPREP_PROFILE stringprep_saslprep
+#endif
+
+static int stringprep_prep(lua_State *L, const prep_profile *profile, int which) {
 	size_t len;
 	const char *s;
-	char string[1024];
-	int ret;
-	Stringprep_profile_flags flags = 0;
+	char output[1024];
+	int strict = 0;
+	int output_len;
+	unsigned char key;
+	uint32_t hash = 0;
 
-	s = check_utf8(L, 1, &len);
+	s = luaL_checklstring(L, 1, &len);
 
 	/* strict */
 	if(!lua_isnoneornil(L, 2)) {
 		luaL_checktype(L, 2, LUA_TBOOLEAN);
-		if(lua_toboolean(L, 2)) {
-			flags = STRINGPREP_NO_UNASSIGNED;
-		}
+		strict = lua_toboolean(L, 2);
 	}
 
-	if(s == NULL || len >= 1024 || len != strlen(s)) {
+	if(len >= 1024) {
 		luaL_pushfail(L);
-		return 1; /* TODO return error message */
+		return 1;
 	}
 
-	strcpy(string, s);
-	ret = stringprep(string, 1024, flags, profile);
+	key = (unsigned char)(which << 1 | strict);
 
-	if(ret == STRINGPREP_OK) {
-		lua_pushstring(L, string);
-		return 1;
-	} else {
+	if(which != PREP_NOCACHE) {
+		prep_cache_entry *e;
+
+		if(prep_ascii_unchanged(which, s, len)) {
+			lua_settop(L, 1);
+			return 1;
+		}
+
+		if(len < PREP_CACHE_MAXLEN) {
+			hash = prep_cache_hash(key, s, len);
+			e = prep_cache_find(key, hash, s, len);
+
+			if(e != NULL) {
+				prep_cache_hits++;
+
+				if(e->out_len == PREP_FAILED) {
+					luaL_pushfail(L);
+				} else {
+					lua_pushlstring(L, e->out, e->out_len);
+				}
+
+				return 1;
+			}
+
+			prep_cache_misses++;
+		}
+	}
+
+	output_len = do_prep(profile, s, len, strict, output);
+
+	if(which != PREP_NOCACHE && len < PREP_CACHE_MAXLEN) {
+		prep_cache_store(key, hash, s, len, output, output_len);
+	}
+
+	if(output_len < 0) {
 		luaL_pushfail(L);
-		return 1; /* TODO return error message */
+	} else {
+		lua_pushlstring(L, output, output_len);
 	}
+
+	return 1;
 }
 
-#define MAKE_PREP_FUNC(myFunc, prep) \
-static int myFunc(lua_State *L) { return stringprep_prep(L, prep); }
+#define MAKE_PREP_FUNC(myFunc, prep, which) \
+static int myFunc(lua_State *L) { return stringprep_prep(L, prep, which); }
+
+MAKE_PREP_FUNC(Lstringprep_nameprep, PREP_NAMEPREP_PROFILE, PREP_NAMEPREP)		/** stringprep.nameprep(s) */
+MAKE_PREP_FUNC(Lstringprep_nodeprep, PREP_NODEPREP_PROFILE, PREP_NODEPREP)		/** stringprep.nodeprep(s) */
+MAKE_PREP_FUNC(Lstringprep_resourceprep, PREP_RESOURCEPREP_PROFILE, PREP_RESOURCEPREP)		/** stringprep.resourceprep(s) */
+MAKE_PREP_FUNC(Lstringprep_saslprep, PREP_SASLPREP_PROFILE, PREP_NOCACHE)		/** stringprep.saslprep(s) */
 
-MAKE_PREP_FUNC(Lstringprep_nameprep, stringprep_nameprep)		/** stringprep.nameprep(s) */
-MAKE_PREP_FUNC(Lstringprep_nodeprep, stringprep_xmpp_nodeprep)		/** stringprep.nodeprep(s) */
-MAKE_PREP_FUNC(Lstringprep_resourceprep, stringprep_xmpp_resourceprep)		/** stringprep.resourceprep(s) */
-MAKE_PREP_FUNC(Lstringprep_saslprep, stringprep_saslprep)		/** stringprep.saslprep(s) */
+/*
+ * Counters of the cache of prepped strings
+ * () -> hits, misses
+ */
+static int Lstringprep_cache_stats(lua_State *L) {
+	lua_pushinteger(L, prep_cache_hits);
+	lua_pushinteger(L, prep_cache_misses);
+	return 2;
+}
 
 static const luaL_Reg Reg_stringprep[] = {
 	{ "nameprep",	Lstringprep_nameprep	},
 	{ "nodeprep",	Lstringprep_nodeprep	},
 	{ "resourceprep",	Lstringprep_resourceprep	},
 	{ "saslprep",	Lstringprep_saslprep	},
+	{ "cache_stats",	Lstringprep_cache_stats	},
 	{ NULL,		NULL	}
 };
-#endif
 
 /***************** IDNA *****************/
 #ifdef USE_STRINGPREP_ICU
@@ -39,6 +39,65 @@ typedef unsigned __int32 uint32_t;
 */
 #define MAX_HKDF_OUTPUT 256
 
+#define HASH_MT "util.hashes.hash"
+
+enum {
+	MD_SHA1, MD_SHA224, MD_SHA256, MD_SHA384, MD_SHA512, MD_MD5,
+	MD_SHA3_256, MD_SHA3_512, MD_BLAKE2S256, MD_BLAKE2B512
+};
+
+/* Names accepted by new() and hmac_new(), in the order above */
+static const char *const md_names[] = {
+	"sha1", "sha224", "sha256", "sha384", "sha512", "md5",
+	"sha3_256", "sha3_512", "blake2s256", "blake2b512", NULL
+};
+
+typedef struct {
+	const char *name; /* as known to OpenSSL */
+	const EVP_MD *(*get)(void);
+	const EVP_MD *md;
+} md_algorithm;
+
+static md_algorithm md_algorithms[] = {
+	{ "SHA1", EVP_sha1, NULL },
+	{ "SHA224", EVP_sha224, NULL },
+	{ "SHA256", EVP_sha256, NULL },
+	{ "SHA384", EVP_sha384, NULL },
+	{ "SHA512", EVP_sha512, NULL },
+	{ "MD5", EVP_md5, NULL },
+	{ "SHA3-256", EVP_sha3_256, NULL },
+	{ "SHA3-512", EVP_sha3_512, NULL },
+	{ "BLAKE2S-256", EVP_blake2s256, NULL },
+	{ "BLAKE2B-512", EVP_blake2b512, NULL },
+};
+
+/*
+ * Look up a digest once and keep it
+ *
+ * With OpenSSL 3 the EVP_sha256() style objects are fetched again from the
+ * provider on every EVP_DigestInit_ex(), an explicitly fetched one is not.
+ */
+static const EVP_MD *get_md(int which) {
+	md_algorithm *a = &md_algorithms[which];
+
+	if(a->md == NULL) {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+		a->md = EVP_MD_fetch(NULL, a->name, NULL);
+
+		if(a->md == NULL) {
+			ERR_clear_error();
+		}
+
+#endif
+
+		if(a->md == NULL) {
+			a->md = a->get();
+		}
+	}
+
+	return a->md;
+}
+
 static const char *hex_tab = "0123456789abcdef";
 static void toHex(const unsigned char *in, int length, unsigned char *out) {
 	int i;
@@ -57,10 +116,15 @@ static int Levp_hash(lua_State *L, const EVP_MD *evp) {
 
 	unsigned char hash[EVP_MAX_MD_SIZE], result[EVP_MAX_MD_SIZE * 2];
 
-	EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+	/* Kept around between calls, EVP_DigestInit_ex() resets it */
+	static EVP_MD_CTX *ctx = NULL;
 
 	if(ctx == NULL) {
-		goto fail;
+		ctx = EVP_MD_CTX_new();
+
+		if(ctx == NULL) {
+			goto fail;
+		}
 	}
 
 	if(!EVP_DigestInit_ex(ctx, evp, NULL)) {
@@ -75,8 +139,6 @@ static int Levp_hash(lua_State *L, const EVP_MD *evp) {
 		goto fail;
 	}
 
-	EVP_MD_CTX_free(ctx);
-
 	if(hex_out) {
 		toHex(hash, size, result);
 		lua_pushlstring(L, (char *)result, size * 2);
@@ -87,48 +149,47 @@ static int Levp_hash(lua_State *L, const EVP_MD *evp) {
 	return 1;
 
 fail:
-	EVP_MD_CTX_free(ctx);
 	return luaL_error(L, ERR_error_string(ERR_get_error(), NULL));
 }
 
 static int Lsha1(lua_State *L) {
-	return Levp_hash(L, EVP_sha1());
+	return Levp_hash(L, get_md(MD_SHA1));
 }
 
 static int Lsha224(lua_State *L) {
-	return Levp_hash(L, EVP_sha224());
+	return Levp_hash(L, get_md(MD_SHA224));
 }
 
 static int Lsha256(lua_State *L) {
-	return Levp_hash(L, EVP_sha256());
+	return Levp_hash(L, get_md(MD_SHA256));
 }
 
 static int Lsha384(lua_State *L) {
-	return Levp_hash(L, EVP_sha384());
+	return Levp_hash(L, get_md(MD_SHA384));
 }
 
 static int Lsha512(lua_State *L) {
-	return Levp_hash(L, EVP_sha512());
+	return Levp_hash(L, get_md(MD_SHA512));
 }
 
 static int Lmd5(lua_State *L) {
-	return Levp_hash(L, EVP_md5());
+	return Levp_hash(L, get_md(MD_MD5));
 }
 
 static int Lblake2s256(lua_State *L) {
-	return Levp_hash(L, EVP_blake2s256());
+	return Levp_hash(L, get_md(MD_BLAKE2S256));
 }
 
 static int Lblake2b512(lua_State *L) {
-	return Levp_hash(L, EVP_blake2b512());
+	return Levp_hash(L, get_md(MD_BLAKE2B512));
 }
 
 static int Lsha3_256(lua_State *L) {
-	return Levp_hash(L, EVP_sha3_256());
+	return Levp_hash(L, get_md(MD_SHA3_256));
 }
 
 static int Lsha3_512(lua_State *L) {
-	return Levp_hash(L, EVP_sha3_512());
+	return Levp_hash(L, get_md(MD_SHA3_512));
 }
 
 static int Levp_hmac(lua_State *L, const EVP_MD *evp) {
@@ -157,43 +218,43 @@ fail:
 }
 
 static int Lhmac_sha1(lua_State *L) {
-	return Levp_hmac(L, EVP_sha1());
+	return Levp_hmac(L, get_md(MD_SHA1));
 }
 
 static int Lhmac_sha224(lua_State *L) {
-	return Levp_hmac(L, EVP_sha224());
+	return Levp_hmac(L, get_md(MD_SHA224));
 }
 
 static int Lhmac_sha256(lua_State *L) {
-	return Levp_hmac(L, EVP_sha256());
+	return Levp_hmac(L, get_md(MD_SHA256));
 }
 
 static int Lhmac_sha384(lua_State *L) {
-	return Levp_hmac(L, EVP_sha384());
+	return Levp_hmac(L, get_md(MD_SHA384));
 }
 
 static int Lhmac_sha512(lua_State *L) {
-	return Levp_hmac(L, EVP_sha512());
+	return Levp_hmac(L, get_md(MD_SHA512));
 }
 
 static int Lhmac_md5(lua_State *L) {
-	return Levp_hmac(L, EVP_md5());
+	return Levp_hmac(L, get_md(MD_MD5));
 }
 
 static int Lhmac_sha3_256(lua_State *L) {
-	return Levp_hmac(L, EVP_sha3_256());
+	return Levp_hmac(L, get_md(MD_SHA3_256));
 }
 
 static int Lhmac_sha3_512(lua_State *L) {
-	return Levp_hmac(L, EVP_sha3_512());
+	return Levp_hmac(L, get_md(MD_SHA3_512));
 }
 
 static int Lhmac_blake2s256(lua_State *L) {
-	return Levp_hmac(L, EVP_blake2s256());
+	return Levp_hmac(L, get_md(MD_BLAKE2S256));
 }
 
 static int Lhmac_blake2b512(lua_State *L) {
-	return Levp_hmac(L, EVP_blake2b512());
+	return Levp_hmac(L, get_md(MD_BLAKE2B512));
 }
 
 
@@ -215,11 +276,11 @@ static int Levp_pbkdf2(lua_State *L, const EVP_MD *evp, size_t out_len) {
 }
 
 static int Lpbkdf2_sha1(lua_State *L) {
-	return Levp_pbkdf2(L, EVP_sha1(), SHA_DIGEST_LENGTH);
+	return Levp_pbkdf2(L, get_md(MD_SHA1), SHA_DIGEST_LENGTH);
 }
 
 static int Lpbkdf2_sha256(lua_State *L) {
-	return Levp_pbkdf2(L, EVP_sha256(), SHA256_DIGEST_LENGTH);
+	return Levp_pbkdf2(L, get_md(MD_SHA256), SHA256_DIGEST_LENGTH);
 }
 
 
@@ -264,11 +325,11 @@ static int Levp_hkdf(lua_State *L, const EVP_MD *evp) {
 }
 
 static int Lhkdf_sha256(lua_State *L) {
-	return Levp_hkdf(L, EVP_sha256());
+	return Levp_hkdf(L, get_md(MD_SHA256));
 }
 
 static int Lhkdf_sha384(lua_State *L) {
-	return Levp_hkdf(L, EVP_sha384());
+	return Levp_hkdf(L, get_md(MD_SHA384));
 }
 
 static int Lhash_equals(lua_State *L) {
@@ -283,6 +344,154 @@ static int Lhash_equals(lua_State *L) {
 	return 1;
 }
 
+/*
+ * Incremental hashing
+ */
+
+typedef struct {
+	EVP_MD_CTX *ctx;
+	const EVP_MD *md;
+	EVP_PKEY *key; /* for HMAC */
+} hash_state;
+
+static int hash_init(hash_state *h) {
+	if(h->key != NULL) {
+		return EVP_DigestSignInit(h->ctx, NULL, h->md, NULL, h->key) == 1;
+	}
+
+	return EVP_DigestInit_ex(h->ctx, h->md, NULL) == 1;
+}
+
+static hash_state *new_hash_state(lua_State *L, int which) {
+	hash_state *h = lua_newuserdata(L, sizeof(hash_state));
+	h->ctx = NULL;
+	h->md = get_md(which);
+	h->key = NULL;
+
+	luaL_getmetatable(L, HASH_MT);
+	lua_setmetatable(L, -2);
+
+	h->ctx = EVP_MD_CTX_new();
+
+	if(h->ctx == NULL) {
+		luaL_error(L, "not enough memory");
+	}
+
+	return h;
+}
+
+/*
+ * Start a hash
+ * (string) -> hash
+ */
+static int Lhash_new(lua_State *L) {
+	hash_state *h = new_hash_state(L, luaL_checkoption(L, 1, NULL, md_names));
+
+	if(!hash_init(h)) {
+		return luaL_error(L, ERR_error_string(ERR_get_error(), NULL));
+	}
+
+	return 1;
+}
+
+/*
+ * Start a HMAC
+ * (string, string) -> hash
+ */
+static int Lhmac_new(lua_State *L) {
+	int which = luaL_checkoption(L, 1, NULL, md_names);
+	size_t key_len;
+	const char *key = luaL_checklstring(L, 2, &key_len);
+	hash_state *h = new_hash_state(L, which);
+
+	h->key = EVP_PKEY_new_raw_private_key(EVP_PKEY_HMAC, NULL, (const unsigned char *)key, key_len);
+
+	if(h->key == NULL || !hash_init(h)) {
+		return luaL_error(L, ERR_error_string(ERR_get_error(), NULL));
+	}
+
+	return 1;
+}
+
+/*
+ * Feed data into the hash
+ * (hash, string) -> hash
+ */
+static int Lhash_update(lua_State *L) {
+	hash_state *h = luaL_checkudata(L, 1, HASH_MT);
+	size_t len;
+	const char *s = luaL_checklstring(L, 2, &len);
+	int ok;
+
+	if(h->key != NULL) {
+		ok = EVP_DigestSignUpdate(h->ctx, s, len);
+	} else {
+		ok = EVP_DigestUpdate(h->ctx, s, len);
+	}
+
+	if(ok != 1) {
+		return luaL_error(L, ERR_error_string(ERR_get_error(), NULL));
+	}
+
+	lua_settop(L, 1);
+	return 1;
+}
+
+/*
+ * Get the digest, after which the hash starts over with the same settings
+ * (hash, boolean?) -> string
+ */
+static int Lhash_final(lua_State *L) {
+	hash_state *h = luaL_checkudata(L, 1, HASH_MT);
+	int hex_out = lua_toboolean(L, 2);
+	unsigned char hash[EVP_MAX_MD_SIZE], result[EVP_MAX_MD_SIZE * 2];
+	size_t size = EVP_MAX_MD_SIZE;
+	int ok;
+
+	if(h->key != NULL) {
+		ok = EVP_DigestSignFinal(h->ctx, hash, &size);
+	} else {
+		unsigned int md_size = EVP_MAX_MD_SIZE;
+		ok = EVP_DigestFinal_ex(h->ctx, hash, &md_size);
+		size = md_size;
+	}
+
+	if(ok != 1 || !hash_init(h)) {
+		return luaL_error(L, ERR_error_string(ERR_get_error(), NULL));
+	}
+
+	if(hex_out) {
+		toHex(hash, size, result);
+		lua_pushlstring(L, (char *)result, size * 2);
+	} else {
+		lua_pushlstring(L, (char *)hash, size);
+	}
+
+	return 1;
+}
+
+static int Lhash_tostring(lua_State *L) {
+	hash_state *h = luaL_checkudata(L, 1, HASH_MT);
+	lua_pushfstring(L, "%s: %p", h->key ? "hmac" : "hash", h);
+	return 1;
+}
+
+static int Lhash_gc(lua_State *L) {
+	hash_state *h = luaL_checkudata(L, 1, HASH_MT);
+
+	if(h->ctx != NULL) {
+		EVP_MD_CTX_free(h->ctx);
+		h->ctx = NULL;
+	}
+
+	if(h->key != NULL) {
+		EVP_PKEY_free(h->key);
+		h->key = NULL;
+	}
+
+	return 0;
+}
+
 static const luaL_Reg Reg[] = {
 	{ "sha1",		Lsha1		},
 	{ "sha224",		Lsha224		},
@@ -310,11 +519,32 @@ static const luaL_Reg Reg[] = {
 	{ "hkdf_hmac_sha256",   Lhkdf_sha256    },
 	{ "hkdf_hmac_sha384",   Lhkdf_sha384    },
 	{ "equals",             Lhash_equals    },
+	{ "new",                Lhash_new       },
+	{ "hmac_new",           Lhmac_new       },
 	{ NULL,			NULL		}
 };
 
 LUALIB_API int luaopen_prosody_util_hashes(lua_State *L) {
 	luaL_checkversion(L);
+
+	if(luaL_newmetatable(L, HASH_MT)) {
+		lua_pushcfunction(L, Lhash_tostring);
+		lua_setfield(L, -2, "__tostring");
+		lua_pushcfunction(L, Lhash_gc);
+		lua_setfield(L, -2, "__gc");
+
+		lua_createtable(L, 0, 2); /* __index */
+		{
+			lua_pushcfunction(L, Lhash_update);
+			lua_setfield(L, -2, "update");
+			lua_pushcfunction(L, Lhash_final);
+			lua_setfield(L, -2, "final");
+		}
+		lua_setfield(L, -2, "__index");
+	}
+
+	lua_pop(L, 1);
+
 	lua_newtable(L);
 	luaL_setfuncs(L, Reg, 0);
 	lua_pushliteral(L, "-3.14");
@@ -0,0 +1,346 @@
+/*
+ * Sets of IP address prefixes
+ *
+ * A path compressed binary trie over packed addresses as returned by
+ * util.net.pton(). IPv4 prefixes are stored as IPv4-mapped IPv6 so that one
+ * trie holds both families and a lookup walks at most 128 bits.
+ *
+ * This project is MIT licensed. Please see the
+ * COPYING file in the source package for more information.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#if (LUA_VERSION_NUM < 504)
+#define luaL_pushfail lua_pushnil
+#endif
+
+#define TRIE_MT "util.iptrie"
+
+#define ADDR_BYTES 16
+#define ADDR_BITS (ADDR_BYTES * 8)
+#define V4_OFFSET 96
+#define NO_NODE UINT32_MAX
+
+typedef struct {
+	unsigned char key[ADDR_BYTES]; /* bits past `bits` are zero */
+	unsigned char bits;
+	unsigned char added; /* prefix length as added plus one, or 0 */
+	uint32_t child[2];
+} trie_node;
+
+typedef struct {
+	trie_node *nodes;
+	uint32_t count; /* nodes in use, node 0 is the root */
+	uint32_t alloc;
+	size_t prefixes;
+} iptrie;
+
+static const unsigned char v4mapped[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+
+static int get_bit(const unsigned char *key, unsigned int n) {
+	return (key[n / 8] >> (7 - n % 8)) & 1;
+}
+
+/* Number of leading bits two keys share, up to `max` */
+static unsigned int common_prefix_bits(const unsigned char *a, const unsigned char *b, unsigned int max) {
+	unsigned int i, n = 0;
+
+	for(i = 0; i < ADDR_BYTES && n < max; i++) {
+		unsigned char diff = a[i] ^ b[i];
+
+		if(diff) {
+			while(!(diff & 0x80)) {
+				diff <<= 1;
+				n++;
+			}
+
+			break;
+		}
+
+		n += 8;
+	}
+
+	return n < max ? n : max;
+}
+
+static void mask_key(unsigned char *key, unsigned int bits) {
+	unsigned int i = bits / 8;
+
+	if(bits % 8) {
+		key[i] &= 0xff << (8 - bits % 8);
+		i++;
+	}
+
+	memset(key + i, 0, ADDR_BYTES - i);
+}
+
+/*
+ * Read a packed address argument into a 16 byte key
+ * Returns the offset of its bits in the key, or -1 if it is not an address
+ */
+static int check_address(lua_State *L, int idx, unsigned char *key) {
+	size_t len;
+	const char *packed = luaL_checklstring(L, idx, &len);
+
+	if(len == ADDR_BYTES) {
+		memcpy(key, packed, ADDR_BYTES);
+		return 0;
+	} else if(len == 4) {
+		memcpy(key, v4mapped, sizeof(v4mapped));
+		memcpy(key + sizeof(v4mapped), packed, 4);
+		return V4_OFFSET;
+	}
+
+	return -1;
+}
+
+static uint32_t new_node(iptrie *t, const unsigned char *key, unsigned int bits) {
+	trie_node *n;
+
+	if(t->count == t->alloc) {
+		uint32_t alloc = t->alloc * 2;
+		trie_node *nodes = realloc(t->nodes, alloc * sizeof(trie_node));
+
+		if(nodes == NULL) {
+			return NO_NODE;
+		}
+
+		t->nodes = nodes;
+		t->alloc = alloc;
+	}
+
+	n = &t->nodes[t->count];
+	memcpy(n->key, key, ADDR_BYTES);
+	mask_key(n->key, bits);
+	n->bits = bits;
+	n->added = 0;
+	n->child[0] = n->child[1] = NO_NODE;
+	return t->count++;
+}
+
+/* Returns 0 if out of memory */
+static int trie_insert(iptrie *t, const unsigned char *key, unsigned int bits, unsigned int added) {
+	uint32_t n = 0, c, m, leaf;
+	unsigned int cp;
+	int b;
+
+	while(1) {
+		if(t->nodes[n].bits == bits) {
+			if(!t->nodes[n].added) {
+				t->prefixes++;
+			}
+
+			t->nodes[n].added = added + 1;
+			return 1;
+		}
+
+		b = get_bit(key, t->nodes[n].bits);
+		c = t->nodes[n].child[b];
+
+		if(c == NO_NODE) {
+			leaf = new_node(t, key, bits);
+
+			if(leaf == NO_NODE) {
+				return 0;
+			}
+
+			t->nodes[leaf].added = added + 1;
+			t->nodes[n].child[b] = leaf;
+			t->prefixes++;
+			return 1;
+		}
+
+		cp = common_prefix_bits(t->nodes[c].key, key, t->nodes[c].bits < bits ? t->nodes[c].bits : bits);
+
+		if(cp == t->nodes[c].bits) {
+			n = c;
+			continue;
+		}
+
+		/* Split the edge to the child where the prefixes part */
+		m = new_node(t, key, cp);
+
+		if(m == NO_NODE) {
+			return 0;
+		}
+
+		t->nodes[m].child[get_bit(t->nodes[c].key, cp)] = c;
+		t->nodes[n].child[b] = m;
+
+		if(cp == bits) {
+			t->nodes[m].added = added + 1;
+		} else {
+			leaf = new_node(t, key, bits);
+
+			if(leaf == NO_NODE) {
+				return 0;
+			}
+
+			t->nodes[leaf].added = added + 1;
+			t->nodes[m].child[get_bit(key, cp)] = leaf;
+		}
+
+		t->prefixes++;
+		return 1;
+	}
+}
+
+/* The node of the longest prefix containing the key, or NO_NODE */
+static uint32_t trie_lookup(const iptrie *t, const unsigned char *key) {
+	uint32_t n = 0, best = NO_NODE;
+
+	while(n != NO_NODE) {
+		const trie_node *node = &t->nodes[n];
+
+		if(common_prefix_bits(node->key, key, node->bits) < node->bits) {
+			break;
+		}
+
+		if(node->added) {
+			best = n;
+		}
+
+		if(node->bits == ADDR_BITS) {
+			break;
+		}
+
+		n = node->child[get_bit(key, node->bits)];
+	}
+
+	return best;
+}
+
+/*
+ * Add a prefix
+ * (trie, string, integer?) -> true
+ *
+ * Takes a packed address and the prefix length, which defaults to the whole
+ * address.
+ */
+static int Ladd(lua_State *L) {
+	iptrie *t = luaL_checkudata(L, 1, TRIE_MT);
+	unsigned char key[ADDR_BYTES];
+	int offset = check_address(L, 2, key);
+	lua_Integer bits;
+
+	luaL_argcheck(L, offset >= 0, 2, "packed IPv4 or IPv6 address expected");
+	bits = luaL_optinteger(L, 3, ADDR_BITS - offset);
+	luaL_argcheck(L, bits >= 0 && bits <= ADDR_BITS - offset, 3, "prefix length out of range");
+
+	if(!trie_insert(t, key, bits + offset, bits)) {
+		return luaL_error(L, "not enough memory");
+	}
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/*
+ * Find the longest prefix containing an address
+ * (trie, string) -> integer?
+ *
+ * Returns the length of the matching prefix as it was added, or nil.
+ */
+static int Llookup(lua_State *L) {
+	iptrie *t = luaL_checkudata(L, 1, TRIE_MT);
+	unsigned char key[ADDR_BYTES];
+	int offset = check_address(L, 2, key);
+	uint32_t n;
+
+	luaL_argcheck(L, offset >= 0, 2, "packed IPv4 or IPv6 address expected");
+
+	n = trie_lookup(t, key);
+
+	if(n == NO_NODE) {
+		luaL_pushfail(L);
+		return 1;
+	}
+
+	lua_pushinteger(L, t->nodes[n].added - 1);
+	return 1;
+}
+
+static int Llength(lua_State *L) {
+	iptrie *t = luaL_checkudata(L, 1, TRIE_MT);
+	lua_pushinteger(L, t->prefixes);
+	return 1;
+}
+
+static int Ltostring(lua_State *L) {
+	iptrie *t = luaL_checkudata(L, 1, TRIE_MT);
+	lua_pushfstring(L, "iptrie: %p %d prefixes", t, (int)t->prefixes);
+	return 1;
+}
+
+static int Lgc(lua_State *L) {
+	iptrie *t = luaL_checkudata(L, 1, TRIE_MT);
+	free(t->nodes);
+	t->nodes = NULL;
+	t->count = t->alloc = 0;
+	return 0;
+}
+
+/*
+ * Create an empty trie
+ * () -> trie
+ */
+static int Lnew(lua_State *L) {
+	unsigned char root[ADDR_BYTES] = { 0 };
+	iptrie *t = lua_newuserdata(L, sizeof(iptrie));
+
+	t->nodes = NULL;
+	t->count = t->alloc = 0;
+	t->prefixes = 0;
+
+	luaL_getmetatable(L, TRIE_MT);
+	lua_setmetatable(L, -2);
+
+	t->nodes = malloc(16 * sizeof(trie_node));
+
+	if(t->nodes == NULL) {
+		return luaL_error(L, "not enough memory");
+	}
+
+	t->alloc = 16;
+	new_node(t, root, 0);
+	return 1;
+}
+
+int luaopen_prosody_util_iptrie(lua_State *L) {
+	luaL_checkversion(L);
+
+	if(luaL_newmetatable(L, TRIE_MT)) {
+		lua_pushcfunction(L, Ltostring);
+		lua_setfield(L, -2, "__tostring");
+		lua_pushcfunction(L, Llength);
+		lua_setfield(L, -2, "__len");
+		lua_pushcfunction(L, Lgc);
+		lua_setfield(L, -2, "__gc");
+
+		lua_createtable(L, 0, 3); /* __index */
+		{
+			lua_pushcfunction(L, Ladd);
+			lua_setfield(L, -2, "add");
+			lua_pushcfunction(L, Llookup);
+			lua_setfield(L, -2, "lookup");
+			lua_pushcfunction(L, Llength);
+			lua_setfield(L, -2, "length");
+		}
+		lua_setfield(L, -2, "__index");
+	}
+
+	lua_createtable(L, 0, 1);
+	lua_pushcfunction(L, Lnew);
+	lua_setfield(L, -2, "new");
+	return 1;
+}
+
+int luaopen_util_iptrie(lua_State *L) {
+	return luaopen_prosody_util_iptrie(L);
+}
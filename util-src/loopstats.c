@@ -0,0 +1,258 @@
+/*
+ * Counters and histograms for the event loop
+ *
+ * Kept in fixed static arrays so that recording a sample is a clock read and
+ * an increment, without touching the Lua heap. Histograms have fixed bucket
+ * bounds, the counts are per bucket and only made cumulative when read.
+ *
+ * This project is MIT licensed. Please see the
+ * COPYING file in the source package for more information.
+ */
+
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+enum {
+	LS_WAIT,     /* time spent blocked in poll:wait */
+	LS_EVENTS,   /* events returned per wait */
+	LS_READABLE, /* time spent in onreadable callbacks */
+	LS_WRITABLE, /* time spent in onwritable callbacks */
+	LS_TIMER,    /* time spent in timer callbacks */
+	LS_HISTOGRAMS
+};
+
+enum {
+	LS_BYTES_READ,
+	LS_BYTES_WRITTEN,
+	LS_SHORT_WRITES,
+	LS_COUNTERS
+};
+
+#define LS_MAX_BOUNDS 12
+
+static const double time_bounds[] = { 1e-6, 1e-5, 1e-4, 1e-3, 1e-2, 1e-1, 1, 10 };
+static const double event_bounds[] = { 0, 1, 2, 4, 8, 16, 32, 64, 128, 256 };
+
+typedef struct {
+	const char *name;
+	const double *bounds;
+	size_t nbounds;
+} ls_histogram_info;
+
+static const ls_histogram_info histogram_info[LS_HISTOGRAMS] = {
+	{ "wait", time_bounds, sizeof(time_bounds) / sizeof(double) },
+	{ "events", event_bounds, sizeof(event_bounds) / sizeof(double) },
+	{ "onreadable", time_bounds, sizeof(time_bounds) / sizeof(double) },
+	{ "onwritable", time_bounds, sizeof(time_bounds) / sizeof(double) },
+	{ "timer", time_bounds, sizeof(time_bounds) / sizeof(double) },
+};
+
+static const char *const counter_names[LS_COUNTERS] = {
+	"bytes_read", "bytes_written", "short_writes",
+};
+
+typedef struct {
+	uint64_t buckets[LS_MAX_BOUNDS + 1]; /* the last one is +Inf */
+	uint64_t count;
+	double sum;
+} ls_histogram;
+
+static ls_histogram histograms[LS_HISTOGRAMS];
+static uint64_t counters[LS_COUNTERS];
+
+static double clock_now(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static void observe(int id, double value) {
+	const ls_histogram_info *info = &histogram_info[id];
+	ls_histogram *h = &histograms[id];
+	size_t i = 0;
+
+	while(i < info->nbounds && value > info->bounds[i]) {
+		i++;
+	}
+
+	h->buckets[i]++;
+	h->count++;
+	h->sum += value;
+}
+
+static int check_histogram(lua_State *L, int idx) {
+	lua_Integer id = luaL_checkinteger(L, idx);
+	luaL_argcheck(L, id >= 1 && id <= LS_HISTOGRAMS, idx, "unknown histogram");
+	return (int)id - 1;
+}
+
+static int check_counter(lua_State *L, int idx) {
+	lua_Integer id = luaL_checkinteger(L, idx);
+	luaL_argcheck(L, id >= 1 && id <= LS_COUNTERS, idx, "unknown counter");
+	return (int)id - 1;
+}
+
+/*
+ * Read the clock used for durations
+ * () -> number
+ */
+static int Lclock(lua_State *L) {
+	lua_pushnumber(L, clock_now());
+	return 1;
+}
+
+/*
+ * Record the time since a reading of clock()
+ * (integer, number) -> ()
+ */
+static int Lduration(lua_State *L) {
+	int id = check_histogram(L, 1);
+	double started = luaL_checknumber(L, 2);
+	observe(id, clock_now() - started);
+	return 0;
+}
+
+/*
+ * Record a value
+ * (integer, number) -> ()
+ */
+static int Lobserve(lua_State *L) {
+	int id = check_histogram(L, 1);
+	observe(id, luaL_checknumber(L, 2));
+	return 0;
+}
+
+/*
+ * Increment a counter
+ * (integer, integer?) -> ()
+ */
+static int Ladd(lua_State *L) {
+	int id = check_counter(L, 1);
+	lua_Integer n = luaL_optinteger(L, 2, 1);
+	luaL_argcheck(L, n >= 0, 2, "counters only go up");
+	counters[id] += (uint64_t)n;
+	return 0;
+}
+
+/*
+ * Read a counter
+ * (integer) -> integer
+ */
+static int Lcounter(lua_State *L) {
+	int id = check_counter(L, 1);
+	lua_pushinteger(L, (lua_Integer)counters[id]);
+	return 1;
+}
+
+/*
+ * Read a histogram
+ * (integer) -> integer, number, { integer }
+ *
+ * Returns the number of samples, their sum and the cumulative count for each
+ * bucket, in the order of bounds() followed by +Inf.
+ */
+static int Lhistogram(lua_State *L) {
+	int id = check_histogram(L, 1);
+	const ls_histogram *h = &histograms[id];
+	size_t i, n = histogram_info[id].nbounds;
+	uint64_t total = 0;
+
+	lua_pushinteger(L, (lua_Integer)h->count);
+	lua_pushnumber(L, h->sum);
+	lua_createtable(L, (int)n + 1, 0);
+
+	for(i = 0; i <= n; i++) {
+		total += h->buckets[i];
+		lua_pushinteger(L, (lua_Integer)total);
+		lua_rawseti(L, -2, (lua_Integer)i + 1);
+	}
+
+	return 3;
+}
+
+/*
+ * Upper bounds of the buckets of a histogram, without +Inf
+ * (integer) -> { number }
+ */
+static int Lbounds(lua_State *L) {
+	int id = check_histogram(L, 1);
+	size_t i, n = histogram_info[id].nbounds;
+
+	lua_createtable(L, (int)n, 0);
+
+	for(i = 0; i < n; i++) {
+		lua_pushnumber(L, histogram_info[id].bounds[i]);
+		lua_rawseti(L, -2, (lua_Integer)i + 1);
+	}
+
+	return 1;
+}
+
+/*
+ * Zero everything
+ * () -> ()
+ */
+static int Lreset(lua_State *L) {
+	(void)L;
+	memset(histograms, 0, sizeof(histograms));
+	memset(counters, 0, sizeof(counters));
+	return 0;
+}
+
+int luaopen_prosody_util_loopstats(lua_State *L) {
+	int i;
+
+	luaL_checkversion(L);
+
+	lua_createtable(L, 0, 10);
+	{
+		lua_pushcfunction(L, Lclock);
+		lua_setfield(L, -2, "clock");
+		lua_pushcfunction(L, Lduration);
+		lua_setfield(L, -2, "duration");
+		lua_pushcfunction(L, Lobserve);
+		lua_setfield(L, -2, "observe");
+		lua_pushcfunction(L, Ladd);
+		lua_setfield(L, -2, "add");
+		lua_pushcfunction(L, Lcounter);
+		lua_setfield(L, -2, "counter");
+		lua_pushcfunction(L, Lhistogram);
+		lua_setfield(L, -2, "histogram");
+		lua_pushcfunction(L, Lbounds);
+		lua_setfield(L, -2, "bounds");
+		lua_pushcfunction(L, Lreset);
+		lua_setfield(L, -2, "reset");
+
+		/* name -> id, for histograms and counters */
+		lua_createtable(L, 0, LS_HISTOGRAMS);
+
+		for(i = 0; i < LS_HISTOGRAMS; i++) {
+			lua_pushinteger(L, i + 1);
+			lua_setfield(L, -2, histogram_info[i].name);
+		}
+
+		lua_setfield(L, -2, "histograms");
+
+		lua_createtable(L, 0, LS_COUNTERS);
+
+		for(i = 0; i < LS_COUNTERS; i++) {
+			lua_pushinteger(L, i + 1);
+			lua_setfield(L, -2, counter_names[i]);
+		}
+
+		lua_setfield(L, -2, "counters");
+	}
+	return 1;
+}
+
+int luaopen_util_loopstats(lua_State *L) {
+	return luaopen_prosody_util_loopstats(L);
+}
@@ -189,16 +189,445 @@ static int lc_ntop(lua_State *L) {
 	return 1;
 }
 
+#ifndef _WIN32
+/*
+ * Batched datagram I/O
+ *
+ * A set of buffers for receiving or sending a number of datagrams with one
+ * recvmmsg(2) or sendmmsg(2) call, allocated once and reused. Elsewhere it
+ * falls back to a loop of recvmsg(2) or sendmsg(2), one per datagram.
+ */
+#define DGRAM_MT "util.net.datagrams"
+#define DGRAM_MAX_COUNT 1024
+#define DGRAM_MAX_SIZE 65536
+
+#if defined(__linux__)
+typedef struct mmsghdr dgram_msg;
+#else
+typedef struct {
+	struct msghdr msg_hdr;
+	unsigned int msg_len;
+} dgram_msg;
+#endif
+
+typedef struct {
+	unsigned int count;
+	size_t size;
+	dgram_msg *msgs;
+	struct iovec *iov;
+	struct sockaddr_storage *addrs;
+	char *buffers;
+} datagrams;
+
+static int dgram_recv(int fd, dgram_msg *msgs, unsigned int n) {
+#if defined(__linux__)
+	int r;
+
+	do {
+		r = recvmmsg(fd, msgs, n, MSG_DONTWAIT, NULL);
+	} while(r < 0 && errno == EINTR);
+
+	return r;
+#else
+	unsigned int i;
+
+	for(i = 0; i < n; i++) {
+		ssize_t r;
+
+		do {
+			r = recvmsg(fd, &msgs[i].msg_hdr, MSG_DONTWAIT);
+		} while(r < 0 && errno == EINTR);
+
+		if(r < 0) {
+			return i > 0 ? (int)i : -1;
+		}
+
+		msgs[i].msg_len = (unsigned int)r;
+	}
+
+	return (int)n;
+#endif
+}
+
+static int dgram_send(int fd, dgram_msg *msgs, unsigned int n) {
+#if defined(__linux__)
+	int r;
+
+	do {
+		r = sendmmsg(fd, msgs, n, MSG_DONTWAIT);
+	} while(r < 0 && errno == EINTR);
+
+	return r;
+#else
+	unsigned int i;
+
+	for(i = 0; i < n; i++) {
+		ssize_t r;
+
+		do {
+			r = sendmsg(fd, &msgs[i].msg_hdr, MSG_DONTWAIT);
+		} while(r < 0 && errno == EINTR);
+
+		if(r < 0) {
+			return i > 0 ? (int)i : -1;
+		}
+
+		msgs[i].msg_len = (unsigned int)r;
+	}
+
+	return (int)n;
+#endif
+}
+
+static void dgram_prepare(datagrams *d, unsigned int i, void *data, size_t len, int with_addr) {
+	struct msghdr *h = &d->msgs[i].msg_hdr;
+
+	d->iov[i].iov_base = data;
+	d->iov[i].iov_len = len;
+	memset(h, 0, sizeof(struct msghdr));
+	h->msg_iov = &d->iov[i];
+	h->msg_iovlen = 1;
+
+	if(with_addr) {
+		h->msg_name = &d->addrs[i];
+		h->msg_namelen = sizeof(struct sockaddr_storage);
+	}
+}
+
+/*
+ * Push the address a datagram came from and store its port
+ * Returns 0 and pushes nothing for unknown address families
+ */
+static int dgram_push_addr(lua_State *L, const struct sockaddr_storage *sa, int *port) {
+	char buf[INET6_ADDRSTRLEN];
+	const void *addr;
+
+	if(sa->ss_family == AF_INET) {
+		const struct sockaddr_in *in = (const struct sockaddr_in *)sa;
+		addr = &in->sin_addr;
+		*port = ntohs(in->sin_port);
+	} else if(sa->ss_family == AF_INET6) {
+		const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)sa;
+		addr = &in6->sin6_addr;
+		*port = ntohs(in6->sin6_port);
+	} else {
+		return 0;
+	}
+
+	if(!inet_ntop(sa->ss_family, addr, buf, sizeof(buf))) {
+		return 0;
+	}
+
+	lua_pushstring(L, buf);
+	return 1;
+}
+
+/* Fill in the destination of a datagram from an address string and port */
+static int dgram_check_addr(lua_State *L, int idx, int port, struct sockaddr_storage *sa) {
+	const char *ip = lua_tostring(L, idx);
+
+	memset(sa, 0, sizeof(struct sockaddr_storage));
+
+	if(ip == NULL || port < 0 || port > 65535) {
+		return 0;
+	}
+
+	if(inet_pton(AF_INET, ip, &((struct sockaddr_in *)sa)->sin_addr) == 1) {
+		struct sockaddr_in *in = (struct sockaddr_in *)sa;
+		in->sin_family = AF_INET;
+		in->sin_port = htons(port);
+		return sizeof(struct sockaddr_in);
+	}
+
+	if(inet_pton(AF_INET6, ip, &((struct sockaddr_in6 *)sa)->sin6_addr) == 1) {
+		struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)sa;
+		in6->sin6_family = AF_INET6;
+		in6->sin6_port = htons(port);
+		return sizeof(struct sockaddr_in6);
+	}
+
+	return 0;
+}
+
+static int push_errno(lua_State *L, int err) {
+	luaL_pushfail(L);
+	lua_pushstring(L, strerror(err));
+	lua_pushinteger(L, err);
+	return 3;
+}
+
+/*
+ * Receive the datagrams waiting on a socket, up to the size of the set
+ * (datagrams, fd, { string }, { string }?, { integer }?) -> integer
+ *
+ * Stores each datagram in the first table, and where it came from in the
+ * other two if given, false if not an IP address. Returns how many were
+ * received, 0 if none were waiting, or nil, strerror, errno. Datagrams
+ * longer than the buffers are truncated.
+ */
+static int Ldgram_recv(lua_State *L) {
+	datagrams *d = luaL_checkudata(L, 1, DGRAM_MT);
+	int fd = luaL_checkinteger(L, 2);
+	int with_addr = !lua_isnoneornil(L, 4);
+	int with_port = !lua_isnoneornil(L, 5);
+	unsigned int i;
+	int n;
+
+	luaL_checktype(L, 3, LUA_TTABLE);
+
+	if(with_addr) {
+		luaL_checktype(L, 4, LUA_TTABLE);
+	}
+
+	if(with_port) {
+		luaL_checktype(L, 5, LUA_TTABLE);
+	}
+
+	for(i = 0; i < d->count; i++) {
+		dgram_prepare(d, i, d->buffers + i * d->size, d->size, with_addr || with_port);
+	}
+
+	n = dgram_recv(fd, d->msgs, d->count);
+
+	if(n < 0) {
+		if(errno == EAGAIN || errno == EWOULDBLOCK) {
+			lua_pushinteger(L, 0);
+			return 1;
+		}
+
+		return push_errno(L, errno);
+	}
+
+	for(i = 0; i < (unsigned int)n; i++) {
+		size_t len = d->msgs[i].msg_len;
+		lua_pushlstring(L, d->buffers + i * d->size, len < d->size ? len : d->size);
+		lua_rawseti(L, 3, i + 1);
+
+		if(with_addr || with_port) {
+			int port = 0;
+			int known = dgram_push_addr(L, &d->addrs[i], &port);
+
+			if(!known) {
+				lua_pushboolean(L, 0);
+			}
+
+			if(with_addr) {
+				lua_rawseti(L, 4, i + 1);
+			} else {
+				lua_pop(L, 1);
+			}
+
+			if(with_port) {
+				if(known) {
+					lua_pushinteger(L, port);
+				} else {
+					lua_pushboolean(L, 0);
+				}
+
+				lua_rawseti(L, 5, i + 1);
+			}
+		}
+	}
+
+	lua_pushinteger(L, n);
+	return 1;
+}
+
+/*
+ * Send a batch of datagrams, up to the size of the set
+ * (datagrams, fd, { string }, { string }?, { integer }?, integer?) -> integer
+ *
+ * Sends the first n (default all) strings of the table, each to the address
+ * and port at the same index of the other two, or to the connected peer
+ * without them. Returns how many were sent, 0 if the socket would block,
+ * or nil, strerror, errno.
+ */
+static int Ldgram_send(lua_State *L) {
+	datagrams *d = luaL_checkudata(L, 1, DGRAM_MT);
+	int fd = luaL_checkinteger(L, 2);
+	int with_addr = !lua_isnoneornil(L, 4);
+	lua_Integer count;
+	unsigned int i;
+	int n;
+
+	luaL_checktype(L, 3, LUA_TTABLE);
+
+	if(with_addr) {
+		luaL_checktype(L, 4, LUA_TTABLE);
+		luaL_checktype(L, 5, LUA_TTABLE);
+	}
+
+	count = luaL_optinteger(L, 6, (lua_Integer)lua_rawlen(L, 3));
+	luaL_argcheck(L, count >= 0, 6, "non-negative integer expected");
+
+	if(count > (lua_Integer)d->count) {
+		count = d->count;
+	}
+
+	if(count == 0) {
+		lua_pushinteger(L, 0);
+		return 1;
+	}
+
+	for(i = 0; i < (unsigned int)count; i++) {
+		size_t len;
+		const char *data;
+
+		/*
+		 * The strings stay referenced by the table during the call. Numbers
+		 * are not converted, the string made from one would not be.
+		 */
+		lua_rawgeti(L, 3, i + 1);
+
+		if(lua_type(L, -1) != LUA_TSTRING) {
+			return luaL_error(L, "string expected at index %d", (int)i + 1);
+		}
+
+		data = lua_tolstring(L, -1, &len);
+		lua_pop(L, 1);
+
+		dgram_prepare(d, i, (void *)data, len, with_addr);
+
+		if(with_addr) {
+			int port, namelen, isnum;
+
+			lua_rawgeti(L, 5, i + 1);
+			port = (int)lua_tointegerx(L, -1, &isnum);
+			lua_rawgeti(L, 4, i + 1);
+			namelen = isnum ? dgram_check_addr(L, -1, port, &d->addrs[i]) : 0;
+			lua_pop(L, 2);
+
+			if(namelen == 0) {
+				return luaL_error(L, "invalid address or port at index %d", (int)i + 1);
+			}
+
+			d->msgs[i].msg_hdr.msg_namelen = namelen;
+		}
+	}
+
+	n = dgram_send(fd, d->msgs, (unsigned int)count);
+
+	if(n < 0) {
+		if(errno == EAGAIN || errno == EWOULDBLOCK) {
+			lua_pushinteger(L, 0);
+			return 1;
+		}
+
+		return push_errno(L, errno);
+	}
+
+	lua_pushinteger(L, n);
+	return 1;
+}
+
+static int Ldgram_len(lua_State *L) {
+	datagrams *d = luaL_checkudata(L, 1, DGRAM_MT);
+	lua_pushinteger(L, d->count);
+	return 1;
+}
+
+static int Ldgram_tostring(lua_State *L) {
+	datagrams *d = luaL_checkudata(L, 1, DGRAM_MT);
+	lua_pushfstring(L, "datagrams: %p %d x %d bytes", d, (int)d->count, (int)d->size);
+	return 1;
+}
+
+/*
+ * Create a set of buffers for batched datagram I/O
+ * (integer?, integer?) -> datagrams
+ *
+ * Room for the given number of datagrams (default 32) of up to the given
+ * size each (default 2048).
+ */
+static int lc_datagrams(lua_State *L) {
+	lua_Integer count = luaL_optinteger(L, 1, 32);
+	lua_Integer size = luaL_optinteger(L, 2, 2048);
+	datagrams *d;
+	char *p;
+
+	luaL_argcheck(L, count >= 1 && count <= DGRAM_MAX_COUNT, 1, "number of datagrams out of range");
+	luaL_argcheck(L, size >= 1 && size <= DGRAM_MAX_SIZE, 2, "datagram size out of range");
+
+	/* Everything in one block, the arrays in order of alignment */
+	d = lua_newuserdata(L, sizeof(datagrams) + count * (sizeof(dgram_msg)
+	                    + sizeof(struct sockaddr_storage) + sizeof(struct iovec) + size));
+	p = (char *)(d + 1);
+	d->count = (unsigned int)count;
+	d->size = (size_t)size;
+	d->addrs = (struct sockaddr_storage *)p;
+	p += count * sizeof(struct sockaddr_storage);
+	d->msgs = (dgram_msg *)p;
+	p += count * sizeof(dgram_msg);
+	d->iov = (struct iovec *)p;
+	p += count * sizeof(struct iovec);
+	d->buffers = p;
+
+	luaL_getmetatable(L, DGRAM_MT);
+	lua_setmetatable(L, -2);
+	return 1;
+}
+
+#if defined(SO_PEERCRED)
+/*
+ * Credentials of the process on the other end of a unix socket
+ * (integer) -> integer, integer, integer
+ *
+ * Returns the pid, uid and gid of the peer as of when it connected,
+ * or nil, strerror, errno.
+ */
+static int lc_peercred(lua_State *L) {
+	int fd = luaL_checkinteger(L, 1);
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if(getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0) {
+		return push_errno(L, errno);
+	}
+
+	lua_pushinteger(L, cred.pid);
+	lua_pushinteger(L, cred.uid);
+	lua_pushinteger(L, cred.gid);
+	return 3;
+}
+#endif
+#endif
+
 int luaopen_prosody_util_net(lua_State *L) {
 	luaL_checkversion(L);
 	luaL_Reg exports[] = {
 		{ "local_addresses", lc_local_addresses },
 		{ "pton", lc_pton },
 		{ "ntop", lc_ntop },
+#ifndef _WIN32
+		{ "datagrams", lc_datagrams },
+#if defined(SO_PEERCRED)
+		{ "peercred", lc_peercred },
+#endif
+#endif
 		{ NULL, NULL }
 	};
 
-	lua_createtable(L, 0, 1);
+#ifndef _WIN32
+	if(luaL_newmetatable(L, DGRAM_MT)) {
+		lua_pushcfunction(L, Ldgram_tostring);
+		lua_setfield(L, -2, "__tostring");
+		lua_pushcfunction(L, Ldgram_len);
+		lua_setfield(L, -2, "__len");
+
+		lua_createtable(L, 0, 2); /* __index */
+		{
+			lua_pushcfunction(L, Ldgram_recv);
+			lua_setfield(L, -2, "recv");
+			lua_pushcfunction(L, Ldgram_send);
+			lua_setfield(L, -2, "send");
+		}
+		lua_setfield(L, -2, "__index");
+	}
+
+	lua_pop(L, 1);
+#endif
+
+	lua_createtable(L, 0, 4);
 	luaL_setfuncs(L, exports, 0);
 	return 1;
 }
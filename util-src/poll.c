@@ -8,10 +8,21 @@
  *
  */
 
+/*
+ * The io_uring backend is opt-in, build with -DUSE_IO_URING to enable it.
+ * It requires Linux 5.11 or later.
+ */
+#if defined(USE_IO_URING) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
 
-#if defined(__linux__)
+#if defined(USE_IO_URING)
+#define POLL_BACKEND "io_uring"
+#elif defined(__linux__)
 #define USE_EPOLL
 #define POLL_BACKEND "epoll"
 #elif defined(__unix__)
@@ -26,9 +37,38 @@
 #include <unistd.h>
 #include <sys/epoll.h>
 #ifndef MAX_EVENTS
-/* Maximum number of returned events, retrieved into Lpoll_state */
+/* Default maximum number of returned events, retrieved into Lpoll_state */
+#define MAX_EVENTS 256
+#endif
+/* Extra flags accepted by add() and set() */
+#ifdef EPOLLEXCLUSIVE
+#define POLL_FLAGS (EPOLLET | EPOLLONESHOT | EPOLLEXCLUSIVE)
+#else
+#define POLL_FLAGS (EPOLLET | EPOLLONESHOT)
+#endif
+#else
+#define POLL_FLAGS 0
+#endif
+#ifdef USE_IO_URING
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <linux/io_uring.h>
+#ifndef MAX_EVENTS
+/* Default maximum number of returned events, retrieved into Lpoll_state */
 #define MAX_EVENTS 256
 #endif
+#ifndef RING_ENTRIES
+/* Size of the submission queue, completions are allowed to overflow */
+#define RING_ENTRIES 256
+#endif
+/* user_data of requests we are not interested in the completion of */
+#define RING_IGNORE UINT64_MAX
 #endif
 #ifdef USE_POLL
 #include <poll.h>
@@ -50,6 +90,24 @@
 #define luaL_pushfail lua_pushnil
 #endif
 
+#ifdef USE_IO_URING
+/*
+ * Registration of an FD, indexed by FD number
+ */
+typedef struct Lpoll_watch {
+	uint32_t events;
+	uint32_t generation; /* Tells stale completions apart */
+	unsigned char registered;
+	unsigned char armed; /* Has a poll request in flight */
+	unsigned char queued; /* Is in the list of FDs to arm */
+} Lpoll_watch;
+
+typedef struct Lpoll_ready {
+	int fd;
+	uint32_t revents;
+} Lpoll_ready;
+#endif
+
 /*
  * Structure to keep state for each type of API
  */
@@ -57,7 +115,38 @@ typedef struct Lpoll_state {
 	int processed;
 #ifdef USE_EPOLL
 	int epoll_fd;
-	struct epoll_event events[MAX_EVENTS];
+	int max_events;
+	struct epoll_event events[];
+#endif
+#ifdef USE_IO_URING
+	int ring_fd;
+	unsigned to_submit;
+	/* Submission queue */
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+	/* Completion queue */
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+	/* Mappings */
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+	/* Registered FDs and those that need a poll request submitted */
+	Lpoll_watch *watched;
+	int watched_size;
+	int *pending;
+	int pending_count;
+	int pending_size;
+	int max_events;
+	Lpoll_ready events[];
 #endif
 #ifdef USE_POLL
 	nfds_t count;
@@ -73,6 +162,316 @@ typedef struct Lpoll_state {
 #endif
 } Lpoll_state;
 
+#ifdef USE_IO_URING
+/*
+ * Submit queued requests without waiting for anything
+ */
+static int ring_submit(struct Lpoll_state *state) {
+	while(state->to_submit > 0) {
+		int ret = syscall(__NR_io_uring_enter, state->ring_fd, state->to_submit, 0, 0, NULL, 0);
+
+		if(ret < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+
+			return -1;
+		}
+
+		state->to_submit -= ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Get a blank submission queue entry, flushing the queue if it is full
+ */
+static struct io_uring_sqe *ring_get_sqe(struct Lpoll_state *state) {
+	unsigned tail = *state->sq_tail;
+
+	if(tail - __atomic_load_n(state->sq_head, __ATOMIC_ACQUIRE) >= state->sq_entries) {
+		if(ring_submit(state) != 0) {
+			return NULL;
+		}
+	}
+
+	unsigned index = tail & state->sq_mask;
+	struct io_uring_sqe *sqe = &state->sqes[index];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	state->sq_array[index] = index;
+	__atomic_store_n(state->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	state->to_submit++;
+	return sqe;
+}
+
+static uint64_t ring_user_data(struct Lpoll_state *state, int fd) {
+	return ((uint64_t)state->watched[fd].generation << 32) | (uint32_t)fd;
+}
+
+/*
+ * Make room for the registration of an FD
+ */
+static int ring_grow(struct Lpoll_state *state, int fd) {
+	if(fd < state->watched_size) {
+		return 0;
+	}
+
+	int size = state->watched_size ? state->watched_size : 64;
+
+	while(size <= fd) {
+		if(size > INT_MAX / 2) {
+			return ENOMEM;
+		}
+
+		size *= 2;
+	}
+
+	Lpoll_watch *watched = realloc(state->watched, size * sizeof(Lpoll_watch));
+	int *pending = realloc(state->pending, size * sizeof(int));
+
+	if(watched != NULL) {
+		state->watched = watched;
+	}
+
+	if(pending != NULL) {
+		state->pending = pending;
+	}
+
+	if(watched == NULL || pending == NULL) {
+		return ENOMEM;
+	}
+
+	memset(&state->watched[state->watched_size], 0, (size - state->watched_size) * sizeof(Lpoll_watch));
+	state->watched_size = size;
+	state->pending_size = size;
+	return 0;
+}
+
+/*
+ * Queue an FD to have a poll request submitted on the next wait
+ */
+static void ring_queue(struct Lpoll_state *state, int fd) {
+	Lpoll_watch *watch = &state->watched[fd];
+
+	if(!watch->queued) {
+		watch->queued = 1;
+		state->pending[state->pending_count++] = fd;
+	}
+}
+
+/*
+ * Cancel the poll request in flight, if any, for an FD
+ */
+static int ring_cancel(struct Lpoll_state *state, int fd) {
+	Lpoll_watch *watch = &state->watched[fd];
+
+	if(watch->armed) {
+		struct io_uring_sqe *sqe = ring_get_sqe(state);
+
+		if(sqe == NULL) {
+			return errno;
+		}
+
+		sqe->opcode = IORING_OP_POLL_REMOVE;
+		sqe->fd = -1;
+		sqe->addr = ring_user_data(state, fd);
+		sqe->user_data = RING_IGNORE;
+		watch->armed = 0;
+	}
+
+	/* Any completion still in flight is now stale */
+	watch->generation++;
+	return 0;
+}
+
+/*
+ * Submit poll requests for all FDs that need one
+ */
+static int ring_arm(struct Lpoll_state *state) {
+	for(int i = 0; i < state->pending_count; i++) {
+		int fd = state->pending[i];
+		Lpoll_watch *watch = &state->watched[fd];
+		watch->queued = 0;
+
+		if(!watch->registered || watch->armed || watch->events == 0) {
+			continue;
+		}
+
+		struct io_uring_sqe *sqe = ring_get_sqe(state);
+
+		if(sqe == NULL) {
+			/* Try again next time */
+			int rest = state->pending_count - i;
+			memmove(state->pending, &state->pending[i], rest * sizeof(int));
+			state->pending_count = rest;
+
+			for(int j = 0; j < rest; j++) {
+				state->watched[state->pending[j]].queued = 1;
+			}
+
+			return errno;
+		}
+
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = fd;
+		sqe->poll32_events = watch->events | POLLERR | POLLHUP | POLLRDHUP;
+		sqe->user_data = ring_user_data(state, fd);
+		watch->armed = 1;
+	}
+
+	state->pending_count = 0;
+	return 0;
+}
+
+/*
+ * Collect completed poll requests into the events array
+ */
+static int ring_reap(struct Lpoll_state *state) {
+	unsigned head = *state->cq_head;
+	unsigned tail = __atomic_load_n(state->cq_tail, __ATOMIC_ACQUIRE);
+	int count = 0;
+
+	while(head != tail && count < state->max_events) {
+		struct io_uring_cqe *cqe = &state->cqes[head & state->cq_mask];
+		head++;
+
+		if(cqe->user_data == RING_IGNORE) {
+			continue;
+		}
+
+		int fd = (int)(cqe->user_data & 0xffffffff);
+		uint32_t generation = (uint32_t)(cqe->user_data >> 32);
+
+		if(fd >= state->watched_size || state->watched[fd].generation != generation) {
+			continue;
+		}
+
+		/*
+		 * Poll requests are one-shot, so re-arming on the next wait gives
+		 * the same level-triggered behaviour as the other backends
+		 */
+		state->watched[fd].armed = 0;
+		ring_queue(state, fd);
+
+		state->events[count].fd = fd;
+		state->events[count].revents = cqe->res < 0 ? POLLERR : (uint32_t)cqe->res;
+		count++;
+	}
+
+	__atomic_store_n(state->cq_head, head, __ATOMIC_RELEASE);
+	return count;
+}
+
+/*
+ * Unmap the rings and close the ring FD
+ */
+static void ring_free(struct Lpoll_state *state) {
+	if(state->sqes != NULL) {
+		munmap(state->sqes, state->sqes_size);
+		state->sqes = NULL;
+	}
+
+	if(state->cq_ring != NULL && state->cq_ring != state->sq_ring) {
+		munmap(state->cq_ring, state->cq_ring_size);
+	}
+
+	state->cq_ring = NULL;
+
+	if(state->sq_ring != NULL) {
+		munmap(state->sq_ring, state->sq_ring_size);
+		state->sq_ring = NULL;
+	}
+
+	free(state->watched);
+	state->watched = NULL;
+	state->watched_size = 0;
+	free(state->pending);
+	state->pending = NULL;
+	state->pending_size = 0;
+	state->pending_count = 0;
+}
+
+/*
+ * Set up the ring and map its queues
+ */
+static int ring_init(struct Lpoll_state *state) {
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+
+	params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+	params.cq_entries = state->max_events > RING_ENTRIES ? state->max_events * 2 : RING_ENTRIES * 2;
+
+	int ring_fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+
+	if(ring_fd < 0) {
+		return errno;
+	}
+
+	state->ring_fd = ring_fd;
+
+	if(!(params.features & IORING_FEAT_EXT_ARG) || !(params.features & IORING_FEAT_NODROP)) {
+		return ENOSYS;
+	}
+
+	state->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	state->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+	if(params.features & IORING_FEAT_SINGLE_MMAP) {
+		if(state->cq_ring_size > state->sq_ring_size) {
+			state->sq_ring_size = state->cq_ring_size;
+		}
+
+		state->cq_ring_size = state->sq_ring_size;
+	}
+
+	void *sq_ring = mmap(NULL, state->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+
+	if(sq_ring == MAP_FAILED) {
+		return errno;
+	}
+
+	state->sq_ring = sq_ring;
+
+	if(params.features & IORING_FEAT_SINGLE_MMAP) {
+		state->cq_ring = sq_ring;
+	}
+	else {
+		void *cq_ring = mmap(NULL, state->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+
+		if(cq_ring == MAP_FAILED) {
+			return errno;
+		}
+
+		state->cq_ring = cq_ring;
+	}
+
+	state->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	void *sqes = mmap(NULL, state->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+
+	if(sqes == MAP_FAILED) {
+		return errno;
+	}
+
+	state->sqes = sqes;
+
+	char *sq = state->sq_ring;
+	state->sq_head = (unsigned *)(sq + params.sq_off.head);
+	state->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+	state->sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+	state->sq_entries = *(unsigned *)(sq + params.sq_off.ring_entries);
+	state->sq_array = (unsigned *)(sq + params.sq_off.array);
+
+	char *cq = state->cq_ring;
+	state->cq_head = (unsigned *)(cq + params.cq_off.head);
+	state->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+	state->cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+	state->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+	return 0;
+}
+#endif
+
 /*
  * Add an FD to be watched
  */
@@ -82,6 +481,8 @@ static int Ladd(lua_State *L) {
 
 	int wantread = lua_toboolean(L, 3);
 	int wantwrite = lua_toboolean(L, 4);
+	lua_Integer flags = luaL_optinteger(L, 5, 0);
+	luaL_argcheck(L, (flags & ~(lua_Integer)POLL_FLAGS) == 0, 5, "unsupported flags");
 
 	if(fd < 0) {
 		luaL_pushfail(L);
@@ -95,7 +496,16 @@ static int Ladd(lua_State *L) {
 	event.data.fd = fd;
 	event.events = (wantread ? EPOLLIN : 0) | (wantwrite ? EPOLLOUT : 0);
 
-	event.events |= EPOLLERR | EPOLLHUP | EPOLLRDHUP;
+	event.events |= EPOLLERR | EPOLLHUP | EPOLLRDHUP | (uint32_t)flags;
+
+#ifdef EPOLLEXCLUSIVE
+
+	/* Not allowed together with EPOLLEXCLUSIVE */
+	if(flags & EPOLLEXCLUSIVE) {
+		event.events &= ~EPOLLRDHUP;
+	}
+
+#endif
 
 	int ret = epoll_ctl(state->epoll_fd, EPOLL_CTL_ADD, fd, &event);
 
@@ -111,6 +521,32 @@ static int Ladd(lua_State *L) {
 	return 1;
 
 #endif
+#ifdef USE_IO_URING
+
+	/* Catch invalid FDs now rather than when the poll request completes */
+	int ret = fcntl(fd, F_GETFD) < 0 ? errno : ring_grow(state, fd);
+
+	if(ret == 0 && state->watched[fd].registered) {
+		ret = EEXIST;
+	}
+
+	if(ret != 0) {
+		luaL_pushfail(L);
+		lua_pushstring(L, strerror(ret));
+		lua_pushinteger(L, ret);
+		return 3;
+	}
+
+	Lpoll_watch *watch = &state->watched[fd];
+	watch->registered = 1;
+	watch->armed = 0;
+	watch->generation++;
+	watch->events = (wantread ? POLLIN : 0) | (wantwrite ? POLLOUT : 0);
+	ring_queue(state, fd);
+
+	lua_pushboolean(L, 1);
+	return 1;
+#endif
 #ifdef USE_POLL
 
 	for(nfds_t i = 0; i < state->count; i++) {
@@ -180,10 +616,13 @@ static int Ladd(lua_State *L) {
 
 /*
  * Set events to watch for, readable and/or writable
+ * Note that epoll does not allow changing registrations made with EPOLLEXCLUSIVE
  */
 static int Lset(lua_State *L) {
 	struct Lpoll_state *state = luaL_checkudata(L, 1, STATE_MT);
 	int fd = luaL_checkinteger(L, 2);
+	lua_Integer flags = luaL_optinteger(L, 5, 0);
+	luaL_argcheck(L, (flags & ~(lua_Integer)POLL_FLAGS) == 0, 5, "unsupported flags");
 
 #ifdef USE_EPOLL
 
@@ -194,7 +633,7 @@ static int Lset(lua_State *L) {
 	event.data.fd = fd;
 	event.events = (wantread ? EPOLLIN : 0) | (wantwrite ? EPOLLOUT : 0);
 
-	event.events |= EPOLLERR | EPOLLHUP | EPOLLRDHUP;
+	event.events |= EPOLLERR | EPOLLHUP | EPOLLRDHUP | (uint32_t)flags;
 
 	int ret = epoll_ctl(state->epoll_fd, EPOLL_CTL_MOD, fd, &event);
 
@@ -211,6 +650,36 @@ static int Lset(lua_State *L) {
 	}
 
 #endif
+#ifdef USE_IO_URING
+	int wantread = lua_toboolean(L, 3);
+	int wantwrite = lua_toboolean(L, 4);
+
+	if(fd < 0 || fd >= state->watched_size || !state->watched[fd].registered) {
+		luaL_pushfail(L);
+		lua_pushstring(L, strerror(ENOENT));
+		lua_pushinteger(L, ENOENT);
+		return 3;
+	}
+
+	/*
+	 * Always replace the poll request, in case the FD was closed without
+	 * being removed and now refers to a different file
+	 */
+	int ret = ring_cancel(state, fd);
+
+	if(ret != 0) {
+		luaL_pushfail(L);
+		lua_pushstring(L, strerror(ret));
+		lua_pushinteger(L, ret);
+		return 3;
+	}
+
+	state->watched[fd].events = (wantread ? POLLIN : 0) | (wantwrite ? POLLOUT : 0);
+	ring_queue(state, fd);
+
+	lua_pushboolean(L, 1);
+	return 1;
+#endif
 #ifdef USE_POLL
 	int wantread = lua_toboolean(L, 3);
 	int wantwrite = lua_toboolean(L, 4);
@@ -291,6 +760,30 @@ static int Ldel(lua_State *L) {
 	}
 
 #endif
+#ifdef USE_IO_URING
+
+	if(fd < 0 || fd >= state->watched_size || !state->watched[fd].registered) {
+		luaL_pushfail(L);
+		lua_pushstring(L, strerror(ENOENT));
+		lua_pushinteger(L, ENOENT);
+		return 3;
+	}
+
+	int ret = ring_cancel(state, fd);
+
+	if(ret != 0) {
+		luaL_pushfail(L);
+		lua_pushstring(L, strerror(ret));
+		lua_pushinteger(L, ret);
+		return 3;
+	}
+
+	state->watched[fd].registered = 0;
+	state->watched[fd].events = 0;
+
+	lua_pushboolean(L, 1);
+	return 1;
+#endif
 #ifdef USE_POLL
 
 	if(state->count == 0) {
@@ -362,6 +855,18 @@ static int Lpushevent(lua_State *L, struct Lpoll_state *state) {
 		return 3;
 	}
 
+#endif
+#ifdef USE_IO_URING
+
+	if(state->processed > 0) {
+		state->processed--;
+		Lpoll_ready event = state->events[state->processed];
+		lua_pushinteger(L, event.fd);
+		lua_pushboolean(L, event.revents & (POLLIN | POLLHUP | POLLRDHUP | POLLERR));
+		lua_pushboolean(L, event.revents & POLLOUT);
+		return 3;
+	}
+
 #endif
 #ifdef USE_POLL
 
@@ -399,19 +904,11 @@ static int Lpushevent(lua_State *L, struct Lpoll_state *state) {
 }
 
 /*
- * Wait for event
+ * Wait for the kernel to report ready FDs, leaving them for Lpushevent
+ * Returns 0 on success, otherwise the number of values pushed on the stack
  */
-static int Lwait(lua_State *L) {
-	struct Lpoll_state *state = luaL_checkudata(L, 1, STATE_MT);
-
-	int ret = Lpushevent(L, state);
-
-	if(ret != 0) {
-		return ret;
-	}
-
-	lua_Number timeout = luaL_checknumber(L, 2);
-	luaL_argcheck(L, timeout >= 0, 1, "positive number expected");
+static int Lpollwait(lua_State *L, struct Lpoll_state *state, lua_Number timeout) {
+	int ret;
 
 	if(timeout == 0.0) {
 		lua_pushnil(L);
@@ -420,7 +917,81 @@ static int Lwait(lua_State *L) {
 	}
 
 #ifdef USE_EPOLL
-	ret = epoll_wait(state->epoll_fd, state->events, MAX_EVENTS, timeout * 1000);
+	ret = epoll_wait(state->epoll_fd, state->events, state->max_events, timeout * 1000);
+#endif
+#ifdef USE_IO_URING
+	ret = ring_arm(state);
+
+	if(ret != 0) {
+		luaL_pushfail(L);
+		lua_pushstring(L, strerror(ret));
+		lua_pushinteger(L, ret);
+		return 3;
+	}
+
+	struct timespec deadline;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += (time_t)timeout;
+	deadline.tv_nsec += ((long long)(timeout * 1000000000)) % 1000000000;
+
+	if(deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+
+	for(;;) {
+		/* Completions may be left over from the last time, no need to wait then */
+		unsigned wait_nr = *state->cq_head == __atomic_load_n(state->cq_tail, __ATOMIC_ACQUIRE) ? 1 : 0;
+		int timed_out = 0;
+		ret = 0;
+
+		if(state->to_submit > 0 || wait_nr > 0) {
+			struct timespec now;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+
+			struct __kernel_timespec ts;
+			ts.tv_sec = deadline.tv_sec - now.tv_sec;
+			ts.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+
+			if(ts.tv_nsec < 0) {
+				ts.tv_sec--;
+				ts.tv_nsec += 1000000000;
+			}
+
+			if(ts.tv_sec < 0) {
+				ts.tv_sec = 0;
+				ts.tv_nsec = 0;
+			}
+
+			struct io_uring_getevents_arg arg;
+			memset(&arg, 0, sizeof(arg));
+			arg.ts = (uint64_t)(uintptr_t)&ts;
+
+			ret = syscall(__NR_io_uring_enter, state->ring_fd, state->to_submit, wait_nr,
+			              IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+
+			if(ret >= 0) {
+				state->to_submit -= ret;
+			}
+			else if(errno == ETIME) {
+				timed_out = 1;
+			}
+			else {
+				break;
+			}
+		}
+
+		ret = ring_reap(state);
+
+		/*
+		 * Stale and cancelled completions are skipped, if that was all
+		 * there was then keep waiting until the timeout is up
+		 */
+		if(ret > 0 || timed_out) {
+			break;
+		}
+	}
+
 #endif
 #ifdef USE_POLL
 	ret = poll(state->events, state->count, timeout * 1000);
@@ -462,9 +1033,9 @@ static int Lwait(lua_State *L) {
 	}
 
 	/*
-	 * Search for the first ready FD and return it
+	 * Prepare for searching for ready FDs
 	 */
-#ifdef USE_EPOLL
+#if defined(USE_EPOLL) || defined(USE_IO_URING)
 	state->processed = ret;
 #endif
 #ifdef USE_POLL
@@ -473,9 +1044,79 @@ static int Lwait(lua_State *L) {
 #ifdef USE_SELECT
 	state->processed = -1;
 #endif
+	return 0;
+}
+
+/*
+ * Wait for event
+ */
+static int Lwait(lua_State *L) {
+	struct Lpoll_state *state = luaL_checkudata(L, 1, STATE_MT);
+
+	int ret = Lpushevent(L, state);
+
+	if(ret != 0) {
+		return ret;
+	}
+
+	lua_Number timeout = luaL_checknumber(L, 2);
+	luaL_argcheck(L, timeout >= 0, 1, "positive number expected");
+
+	ret = Lpollwait(L, state, timeout);
+
+	if(ret != 0) {
+		return ret;
+	}
+
+	/*
+	 * Search for the first ready FD and return it
+	 */
 	return Lpushevent(L, state);
 }
 
+/*
+ * Move all pending events into the table at idx as (fd, readable, writable)
+ * triples, returns the number of events stored
+ */
+static int Lpushevents(lua_State *L, struct Lpoll_state *state, int idx) {
+	int count = 0;
+
+	while(Lpushevent(L, state) != 0) {
+		lua_rawseti(L, idx, count * 3 + 3);
+		lua_rawseti(L, idx, count * 3 + 2);
+		lua_rawseti(L, idx, count * 3 + 1);
+		count++;
+	}
+
+	return count;
+}
+
+/*
+ * Wait for events, returning all of them at once
+ */
+static int Lwaitmany(lua_State *L) {
+	struct Lpoll_state *state = luaL_checkudata(L, 1, STATE_MT);
+	lua_Number timeout = luaL_checknumber(L, 2);
+	luaL_argcheck(L, timeout >= 0, 2, "positive number expected");
+	luaL_checktype(L, 3, LUA_TTABLE);
+
+	/* Leftovers from earlier calls to :wait() */
+	int count = Lpushevents(L, state, 3);
+
+	if(count == 0) {
+		int ret = Lpollwait(L, state, timeout);
+
+		if(ret != 0) {
+			return ret;
+		}
+
+		count = Lpushevents(L, state, 3);
+	}
+
+	lua_pushinteger(L, count);
+	return 1;
+}
+
 #ifdef USE_EPOLL
 /*
  * Return Epoll FD
@@ -508,6 +1149,40 @@ static int Lgc(lua_State *L) {
 }
 #endif
 
+#ifdef USE_IO_URING
+/*
+ * Return io_uring FD, which becomes readable when completions are available
+ */
+static int Lgetfd(lua_State *L) {
+	struct Lpoll_state *state = luaL_checkudata(L, 1, STATE_MT);
+	lua_pushinteger(L, state->ring_fd);
+	return 1;
+}
+
+/*
+ * Tear down the ring
+ */
+static int Lgc(lua_State *L) {
+	struct Lpoll_state *state = luaL_checkudata(L, 1, STATE_MT);
+
+	ring_free(state);
+
+	if(state->ring_fd == -1) {
+		return 0;
+	}
+
+	if(close(state->ring_fd) == 0) {
+		state->ring_fd = -1;
+	}
+	else {
+		lua_pushstring(L, strerror(errno));
+		lua_error(L);
+	}
+
+	return 0;
+}
+#endif
+
 /*
  * String representation
  */
@@ -521,13 +1196,29 @@ static int Ltos(lua_State *L) {
  * Create a new context
  */
 static int Lnew(lua_State *L) {
+#ifdef USE_EPOLL
+	/* Size of the returned events array, only used by epoll */
+	lua_Integer max_events = luaL_optinteger(L, 1, MAX_EVENTS);
+	luaL_argcheck(L, max_events > 0 && max_events <= INT_MAX / (lua_Integer)sizeof(struct epoll_event), 1,
+	              "number of events out of range");
+
 	/* Allocate state */
+	Lpoll_state *state = lua_newuserdata(L, sizeof(Lpoll_state) + max_events * sizeof(struct epoll_event));
+#elif defined(USE_IO_URING)
+	lua_Integer max_events = luaL_optinteger(L, 1, MAX_EVENTS);
+	luaL_argcheck(L, max_events > 0 && max_events <= INT_MAX / (lua_Integer)sizeof(Lpoll_ready) / 2, 1,
+	              "number of events out of range");
+
+	Lpoll_state *state = lua_newuserdata(L, sizeof(Lpoll_state) + max_events * sizeof(Lpoll_ready));
+#else
 	Lpoll_state *state = lua_newuserdata(L, sizeof(Lpoll_state));
+#endif
 	luaL_setmetatable(L, STATE_MT);
 
 	/* Initialize state */
 #ifdef USE_EPOLL
 	state->epoll_fd = -1;
+	state->max_events = (int)max_events;
 	state->processed = 0;
 
 	int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
@@ -541,6 +1232,29 @@ static int Lnew(lua_State *L) {
 
 	state->epoll_fd = epoll_fd;
 #endif
+#ifdef USE_IO_URING
+	memset(state, 0, sizeof(Lpoll_state));
+	state->ring_fd = -1;
+	state->max_events = (int)max_events;
+
+	int ret = ring_init(state);
+
+	if(ret != 0) {
+		/* Clean up now rather than waiting for the garbage collector */
+		ring_free(state);
+
+		if(state->ring_fd != -1) {
+			close(state->ring_fd);
+			state->ring_fd = -1;
+		}
+
+		luaL_pushfail(L);
+		lua_pushstring(L, strerror(ret));
+		lua_pushinteger(L, ret);
+		return 3;
+	}
+
+#endif
 #ifdef USE_POLL
 	state->processed = -1;
 	state->count = 0;
@@ -590,14 +1304,16 @@ int luaopen_prosody_util_poll(lua_State *L) {
 			lua_setfield(L, -2, "del");
 			lua_pushcfunction(L, Lwait);
 			lua_setfield(L, -2, "wait");
-#ifdef USE_EPOLL
+			lua_pushcfunction(L, Lwaitmany);
+			lua_setfield(L, -2, "waitmany");
+#if defined(USE_EPOLL) || defined(USE_IO_URING)
 			lua_pushcfunction(L, Lgetfd);
 			lua_setfield(L, -2, "getfd");
 #endif
 		}
 		lua_setfield(L, -2, "__index");
 
-#ifdef USE_EPOLL
+#if defined(USE_EPOLL) || defined(USE_IO_URING)
 		lua_pushcfunction(L, Lgc);
 		lua_setfield(L, -2, "__gc");
 #endif
@@ -615,6 +1331,17 @@ int luaopen_prosody_util_poll(lua_State *L) {
 		push_errno(EMFILE);
 		push_errno(ENOENT);
 
+#ifdef USE_EPOLL
+#define push_flag(named_flag) lua_pushinteger(L, named_flag);\
+		lua_setfield(L, -2, #named_flag);
+
+		push_flag(EPOLLET);
+		push_flag(EPOLLONESHOT);
+#ifdef EPOLLEXCLUSIVE
+		push_flag(EPOLLEXCLUSIVE);
+#endif
+#endif
+
 		lua_pushliteral(L, POLL_BACKEND);
 		lua_setfield(L, -2, "api");
 
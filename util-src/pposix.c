@@ -46,6 +46,12 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/utsname.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stddef.h>
 #include <fcntl.h>
 
 #include <syslog.h>
@@ -138,6 +144,70 @@ static int lc_daemonize(lua_State *L) {
 	return 2;
 }
 
+/*
+ * Fork the process
+ * () -> integer
+ *
+ * Returns the pid of the child in the parent and 0 in the child.
+ */
+static int lc_fork(lua_State *L) {
+	/* Bypasses the rfork() above, workers need their own file descriptor table */
+	pid_t pid = (fork)();
+
+	if(pid < 0) {
+		luaL_pushfail(L);
+		lua_pushstring(L, strerror(errno));
+		lua_pushinteger(L, errno);
+		return 3;
+	}
+
+	lua_pushinteger(L, pid);
+	return 1;
+}
+
+/*
+ * Collect a child that has exited
+ * (integer?, boolean?) -> integer, string, integer
+ *
+ * Waits for the given pid, or any child, unless the second argument is true.
+ * Returns the pid, "exited" or "signaled", and the exit status or signal.
+ * Returns false if no child has exited yet and not waiting.
+ */
+static int lc_waitpid(lua_State *L) {
+	pid_t wanted = (pid_t)luaL_optinteger(L, 1, -1);
+	int options = lua_toboolean(L, 2) ? WNOHANG : 0;
+	pid_t pid;
+	int status;
+
+	do {
+		pid = waitpid(wanted, &status, options);
+	} while(pid < 0 && errno == EINTR);
+
+	if(pid < 0) {
+		luaL_pushfail(L);
+		lua_pushstring(L, strerror(errno));
+		lua_pushinteger(L, errno);
+		return 3;
+	}
+
+	if(pid == 0) {
+		lua_pushboolean(L, 0);
+		return 1;
+	}
+
+	lua_pushinteger(L, pid);
+
+	if(WIFSIGNALED(status)) {
+		lua_pushliteral(L, "signaled");
+		lua_pushinteger(L, WTERMSIG(status));
+	} else {
+		lua_pushliteral(L, "exited");
+		lua_pushinteger(L, WEXITSTATUS(status));
+	}
+
+	return 3;
+}
+
 /* Syslog support */
 
 static const char *const facility_strings[] = {
@@ -780,8 +850,475 @@ static int lc_setenv(lua_State *L) {
 	return 1;
 }
 
-#ifdef WITH_MALLINFO
+/*
+ * Pooling allocator
+ *
+ * An optional replacement for the allocator of the Lua state. Blocks of up to
+ * POOL_MAX_SIZE bytes, which is most tables, strings and closures made while
+ * handling stanzas, are carved from slabs of fixed size classes. Each slab is
+ * one aligned chunk, so the owner of a block is found by masking its address,
+ * and a chunk is given back once all its slots are free. Larger blocks, and
+ * any block allocated before the switch, go to the previous allocator.
+ *
+ * Blocks remember the tag that was active when they were allocated, so the
+ * bytes they hold can be accounted to it until they are freed. Small blocks
+ * keep it in their chunk, larger ones in a table on the side.
+ */
+#define POOL_CHUNK_SHIFT 16
+#define POOL_CHUNK_SIZE ((size_t)1 << POOL_CHUNK_SHIFT)
+#define POOL_MAX_SIZE 512
+#define POOL_CLASSES 16
+#define POOL_MAX_TAGS 256
+
+static const unsigned short pool_class_size[POOL_CLASSES] = {
+	16, 32, 48, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384, 448, 512
+};
+
+typedef struct pool_chunk {
+	struct pool_chunk *prev, *next; /* chunks of the same class with free slots */
+	void *free; /* freed slots, linked through their first bytes */
+	char *slots;
+	unsigned int size_class;
+	unsigned int nslots;
+	unsigned int used;
+	unsigned int fresh; /* slots from here on were never handed out */
+	unsigned char tags[]; /* tag of each slot */
+} pool_chunk;
+
+typedef struct {
+	pool_chunk *partial;
+	size_t chunks;
+	size_t used; /* slots handed out */
+} pool_class;
+
+/* Open addressing map from address to tag, removal by shifting back */
+typedef struct {
+	uintptr_t *keys; /* 0 marks an empty slot */
+	unsigned char *values;
+	size_t mask;
+	size_t count;
+	int shift; /* low bits of the keys that carry no information */
+} ptrmap;
+
+typedef struct {
+	lua_Alloc orig;
+	void *orig_ud;
+	pool_class classes[POOL_CLASSES];
+	ptrmap chunks; /* chunk addresses */
+	ptrmap large; /* tagged blocks from the previous allocator */
+	unsigned char tag;
+	unsigned int ntags;
+	size_t tag_bytes[POOL_MAX_TAGS];
+	char *tag_names[POOL_MAX_TAGS];
+} pool_state;
+
+static pool_state pool;
+static unsigned char pool_class_of[POOL_MAX_SIZE / 16 + 1];
+
+static size_t ptrmap_home(const ptrmap *m, uintptr_t key) {
+	return (size_t)(((uint64_t)(key >> m->shift) * UINT64_C(0x9E3779B97F4A7C15)) >> 32) & m->mask;
+}
+
+static size_t ptrmap_find(const ptrmap *m, uintptr_t key) {
+	size_t i;
+
+	if(m->count == 0) {
+		return SIZE_MAX;
+	}
+
+	for(i = ptrmap_home(m, key); m->keys[i] != 0; i = (i + 1) & m->mask) {
+		if(m->keys[i] == key) {
+			return i;
+		}
+	}
+
+	return SIZE_MAX;
+}
+
+static int ptrmap_grow(ptrmap *m) {
+	size_t size = m->keys ? (m->mask + 1) * 2 : 64, i, j;
+	uintptr_t *old_keys = m->keys;
+	unsigned char *old_values = m->values;
+	size_t old_size = old_keys ? m->mask + 1 : 0;
+	uintptr_t *keys = calloc(size, sizeof(uintptr_t));
+	unsigned char *values = malloc(size);
+
+	if(keys == NULL || values == NULL) {
+		free(keys);
+		free(values);
+		return 0;
+	}
+
+	m->keys = keys;
+	m->values = values;
+	m->mask = size - 1;
+
+	for(i = 0; i < old_size; i++) {
+		if(old_keys[i] != 0) {
+			for(j = ptrmap_home(m, old_keys[i]); keys[j] != 0; j = (j + 1) & m->mask);
+
+			keys[j] = old_keys[i];
+			values[j] = old_values[i];
+		}
+	}
+
+	free(old_keys);
+	free(old_values);
+	return 1;
+}
+
+static int ptrmap_insert(ptrmap *m, uintptr_t key, unsigned char value) {
+	size_t i;
+
+	if((m->keys == NULL || (m->count + 1) * 2 > m->mask + 1) && !ptrmap_grow(m)) {
+		return 0;
+	}
+
+	for(i = ptrmap_home(m, key); m->keys[i] != 0; i = (i + 1) & m->mask);
+
+	m->keys[i] = key;
+	m->values[i] = value;
+	m->count++;
+	return 1;
+}
+
+static void ptrmap_remove_at(ptrmap *m, size_t i) {
+	size_t j = i;
+
+	for(;;) {
+		j = (j + 1) & m->mask;
+
+		if(m->keys[j] == 0) {
+			break;
+		}
+
+		/* Entries further along may move back to the hole if it is on their way */
+		if(((j - ptrmap_home(m, m->keys[j])) & m->mask) >= ((j - i) & m->mask)) {
+			m->keys[i] = m->keys[j];
+			m->values[i] = m->values[j];
+			i = j;
+		}
+	}
+
+	m->keys[i] = 0;
+	m->count--;
+}
+
+static pool_chunk *pool_owner(pool_state *s, void *p) {
+	uintptr_t base = (uintptr_t)p & ~(uintptr_t)(POOL_CHUNK_SIZE - 1);
+	return ptrmap_find(&s->chunks, base) == SIZE_MAX ? NULL : (pool_chunk *)base;
+}
+
+static size_t pool_slot(const pool_chunk *c, const void *p) {
+	return (size_t)((const char *)p - c->slots) / pool_class_size[c->size_class];
+}
+
+static void pool_unlink(pool_class *pc, pool_chunk *c) {
+	if(c->prev) {
+		c->prev->next = c->next;
+	} else {
+		pc->partial = c->next;
+	}
+
+	if(c->next) {
+		c->next->prev = c->prev;
+	}
+
+	c->prev = c->next = NULL;
+}
+
+static void pool_link(pool_class *pc, pool_chunk *c) {
+	c->prev = NULL;
+	c->next = pc->partial;
+
+	if(c->next) {
+		c->next->prev = c;
+	}
+
+	pc->partial = c;
+}
+
+static pool_chunk *pool_new_chunk(pool_state *s, unsigned int cls) {
+	size_t size = pool_class_size[cls];
+	size_t header = offsetof(pool_chunk, tags);
+	size_t nslots = (POOL_CHUNK_SIZE - header) / (size + 1);
+	size_t start;
+	void *mem;
+	pool_chunk *c;
+
+	/* Slots start 16 byte aligned after the header and the tags */
+	while(start = (header + nslots + 15) & ~(size_t)15, start + nslots * size > POOL_CHUNK_SIZE) {
+		nslots--;
+	}
+
+	if(posix_memalign(&mem, POOL_CHUNK_SIZE, POOL_CHUNK_SIZE) != 0) {
+		return NULL;
+	}
+
+	if(!ptrmap_insert(&s->chunks, (uintptr_t)mem, 0)) {
+		free(mem);
+		return NULL;
+	}
+
+	c = mem;
+	c->free = NULL;
+	c->slots = (char *)mem + start;
+	c->size_class = cls;
+	c->nslots = (unsigned int)nslots;
+	c->used = 0;
+	c->fresh = 0;
+	pool_link(&s->classes[cls], c);
+	s->classes[cls].chunks++;
+	return c;
+}
+
+/* A free slot of a size class, or NULL if no chunk could be had */
+static void *pool_take(pool_state *s, unsigned int cls, unsigned char tag) {
+	pool_class *pc = &s->classes[cls];
+	pool_chunk *c = pc->partial;
+	void *p;
+
+	if(c == NULL && (c = pool_new_chunk(s, cls)) == NULL) {
+		return NULL;
+	}
+
+	if(c->free) {
+		p = c->free;
+		memcpy(&c->free, p, sizeof(void *));
+	} else {
+		p = c->slots + (size_t)c->fresh++ * pool_class_size[cls];
+	}
+
+	c->tags[pool_slot(c, p)] = tag;
+	pc->used++;
+
+	if(++c->used == c->nslots) {
+		pool_unlink(pc, c);
+	}
+
+	return p;
+}
+
+static void pool_give(pool_state *s, pool_chunk *c, void *p) {
+	pool_class *pc = &s->classes[c->size_class];
+
+	memcpy(p, &c->free, sizeof(void *));
+	c->free = p;
+	pc->used--;
+
+	if(c->used-- == c->nslots) {
+		pool_link(pc, c);
+	}
+
+	/* Hand empty chunks back, but keep one around to avoid churn */
+	if(c->used == 0 && (pc->partial != c || c->next != NULL)) {
+		pool_unlink(pc, c);
+		ptrmap_remove_at(&s->chunks, ptrmap_find(&s->chunks, (uintptr_t)c));
+		pc->chunks--;
+		free(c);
+	}
+}
+
+static unsigned char pool_large_tag(pool_state *s, void *p) {
+	size_t i = ptrmap_find(&s->large, (uintptr_t)p);
+	return i == SIZE_MAX ? 0 : s->large.values[i];
+}
+
+static void pool_large_forget(pool_state *s, void *p) {
+	size_t i = ptrmap_find(&s->large, (uintptr_t)p);
+
+	if(i != SIZE_MAX) {
+		ptrmap_remove_at(&s->large, i);
+	}
+}
+
+/* Free a block wherever it came from */
+static void pool_release(pool_state *s, pool_chunk *c, void *p, size_t osize, unsigned char tag) {
+	if(c) {
+		pool_give(s, c, p);
+	} else {
+		if(tag) {
+			pool_large_forget(s, p);
+		}
+
+		s->orig(s->orig_ud, p, osize, 0);
+	}
+}
+
+static void *pool_lua_alloc(void *ud, void *ptr, size_t osize, size_t nsize) {
+	pool_state *s = ud;
+	pool_chunk *c = NULL;
+	unsigned char tag;
+	void *p;
+
+	if(ptr == NULL) {
+		osize = 0; /* it is the type of the new object then */
+		tag = s->tag;
+	} else {
+		if(osize <= POOL_MAX_SIZE) {
+			c = pool_owner(s, ptr);
+		}
+
+		tag = c ? c->tags[pool_slot(c, ptr)] : pool_large_tag(s, ptr);
+	}
+
+	if(nsize == 0) {
+		s->tag_bytes[tag] -= osize;
+
+		if(ptr) {
+			pool_release(s, c, ptr, osize, tag);
+		}
+
+		return NULL;
+	}
+
+	if(c && nsize <= pool_class_size[c->size_class]
+	        && (c->size_class == 0 || nsize > pool_class_size[c->size_class - 1])) {
+		/* Still the right size class */
+		s->tag_bytes[tag] += nsize - osize;
+		return ptr;
+	}
+
+	if(nsize <= POOL_MAX_SIZE && (p = pool_take(s, pool_class_of[(nsize + 15) / 16], tag)) != NULL) {
+		if(ptr) {
+			memcpy(p, ptr, osize < nsize ? osize : nsize);
+			pool_release(s, c, ptr, osize, tag);
+		}
+
+		s->tag_bytes[tag] += nsize - osize;
+		return p;
+	}
+
+	if(c) {
+		if(nsize <= pool_class_size[c->size_class]) {
+			/* Shrinking, but there was no smaller slot to be had */
+			s->tag_bytes[tag] += nsize - osize;
+			return ptr;
+		}
+
+		if((p = s->orig(s->orig_ud, NULL, 0, nsize)) == NULL) {
+			return NULL;
+		}
+
+		memcpy(p, ptr, osize);
+		pool_give(s, c, ptr);
+	} else {
+		if((p = s->orig(s->orig_ud, ptr, osize, nsize)) == NULL) {
+			return NULL;
+		}
+
+		if(ptr && tag) {
+			pool_large_forget(s, ptr);
+		}
+	}
+
+	if(tag && !ptrmap_insert(&s->large, (uintptr_t)p, tag)) {
+		/* Can't follow it, so stop counting it */
+		s->tag_bytes[tag] -= osize;
+		return p;
+	}
+
+	s->tag_bytes[tag] += nsize - osize;
+	return p;
+}
+
+/*
+ * Switch the Lua state over to the pooling allocator
+ * () -> true
+ * () -> nil, string
+ *
+ * Blocks allocated before are still freed by the previous allocator. There is
+ * no way back, as pooled blocks may be anywhere.
+ */
+static int lc_pool_allocator(lua_State *L) {
+	void *ud;
+	lua_Alloc current = lua_getallocf(L, &ud);
+	unsigned int cls = 0, i;
+
+	if(current == pool_lua_alloc) {
+		lua_pushboolean(L, 1);
+		return 1;
+	}
+
+	if(pool.orig != NULL) {
+		luaL_pushfail(L);
+		lua_pushliteral(L, "already used by another Lua state");
+		return 2;
+	}
+
+	for(i = 1; i < sizeof(pool_class_of); i++) {
+		while(pool_class_size[cls] < i * 16) {
+			cls++;
+		}
+
+		pool_class_of[i] = (unsigned char)cls;
+	}
+
+	pool.orig = current;
+	pool.orig_ud = ud;
+	pool.chunks.shift = POOL_CHUNK_SHIFT;
+	pool.large.shift = 4;
+	lua_setallocf(L, pool_lua_alloc, &pool);
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/*
+ * Get the number for a tag to account memory to
+ * (string) -> integer
+ * (string) -> nil, string
+ *
+ * The same name always gets the same number. There is room for 255 names.
+ */
+static int lc_new_memtag(lua_State *L) {
+	size_t len;
+	const char *name = luaL_checklstring(L, 1, &len);
+	unsigned int i;
+	char *copy;
+
+	for(i = 1; i <= pool.ntags; i++) {
+		if(strcmp(pool.tag_names[i], name) == 0) {
+			lua_pushinteger(L, i);
+			return 1;
+		}
+	}
+
+	if(pool.ntags + 1 >= POOL_MAX_TAGS) {
+		luaL_pushfail(L);
+		lua_pushliteral(L, "too many tags");
+		return 2;
+	}
+
+	if((copy = malloc(len + 1)) == NULL) {
+		luaL_pushfail(L);
+		lua_pushstring(L, strerror(ENOMEM));
+		return 2;
+	}
+
+	memcpy(copy, name, len + 1);
+	pool.tag_names[++pool.ntags] = copy;
+	lua_pushinteger(L, pool.ntags);
+	return 1;
+}
+
+/*
+ * Set the tag that new allocations are accounted to
+ * (integer?) -> integer
+ *
+ * 0 or nil for none. Returns the previous tag.
+ */
+static int lc_memtag(lua_State *L) {
+	lua_Integer tag = luaL_optinteger(L, 1, 0);
+
+	luaL_argcheck(L, tag >= 0 && tag <= (lua_Integer)pool.ntags, 1, "unknown tag");
+	lua_pushinteger(L, pool.tag);
+	pool.tag = (unsigned char)tag;
+	return 1;
+}
+
 static int lc_meminfo(lua_State *L) {
+#ifdef WITH_MALLINFO
 #if __GLIBC_PREREQ(2, 33)
 	struct mallinfo2 info = mallinfo2();
 #define MALLINFO_T size_t
@@ -789,7 +1326,9 @@ static int lc_meminfo(lua_State *L) {
 	struct mallinfo info = mallinfo();
 #define MALLINFO_T unsigned
 #endif
-	lua_createtable(L, 0, 5);
+#endif
+	lua_createtable(L, 0, 7);
+#ifdef WITH_MALLINFO
 	/* This is the total size of memory allocated with sbrk by malloc, in bytes. */
 	lua_pushinteger(L, (MALLINFO_T)info.arena);
 	lua_setfield(L, -2, "allocated");
@@ -806,27 +1345,45 @@ static int lc_meminfo(lua_State *L) {
 	   end of the heap (i.e., the high end of the virtual address space's data segment). */
 	lua_pushinteger(L, (MALLINFO_T)info.keepcost);
 	lua_setfield(L, -2, "returnable");
-	return 1;
-}
 #undef MALLINFO_T
 #endif
 
-/*
- * Append some data to a file handle
- * Attempt to allocate space first
- * Truncate to original size on failure
- */
-static int lc_atomic_append(lua_State *L) {
-	int err;
-	size_t len;
+	if(pool.orig != NULL) {
+		size_t chunks = 0, used = 0;
+		unsigned int i;
 
-	FILE *f = *(FILE **) luaL_checkudata(L, 1, LUA_FILEHANDLE);
-	const char *data = luaL_checklstring(L, 2, &len);
+		for(i = 0; i < POOL_CLASSES; i++) {
+			chunks += pool.classes[i].chunks;
+			used += pool.classes[i].used * pool_class_size[i];
+		}
 
-	off_t offset = ftell(f);
+		lua_createtable(L, 0, 2);
+		/* Size of the chunks slots are carved from, and of the slots in use. */
+		lua_pushinteger(L, (lua_Integer)(chunks * POOL_CHUNK_SIZE));
+		lua_setfield(L, -2, "allocated");
+		lua_pushinteger(L, (lua_Integer)used);
+		lua_setfield(L, -2, "used");
+		lua_setfield(L, -2, "pool");
+
+		/* Bytes held by blocks allocated while each tag was active. */
+		lua_createtable(L, 0, pool.ntags);
+
+		for(i = 1; i <= pool.ntags; i++) {
+			lua_pushinteger(L, (lua_Integer)pool.tag_bytes[i]);
+			lua_setfield(L, -2, pool.tag_names[i]);
+		}
+
+		lua_setfield(L, -2, "tags");
+	}
 
+	return 1;
+}
+
+/* Try to allocate space without changing the file size, returns an errno or 0 */
+static int append_reserve(FILE *f, off_t offset, size_t len) {
 #if defined(__linux__)
-	/* Try to allocate space without changing the file size. */
+	int err;
+
 	if((err = fallocate(fileno(f), FALLOC_FL_KEEP_SIZE, offset, len))) {
 		if(errno != 0) {
 			/* Some old versions of Linux apparently use the return value instead of errno */
@@ -836,17 +1393,41 @@ static int lc_atomic_append(lua_State *L) {
 			case ENOSYS: /* Kernel doesn't implement fallocate */
 			case EOPNOTSUPP: /* Filesystem doesn't support it */
 				/* Ignore and proceed to try to write */
-				break;
+				return 0;
 
 			case ENOSPC: /* No space left */
 			default: /* Other issues */
-				luaL_pushfail(L);
-				lua_pushstring(L, strerror(err));
-				lua_pushinteger(L, err);
-				return 3;
+				return err;
 		}
 	}
+#else
+	(void)f;
+	(void)offset;
+	(void)len;
 #endif
+	return 0;
+}
+
+/*
+ * Append some data to a file handle
+ * Attempt to allocate space first
+ * Truncate to original size on failure
+ */
+static int lc_atomic_append(lua_State *L) {
+	int err;
+	size_t len;
+
+	FILE *f = *(FILE **) luaL_checkudata(L, 1, LUA_FILEHANDLE);
+	const char *data = luaL_checklstring(L, 2, &len);
+
+	off_t offset = ftell(f);
+
+	if((err = append_reserve(f, offset, len))) {
+		luaL_pushfail(L);
+		lua_pushstring(L, strerror(err));
+		lua_pushinteger(L, err);
+		return 3;
+	}
 
 	if(fwrite(data, sizeof(char), len, f) == len) {
 		if(fflush(f) == 0) {
@@ -873,6 +1454,139 @@ static int lc_atomic_append(lua_State *L) {
 	return 3;
 }
 
+/* Chunks handed to a single writev() call */
+#if defined(IOV_MAX) && IOV_MAX < 64
+#define APPEND_IOV IOV_MAX
+#else
+#define APPEND_IOV 64
+#endif
+
+/* Write all of `iov`, returns an errno or 0 */
+static int append_writev(int fd, struct iovec *iov, int count) {
+	while(count > 0) {
+		ssize_t r = writev(fd, iov, count);
+
+		if(r < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+
+			return errno;
+		}
+
+		while(count > 0 && (size_t)r >= iov->iov_len) {
+			r -= iov->iov_len;
+			iov++;
+			count--;
+		}
+
+		if(count > 0) {
+			iov->iov_base = (char *)iov->iov_base + r;
+			iov->iov_len -= r;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Append a list of strings to a file, all or nothing
+ * (file, { string... }, boolean?) -> true
+ *
+ * Like atomic_append() with one fallocate() and as few writev() calls as
+ * possible for all the strings, optionally followed by fdatasync().
+ */
+static int lc_atomic_append_batch(lua_State *L) {
+	int err = 0;
+	size_t count, total = 0, i;
+	off_t offset;
+
+	FILE *f = *(FILE **) luaL_checkudata(L, 1, LUA_FILEHANDLE);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	int sync = lua_toboolean(L, 3);
+	int fd = fileno(f);
+
+	count = lua_rawlen(L, 2);
+
+	for(i = 1; i <= count; i++) {
+		size_t len;
+		lua_rawgeti(L, 2, i);
+
+		if(lua_type(L, -1) != LUA_TSTRING) {
+			return luaL_argerror(L, 2, lua_pushfstring(L, "string expected at index %d", (int)i));
+		}
+
+		lua_tolstring(L, -1, &len);
+		total += len;
+		lua_pop(L, 1);
+	}
+
+	/* Anything buffered must go out first, then write behind stdio */
+	if(fflush(f) != 0) {
+		err = errno;
+		luaL_pushfail(L);
+		lua_pushstring(L, strerror(err));
+		lua_pushinteger(L, err);
+		return 3;
+	}
+
+	offset = ftell(f);
+
+	if((err = append_reserve(f, offset, total)) == 0 && lseek(fd, offset, SEEK_SET) < 0) {
+		err = errno;
+	}
+
+	if(err) {
+		luaL_pushfail(L);
+		lua_pushstring(L, strerror(err));
+		lua_pushinteger(L, err);
+		return 3;
+	}
+
+	for(i = 0; i < count && !err;) {
+		struct iovec iov[APPEND_IOV];
+		int n;
+
+		for(n = 0; n < APPEND_IOV && i < count; n++, i++) {
+			/* the strings stay referenced from the table */
+			lua_rawgeti(L, 2, i + 1);
+			iov[n].iov_base = (char *)lua_tolstring(L, -1, &iov[n].iov_len);
+			lua_pop(L, 1);
+		}
+
+		err = append_writev(fd, iov, n);
+	}
+
+	if(!err && sync) {
+#if defined(__linux__) || (defined(_POSIX_SYNCHRONIZED_IO) && _POSIX_SYNCHRONIZED_IO > 0)
+		if(fdatasync(fd) != 0) {
+#else
+		if(fsync(fd) != 0) {
+#endif
+			err = errno;
+		}
+	}
+
+	if(!err) {
+		fseek(f, offset + total, SEEK_SET);
+		lua_pushboolean(L, 1);
+		return 1;
+	}
+
+	fseek(f, offset, SEEK_SET);
+
+	/* Cut partially written data */
+	if(ftruncate(fd, offset)) {
+		/* The file is now most likely corrupted, throw hard error */
+		return luaL_error(L, "atomic_append_batch() failed in ftruncate(): %s", strerror(errno));
+	}
+
+	luaL_pushfail(L);
+	lua_pushstring(L, strerror(err));
+	lua_pushinteger(L, err);
+	return 3;
+}
+
 static int lc_remove_blocks(lua_State *L) {
 #if defined(__linux__)
 	int err;
@@ -908,6 +1622,270 @@ static int lc_remove_blocks(lua_State *L) {
 #endif
 }
 
+/* Read-only file mappings */
+
+#define MAPPING_MT "util.pposix.mapping"
+
+typedef struct {
+	int fd;
+	char *addr;
+	size_t len;
+} mapping;
+
+static const char *const advice_names[] = { "normal", "random", "sequential", "willneed", "dontneed", NULL };
+static const int advice_values[] = {
+	POSIX_MADV_NORMAL, POSIX_MADV_RANDOM, POSIX_MADV_SEQUENTIAL, POSIX_MADV_WILLNEED, POSIX_MADV_DONTNEED
+};
+
+static void mapping_unmap(mapping *m) {
+	if(m->addr != NULL) {
+		munmap(m->addr, m->len);
+		m->addr = NULL;
+	}
+
+	m->len = 0;
+}
+
+/*
+ * Map the whole file again if its size changed since it was last mapped
+ * Returns 0 or an errno value
+ */
+static int mapping_refresh(mapping *m) {
+	struct stat st;
+	void *addr;
+
+	if(m->fd < 0) {
+		return EBADF;
+	}
+
+	if(fstat(m->fd, &st) != 0) {
+		return errno;
+	}
+
+	if((size_t)st.st_size == m->len) {
+		return 0;
+	}
+
+	mapping_unmap(m);
+
+	if(st.st_size == 0) {
+		return 0;
+	}
+
+	addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, m->fd, 0);
+
+	if(addr == MAP_FAILED) {
+		return errno;
+	}
+
+	m->addr = addr;
+	m->len = st.st_size;
+	/* Lookups into indices and archives jump around, so don't read ahead */
+	posix_madvise(m->addr, m->len, POSIX_MADV_RANDOM);
+	return 0;
+}
+
+/*
+ * Make sure the first `want` bytes are mapped, if the file is that long
+ * Returns how many bytes may be read from the start of the mapping. Only
+ * reads past the end of the mapping look at the file again, so a file must
+ * not shrink under a mapping. Callers changing a file in place close or remap
+ * any mappings of it first.
+ */
+static size_t mapping_covers(mapping *m, size_t want) {
+	if(want > m->len) {
+		/* On failure m->len still describes what is mapped, if anything */
+		mapping_refresh(m);
+	}
+
+	return m->len;
+}
+
+static mapping *check_mapping(lua_State *L, int idx) {
+	mapping *m = luaL_checkudata(L, idx, MAPPING_MT);
+	luaL_argcheck(L, m->fd >= 0, idx, "attempt to use a closed mapping");
+	return m;
+}
+
+/*
+ * Map a file into memory
+ * (file) -> mapping
+ *
+ * The mapping keeps its own file descriptor, the file handle may be closed
+ * afterwards. It grows with the file as reads past its end are attempted.
+ */
+static int lc_mmap(lua_State *L) {
+	FILE *f = *(FILE **) luaL_checkudata(L, 1, LUA_FILEHANDLE);
+	mapping *m;
+	int err;
+
+	m = lua_newuserdata(L, sizeof(mapping));
+	m->fd = -1;
+	m->addr = NULL;
+	m->len = 0;
+	luaL_setmetatable(L, MAPPING_MT);
+
+	if((m->fd = dup(fileno(f))) < 0) {
+		err = errno;
+	} else {
+		err = mapping_refresh(m);
+	}
+
+	if(err != 0) {
+		if(m->fd >= 0) {
+			close(m->fd);
+			m->fd = -1;
+		}
+
+		luaL_pushfail(L);
+		lua_pushstring(L, strerror(err));
+		lua_pushinteger(L, err);
+		return 3;
+	}
+
+	return 1;
+}
+
+/*
+ * Bytes i to j of the file, like string.sub() but not with negative indices
+ * (mapping, integer, integer?) -> string
+ */
+static int lc_mapping_sub(lua_State *L) {
+	mapping *m = check_mapping(L, 1);
+	lua_Integer i = luaL_checkinteger(L, 2);
+	lua_Integer j = luaL_optinteger(L, 3, (lua_Integer)m->len);
+	size_t avail;
+
+	luaL_argcheck(L, i >= 1, 2, "positive integer expected");
+
+	if(j < i) {
+		lua_pushliteral(L, "");
+		return 1;
+	}
+
+	avail = mapping_covers(m, (size_t)j);
+
+	if((size_t)j > avail) {
+		j = (lua_Integer)avail;
+
+		if(j < i) {
+			lua_pushliteral(L, "");
+			return 1;
+		}
+	}
+
+	lua_pushlstring(L, m->addr + i - 1, (size_t)(j - i + 1));
+	return 1;
+}
+
+/*
+ * Decode the n-th native size_t, i.e. string.unpack("T") at (n * packsize("T")) + 1
+ * (mapping, integer) -> integer?
+ */
+static int lc_mapping_offset(lua_State *L) {
+	mapping *m = check_mapping(L, 1);
+	lua_Integer n = luaL_checkinteger(L, 2);
+	size_t v, need;
+
+	if(n < 0 || (size_t)n > (SIZE_MAX / sizeof(size_t)) - 1) {
+		return 0;
+	}
+
+	need = ((size_t)n + 1) * sizeof(size_t);
+
+	if(mapping_covers(m, need) < need) {
+		return 0;
+	}
+
+	memcpy(&v, m->addr + n * sizeof(size_t), sizeof(size_t));
+	lua_pushinteger(L, (lua_Integer)v);
+	return 1;
+}
+
+/* Number of whole size_t entries, after catching up with the file */
+static int lc_mapping_entries(lua_State *L) {
+	mapping *m = check_mapping(L, 1);
+	mapping_refresh(m);
+	lua_pushinteger(L, (lua_Integer)(m->len / sizeof(size_t)));
+	return 1;
+}
+
+static int lc_mapping_size(lua_State *L) {
+	mapping *m = check_mapping(L, 1);
+	lua_pushinteger(L, (lua_Integer)m->len);
+	return 1;
+}
+
+/*
+ * Catch up with the size of the file
+ * (mapping) -> integer
+ */
+static int lc_mapping_remap(lua_State *L) {
+	mapping *m = check_mapping(L, 1);
+	int err = mapping_refresh(m);
+
+	if(err != 0) {
+		luaL_pushfail(L);
+		lua_pushstring(L, strerror(err));
+		lua_pushinteger(L, err);
+		return 3;
+	}
+
+	lua_pushinteger(L, (lua_Integer)m->len);
+	return 1;
+}
+
+/*
+ * Tell the kernel how the mapping is going to be read
+ * (mapping, "normal"|"random"|"sequential"|"willneed"|"dontneed") -> true
+ */
+static int lc_mapping_advise(lua_State *L) {
+	mapping *m = check_mapping(L, 1);
+	int advice = advice_values[luaL_checkoption(L, 2, NULL, advice_names)];
+	int err;
+
+	if(m->addr == NULL) {
+		lua_pushboolean(L, 1);
+		return 1;
+	}
+
+	if((err = posix_madvise(m->addr, m->len, advice)) != 0) {
+		luaL_pushfail(L);
+		lua_pushstring(L, strerror(err));
+		lua_pushinteger(L, err);
+		return 3;
+	}
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static int lc_mapping_close(lua_State *L) {
+	mapping *m = luaL_checkudata(L, 1, MAPPING_MT);
+
+	mapping_unmap(m);
+
+	if(m->fd >= 0) {
+		close(m->fd);
+		m->fd = -1;
+	}
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static int lc_mapping_tostring(lua_State *L) {
+	mapping *m = luaL_checkudata(L, 1, MAPPING_MT);
+
+	if(m->fd < 0) {
+		lua_pushliteral(L, "mapping (closed)");
+	} else {
+		lua_pushfstring(L, "mapping: %p %d bytes", m, (int)m->len);
+	}
+
+	return 1;
+}
+
 static int lc_isatty(lua_State *L) {
 	FILE *f = *(FILE **) luaL_checkudata(L, 1, LUA_FILEHANDLE);
 	const int fd = fileno(f);
@@ -923,6 +1901,8 @@ int luaopen_prosody_util_pposix(lua_State *L) {
 		{ "abort", lc_abort },
 
 		{ "daemonize", lc_daemonize },
+		{ "fork", lc_fork },
+		{ "waitpid", lc_waitpid },
 
 		{ "syslog_open", lc_syslog_open },
 		{ "syslog_close", lc_syslog_close },
@@ -951,18 +1931,51 @@ int luaopen_prosody_util_pposix(lua_State *L) {
 
 		{ "setenv", lc_setenv },
 
-#ifdef WITH_MALLINFO
 		{ "meminfo", lc_meminfo },
-#endif
+		{ "pool_allocator", lc_pool_allocator },
+		{ "new_memtag", lc_new_memtag },
+		{ "memtag", lc_memtag },
 
 		{ "atomic_append", lc_atomic_append },
+		{ "atomic_append_batch", lc_atomic_append_batch },
 		{ "remove_blocks", lc_remove_blocks },
 
+		{ "mmap", lc_mmap },
+
 		{ "isatty", lc_isatty },
 
 		{ NULL, NULL }
 	};
 
+	luaL_Reg mapping_methods[] = {
+		{ "sub", lc_mapping_sub },
+		{ "offset", lc_mapping_offset },
+		{ "entries", lc_mapping_entries },
+		{ "size", lc_mapping_size },
+		{ "remap", lc_mapping_remap },
+		{ "advise", lc_mapping_advise },
+		{ "close", lc_mapping_close },
+		{ NULL, NULL }
+	};
+
+	if(luaL_newmetatable(L, MAPPING_MT)) {
+		lua_pushcfunction(L, lc_mapping_tostring);
+		lua_setfield(L, -2, "__tostring");
+		lua_pushcfunction(L, lc_mapping_size);
+		lua_setfield(L, -2, "__len");
+		lua_pushcfunction(L, lc_mapping_close);
+		lua_setfield(L, -2, "__gc");
+#if (LUA_VERSION_NUM >= 504)
+		lua_pushcfunction(L, lc_mapping_close);
+		lua_setfield(L, -2, "__close");
+#endif
+		lua_newtable(L);
+		luaL_setfuncs(L, mapping_methods, 0);
+		lua_setfield(L, -2, "__index");
+	}
+
+	lua_pop(L, 1);
+
 	lua_newtable(L);
 	luaL_setfuncs(L, exports, 0);
 
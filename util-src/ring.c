@@ -0,0 +1,392 @@
+/*
+ * Consistent hash rings
+ *
+ * Every node is placed on the ring at a number of 64 bit points, kept in one
+ * sorted array. A key belongs to the node owning the first point after the
+ * key's own hash, wrapping around at the end. Nodes are added by merging
+ * their points in and removed by filtering them out, so membership changes
+ * never rehash the other nodes.
+ *
+ * Node names live in the uservalue table, as name -> id and id -> name.
+ *
+ * This project is MIT licensed. Please see the
+ * COPYING file in the source package for more information.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#if (LUA_VERSION_NUM < 504)
+#define luaL_pushfail lua_pushnil
+#endif
+
+#define RING_MT "util.ring"
+
+typedef struct {
+	uint64_t point;
+	uint32_t node;
+} ring_point;
+
+typedef struct {
+	ring_point *points;
+	size_t count;
+	size_t alloc;
+	uint32_t next_node; /* id for the next node added, 0 is never used */
+	size_t nodes;
+} ring;
+
+/* FNV-1a, with the splitmix64 finalizer to spread its output over the ring */
+#define FNV_OFFSET UINT64_C(0xcbf29ce484222325)
+#define FNV_PRIME UINT64_C(0x100000001b3)
+
+static uint64_t fnv_update(uint64_t h, const char *s, size_t len) {
+	size_t i;
+
+	for(i = 0; i < len; i++) {
+		h ^= (unsigned char)s[i];
+		h *= FNV_PRIME;
+	}
+
+	return h;
+}
+
+static uint64_t hash_finish(uint64_t h) {
+	h ^= h >> 30;
+	h *= UINT64_C(0xbf58476d1ce4e5b9);
+	h ^= h >> 27;
+	h *= UINT64_C(0x94d049bb133111eb);
+	h ^= h >> 31;
+	return h;
+}
+
+static uint64_t hash_string(const char *s, size_t len) {
+	return hash_finish(fnv_update(FNV_OFFSET, s, len));
+}
+
+/* The point of a replica is the hash of "name:replica" */
+static uint64_t hash_replica(const char *name, size_t len, lua_Integer replica) {
+	char digits[24];
+	size_t n = sizeof(digits);
+	uint64_t h = fnv_update(FNV_OFFSET, name, len);
+
+	do {
+		digits[--n] = '0' + replica % 10;
+		replica /= 10;
+	} while(replica > 0);
+
+	h = fnv_update(h, ":", 1);
+	return hash_finish(fnv_update(h, digits + n, sizeof(digits) - n));
+}
+
+/* The leading 8 bytes of a hash from elsewhere, as a big endian number */
+static uint64_t check_hash(lua_State *L, int idx) {
+	size_t len, i;
+	const unsigned char *s = (const unsigned char *)luaL_checklstring(L, idx, &len);
+	uint64_t h = 0;
+
+	for(i = 0; i < 8; i++) {
+		h = (h << 8) | (i < len ? s[i] : 0);
+	}
+
+	return h;
+}
+
+static int compare_points(const void *a, const void *b) {
+	uint64_t pa = ((const ring_point *)a)->point, pb = ((const ring_point *)b)->point;
+	return pa < pb ? -1 : pa > pb;
+}
+
+/* Index of the first point strictly after h, or 0 past the end */
+static size_t ring_search(const ring *r, uint64_t h) {
+	size_t lo = 0, hi = r->count;
+
+	while(lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if(r->points[mid].point <= h) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return lo == r->count ? 0 : lo;
+}
+
+/* Merge `added` sorted points into the array, which has room for them */
+static void ring_merge(ring *r, const ring_point *added_points, size_t added) {
+	ring_point *p = r->points;
+	size_t i = r->count, j = added, out = r->count + added;
+
+	while(j > 0) {
+		if(i > 0 && p[i - 1].point > added_points[j - 1].point) {
+			p[--out] = p[--i];
+		} else {
+			p[--out] = added_points[--j];
+		}
+	}
+
+	r->count += added;
+}
+
+static void ring_reserve(lua_State *L, ring *r, size_t extra) {
+	size_t alloc;
+	ring_point *points;
+
+	if(r->alloc - r->count >= extra) {
+		return;
+	}
+
+	alloc = r->alloc ? r->alloc : 64;
+
+	while(alloc - r->count < extra) {
+		alloc *= 2;
+	}
+
+	points = realloc(r->points, alloc * sizeof(ring_point));
+
+	if(points == NULL) {
+		luaL_error(L, "not enough memory");
+	}
+
+	r->points = points;
+	r->alloc = alloc;
+}
+
+/* Push the name of the node owning the point at index i */
+static void push_owner(lua_State *L, const ring *r, size_t i) {
+	lua_getuservalue(L, 1);
+	lua_rawgeti(L, -1, r->points[i].node);
+	lua_remove(L, -2);
+}
+
+/*
+ * Add a node
+ * (ring, string, integer) -> boolean
+ * (ring, string, { string }) -> boolean
+ *
+ * Places the node at the given number of points, hashed from its name, or at
+ * the points given by an array of hashes computed elsewhere, of which the
+ * first 8 bytes are used. Returns false if the node is already on the ring.
+ */
+static int Ladd(lua_State *L) {
+	ring *r = luaL_checkudata(L, 1, RING_MT);
+	size_t len, added, i;
+	const char *name = luaL_checklstring(L, 2, &len);
+	int custom = lua_istable(L, 3);
+	lua_Integer replicas = custom ? (lua_Integer)lua_rawlen(L, 3) : luaL_checkinteger(L, 3);
+	ring_point *added_points;
+	uint32_t node;
+
+	luaL_argcheck(L, replicas >= 0, 3, "number of replicas must be non-negative");
+
+	lua_getuservalue(L, 1);
+	lua_pushvalue(L, 2);
+	lua_rawget(L, -2);
+
+	if(!lua_isnil(L, -1)) {
+		lua_pushboolean(L, 0);
+		return 1;
+	}
+
+	lua_pop(L, 1);
+
+	if(r->next_node == UINT32_MAX) {
+		return luaL_error(L, "too many nodes");
+	}
+
+	node = r->next_node++;
+	added = (size_t)replicas;
+	ring_reserve(L, r, added);
+
+	/* Owned by the GC, so that a bad hash part way through doesn't leak */
+	added_points = lua_newuserdata(L, added * sizeof(ring_point));
+
+	for(i = 0; i < added; i++) {
+		ring_point *p = &added_points[i];
+
+		if(custom) {
+			lua_rawgeti(L, 3, i + 1);
+			p->point = check_hash(L, -1);
+			lua_pop(L, 1);
+		} else {
+			p->point = hash_replica(name, len, i + 1);
+		}
+
+		p->node = node;
+	}
+
+	qsort(added_points, added, sizeof(ring_point), compare_points);
+	ring_merge(r, added_points, added);
+	lua_pop(L, 1);
+	r->nodes++;
+
+	lua_pushvalue(L, 2);
+	lua_pushinteger(L, node);
+	lua_rawset(L, -3);
+	lua_pushvalue(L, 2);
+	lua_rawseti(L, -2, node);
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/*
+ * Remove a node and all its points
+ * (ring, string) -> boolean
+ */
+static int Lremove(lua_State *L) {
+	ring *r = luaL_checkudata(L, 1, RING_MT);
+	size_t i, out = 0;
+	uint32_t node;
+
+	luaL_checkstring(L, 2);
+	lua_getuservalue(L, 1);
+	lua_pushvalue(L, 2);
+	lua_rawget(L, -2);
+
+	if(lua_isnil(L, -1)) {
+		lua_pushboolean(L, 0);
+		return 1;
+	}
+
+	node = (uint32_t)lua_tointeger(L, -1);
+	lua_pop(L, 1);
+
+	for(i = 0; i < r->count; i++) {
+		if(r->points[i].node != node) {
+			r->points[out++] = r->points[i];
+		}
+	}
+
+	r->count = out;
+	r->nodes--;
+
+	lua_pushvalue(L, 2);
+	lua_pushnil(L);
+	lua_rawset(L, -3);
+	lua_pushnil(L);
+	lua_rawseti(L, -2, node);
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/*
+ * Find the node a key belongs to
+ * (ring, string) -> string?
+ */
+static int Lget(lua_State *L) {
+	ring *r = luaL_checkudata(L, 1, RING_MT);
+	size_t len;
+	const char *key = luaL_checklstring(L, 2, &len);
+
+	if(r->count == 0) {
+		luaL_pushfail(L);
+		return 1;
+	}
+
+	push_owner(L, r, ring_search(r, hash_string(key, len)));
+	return 1;
+}
+
+/*
+ * Find the node for a key hashed elsewhere
+ * (ring, string) -> string?
+ *
+ * Takes a hash from the same function as the points given to :add().
+ */
+static int Lget_hash(lua_State *L) {
+	ring *r = luaL_checkudata(L, 1, RING_MT);
+	uint64_t h = check_hash(L, 2);
+
+	if(r->count == 0) {
+		luaL_pushfail(L);
+		return 1;
+	}
+
+	push_owner(L, r, ring_search(r, h));
+	return 1;
+}
+
+static int Llength(lua_State *L) {
+	ring *r = luaL_checkudata(L, 1, RING_MT);
+	lua_pushinteger(L, r->count);
+	return 1;
+}
+
+static int Ltostring(lua_State *L) {
+	ring *r = luaL_checkudata(L, 1, RING_MT);
+	lua_pushfstring(L, "ring: %p %d nodes %d points", r, (int)r->nodes, (int)r->count);
+	return 1;
+}
+
+static int Lgc(lua_State *L) {
+	ring *r = luaL_checkudata(L, 1, RING_MT);
+	free(r->points);
+	r->points = NULL;
+	r->count = r->alloc = 0;
+	return 0;
+}
+
+/*
+ * Create an empty ring
+ * () -> ring
+ */
+static int Lnew(lua_State *L) {
+	ring *r = lua_newuserdata(L, sizeof(ring));
+
+	r->points = NULL;
+	r->count = r->alloc = 0;
+	r->next_node = 1;
+	r->nodes = 0;
+
+	luaL_getmetatable(L, RING_MT);
+	lua_setmetatable(L, -2);
+
+	lua_createtable(L, 0, 0); /* node names and ids */
+	lua_setuservalue(L, -2);
+
+	return 1;
+}
+
+int luaopen_prosody_util_ring(lua_State *L) {
+	luaL_checkversion(L);
+
+	if(luaL_newmetatable(L, RING_MT)) {
+		lua_pushcfunction(L, Ltostring);
+		lua_setfield(L, -2, "__tostring");
+		lua_pushcfunction(L, Llength);
+		lua_setfield(L, -2, "__len");
+		lua_pushcfunction(L, Lgc);
+		lua_setfield(L, -2, "__gc");
+
+		lua_createtable(L, 0, 5); /* __index */
+		{
+			lua_pushcfunction(L, Ladd);
+			lua_setfield(L, -2, "add");
+			lua_pushcfunction(L, Lremove);
+			lua_setfield(L, -2, "remove");
+			lua_pushcfunction(L, Lget);
+			lua_setfield(L, -2, "get");
+			lua_pushcfunction(L, Lget_hash);
+			lua_setfield(L, -2, "get_hash");
+			lua_pushcfunction(L, Llength);
+			lua_setfield(L, -2, "length");
+		}
+		lua_setfield(L, -2, "__index");
+	}
+
+	lua_createtable(L, 0, 1);
+	lua_pushcfunction(L, Lnew);
+	lua_setfield(L, -2, "new");
+	return 1;
+}
+
+int luaopen_util_ring(lua_State *L) {
+	return luaopen_prosody_util_ring(L);
+}
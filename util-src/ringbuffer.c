@@ -2,6 +2,8 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <sys/uio.h>
 
 #include <lua.h>
 #include <lauxlib.h>
@@ -10,11 +12,17 @@
 #define luaL_pushfail lua_pushnil
 #endif
 
+/* Longest needle for which the scan offset is remembered between searches */
+#define RB_SCAN_MAX 16
+
 typedef struct {
 	size_t rpos; /* read position */
 	size_t wpos; /* write position */
 	size_t alen; /* allocated size */
 	size_t blen; /* current content size */
+	size_t scanned; /* offset up to which the last searched needle can't start */
+	size_t scan_len; /* length of the last searched needle, 0 if none */
+	char scan_needle[RB_SCAN_MAX];
 	char buffer[];
 } ringbuffer;
 
@@ -67,41 +75,91 @@ static int calc_splice_positions(const ringbuffer *b, long start, long end, long
 	return 1;
 }
 
-static void writechar(ringbuffer *b, char c) {
-	b->blen++;
-	b->buffer[(b->wpos++) % b->alen] = c;
-}
-
 /* make sure position counters stay within the allocation */
 static void modpos(ringbuffer *b) {
 	b->rpos = b->rpos % b->alen;
 	b->wpos = b->wpos % b->alen;
 }
 
+/* drop `r` bytes from the front of the buffer */
+static void consume(ringbuffer *b, size_t r) {
+	b->blen -= r;
+	b->rpos += r;
+	modpos(b);
+
+	if(r < b->scanned) {
+		b->scanned -= r;
+	} else {
+		b->scanned = 0;
+	}
+}
+
+/* offset from the read position to a position within the allocation */
+static size_t offset_pos(const ringbuffer *b, size_t i) {
+	size_t pos = b->rpos + i;
+	return pos >= b->alen ? pos - b->alen : pos;
+}
+
+/* compare the needle at offset `i`, which may straddle the wrap point */
+static int match_at(const ringbuffer *b, size_t i, const char *s, size_t l) {
+	size_t pos = offset_pos(b, i);
+	size_t first = b->alen - pos;
+
+	if(first >= l) {
+		return memcmp(&b->buffer[pos], s, l) == 0;
+	}
+
+	return memcmp(&b->buffer[pos], s, first) == 0 && memcmp(b->buffer, s + first, l - first) == 0;
+}
+
 static int find(ringbuffer *b, const char *s, size_t l) {
-	size_t i, j;
-	int m;
+	size_t i = 0, last;
 
-	if(b->rpos == b->wpos) { /* empty */
+	if(l == 0 || l > b->blen) {
 		return 0;
 	}
 
-	/* look for a matching first byte */
-	for(i = 0; i <= b->blen - l; i++) {
-		if(b->buffer[(b->rpos + i) % b->alen] == *s) {
-			m = 1;
+	/* skip what an earlier search for the same needle already covered */
+	if(l == b->scan_len && memcmp(s, b->scan_needle, l) == 0) {
+		i = b->scanned;
+	}
 
-			/* check if the following byte also match */
-			for(j = 1; j < l; j++)
-				if(b->buffer[(b->rpos + i + j) % b->alen] != s[j]) {
-					m = 0;
-					break;
-				}
+	last = b->blen - l; /* last offset where a match can start */
 
-			if(m) {
-				return i + l;
-			}
+	/* scan each contiguous span for the first byte */
+	while(i <= last) {
+		size_t pos = offset_pos(b, i);
+		size_t span = b->alen - pos;
+		const char *p;
+
+		if(span > last - i + 1) {
+			span = last - i + 1;
 		}
+
+		p = memchr(&b->buffer[pos], *s, span);
+
+		if(p == NULL) {
+			i += span;
+			continue;
+		}
+
+		i += p - &b->buffer[pos];
+
+		if(match_at(b, i, s, l)) {
+			break;
+		}
+
+		i++;
+	}
+
+	if(l <= RB_SCAN_MAX) {
+		memcpy(b->scan_needle, s, l);
+		b->scan_len = l;
+		b->scanned = i;
+	}
+
+	if(i <= last) {
+		return i + l;
 	}
 
 	return 0;
@@ -138,9 +196,7 @@ static int rb_discard(lua_State *L) {
 		return 1;
 	}
 
-	b->blen -= r;
-	b->rpos += r;
-	modpos(b);
+	consume(b, r);
 
 	lua_pushboolean(L, 1);
 	return 1;
@@ -170,9 +226,7 @@ static int rb_read(lua_State *L) {
 	}
 
 	if(!peek) {
-		b->blen -= r;
-		b->rpos += r;
-		modpos(b);
+		consume(b, r);
 	}
 
 	return 1;
@@ -202,7 +256,7 @@ static int rb_readuntil(lua_State *L) {
  * (buffer, string) -> integer
  */
 static int rb_write(lua_State *L) {
-	size_t l, w = 0;
+	size_t l;
 	ringbuffer *b = luaL_checkudata(L, 1, "ringbuffer_mt");
 	const char *s = luaL_checklstring(L, 2, &l);
 
@@ -212,15 +266,128 @@ static int rb_write(lua_State *L) {
 		return 1;
 	}
 
-	while(l-- > 0) {
-		writechar(b, *s++);
-		w++;
+	if(l > b->alen - b->wpos) {
+		/* Wraps around to the beginning of the buffer */
+		size_t first = b->alen - b->wpos;
+		memcpy(&b->buffer[b->wpos], s, first);
+		memcpy(b->buffer, s + first, l - first);
+	} else {
+		memcpy(&b->buffer[b->wpos], s, l);
+	}
+
+	b->blen += l;
+	b->wpos += l;
+	modpos(b);
+
+	lua_pushinteger(L, l);
+
+	return 1;
+}
+
+/* describe up to `max` bytes of free space as at most two segments */
+static int free_segments(ringbuffer *b, size_t max, struct iovec *iov) {
+	size_t n = b->alen - b->blen;
+	size_t first = b->alen - b->wpos;
+
+	if(n > max) {
+		n = max;
+	}
+
+	iov[0].iov_base = &b->buffer[b->wpos];
+
+	if(n <= first) {
+		iov[0].iov_len = n;
+		return 1;
+	}
+
+	iov[0].iov_len = first;
+	iov[1].iov_base = b->buffer;
+	iov[1].iov_len = n - first;
+	return 2;
+}
+
+/* describe the buffered data as at most two segments */
+static int used_segments(ringbuffer *b, struct iovec *iov) {
+	size_t first = b->alen - b->rpos;
+
+	iov[0].iov_base = &b->buffer[b->rpos];
+
+	if(b->blen <= first) {
+		iov[0].iov_len = b->blen;
+		return 1;
+	}
+
+	iov[0].iov_len = first;
+	iov[1].iov_base = b->buffer;
+	iov[1].iov_len = b->blen - first;
+	return 2;
+}
+
+/*
+ * Read from a file descriptor straight into the free space of the buffer
+ * (buffer, fd, number?) -> integer
+ * Returns 0 at end of file
+ */
+static int rb_recv(lua_State *L) {
+	ringbuffer *b = luaL_checkudata(L, 1, "ringbuffer_mt");
+	int fd = luaL_checkinteger(L, 2);
+	lua_Integer max = luaL_optinteger(L, 3, b->alen);
+	struct iovec iov[2];
+	ssize_t r;
+
+	luaL_argcheck(L, max > 0, 3, "positive integer expected");
+
+	if(b->blen == b->alen) {
+		luaL_pushfail(L);
+		lua_pushstring(L, strerror(ENOBUFS));
+		lua_pushinteger(L, ENOBUFS);
+		return 3;
+	}
+
+	r = readv(fd, iov, free_segments(b, (size_t)max, iov));
+
+	if(r < 0) {
+		luaL_pushfail(L);
+		lua_pushstring(L, strerror(errno));
+		lua_pushinteger(L, errno);
+		return 3;
 	}
 
+	b->blen += r;
+	b->wpos += r;
 	modpos(b);
 
-	lua_pushinteger(L, w);
+	lua_pushinteger(L, r);
+	return 1;
+}
+
+/*
+ * Write buffered data to a file descriptor, dropping what was written
+ * (buffer, fd) -> integer
+ */
+static int rb_send(lua_State *L) {
+	ringbuffer *b = luaL_checkudata(L, 1, "ringbuffer_mt");
+	int fd = luaL_checkinteger(L, 2);
+	struct iovec iov[2];
+	ssize_t r;
+
+	if(b->blen == 0) {
+		lua_pushinteger(L, 0);
+		return 1;
+	}
+
+	r = writev(fd, iov, used_segments(b, iov));
+
+	if(r < 0) {
+		luaL_pushfail(L);
+		lua_pushstring(L, strerror(errno));
+		lua_pushinteger(L, errno);
+		return 3;
+	}
+
+	consume(b, r);
 
+	lua_pushinteger(L, r);
 	return 1;
 }
 
@@ -306,6 +473,8 @@ static int rb_new(lua_State *L) {
 	b->wpos = 0;
 	b->alen = size;
 	b->blen = 0;
+	b->scanned = 0;
+	b->scan_len = 0;
 
 	luaL_getmetatable(L, "ringbuffer_mt");
 	lua_setmetatable(L, -2);
@@ -322,7 +491,7 @@ int luaopen_prosody_util_ringbuffer(lua_State *L) {
 		lua_pushcfunction(L, rb_length);
 		lua_setfield(L, -2, "__len");
 
-		lua_createtable(L, 0, 7); /* __index */
+		lua_createtable(L, 0, 12); /* __index */
 		{
 			lua_pushcfunction(L, rb_find);
 			lua_setfield(L, -2, "find");
@@ -334,6 +503,10 @@ int luaopen_prosody_util_ringbuffer(lua_State *L) {
 			lua_setfield(L, -2, "readuntil");
 			lua_pushcfunction(L, rb_write);
 			lua_setfield(L, -2, "write");
+			lua_pushcfunction(L, rb_recv);
+			lua_setfield(L, -2, "recv");
+			lua_pushcfunction(L, rb_send);
+			lua_setfield(L, -2, "send");
 			lua_pushcfunction(L, rb_size);
 			lua_setfield(L, -2, "size");
 			lua_pushcfunction(L, rb_length);
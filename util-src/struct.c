@@ -125,10 +125,10 @@ static size_t optsize (lua_State *L, char opt, const char **fmt) {
 ** return number of bytes needed to align an element of size 'size'
 ** at current position 'len'
 */
-static int gettoalign (size_t len, Header *h, int opt, size_t size) {
+static int gettoalign (size_t len, int align, int opt, size_t size) {
   if (size == 0 || opt == 'c') return 0;
-  if (size > (size_t)h->align)
-    size = h->align;  /* respect max. alignment */
+  if (size > (size_t)align)
+    size = align;  /* respect max. alignment */
   return (size - (len & (size - 1))) & (size - 1);
 }
 
@@ -157,6 +157,84 @@ static void controloptions (lua_State *L, int opt, const char **fmt,
 }
 
 
+/*
+** {======================================================
+** Formats are parsed once into a list of items, with the endianness and
+** alignment in effect for each, which pack and unpack then walk
+** =======================================================
+*/
+
+typedef struct Item {
+  char opt;
+  char endian;
+  int align;
+  size_t size;
+} Item;
+
+
+typedef struct Format {
+  size_t nitems;
+  size_t fixedsize;  /* total size, if 'fixed' */
+  int fixed;  /* no 's' or 'c0' items */
+  Item items[1];
+} Format;
+
+
+#define FORMAT_MT	"util.struct format"
+
+/* formats up to this long are parsed on the C stack by the plain functions */
+#define STACKITEMS	32
+
+#define formatsize(n)	(offsetof(Format, items) + (n) * sizeof(Item))
+
+
+/* 'f' must have room for at least strlen(fmt) items */
+static void parseformat (lua_State *L, const char *fmt, Format *f) {
+  Header h;
+  size_t pos = 0;
+  defaultoptions(&h);
+  f->nitems = 0;
+  f->fixed = 1;
+  while (*fmt != '\0') {
+    int opt = *fmt++;
+    size_t size = optsize(L, opt, &fmt);
+    switch (opt) {
+      case 'b': case 'B': case 'h': case 'H': case 'l': case 'L':
+      case 'T': case 'i': case 'I': case 'x': case 'f': case 'd':
+      case 'c': case 's': {
+        Item *item = &f->items[f->nitems++];
+        item->opt = opt;
+        item->endian = h.endian;
+        item->align = h.align;
+        item->size = size;
+        if (opt == 's' || (opt == 'c' && size == 0))
+          f->fixed = 0;
+        pos += gettoalign(pos, h.align, opt, size) + size;
+        break;
+      }
+      default: controloptions(L, opt, &fmt, &h);
+    }
+  }
+  f->fixedsize = pos;
+}
+
+
+/* parse the format at index 1, on the stack if short */
+#define checkformat(L, stackf) \
+  (lua_type(L, 1) == LUA_TUSERDATA ? \
+    (Format *)luaL_checkudata(L, 1, FORMAT_MT) : tempformat(L, stackf))
+
+static Format *tempformat (lua_State *L, Format *stackf) {
+  size_t len;
+  const char *fmt = luaL_checklstring(L, 1, &len);
+  Format *f = stackf;
+  if (len > STACKITEMS)
+    f = (Format *)lua_newuserdata(L, formatsize(len));
+  parseformat(L, fmt, f);
+  return f;
+}
+
+
 static void putinteger (lua_State *L, luaL_Buffer *b, int arg, int endian,
                         int size) {
   lua_Number n = luaL_checknumber(L, arg);
@@ -196,25 +274,24 @@ static void correctbytes (char *b, int size, int endian) {
 }
 
 
-static int b_pack (lua_State *L) {
+/* pack the arguments from index 2 on */
+static int packformat (lua_State *L, const Format *fmt) {
   luaL_Buffer b;
-  const char *fmt = luaL_checkstring(L, 1);
-  Header h;
   int arg = 2;
-  size_t totalsize = 0;
-  defaultoptions(&h);
+  size_t i, totalsize = 0;
   lua_pushnil(L);  /* mark to separate arguments from string buffer */
   luaL_buffinit(L, &b);
-  while (*fmt != '\0') {
-    int opt = *fmt++;
-    size_t size = optsize(L, opt, &fmt);
-    int toalign = gettoalign(totalsize, &h, opt, size);
+  for (i = 0; i < fmt->nitems; i++) {
+    const Item *item = &fmt->items[i];
+    int opt = item->opt;
+    size_t size = item->size;
+    int toalign = gettoalign(totalsize, item->align, opt, size);
     totalsize += toalign;
     while (toalign-- > 0) luaL_addchar(&b, '\0');
     switch (opt) {
       case 'b': case 'B': case 'h': case 'H':
       case 'l': case 'L': case 'T': case 'i': case 'I': {  /* integer types */
-        putinteger(L, &b, arg++, h.endian, size);
+        putinteger(L, &b, arg++, item->endian, size);
         break;
       }
       case 'x': {
@@ -223,13 +300,13 @@ static int b_pack (lua_State *L) {
       }
       case 'f': {
         float f = (float)luaL_checknumber(L, arg++);
-        correctbytes((char *)&f, size, h.endian);
+        correctbytes((char *)&f, size, item->endian);
         luaL_addlstring(&b, (char *)&f, size);
         break;
       }
       case 'd': {
         double d = luaL_checknumber(L, arg++);
-        correctbytes((char *)&d, size, h.endian);
+        correctbytes((char *)&d, size, item->endian);
         luaL_addlstring(&b, (char *)&d, size);
         break;
       }
@@ -245,7 +322,6 @@ static int b_pack (lua_State *L) {
         }
         break;
       }
-      default: controloptions(L, opt, &fmt, &h);
     }
     totalsize += size;
   }
@@ -254,6 +330,12 @@ static int b_pack (lua_State *L) {
 }
 
 
+static int b_pack (lua_State *L) {
+  union { Format f; char buf[formatsize(STACKITEMS)]; } stackf;
+  return packformat(L, checkformat(L, &stackf.f));
+}
+
+
 static lua_Number getinteger (const char *buff, int endian,
                         int issigned, int size) {
   Uinttype l = 0;
@@ -281,28 +363,32 @@ static lua_Number getinteger (const char *buff, int endian,
 }
 
 
-static int b_unpack (lua_State *L) {
-  Header h;
-  const char *fmt = luaL_checkstring(L, 1);
+/*
+** unpack the string at index 'darg', starting at 'darg'+1; values go onto
+** the stack, or into the table at index 'into' when that is not 0
+*/
+static int unpackformat (lua_State *L, const Format *fmt, int darg, int into) {
   size_t ld;
-  const char *data = luaL_checklstring(L, 2, &ld);
-  size_t pos = (size_t)luaL_optinteger(L, 3, 1) - 1;
+  const char *data = luaL_checklstring(L, darg, &ld);
+  size_t pos = (size_t)luaL_optinteger(L, darg + 1, 1) - 1;
+  size_t i;
   int n = 0;  /* number of results */
-  luaL_argcheck(L, pos <= ld, 3, "initial position out of string");
-  defaultoptions(&h);
-  while (*fmt) {
-    int opt = *fmt++;
-    size_t size = optsize(L, opt, &fmt);
-    pos += gettoalign(pos, &h, opt, size);
-    luaL_argcheck(L, size <= ld - pos, 2, "data string too short");
+  luaL_argcheck(L, pos <= ld, darg + 1, "initial position out of string");
+  for (i = 0; i < fmt->nitems; i++) {
+    const Item *item = &fmt->items[i];
+    int opt = item->opt;
+    size_t size = item->size;
+    int pushed = 0;
+    pos += gettoalign(pos, item->align, opt, size);
+    luaL_argcheck(L, size <= ld - pos, darg, "data string too short");
     /* stack space for item + next position */
     luaL_checkstack(L, 2, "too many results");
     switch (opt) {
       case 'b': case 'B': case 'h': case 'H':
       case 'l': case 'L': case 'T': case 'i':  case 'I': {  /* integer types */
         int issigned = islower(opt);
-        lua_Number res = getinteger(data+pos, h.endian, issigned, size);
-        lua_pushnumber(L, res); n++;
+        lua_Number res = getinteger(data+pos, item->endian, issigned, size);
+        lua_pushnumber(L, res); pushed = 1;
         break;
       }
       case 'x': {
@@ -311,26 +397,32 @@ static int b_unpack (lua_State *L) {
       case 'f': {
         float f;
         memcpy(&f, data+pos, size);
-        correctbytes((char *)&f, sizeof(f), h.endian);
-        lua_pushnumber(L, f); n++;
+        correctbytes((char *)&f, sizeof(f), item->endian);
+        lua_pushnumber(L, f); pushed = 1;
         break;
       }
       case 'd': {
         double d;
         memcpy(&d, data+pos, size);
-        correctbytes((char *)&d, sizeof(d), h.endian);
-        lua_pushnumber(L, d); n++;
+        correctbytes((char *)&d, sizeof(d), item->endian);
+        lua_pushnumber(L, d); pushed = 1;
         break;
       }
       case 'c': {
         if (size == 0) {
+          if (into)
+            lua_rawgeti(L, into, n);
           if (n == 0 || !lua_isnumber(L, -1))
             luaL_error(L, "format 'c0' needs a previous size");
           size = lua_tonumber(L, -1);
           lua_pop(L, 1); n--;
-          luaL_argcheck(L, size <= ld - pos, 2, "data string too short");
+          if (into) {
+            lua_pushnil(L);
+            lua_rawseti(L, into, n + 1);
+          }
+          luaL_argcheck(L, size <= ld - pos, darg, "data string too short");
         }
-        lua_pushlstring(L, data+pos, size); n++;
+        lua_pushlstring(L, data+pos, size); pushed = 1;
         break;
       }
       case 's': {
@@ -338,36 +430,75 @@ static int b_unpack (lua_State *L) {
         if (e == NULL)
           luaL_error(L, "unfinished string in data");
         size = (e - (data+pos)) + 1;
-        lua_pushlstring(L, data+pos, size - 1); n++;
+        lua_pushlstring(L, data+pos, size - 1); pushed = 1;
         break;
       }
-      default: controloptions(L, opt, &fmt, &h);
+    }
+    if (pushed) {
+      n++;
+      if (into)
+        lua_rawseti(L, into, n);
     }
     pos += size;
   }
+  if (into) {
+    lua_pushvalue(L, into);
+    lua_pushinteger(L, pos + 1);  /* next position */
+    return 2;
+  }
   lua_pushinteger(L, pos + 1);  /* next position */
   return n + 1;
 }
 
 
+static int b_unpack (lua_State *L) {
+  union { Format f; char buf[formatsize(STACKITEMS)]; } stackf;
+  return unpackformat(L, checkformat(L, &stackf.f), 2, 0);
+}
+
+
 static int b_size (lua_State *L) {
-  Header h;
-  const char *fmt = luaL_checkstring(L, 1);
-  size_t pos = 0;
-  defaultoptions(&h);
-  while (*fmt) {
-    int opt = *fmt++;
-    size_t size = optsize(L, opt, &fmt);
-    pos += gettoalign(pos, &h, opt, size);
-    if (opt == 's')
+  union { Format f; char buf[formatsize(STACKITEMS)]; } stackf;
+  const Format *fmt = checkformat(L, &stackf.f);
+  size_t i;
+  for (i = 0; !fmt->fixed && i < fmt->nitems; i++) {
+    if (fmt->items[i].opt == 's')
       luaL_argerror(L, 1, "option 's' has no fixed size");
-    else if (opt == 'c' && size == 0)
+    else if (fmt->items[i].opt == 'c' && fmt->items[i].size == 0)
       luaL_argerror(L, 1, "option 'c0' has no fixed size");
-    if (!isalnum(opt))
-      controloptions(L, opt, &fmt, &h);
-    pos += size;
   }
-  lua_pushinteger(L, pos);
+  lua_pushinteger(L, fmt->fixedsize);
+  return 1;
+}
+
+
+/*
+** compile(fmt) -> format
+** format:pack(...), format:unpack(s [, pos]), format:size() and
+** format:unpack_into(t, s [, pos]), which stores the values in t[1..n]
+** and returns t and the next position
+*/
+static int b_compile (lua_State *L) {
+  size_t len;
+  const char *fmt = luaL_checklstring(L, 1, &len);
+  Format *f = (Format *)lua_newuserdata(L, formatsize(len > 0 ? len : 1));
+  parseformat(L, fmt, f);
+  luaL_getmetatable(L, FORMAT_MT);
+  lua_setmetatable(L, -2);
+  return 1;
+}
+
+
+static int f_unpack_into (lua_State *L) {
+  const Format *fmt = (const Format *)luaL_checkudata(L, 1, FORMAT_MT);
+  luaL_checktype(L, 2, LUA_TTABLE);
+  return unpackformat(L, fmt, 3, 2);
+}
+
+
+static int f_tostring (lua_State *L) {
+  const Format *fmt = (const Format *)luaL_checkudata(L, 1, FORMAT_MT);
+  lua_pushfstring(L, "struct format: %p", (const void *)fmt);
   return 1;
 }
 
@@ -379,6 +510,16 @@ static const struct luaL_Reg thislib[] = {
   {"pack", b_pack},
   {"unpack", b_unpack},
   {"size", b_size},
+  {"compile", b_compile},
+  {NULL, NULL}
+};
+
+
+static const struct luaL_Reg formatmethods[] = {
+  {"pack", b_pack},
+  {"unpack", b_unpack},
+  {"unpack_into", f_unpack_into},
+  {"size", b_size},
   {NULL, NULL}
 };
 
@@ -386,6 +527,12 @@ static const struct luaL_Reg thislib[] = {
 LUALIB_API int luaopen_util_struct (lua_State *L);
 
 LUALIB_API int luaopen_prosody_util_struct (lua_State *L) {
+  luaL_newmetatable(L, FORMAT_MT);
+  lua_pushcfunction(L, f_tostring);
+  lua_setfield(L, -2, "__tostring");
+  luaL_newlib(L, formatmethods);
+  lua_setfield(L, -2, "__index");
+  lua_pop(L, 1);
   luaL_newlib(L, thislib);
   return 1;
 }
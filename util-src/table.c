@@ -60,15 +60,187 @@ static int Lmove (lua_State *L) {
 	return 1;
 }
 
+/* Remove every key, leaving the allocated array and hash parts in place */
+static void clear_table(lua_State *L, int idx) {
+	idx = lua_absindex(L, idx);
+	lua_pushnil(L);
+
+	while(lua_next(L, idx) != 0) {
+		lua_pop(L, 1);
+		lua_pushvalue(L, -1);
+		lua_pushnil(L);
+		lua_rawset(L, idx); /* assigning nil to existing fields is fine during next() */
+	}
+}
+
+static int Lclear(lua_State *L) {
+	luaL_checktype(L, 1, LUA_TTABLE);
+	clear_table(L, 1);
+	lua_settop(L, 1);
+	return 1;
+}
+
+/* table.concat() on t[i..j], with raw access and no __index per element */
+static int Lconcat_range(lua_State *L) {
+	luaL_Buffer b;
+	size_t lsep;
+	lua_Integer i, j;
+	const char *sep;
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+	i = luaL_optinteger(L, 2, 1);
+	j = luaL_opt(L, luaL_checkinteger, 3, (lua_Integer)lua_rawlen(L, 1));
+	sep = luaL_optlstring(L, 4, "", &lsep);
+
+	luaL_buffinit(L, &b);
+
+	for(; i <= j; i++) {
+		lua_rawgeti(L, 1, i);
+
+		if(!lua_isstring(L, -1)) {
+			return luaL_error(L, "invalid value (at index %d) in table for 'concat_range'", (int)i);
+		}
+
+		luaL_addvalue(&b);
+
+		if(i != j) {
+			luaL_addlstring(&b, sep, lsep);
+		}
+
+		if(i == LUA_MAXINTEGER) {
+			break;
+		}
+	}
+
+	luaL_pushresult(&b);
+	return 1;
+}
+
+/*
+ * Pools of tables for reuse
+ *
+ * Tables handed back with put() are cleared and kept, up to a limit, to be
+ * returned by later calls to get() instead of allocating new ones. Cleared
+ * tables keep their allocated size, so they should be put back into the pool
+ * they came from. The free tables live in the uservalue.
+ */
+#define POOL_MT "util.table.pool"
+
+typedef struct {
+	int narr;
+	int nrec;
+	lua_Integer max;
+	lua_Integer free;
+} table_pool;
+
+static int Lpool_get(lua_State *L) {
+	table_pool *p = luaL_checkudata(L, 1, POOL_MT);
+
+	if(p->free == 0) {
+		lua_createtable(L, p->narr, p->nrec);
+		return 1;
+	}
+
+	lua_getuservalue(L, 1);
+	lua_rawgeti(L, -1, p->free);
+	lua_pushnil(L);
+	lua_rawseti(L, -3, p->free);
+	p->free--;
+	return 1;
+}
+
+/* Returns false if the pool is full and the table was left alone */
+static int Lpool_put(lua_State *L) {
+	table_pool *p = luaL_checkudata(L, 1, POOL_MT);
+	luaL_checktype(L, 2, LUA_TTABLE);
+
+	if(p->free >= p->max) {
+		lua_pushboolean(L, 0);
+		return 1;
+	}
+
+	clear_table(L, 2);
+	lua_pushnil(L);
+	lua_setmetatable(L, 2);
+
+	lua_getuservalue(L, 1);
+	lua_pushvalue(L, 2);
+	lua_rawseti(L, -2, ++p->free);
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static int Lpool_length(lua_State *L) {
+	table_pool *p = luaL_checkudata(L, 1, POOL_MT);
+	lua_pushinteger(L, p->free);
+	return 1;
+}
+
+static int Lpool_tostring(lua_State *L) {
+	table_pool *p = luaL_checkudata(L, 1, POOL_MT);
+	lua_pushfstring(L, "table pool: %p (%d/%d free)", p, (int)p->free, (int)p->max);
+	return 1;
+}
+
+/* (narr, nrec, max?) -> pool */
+static int Lpool(lua_State *L) {
+	lua_Integer narr = luaL_optinteger(L, 1, 0);
+	lua_Integer nrec = luaL_optinteger(L, 2, 0);
+	lua_Integer max = luaL_optinteger(L, 3, 256);
+	table_pool *p;
+
+	luaL_argcheck(L, narr >= 0 && narr <= 0x7fffffff, 1, "size out of range");
+	luaL_argcheck(L, nrec >= 0 && nrec <= 0x7fffffff, 2, "size out of range");
+	luaL_argcheck(L, max >= 0, 3, "limit must be non-negative");
+
+	p = lua_newuserdata(L, sizeof(table_pool));
+	p->narr = (int)narr;
+	p->nrec = (int)nrec;
+	p->max = max;
+	p->free = 0;
+
+	luaL_getmetatable(L, POOL_MT);
+	lua_setmetatable(L, -2);
+
+	lua_createtable(L, max < 64 ? (int)max : 64, 0); /* free tables */
+	lua_setuservalue(L, -2);
+	return 1;
+}
+
 int luaopen_prosody_util_table(lua_State *L) {
 	luaL_checkversion(L);
-	lua_createtable(L, 0, 2);
+
+	if(luaL_newmetatable(L, POOL_MT)) {
+		lua_pushcfunction(L, Lpool_tostring);
+		lua_setfield(L, -2, "__tostring");
+		lua_pushcfunction(L, Lpool_length);
+		lua_setfield(L, -2, "__len");
+
+		lua_createtable(L, 0, 2); /* __index */
+		{
+			lua_pushcfunction(L, Lpool_get);
+			lua_setfield(L, -2, "get");
+			lua_pushcfunction(L, Lpool_put);
+			lua_setfield(L, -2, "put");
+		}
+		lua_setfield(L, -2, "__index");
+	}
+
+	lua_pop(L, 1);
+
+	lua_createtable(L, 0, 6);
 	lua_pushcfunction(L, Lcreate_table);
 	lua_setfield(L, -2, "create");
 	lua_pushcfunction(L, Lpack);
 	lua_setfield(L, -2, "pack");
 	lua_pushcfunction(L, Lmove);
 	lua_setfield(L, -2, "move");
+	lua_pushcfunction(L, Lclear);
+	lua_setfield(L, -2, "clear");
+	lua_pushcfunction(L, Lpool);
+	lua_setfield(L, -2, "pool");
+	lua_pushcfunction(L, Lconcat_range);
+	lua_setfield(L, -2, "concat_range");
 	return 1;
 }
 
@@ -5,31 +5,100 @@
 #include <time.h>
 #include <lua.h>
 
+/* Linux only, the regular clocks do the same job elsewhere */
+#ifndef CLOCK_REALTIME_COARSE
+#define CLOCK_REALTIME_COARSE CLOCK_REALTIME
+#endif
+
+#ifndef CLOCK_MONOTONIC_COARSE
+#define CLOCK_MONOTONIC_COARSE CLOCK_MONOTONIC
+#endif
+
+/* Readings from the last tick(), shared by every caller in the process */
+static lua_Number cached_realtime, cached_monotonic;
+static int ticked = 0;
+
 static lua_Number tv2number(struct timespec *tv) {
 	return tv->tv_sec + tv->tv_nsec * 1e-9;
 }
 
-static int lc_time_realtime(lua_State *L) {
+static lua_Number read_clock(clockid_t clock) {
 	struct timespec t;
-	clock_gettime(CLOCK_REALTIME, &t);
-	lua_pushnumber(L, tv2number(&t));
+	clock_gettime(clock, &t);
+	return tv2number(&t);
+}
+
+static int lc_time_realtime(lua_State *L) {
+	lua_pushnumber(L, read_clock(CLOCK_REALTIME));
 	return 1;
 }
 
 static int lc_time_monotonic(lua_State *L) {
-	struct timespec t;
-	clock_gettime(CLOCK_MONOTONIC, &t);
-	lua_pushnumber(L, tv2number(&t));
+	lua_pushnumber(L, read_clock(CLOCK_MONOTONIC));
+	return 1;
+}
+
+static int lc_time_realtime_coarse(lua_State *L) {
+	lua_pushnumber(L, read_clock(CLOCK_REALTIME_COARSE));
+	return 1;
+}
+
+static int lc_time_monotonic_coarse(lua_State *L) {
+	lua_pushnumber(L, read_clock(CLOCK_MONOTONIC_COARSE));
+	return 1;
+}
+
+/*
+ * Refresh the cached clocks, meant to be called once per turn of the main loop
+ * (boolean?) -> number, number
+ *
+ * Reads the coarse clocks if the argument is true, which are only as precise
+ * as the kernel tick but cheaper still. Returns the new readings.
+ */
+static int lc_time_tick(lua_State *L) {
+	int coarse = lua_toboolean(L, 1);
+	lua_Number monotonic = read_clock(coarse ? CLOCK_MONOTONIC_COARSE : CLOCK_MONOTONIC);
+	cached_realtime = read_clock(coarse ? CLOCK_REALTIME_COARSE : CLOCK_REALTIME);
+
+	/* A coarse reading can be behind a precise one from an earlier tick */
+	if(!ticked || monotonic > cached_monotonic) {
+		cached_monotonic = monotonic;
+	}
+
+	ticked = 1;
+	lua_pushnumber(L, cached_realtime);
+	lua_pushnumber(L, cached_monotonic);
+	return 2;
+}
+
+/* Until something calls tick(), these read the clocks like now() and monotonic() */
+static int lc_time_cached_realtime(lua_State *L) {
+	lua_pushnumber(L, ticked ? cached_realtime : read_clock(CLOCK_REALTIME));
+	return 1;
+}
+
+static int lc_time_cached_monotonic(lua_State *L) {
+	lua_pushnumber(L, ticked ? cached_monotonic : read_clock(CLOCK_MONOTONIC));
 	return 1;
 }
 
 int luaopen_prosody_util_time(lua_State *L) {
-	lua_createtable(L, 0, 2);
+	lua_createtable(L, 0, 7);
 	{
 		lua_pushcfunction(L, lc_time_realtime);
 		lua_setfield(L, -2, "now");
 		lua_pushcfunction(L, lc_time_monotonic);
 		lua_setfield(L, -2, "monotonic");
+		lua_pushcfunction(L, lc_time_realtime_coarse);
+		lua_setfield(L, -2, "coarse_now");
+		lua_pushcfunction(L, lc_time_monotonic_coarse);
+		lua_setfield(L, -2, "coarse_monotonic");
+		lua_pushcfunction(L, lc_time_tick);
+		lua_setfield(L, -2, "tick");
+		lua_pushcfunction(L, lc_time_cached_realtime);
+		lua_setfield(L, -2, "cached_now");
+		lua_pushcfunction(L, lc_time_cached_monotonic);
+		lua_setfield(L, -2, "cached_monotonic");
 	}
 	return 1;
 }
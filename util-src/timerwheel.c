@@ -0,0 +1,608 @@
+/*
+ * Hierarchical timer wheel
+ *
+ * Four levels of 256 slots, each slot a doubly linked list of nodes kept in
+ * a single growable array. Inserting, removing and rescheduling a timer is
+ * O(1); expired timers are collected in batches as the wheel is advanced.
+ * Nodes in the outer levels are redistributed ("cascaded") into the inner
+ * levels as time reaches their slot.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#if (LUA_VERSION_NUM < 504)
+#define luaL_pushfail lua_pushnil
+#endif
+
+/* Ids are kept below 2^53 so that they survive as Lua 5.2 numbers */
+#if (LUA_VERSION_NUM < 503)
+#define tw_pushid(L, id) lua_pushnumber(L, (lua_Number)(id))
+#define tw_checkid(L, arg) ((uint64_t)luaL_checknumber(L, arg))
+#else
+#define tw_pushid(L, id) lua_pushinteger(L, (lua_Integer)(id))
+#define tw_checkid(L, arg) ((uint64_t)luaL_checkinteger(L, arg))
+#endif
+
+#define TW_MT "util.timerwheel"
+
+#define TW_BITS 8
+#define TW_SLOTS (1 << TW_BITS)
+#define TW_MASK (TW_SLOTS - 1)
+#define TW_LEVELS 4
+#define TW_RANGE ((uint64_t)1 << (TW_LEVELS * TW_BITS))
+
+/* An id is a node index plus a generation, so stale ids never match a reused node */
+#define TW_INDEX_BITS 22
+#define TW_MAX_NODES (1 << TW_INDEX_BITS)
+#define TW_SEQ_MASK 0x7fffffff
+
+#define TW_NONE (-1)
+
+/* Upper bound on ticks, ~146 millennia at the default resolution */
+#define TW_MAX_TICKS ((uint64_t)1 << 62)
+
+enum {
+	TW_FREE,
+	TW_PENDING, /* in a wheel slot */
+	TW_READY, /* expired, waiting to be popped */
+	TW_FIRED, /* popped, waiting to be re-inserted or removed */
+};
+
+typedef struct {
+	uint64_t expires; /* tick at which the timer is due */
+	int32_t next;
+	int32_t prev;
+	uint32_t seq;
+	uint8_t state;
+	uint8_t level;
+	uint8_t slot;
+} tw_node;
+
+typedef struct {
+	lua_Number base;
+	lua_Number resolution;
+	uint64_t tick; /* next tick to be processed */
+	uint64_t peek; /* cached lower bound for the next expiry */
+	int peek_valid;
+	int32_t ready_head;
+	int32_t ready_tail;
+	int32_t free_head;
+	int32_t used; /* nodes handed out from the pool so far */
+	int32_t capacity;
+	size_t live; /* nodes not on the free list */
+	size_t pending; /* nodes in a slot or on the ready list */
+	size_t count[TW_LEVELS];
+	tw_node *nodes;
+	int32_t slots[TW_LEVELS][TW_SLOTS];
+} timerwheel;
+
+static uint64_t tw_ticks(const timerwheel *w, lua_Number t, int round_up) {
+	lua_Number ticks = (t - w->base) / w->resolution;
+	uint64_t k;
+
+	if(!(ticks > 0)) {
+		return 0;
+	}
+
+	if(ticks >= (lua_Number)TW_MAX_TICKS) {
+		return TW_MAX_TICKS;
+	}
+
+	k = (uint64_t)ticks;
+
+	if(round_up && (lua_Number)k < ticks) {
+		k++;
+	}
+
+	return k;
+}
+
+static lua_Number tw_time(const timerwheel *w, uint64_t tick) {
+	return w->base + (lua_Number)tick * w->resolution;
+}
+
+static uint64_t tw_id(const timerwheel *w, int32_t i) {
+	return ((uint64_t)w->nodes[i].seq << TW_INDEX_BITS) | (uint64_t)i;
+}
+
+static int32_t tw_lookup(const timerwheel *w, uint64_t id) {
+	int32_t i = (int32_t)(id & (TW_MAX_NODES - 1));
+
+	if(i >= w->used || w->nodes[i].state == TW_FREE || w->nodes[i].seq != (id >> TW_INDEX_BITS)) {
+		return TW_NONE;
+	}
+
+	return i;
+}
+
+static void tw_link(timerwheel *w, int32_t i, int level, unsigned int slot) {
+	tw_node *n = &w->nodes[i];
+	int32_t head = w->slots[level][slot];
+
+	n->level = (uint8_t)level;
+	n->slot = (uint8_t)slot;
+	n->prev = TW_NONE;
+	n->next = head;
+
+	if(head != TW_NONE) {
+		w->nodes[head].prev = i;
+	}
+
+	w->slots[level][slot] = i;
+	w->count[level]++;
+}
+
+static void tw_unlink(timerwheel *w, int32_t i) {
+	tw_node *n = &w->nodes[i];
+
+	if(n->prev != TW_NONE) {
+		w->nodes[n->prev].next = n->next;
+	} else if(n->state == TW_READY) {
+		w->ready_head = n->next;
+	} else {
+		w->slots[n->level][n->slot] = n->next;
+	}
+
+	if(n->next != TW_NONE) {
+		w->nodes[n->next].prev = n->prev;
+	} else if(n->state == TW_READY) {
+		w->ready_tail = n->prev;
+	}
+
+	if(n->state == TW_PENDING) {
+		w->count[n->level]--;
+	}
+
+	n->next = n->prev = TW_NONE;
+}
+
+/* Put a node into the slot matching its expiry relative to the current tick */
+static void tw_place(timerwheel *w, int32_t i) {
+	uint64_t expires = w->nodes[i].expires;
+	uint64_t delta;
+	int level = 0;
+
+	if(expires < w->tick) {
+		expires = w->tick;
+	}
+
+	delta = expires - w->tick;
+
+	if(delta >= TW_RANGE) {
+		/* Park it as far out as the wheel reaches, it is placed again when cascaded */
+		delta = TW_RANGE - 1;
+		expires = w->tick + delta;
+	}
+
+	while(level < TW_LEVELS - 1 && delta >= ((uint64_t)1 << ((level + 1) * TW_BITS))) {
+		level++;
+	}
+
+	w->nodes[i].state = TW_PENDING;
+	tw_link(w, i, level, (expires >> (level * TW_BITS)) & TW_MASK);
+}
+
+static void tw_ready(timerwheel *w, int32_t i) {
+	tw_node *n = &w->nodes[i];
+
+	n->state = TW_READY;
+	n->next = TW_NONE;
+	n->prev = w->ready_tail;
+
+	if(w->ready_tail != TW_NONE) {
+		w->nodes[w->ready_tail].next = i;
+	} else {
+		w->ready_head = i;
+	}
+
+	w->ready_tail = i;
+}
+
+/* Detach a slot and hand each of its nodes to fn */
+static void tw_drain(timerwheel *w, int level, unsigned int slot, void (*fn)(timerwheel *, int32_t)) {
+	int32_t i = w->slots[level][slot];
+
+	w->slots[level][slot] = TW_NONE;
+
+	while(i != TW_NONE) {
+		int32_t next = w->nodes[i].next;
+		w->count[level]--;
+		fn(w, i);
+		i = next;
+	}
+}
+
+static void tw_advance(timerwheel *w, uint64_t target) {
+	while(w->tick <= target) {
+		unsigned int idx = w->tick & TW_MASK;
+
+		if(idx == 0) {
+			int level;
+
+			for(level = 1; level < TW_LEVELS; level++) {
+				unsigned int slot = (w->tick >> (level * TW_BITS)) & TW_MASK;
+				tw_drain(w, level, slot, tw_place);
+
+				if(slot != 0) {
+					break;
+				}
+			}
+		}
+
+		tw_drain(w, 0, idx, tw_ready);
+		w->tick++;
+
+		if(w->count[0] == 0) {
+			/* Nothing can happen before the next cascade of the innermost occupied level */
+			int level = 1;
+			uint64_t span, next;
+
+			while(level < TW_LEVELS && w->count[level] == 0) {
+				level++;
+			}
+
+			if(level == TW_LEVELS) {
+				w->tick = target + 1;
+				break;
+			}
+
+			span = (uint64_t)1 << (level * TW_BITS);
+			next = (w->tick + span - 1) & ~(span - 1);
+			w->tick = next < target + 1 ? next : target + 1;
+		}
+	}
+
+	w->peek_valid = 0;
+}
+
+/* Earliest tick at which anything can expire. Exact for the innermost level,
+ * for outer levels it is the tick at which their next occupied slot cascades. */
+static uint64_t tw_lower_bound(const timerwheel *w) {
+	uint64_t best = UINT64_MAX;
+	int level;
+
+	for(level = 0; level < TW_LEVELS; level++) {
+		unsigned int shift = level * TW_BITS;
+		uint64_t first = (w->tick + ((uint64_t)1 << shift) - 1) >> shift;
+		unsigned int d;
+
+		if(w->count[level] == 0) {
+			continue;
+		}
+
+		for(d = 0; d < TW_SLOTS; d++) {
+			if(w->slots[level][(first + d) & TW_MASK] != TW_NONE) {
+				uint64_t t = (first + d) << shift;
+
+				if(t < best) {
+					best = t;
+				}
+
+				break;
+			}
+		}
+	}
+
+	return best;
+}
+
+static void tw_bound_changed(timerwheel *w, uint64_t expires) {
+	if(w->peek_valid && expires <= w->peek) {
+		w->peek_valid = 0;
+	}
+}
+
+static int32_t tw_alloc(lua_State *L, timerwheel *w) {
+	int32_t i = w->free_head;
+
+	if(i != TW_NONE) {
+		w->free_head = w->nodes[i].next;
+	} else {
+		if(w->used == w->capacity) {
+			int32_t capacity = w->capacity ? w->capacity * 2 : 64;
+			tw_node *nodes;
+
+			if(w->capacity >= TW_MAX_NODES) {
+				luaL_error(L, "too many timers");
+			}
+
+			if(capacity > TW_MAX_NODES) {
+				capacity = TW_MAX_NODES;
+			}
+
+			nodes = realloc(w->nodes, capacity * sizeof(tw_node));
+
+			if(nodes == NULL) {
+				luaL_error(L, "not enough memory");
+			}
+
+			w->nodes = nodes;
+			w->capacity = capacity;
+		}
+
+		i = w->used++;
+		w->nodes[i].seq = 0;
+	}
+
+	w->nodes[i].seq = (w->nodes[i].seq + 1) & TW_SEQ_MASK;
+
+	if(w->nodes[i].seq == 0) {
+		w->nodes[i].seq = 1;
+	}
+
+	w->nodes[i].next = w->nodes[i].prev = TW_NONE;
+	w->live++;
+	return i;
+}
+
+/* Release a node and push the item it held */
+static void tw_release(lua_State *L, timerwheel *w, int32_t i) {
+	tw_node *n = &w->nodes[i];
+
+	if(n->state == TW_PENDING || n->state == TW_READY) {
+		tw_bound_changed(w, n->expires);
+		tw_unlink(w, i);
+		w->pending--;
+	}
+
+	n->state = TW_FREE;
+	n->next = w->free_head;
+	w->free_head = i;
+	w->live--;
+
+	lua_getuservalue(L, 1);
+	lua_rawgeti(L, -1, i + 1);
+	lua_pushnil(L);
+	lua_rawseti(L, -3, i + 1);
+	lua_remove(L, -2);
+}
+
+/*
+ * Add a timer, returns its id
+ * wheel:insert(item, time)
+ *
+ * Passing the id of a timer returned by :pop() arms it again
+ * wheel:insert(item, time, id)
+ */
+static int Linsert(lua_State *L) {
+	timerwheel *w = luaL_checkudata(L, 1, TW_MT);
+	lua_Number t = luaL_checknumber(L, 3);
+	int32_t i;
+
+	luaL_argcheck(L, !lua_isnoneornil(L, 2), 2, "value expected");
+
+	if(lua_isnoneornil(L, 4)) {
+		i = tw_alloc(L, w);
+	} else {
+		i = tw_lookup(w, tw_checkid(L, 4));
+
+		if(i == TW_NONE || w->nodes[i].state != TW_FIRED) {
+			luaL_pushfail(L);
+			return 1;
+		}
+	}
+
+	w->nodes[i].expires = tw_ticks(w, t, 1);
+	tw_place(w, i);
+	w->pending++;
+
+	if(w->peek_valid && w->nodes[i].expires < w->peek) {
+		w->peek = w->nodes[i].expires < w->tick ? w->tick : w->nodes[i].expires;
+	}
+
+	lua_getuservalue(L, 1);
+	lua_pushvalue(L, 2);
+	lua_rawseti(L, -2, i + 1);
+
+	tw_pushid(L, tw_id(w, i));
+	return 1;
+}
+
+/*
+ * Cancel a timer, returns the item it held
+ * wheel:remove(id)
+ */
+static int Lremove(lua_State *L) {
+	timerwheel *w = luaL_checkudata(L, 1, TW_MT);
+	int32_t i = tw_lookup(w, tw_checkid(L, 2));
+
+	if(i == TW_NONE) {
+		luaL_pushfail(L);
+		return 1;
+	}
+
+	tw_release(L, w, i);
+	return 1;
+}
+
+/*
+ * Move a pending timer to a new time
+ * wheel:reprioritize(id, time)
+ */
+static int Lreprioritize(lua_State *L) {
+	timerwheel *w = luaL_checkudata(L, 1, TW_MT);
+	int32_t i = tw_lookup(w, tw_checkid(L, 2));
+	lua_Number t = luaL_checknumber(L, 3);
+	tw_node *n;
+
+	if(i == TW_NONE || (w->nodes[i].state != TW_PENDING && w->nodes[i].state != TW_READY)) {
+		luaL_pushfail(L);
+		return 1;
+	}
+
+	n = &w->nodes[i];
+	tw_bound_changed(w, n->expires);
+	tw_unlink(w, i);
+	n->expires = tw_ticks(w, t, 1);
+	tw_place(w, i);
+	tw_bound_changed(w, n->expires);
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/*
+ * Time at or before which the next timer expires, nil if there are none
+ * wheel:peek()
+ */
+static int Lpeek(lua_State *L) {
+	timerwheel *w = luaL_checkudata(L, 1, TW_MT);
+
+	if(w->pending == 0) {
+		lua_pushnil(L);
+		return 1;
+	}
+
+	if(w->ready_head != TW_NONE) {
+		lua_pushnumber(L, tw_time(w, w->nodes[w->ready_head].expires));
+		return 1;
+	}
+
+	if(!w->peek_valid) {
+		w->peek = tw_lower_bound(w);
+		w->peek_valid = 1;
+	}
+
+	lua_pushnumber(L, tw_time(w, w->peek));
+	return 1;
+}
+
+/*
+ * Take the next timer that is due at the given time
+ * wheel:pop(now) -> id, item
+ *
+ * The timer stays reserved until it is re-inserted or removed.
+ */
+static int Lpop(lua_State *L) {
+	timerwheel *w = luaL_checkudata(L, 1, TW_MT);
+	lua_Number now = luaL_checknumber(L, 2);
+	int32_t i;
+
+	if(w->ready_head == TW_NONE) {
+		uint64_t target = tw_ticks(w, now, 0);
+
+		if(target >= w->tick) {
+			tw_advance(w, target);
+		}
+	}
+
+	i = w->ready_head;
+
+	if(i == TW_NONE) {
+		return 0;
+	}
+
+	tw_unlink(w, i);
+	w->nodes[i].state = TW_FIRED;
+	w->pending--;
+
+	tw_pushid(L, tw_id(w, i));
+	lua_getuservalue(L, 1);
+	lua_rawgeti(L, -1, i + 1);
+	lua_remove(L, -2);
+	return 2;
+}
+
+static int Llength(lua_State *L) {
+	timerwheel *w = luaL_checkudata(L, 1, TW_MT);
+	lua_pushinteger(L, (lua_Integer)w->live);
+	return 1;
+}
+
+static int Lgc(lua_State *L) {
+	timerwheel *w = luaL_checkudata(L, 1, TW_MT);
+	free(w->nodes);
+	w->nodes = NULL;
+	w->used = w->capacity = 0;
+	w->free_head = TW_NONE;
+	return 0;
+}
+
+static int Ltostring(lua_State *L) {
+	timerwheel *w = luaL_checkudata(L, 1, TW_MT);
+	lua_pushfstring(L, "timerwheel: %p", w);
+	return 1;
+}
+
+/*
+ * Create a new wheel
+ * timerwheel.new(now, resolution)
+ */
+static int Lnew(lua_State *L) {
+	lua_Number now = luaL_optnumber(L, 1, 0);
+	lua_Number resolution = luaL_optnumber(L, 2, 0.001);
+	timerwheel *w;
+	int level, slot;
+
+	luaL_argcheck(L, resolution > 0, 2, "positive number expected");
+
+	w = lua_newuserdata(L, sizeof(timerwheel));
+
+	w->base = now;
+	w->resolution = resolution;
+	w->tick = 0;
+	w->peek = 0;
+	w->peek_valid = 0;
+	w->ready_head = w->ready_tail = TW_NONE;
+	w->free_head = TW_NONE;
+	w->used = w->capacity = 0;
+	w->live = w->pending = 0;
+	w->nodes = NULL;
+
+	for(level = 0; level < TW_LEVELS; level++) {
+		w->count[level] = 0;
+
+		for(slot = 0; slot < TW_SLOTS; slot++) {
+			w->slots[level][slot] = TW_NONE;
+		}
+	}
+
+	luaL_getmetatable(L, TW_MT);
+	lua_setmetatable(L, -2);
+
+	lua_createtable(L, 0, 0); /* items, indexed by node */
+	lua_setuservalue(L, -2);
+
+	return 1;
+}
+
+int luaopen_prosody_util_timerwheel(lua_State *L) {
+	luaL_checkversion(L);
+
+	if(luaL_newmetatable(L, TW_MT)) {
+		lua_pushcfunction(L, Ltostring);
+		lua_setfield(L, -2, "__tostring");
+		lua_pushcfunction(L, Llength);
+		lua_setfield(L, -2, "__len");
+		lua_pushcfunction(L, Lgc);
+		lua_setfield(L, -2, "__gc");
+
+		lua_createtable(L, 0, 5); /* __index */
+		{
+			lua_pushcfunction(L, Linsert);
+			lua_setfield(L, -2, "insert");
+			lua_pushcfunction(L, Lremove);
+			lua_setfield(L, -2, "remove");
+			lua_pushcfunction(L, Lreprioritize);
+			lua_setfield(L, -2, "reprioritize");
+			lua_pushcfunction(L, Lpeek);
+			lua_setfield(L, -2, "peek");
+			lua_pushcfunction(L, Lpop);
+			lua_setfield(L, -2, "pop");
+		}
+		lua_setfield(L, -2, "__index");
+	}
+
+	lua_createtable(L, 0, 1);
+	lua_pushcfunction(L, Lnew);
+	lua_setfield(L, -2, "new");
+	return 1;
+}
+
+int luaopen_util_timerwheel(lua_State *L) {
+	return luaopen_prosody_util_timerwheel(L);
+}
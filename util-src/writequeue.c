@@ -0,0 +1,437 @@
+/*
+ * Output queue of Lua strings
+ *
+ * Holds references to the queued strings rather than copying them, remembers
+ * how much of the first one has been consumed and writes them out with
+ * writev(). Meant as the write buffer of network connections.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#if (LUA_VERSION_NUM < 504)
+#define luaL_pushfail lua_pushnil
+#endif
+
+#define WQ_MT "util.writequeue"
+
+/* Chunks handed to a single writev() call */
+#if defined(IOV_MAX) && IOV_MAX < 64
+#define WQ_IOV IOV_MAX
+#else
+#define WQ_IOV 64
+#endif
+
+/* At most this much is copied together by :peek() */
+#define WQ_COALESCE (64 * 1024)
+
+typedef struct {
+	const char *data;
+	size_t len;
+} wq_chunk;
+
+typedef struct {
+	size_t head; /* index of the first queued chunk */
+	size_t count; /* number of queued chunks */
+	size_t alloc; /* allocated chunk slots */
+	size_t offset; /* bytes of the first chunk already consumed */
+	size_t length; /* bytes queued */
+	size_t max_length;
+	size_t max_chunks;
+	wq_chunk *chunks;
+} writequeue;
+
+/* Make room for one more chunk at the end, the strings sit in the uservalue at 1 */
+static int wq_reserve(lua_State *L, writequeue *q) {
+	size_t i;
+
+	if(q->head + q->count < q->alloc) {
+		return 1;
+	}
+
+	if(q->head > 0) {
+		/* Move everything down to the front */
+		memmove(q->chunks, &q->chunks[q->head], q->count * sizeof(wq_chunk));
+
+		lua_getuservalue(L, 1);
+
+		for(i = 0; i < q->count; i++) {
+			lua_rawgeti(L, -1, q->head + i + 1);
+			lua_rawseti(L, -2, i + 1);
+		}
+
+		for(i = q->count; i < q->head + q->count; i++) {
+			lua_pushnil(L);
+			lua_rawseti(L, -2, i + 1);
+		}
+
+		lua_pop(L, 1);
+		q->head = 0;
+	} else {
+		size_t alloc = q->alloc ? q->alloc * 2 : 16;
+		wq_chunk *chunks = realloc(q->chunks, alloc * sizeof(wq_chunk));
+
+		if(chunks == NULL) {
+			return 0;
+		}
+
+		q->chunks = chunks;
+		q->alloc = alloc;
+	}
+
+	return 1;
+}
+
+static void wq_push(lua_State *L, writequeue *q, int idx) {
+	size_t i = q->head + q->count;
+	wq_chunk *c = &q->chunks[i];
+
+	c->data = lua_tolstring(L, idx, &c->len);
+
+	lua_getuservalue(L, 1);
+	lua_pushvalue(L, idx);
+	lua_rawseti(L, -2, i + 1);
+	lua_pop(L, 1);
+
+	q->count++;
+	q->length += c->len;
+}
+
+/* Drop `n` bytes from the front, releasing fully consumed strings */
+static void wq_consume(lua_State *L, writequeue *q, size_t n) {
+	lua_getuservalue(L, 1);
+
+	q->length -= n;
+
+	while(n > 0 && q->count > 0) {
+		size_t remaining = q->chunks[q->head].len - q->offset;
+
+		if(n < remaining) {
+			q->offset += n;
+			break;
+		}
+
+		n -= remaining;
+		lua_pushnil(L);
+		lua_rawseti(L, -2, q->head + 1);
+		q->head++;
+		q->count--;
+		q->offset = 0;
+	}
+
+	if(q->count == 0) {
+		q->head = 0;
+	}
+
+	lua_pop(L, 1);
+}
+
+/* Replace everything queued with a single string */
+static void wq_collapse(lua_State *L, writequeue *q) {
+	luaL_Buffer buf;
+	size_t i;
+
+	luaL_buffinit(L, &buf);
+
+	for(i = 0; i < q->count; i++) {
+		wq_chunk *c = &q->chunks[q->head + i];
+		size_t skip = i == 0 ? q->offset : 0;
+		luaL_addlstring(&buf, c->data + skip, c->len - skip);
+	}
+
+	luaL_pushresult(&buf);
+	wq_consume(L, q, q->length);
+	wq_push(L, q, lua_gettop(L));
+	lua_pop(L, 1);
+}
+
+/*
+ * Queue a string, fails if it would exceed the size limit
+ * (queue, string) -> boolean
+ */
+static int Lwrite(lua_State *L) {
+	writequeue *q = luaL_checkudata(L, 1, WQ_MT);
+	size_t len;
+
+	luaL_checklstring(L, 2, &len);
+
+	if(len > q->max_length - q->length) {
+		luaL_pushfail(L);
+		return 1;
+	}
+
+	if(len == 0) {
+		lua_pushboolean(L, 1);
+		return 1;
+	}
+
+	if(q->max_chunks && q->count >= q->max_chunks) {
+		wq_collapse(L, q);
+	}
+
+	if(!wq_reserve(L, q)) {
+		luaL_pushfail(L);
+		return 1;
+	}
+
+	wq_push(L, q, 2);
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/*
+ * The next piece of data to send, as arguments for LuaSocket's :send()
+ * (queue, number?) -> string, integer, integer
+ *
+ * A large enough first chunk is returned as is, with the range to send.
+ * Smaller chunks are concatenated up to a limit.
+ */
+static int Lpeek(lua_State *L) {
+	writequeue *q = luaL_checkudata(L, 1, WQ_MT);
+	lua_Integer max = luaL_optinteger(L, 2, q->length);
+	wq_chunk *c;
+	size_t remaining, want;
+
+	if(q->count == 0) {
+		return 0;
+	}
+
+	luaL_argcheck(L, max > 0, 2, "positive integer expected");
+
+	c = &q->chunks[q->head];
+	remaining = c->len - q->offset;
+	want = (size_t)max < q->length ? (size_t)max : q->length;
+
+	if(remaining >= want || remaining >= WQ_COALESCE) {
+		lua_getuservalue(L, 1);
+		lua_rawgeti(L, -1, q->head + 1);
+		lua_pushinteger(L, q->offset + 1);
+		lua_pushinteger(L, q->offset + (remaining < want ? remaining : want));
+		return 3;
+	} else {
+		luaL_Buffer buf;
+		size_t i, total = 0;
+
+		if(want > WQ_COALESCE) {
+			want = WQ_COALESCE;
+		}
+
+		luaL_buffinit(L, &buf);
+
+		for(i = 0; i < q->count && total < want; i++) {
+			size_t skip = i == 0 ? q->offset : 0;
+			size_t n = q->chunks[q->head + i].len - skip;
+
+			if(n > want - total) {
+				n = want - total;
+			}
+
+			luaL_addlstring(&buf, q->chunks[q->head + i].data + skip, n);
+			total += n;
+		}
+
+		luaL_pushresult(&buf);
+		lua_pushinteger(L, 1);
+		lua_pushinteger(L, total);
+		return 3;
+	}
+}
+
+/*
+ * Drop bytes from the front of the queue
+ * (queue, number) -> boolean
+ */
+static int Ldiscard(lua_State *L) {
+	writequeue *q = luaL_checkudata(L, 1, WQ_MT);
+	lua_Integer n = luaL_checkinteger(L, 2);
+
+	luaL_argcheck(L, n >= 0, 2, "non-negative integer expected");
+
+	if((size_t)n > q->length) {
+		n = q->length;
+	}
+
+	wq_consume(L, q, n);
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/*
+ * Write queued data to a file descriptor until it would block
+ * (queue, fd, number?) -> integer
+ *
+ * Returns the number of bytes written and dropped from the queue, which is 0
+ * if the descriptor is not ready, or nil, strerror, errno. The error is
+ * "closed" when the other end went away, like with LuaSocket.
+ */
+static int Lflush(lua_State *L) {
+	writequeue *q = luaL_checkudata(L, 1, WQ_MT);
+	int fd = luaL_checkinteger(L, 2);
+	lua_Integer max = luaL_optinteger(L, 3, q->length);
+	struct iovec iov[WQ_IOV];
+	size_t written = 0;
+	int err;
+
+	if(q->count == 0) {
+		lua_pushinteger(L, 0);
+		return 1;
+	}
+
+	luaL_argcheck(L, max > 0, 3, "positive integer expected");
+
+	while(q->count > 0 && written < (size_t)max) {
+		size_t want = (size_t)max - written;
+		size_t batch = 0;
+		int n = 0;
+		ssize_t r;
+
+		while(n < WQ_IOV && (size_t)n < q->count && batch < want) {
+			wq_chunk *c = &q->chunks[q->head + n];
+			size_t skip = n == 0 ? q->offset : 0;
+			size_t len = c->len - skip;
+
+			if(len > want - batch) {
+				len = want - batch;
+			}
+
+			iov[n].iov_base = (char *)c->data + skip;
+			iov[n].iov_len = len;
+			batch += len;
+			n++;
+		}
+
+		r = writev(fd, iov, n);
+
+		if(r < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+
+			if(errno == EAGAIN || errno == EWOULDBLOCK) {
+				break;
+			}
+
+			if(written > 0) {
+				/* report what did get written, the error comes back next time */
+				break;
+			}
+
+			err = errno;
+			luaL_pushfail(L);
+
+			if(err == EPIPE || err == ECONNRESET) {
+				/* Same as LuaSocket, so the reason a connection went away
+				 * doesn't depend on how it was written to */
+				lua_pushliteral(L, "closed");
+			} else {
+				lua_pushstring(L, strerror(err));
+			}
+
+			lua_pushinteger(L, err);
+			return 3;
+		}
+
+		wq_consume(L, q, r);
+		written += r;
+
+		if((size_t)r < batch) {
+			break;
+		}
+	}
+
+	lua_pushinteger(L, written);
+	return 1;
+}
+
+static int Llength(lua_State *L) {
+	writequeue *q = luaL_checkudata(L, 1, WQ_MT);
+	lua_pushinteger(L, q->length);
+	return 1;
+}
+
+static int Ltostring(lua_State *L) {
+	writequeue *q = luaL_checkudata(L, 1, WQ_MT);
+	lua_pushfstring(L, "writequeue: %p %d bytes in %d chunks", q, (int)q->length, (int)q->count);
+	return 1;
+}
+
+static int Lgc(lua_State *L) {
+	writequeue *q = luaL_checkudata(L, 1, WQ_MT);
+	free(q->chunks);
+	q->chunks = NULL;
+	q->head = q->count = q->alloc = q->offset = q->length = 0;
+	return 0;
+}
+
+/*
+ * Create a queue
+ * (number?, number?) -> queue
+ */
+static int Lnew(lua_State *L) {
+	lua_Integer max_length = luaL_optinteger(L, 1, 0);
+	lua_Integer max_chunks = luaL_optinteger(L, 2, 0);
+	writequeue *q;
+
+	luaL_argcheck(L, max_length >= 0, 1, "non-negative integer expected");
+	luaL_argcheck(L, max_chunks >= 0, 2, "non-negative integer expected");
+
+	q = lua_newuserdata(L, sizeof(writequeue));
+	q->head = q->count = q->alloc = 0;
+	q->offset = q->length = 0;
+	q->max_length = max_length ? (size_t)max_length : SIZE_MAX;
+	q->max_chunks = (size_t)max_chunks;
+	q->chunks = NULL;
+
+	luaL_getmetatable(L, WQ_MT);
+	lua_setmetatable(L, -2);
+
+	lua_createtable(L, 0, 0);
+	lua_setuservalue(L, -2);
+
+	return 1;
+}
+
+int luaopen_prosody_util_writequeue(lua_State *L) {
+	luaL_checkversion(L);
+
+	if(luaL_newmetatable(L, WQ_MT)) {
+		lua_pushcfunction(L, Ltostring);
+		lua_setfield(L, -2, "__tostring");
+		lua_pushcfunction(L, Llength);
+		lua_setfield(L, -2, "__len");
+		lua_pushcfunction(L, Lgc);
+		lua_setfield(L, -2, "__gc");
+
+		lua_createtable(L, 0, 5); /* __index */
+		{
+			lua_pushcfunction(L, Lwrite);
+			lua_setfield(L, -2, "write");
+			lua_pushcfunction(L, Lpeek);
+			lua_setfield(L, -2, "peek");
+			lua_pushcfunction(L, Ldiscard);
+			lua_setfield(L, -2, "discard");
+			lua_pushcfunction(L, Lflush);
+			lua_setfield(L, -2, "flush");
+			lua_pushcfunction(L, Llength);
+			lua_setfield(L, -2, "length");
+		}
+		lua_setfield(L, -2, "__index");
+	}
+
+	lua_createtable(L, 0, 1);
+	lua_pushcfunction(L, Lnew);
+	lua_setfield(L, -2, "new");
+	return 1;
+}
+
+int luaopen_util_writequeue(lua_State *L) {
+	return luaopen_prosody_util_writequeue(L);
+}
@@ -0,0 +1,277 @@
+/*
+ * WebSocket frame headers and masking, RFC 6455 section 5.2
+ *
+ * This project is MIT licensed. Please see the
+ * COPYING file in the source package for more information.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#ifndef LUA_MAXINTEGER
+#define LUA_MAXINTEGER PTRDIFF_MAX
+#endif
+
+#define MAX_HEADER (2 + 8 + 4)
+
+static uint64_t read_be(const unsigned char *p, size_t n) {
+	uint64_t v = 0;
+	size_t i;
+
+	for(i = 0; i < n; i++) {
+		v = (v << 8) | p[i];
+	}
+
+	return v;
+}
+
+static void write_be(unsigned char *p, uint64_t v, size_t n) {
+	while(n-- > 0) {
+		p[n] = v & 0xff;
+		v >>= 8;
+	}
+}
+
+/*
+ * XOR `len` bytes with the 4 byte key. The key is spread over a word so that
+ * all but the tail is done a word at a time, which compilers vectorize where
+ * they can.
+ */
+static void apply_mask(unsigned char *out, const unsigned char *in, size_t len, const unsigned char *key) {
+	unsigned char key_word[sizeof(uint64_t)];
+	uint64_t w, k;
+	size_t i;
+
+	for(i = 0; i < sizeof(key_word); i++) {
+		key_word[i] = key[i & 3];
+	}
+
+	memcpy(&k, key_word, sizeof(k));
+
+	for(i = 0; i + sizeof(w) <= len; i += sizeof(w)) {
+		memcpy(&w, in + i, sizeof(w));
+		w ^= k;
+		memcpy(out + i, &w, sizeof(w));
+	}
+
+	for(; i < len; i++) {
+		out[i] = in[i] ^ key_word[i & (sizeof(key_word) - 1)];
+	}
+}
+
+static void push_length(lua_State *L, uint64_t length) {
+	if(length > (uint64_t)LUA_MAXINTEGER) {
+		lua_pushnumber(L, (lua_Number)length);
+	} else {
+		lua_pushinteger(L, (lua_Integer)length);
+	}
+}
+
+static size_t check_range(lua_State *L, size_t len, int idx, lua_Integer def) {
+	lua_Integer pos = luaL_optinteger(L, idx, def);
+
+	if(pos < 0) {
+		pos = (lua_Integer)len + pos + 1;
+	}
+
+	if(pos < 1) {
+		return 0;
+	}
+
+	return (size_t)pos > len ? len : (size_t)pos;
+}
+
+/*
+ * Parse the frame header at the start of a string, or at `init`
+ * (string, integer?) -> table, integer
+ *
+ * Returns nothing if the string is too short to hold the whole header.
+ * Otherwise returns the fields in the same table layout as
+ * net.websocket.frames and the length of the header.
+ */
+static int Lparse_header(lua_State *L) {
+	size_t len;
+	const unsigned char *data = (const unsigned char *)luaL_checklstring(L, 1, &len);
+	lua_Integer init = luaL_optinteger(L, 2, 1);
+	size_t length_bytes = 0, header_length;
+	uint64_t length;
+	int masked;
+
+	luaL_argcheck(L, init >= 1, 2, "positive integer expected");
+
+	if((size_t)(init - 1) >= len) {
+		return 0;
+	}
+
+	data += init - 1;
+	len -= init - 1;
+
+	if(len < 2) {
+		return 0;
+	}
+
+	masked = (data[1] & 0x80) != 0;
+	length = data[1] & 0x7f;
+
+	if(length == 126) {
+		length_bytes = 2;
+	} else if(length == 127) {
+		length_bytes = 8;
+	}
+
+	header_length = 2 + length_bytes + (masked ? 4 : 0);
+
+	if(len < header_length) {
+		return 0;
+	}
+
+	if(length_bytes) {
+		length = read_be(data + 2, length_bytes);
+	}
+
+	lua_createtable(L, 0, 8);
+	lua_pushboolean(L, data[0] & 0x80);
+	lua_setfield(L, -2, "FIN");
+	lua_pushboolean(L, data[0] & 0x40);
+	lua_setfield(L, -2, "RSV1");
+	lua_pushboolean(L, data[0] & 0x20);
+	lua_setfield(L, -2, "RSV2");
+	lua_pushboolean(L, data[0] & 0x10);
+	lua_setfield(L, -2, "RSV3");
+	lua_pushinteger(L, data[0] & 0x0f);
+	lua_setfield(L, -2, "opcode");
+	lua_pushboolean(L, masked);
+	lua_setfield(L, -2, "MASK");
+	push_length(L, length);
+	lua_setfield(L, -2, "length");
+
+	if(masked) {
+		lua_pushlstring(L, (const char *)data + 2 + length_bytes, 4);
+		lua_setfield(L, -2, "key");
+	}
+
+	lua_pushinteger(L, header_length);
+	return 2;
+}
+
+/*
+ * XOR a range of a string with a masking key
+ * (string, string, integer?, integer?) -> string
+ *
+ * Takes i and j like string.sub(). The first byte of the range is XORed with
+ * the first byte of the key.
+ */
+static int Lmask(lua_State *L) {
+	size_t len, key_len;
+	const unsigned char *data = (const unsigned char *)luaL_checklstring(L, 1, &len);
+	const unsigned char *key = (const unsigned char *)luaL_checklstring(L, 2, &key_len);
+	lua_Integer start = luaL_optinteger(L, 3, 1);
+	size_t j = check_range(L, len, 4, -1);
+	size_t i;
+	luaL_Buffer buf;
+	unsigned char *out;
+
+	luaL_argcheck(L, key_len == 4, 2, "masking key must be 4 bytes");
+
+	/* Like string.sub(), only the end is clamped, starting past it is empty */
+	if(start < 0) {
+		start = (lua_Integer)len + start + 1;
+	}
+
+	if(start < 1) {
+		start = 1;
+	}
+
+	if((size_t)start > len) {
+		lua_pushliteral(L, "");
+		return 1;
+	}
+
+	i = (size_t)start;
+
+	if(j < i) {
+		lua_pushliteral(L, "");
+		return 1;
+	}
+
+	out = (unsigned char *)luaL_buffinitsize(L, &buf, j - i + 1);
+	apply_mask(out, data + i - 1, j - i + 1, key);
+	luaL_pushresultsize(&buf, j - i + 1);
+	return 1;
+}
+
+/*
+ * Build a whole frame
+ * (integer, string, string?) -> string
+ *
+ * Takes the first header byte (FIN, RSV and opcode bits), the payload and
+ * optionally a masking key, and writes everything in one go.
+ */
+static int Lbuild(lua_State *L) {
+	lua_Integer b1 = luaL_checkinteger(L, 1);
+	size_t len, key_len = 0;
+	const unsigned char *data = (const unsigned char *)luaL_checklstring(L, 2, &len);
+	const unsigned char *key = (const unsigned char *)luaL_optlstring(L, 3, NULL, &key_len);
+	unsigned char header[MAX_HEADER];
+	size_t header_length = 2;
+	luaL_Buffer buf;
+	unsigned char *out;
+
+	luaL_argcheck(L, b1 >= 0 && b1 <= 0xff, 1, "header byte out of range");
+	luaL_argcheck(L, key == NULL || key_len == 4, 3, "masking key must be 4 bytes");
+
+	header[0] = (unsigned char)b1;
+
+	if(len <= 125) {
+		header[1] = (unsigned char)len;
+	} else if(len <= 0xffff) {
+		header[1] = 126;
+		write_be(header + 2, len, 2);
+		header_length += 2;
+	} else {
+		header[1] = 127;
+		write_be(header + 2, len, 8);
+		header_length += 8;
+	}
+
+	if(key) {
+		header[1] |= 0x80;
+		memcpy(header + header_length, key, 4);
+		header_length += 4;
+	}
+
+	out = (unsigned char *)luaL_buffinitsize(L, &buf, header_length + len);
+	memcpy(out, header, header_length);
+
+	if(key) {
+		apply_mask(out + header_length, data, len, key);
+	} else {
+		memcpy(out + header_length, data, len);
+	}
+
+	luaL_pushresultsize(&buf, header_length + len);
+	return 1;
+}
+
+int luaopen_prosody_util_wsframe(lua_State *L) {
+	luaL_Reg exports[] = {
+		{ "parse_header", Lparse_header },
+		{ "mask", Lmask },
+		{ "build", Lbuild },
+		{ NULL, NULL }
+	};
+
+	luaL_checkversion(L);
+
+	lua_newtable(L);
+	luaL_setfuncs(L, exports, 0);
+	return 1;
+}
+
+int luaopen_util_wsframe(lua_State *L) {
+	return luaopen_prosody_util_wsframe(L);
+}
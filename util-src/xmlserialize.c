@@ -0,0 +1,305 @@
+/*
+ * XML serialization of stanzas
+ *
+ * Produces exactly what the Lua serializer in util.stanza does, walking the
+ * tree once and escaping straight into a single buffer.
+ *
+ * This project is MIT licensed. Please see the
+ * COPYING file in the source package for more information.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#define BUFFER_MT "util.xmlserialize buffer"
+
+/* Deeper than anything util.xmppstream would produce, shallow enough for the C stack */
+#define MAX_DEPTH 10000
+
+/* Replacement for each byte, or NULL if it is written as is */
+static const char *escapes[256] = {
+	['\''] = "&apos;",
+	['"'] = "&quot;",
+	['<'] = "&lt;",
+	['>'] = "&gt;",
+	['&'] = "&amp;",
+};
+
+typedef struct {
+	char *data;
+	size_t len;
+	size_t alloc;
+} xml_buffer;
+
+static void buffer_reserve(lua_State *L, xml_buffer *b, size_t extra) {
+	size_t alloc;
+	char *data;
+
+	if(b->alloc - b->len >= extra) {
+		return;
+	}
+
+	alloc = b->alloc ? b->alloc : 256;
+
+	while(alloc - b->len < extra) {
+		alloc *= 2;
+	}
+
+	data = realloc(b->data, alloc);
+
+	if(data == NULL) {
+		luaL_error(L, "not enough memory");
+	}
+
+	b->data = data;
+	b->alloc = alloc;
+}
+
+static void buffer_add(lua_State *L, xml_buffer *b, const char *s, size_t len) {
+	buffer_reserve(L, b, len);
+	memcpy(b->data + b->len, s, len);
+	b->len += len;
+}
+
+#define buffer_addliteral(L, b, s) buffer_add(L, b, "" s, sizeof(s) - 1)
+
+/* Copy runs of bytes that need no escaping in one go */
+static void buffer_add_escaped(lua_State *L, xml_buffer *b, const char *s, size_t len) {
+	size_t i = 0, run;
+
+	while(i < len) {
+		const char *replacement;
+		run = i;
+
+		while(run < len && escapes[(unsigned char)s[run]] == NULL) {
+			run++;
+		}
+
+		buffer_add(L, b, s + i, run - i);
+
+		if(run == len) {
+			break;
+		}
+
+		replacement = escapes[(unsigned char)s[run]];
+		buffer_add(L, b, replacement, strlen(replacement));
+		i = run + 1;
+	}
+}
+
+static int Lbuffer_gc(lua_State *L) {
+	xml_buffer *b = luaL_checkudata(L, 1, BUFFER_MT);
+	free(b->data);
+	b->data = NULL;
+	b->len = b->alloc = 0;
+	return 0;
+}
+
+/*
+ * Serialize the stanza at `idx`. `parentns` is the stack index of the
+ * parent's xmlns attribute, or 0. Leaves the stack as it found it.
+ */
+static void serialize_tag(lua_State *L, xml_buffer *b, int idx, int parentns, int depth) {
+	const char *name;
+	size_t name_len, n, len;
+	int attr, xmlns, nsid = 0;
+
+	if(depth > MAX_DEPTH) {
+		luaL_error(L, "stanza nested too deeply");
+	}
+
+	luaL_checkstack(L, 8, "stanza nested too deeply");
+
+	lua_getfield(L, idx, "name");
+	name = lua_tolstring(L, -1, &name_len);
+
+	if(name == NULL) {
+		luaL_error(L, "invalid stanza: name is not a string");
+	}
+
+	buffer_addliteral(L, b, "<");
+	buffer_add(L, b, name, name_len);
+
+	lua_getfield(L, idx, "attr");
+	attr = lua_gettop(L);
+
+	if(!lua_istable(L, attr)) {
+		luaL_error(L, "invalid stanza: attr is not a table");
+	}
+
+	lua_pushnil(L);
+
+	while(lua_next(L, attr) != 0) {
+		const char *k, *v, *sep;
+		size_t k_len, v_len;
+
+		/* lua_tolstring() on the key itself would confuse lua_next() */
+		lua_pushvalue(L, -2);
+		k = lua_tolstring(L, -1, &k_len);
+		v = lua_tolstring(L, -2, &v_len);
+
+		if(k == NULL || v == NULL) {
+			luaL_error(L, "invalid stanza: attribute is not a string");
+		}
+
+		if((sep = memchr(k, '\1', k_len)) != NULL) {
+			char prefix[32];
+			int prefix_len = snprintf(prefix, sizeof(prefix), "ns%d", ++nsid);
+
+			buffer_addliteral(L, b, " xmlns:");
+			buffer_add(L, b, prefix, prefix_len);
+			buffer_addliteral(L, b, "='");
+			buffer_add_escaped(L, b, k, sep - k);
+			buffer_addliteral(L, b, "' ");
+			buffer_add(L, b, prefix, prefix_len);
+			buffer_addliteral(L, b, ":");
+			buffer_add(L, b, sep + 1, k_len - (sep - k) - 1);
+			buffer_addliteral(L, b, "='");
+			buffer_add_escaped(L, b, v, v_len);
+			buffer_addliteral(L, b, "'");
+		} else if(!(k_len == 5 && memcmp(k, "xmlns", 5) == 0 && parentns && lua_rawequal(L, -2, parentns))) {
+			buffer_addliteral(L, b, " ");
+			buffer_add(L, b, k, k_len);
+			buffer_addliteral(L, b, "='");
+			buffer_add_escaped(L, b, v, v_len);
+			buffer_addliteral(L, b, "'");
+		}
+
+		lua_pop(L, 2);
+	}
+
+	len = lua_rawlen(L, idx);
+
+	if(len == 0) {
+		buffer_addliteral(L, b, "/>");
+		lua_pop(L, 2);
+		return;
+	}
+
+	buffer_addliteral(L, b, ">");
+
+	lua_getfield(L, attr, "xmlns");
+	xmlns = lua_isnil(L, -1) ? 0 : lua_gettop(L);
+
+	for(n = 1; n <= len; n++) {
+		lua_rawgeti(L, idx, n);
+
+		if(lua_type(L, -1) == LUA_TTABLE) {
+			serialize_tag(L, b, lua_gettop(L), xmlns, depth + 1);
+		} else {
+			size_t text_len;
+			const char *text = lua_tolstring(L, -1, &text_len);
+
+			if(text == NULL) {
+				luaL_error(L, "invalid stanza: child is neither a stanza nor text");
+			}
+
+			buffer_add_escaped(L, b, text, text_len);
+		}
+
+		lua_pop(L, 1);
+	}
+
+	buffer_addliteral(L, b, "</");
+	buffer_add(L, b, name, name_len);
+	buffer_addliteral(L, b, ">");
+	lua_pop(L, 3);
+}
+
+/*
+ * Serialize a stanza to XML
+ * (stanza) -> string
+ */
+static int Lserialize(lua_State *L) {
+	xml_buffer *b;
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+	lua_settop(L, 1);
+
+	/* Owned by the GC, so that errors part way through don't leak */
+	b = lua_newuserdata(L, sizeof(xml_buffer));
+	b->data = NULL;
+	b->len = b->alloc = 0;
+	luaL_getmetatable(L, BUFFER_MT);
+	lua_setmetatable(L, -2);
+
+	serialize_tag(L, b, 1, 0, 0);
+
+	lua_pushlstring(L, b->data, b->len);
+	free(b->data);
+	b->data = NULL;
+	b->len = b->alloc = 0;
+	return 1;
+}
+
+/*
+ * Escape the characters that are special in XML text and attributes
+ * (string) -> string
+ */
+static int Lescape(lua_State *L) {
+	size_t len, i;
+	const char *s = luaL_checklstring(L, 1, &len);
+	luaL_Buffer buf;
+
+	for(i = 0; i < len; i++) {
+		if(escapes[(unsigned char)s[i]] != NULL) {
+			break;
+		}
+	}
+
+	if(i == len) {
+		/* Nothing to do, which is the common case */
+		if(lua_type(L, 1) == LUA_TSTRING) {
+			lua_settop(L, 1);
+		} else {
+			lua_pushlstring(L, s, len);
+		}
+
+		return 1;
+	}
+
+	luaL_buffinit(L, &buf);
+	luaL_addlstring(&buf, s, i);
+
+	for(; i < len; i++) {
+		const char *replacement = escapes[(unsigned char)s[i]];
+
+		if(replacement != NULL) {
+			luaL_addstring(&buf, replacement);
+		} else {
+			luaL_addchar(&buf, s[i]);
+		}
+	}
+
+	luaL_pushresult(&buf);
+	return 1;
+}
+
+int luaopen_prosody_util_xmlserialize(lua_State *L) {
+	luaL_Reg exports[] = {
+		{ "serialize", Lserialize },
+		{ "escape", Lescape },
+		{ NULL, NULL }
+	};
+
+	luaL_checkversion(L);
+
+	if(luaL_newmetatable(L, BUFFER_MT)) {
+		lua_pushcfunction(L, Lbuffer_gc);
+		lua_setfield(L, -2, "__gc");
+	}
+
+	lua_pop(L, 1);
+
+	lua_newtable(L);
+	luaL_setfuncs(L, exports, 0);
+	return 1;
+}
+
+int luaopen_util_xmlserialize(lua_State *L) {
+	return luaopen_prosody_util_xmlserialize(L);
+}
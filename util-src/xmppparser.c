@@ -0,0 +1,744 @@
+/*
+ * XMPP stream parser
+ *
+ * Builds stanzas straight from expat events, the same way the LuaExpat
+ * handlers in util.xmppstream do, and only calls into Lua once per complete
+ * stanza or stream event.
+ *
+ * This project is MIT licensed. Please see the
+ * COPYING file in the source package for more information.
+ */
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <expat.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#define PARSER_MT "util.xmppparser"
+
+#define NS_SEPARATOR '\1'
+#define XML_NAMESPACE "http://www.w3.org/XML/1998/namespace\1"
+#define DEFAULT_SIZE_LIMIT (1024 * 1024)
+
+/* Slots in the table kept as the parser's user value */
+enum {
+	S_SESSION = 1,
+	S_STANZA_MT,
+	S_STACK, /* elements of the current stanza, outermost first */
+	S_LANG, /* xml:lang of the stream */
+	S_STREAMOPENED,
+	S_HANDLESTANZA,
+	S_STREAMCLOSED,
+	S_ERROR,
+	S_PENDING_ERROR, /* raised by a callback, rethrown once expat returns */
+};
+
+typedef struct {
+	XML_Parser parser;
+	XML_Parser running; /* differs from parser if reset during a callback */
+	lua_State *L;
+	int state; /* stack index of the user value while parsing */
+	char *stream_tag;
+	char *error_tag;
+	char *default_ns; /* may be NULL */
+	lua_Integer size_limit;
+	lua_Integer outstanding; /* bytes fed but not accounted for by events */
+	lua_Integer stanza_size;
+	int depth; /* open elements of the current stanza */
+	int non_streamns_depth;
+	int failed;
+	const char *error; /* raised once expat returns */
+	char *text;
+	size_t text_len;
+	size_t text_alloc;
+} xmpp_parser;
+
+static const char restricted_xml[] = "Restricted XML, see RFC 6120 section 11.1.";
+
+static int ascii_caseeq(const char *a, const char *b) {
+	for(; *a && *b; a++, b++) {
+		char ca = *a >= 'A' && *a <= 'Z' ? *a + ('a' - 'A') : *a;
+
+		if(ca != *b) {
+			return 0;
+		}
+	}
+
+	return *a == *b;
+}
+
+static void progress(xmpp_parser *x, lua_Integer bytes) {
+	x->outstanding -= bytes;
+}
+
+static int event_bytes(xmpp_parser *x) {
+	return XML_GetCurrentByteCount(x->running);
+}
+
+/*
+ * Push a callback and the session. Returns 0 and pushes nothing if there is
+ * no such callback.
+ */
+static int push_callback(xmpp_parser *x, int slot) {
+	lua_State *L = x->L;
+
+	lua_rawgeti(L, x->state, slot);
+
+	if(lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		return 0;
+	}
+
+	lua_rawgeti(L, x->state, S_SESSION);
+	return 1;
+}
+
+/* Call what push_callback() pushed, plus nargs arguments */
+static void call_callback(xmpp_parser *x, int nargs) {
+	lua_State *L = x->L;
+
+	if(lua_pcall(L, nargs + 1, 0, 0) != LUA_OK) {
+		lua_rawseti(L, x->state, S_PENDING_ERROR);
+		x->failed = 1;
+		XML_StopParser(x->running, XML_FALSE);
+	}
+}
+
+/*
+ * Errors can't be raised while expat is running, so stop it and leave the
+ * error for Lfeed to raise once XML_Parse returns
+ */
+static void fail(xmpp_parser *x, const char *error) {
+	x->error = error;
+	x->failed = 1;
+	XML_StopParser(x->running, XML_FALSE);
+}
+
+static void stream_error(xmpp_parser *x, const char *condition, const char *text, const char *extra) {
+	if(!push_callback(x, S_ERROR)) {
+		return;
+	}
+
+	lua_pushstring(x->L, condition);
+
+	if(extra != NULL) {
+		lua_pushstring(x->L, text);
+		lua_pushstring(x->L, extra);
+		call_callback(x, 3);
+	} else if(text != NULL) {
+		lua_pushstring(x->L, text);
+		call_callback(x, 2);
+	} else {
+		call_callback(x, 1);
+	}
+}
+
+static void restricted(xmpp_parser *x) {
+	stream_error(x, "parse-error", "restricted-xml", restricted_xml);
+	XML_StopParser(x->running, XML_FALSE);
+}
+
+/* Add buffered character data to the innermost open element */
+static void flush_text(xmpp_parser *x) {
+	lua_State *L = x->L;
+
+	if(x->depth == 0 || x->text_len == 0) {
+		return;
+	}
+
+	lua_rawgeti(L, x->state, S_STACK);
+	lua_rawgeti(L, -1, x->depth);
+	lua_pushlstring(L, x->text, x->text_len);
+	lua_rawseti(L, -2, lua_rawlen(L, -2) + 1);
+	lua_pop(L, 2);
+	x->text_len = 0;
+}
+
+/* Replace the attribute table on top of the stack with a new stanza */
+static void push_element(xmpp_parser *x, const char *name) {
+	lua_State *L = x->L;
+
+	lua_createtable(L, 0, 3);
+	lua_pushstring(L, name);
+	lua_setfield(L, -2, "name");
+	lua_pushvalue(L, -2);
+	lua_setfield(L, -2, "attr");
+	lua_newtable(L);
+	lua_setfield(L, -2, "tags");
+	lua_rawgeti(L, x->state, S_STANZA_MT);
+	lua_setmetatable(L, -2);
+	lua_remove(L, -2);
+}
+
+static void push_attributes(xmpp_parser *x, const char *ns, size_t ns_len, const XML_Char **attrs) {
+	lua_State *L = x->L;
+	int n = 0;
+
+	while(attrs[n] != NULL) {
+		n += 2;
+	}
+
+	lua_createtable(L, 0, n / 2 + 1);
+
+	if(x->default_ns == NULL || strlen(x->default_ns) != ns_len
+	        || memcmp(x->default_ns, ns, ns_len) != 0 || x->non_streamns_depth > 0) {
+		lua_pushlstring(L, ns, ns_len);
+		lua_setfield(L, -2, "xmlns");
+		x->non_streamns_depth++;
+	}
+
+	for(; *attrs != NULL; attrs += 2) {
+		const char *k = attrs[0];
+
+		if(strncmp(k, XML_NAMESPACE, sizeof(XML_NAMESPACE) - 1) == 0) {
+			const char *local = k + sizeof(XML_NAMESPACE) - 1;
+
+			if(strcmp(local, "lang") == 0 || strcmp(local, "space") == 0
+			        || strcmp(local, "base") == 0 || strcmp(local, "id") == 0) {
+				lua_pushfstring(L, "xml:%s", local);
+				lua_pushstring(L, attrs[1]);
+				lua_rawset(L, -3);
+				continue;
+			}
+		}
+
+		lua_pushstring(L, attrs[1]);
+		lua_setfield(L, -2, k);
+	}
+}
+
+static void on_start_element(void *ud, const XML_Char *tagname, const XML_Char **attrs) {
+	xmpp_parser *x = ud;
+	lua_State *L = x->L;
+	const char *sep, *ns, *name;
+	size_t ns_len;
+	int notopen;
+
+	if(x->failed) {
+		return;
+	}
+
+	if(!lua_checkstack(L, 8)) {
+		fail(x, "stack overflow");
+		return;
+	}
+
+	flush_text(x);
+
+	if((sep = strchr(tagname, NS_SEPARATOR)) != NULL) {
+		ns = tagname;
+		ns_len = sep - tagname;
+		name = sep + 1;
+	} else {
+		ns = "";
+		ns_len = 0;
+		name = tagname;
+	}
+
+	push_attributes(x, ns, ns_len, attrs);
+
+	if(x->depth > 0) {
+		x->stanza_size += event_bytes(x);
+		push_element(x, name);
+		lua_rawgeti(L, x->state, S_STACK);
+		lua_rawgeti(L, -1, x->depth); /* parent */
+		lua_pushvalue(L, -3);
+		lua_rawseti(L, -2, lua_rawlen(L, -2) + 1);
+		lua_getfield(L, -1, "tags");
+		lua_pushvalue(L, -4);
+		lua_rawseti(L, -2, lua_rawlen(L, -2) + 1);
+		lua_pop(L, 2);
+		lua_pushvalue(L, -2);
+		lua_rawseti(L, -2, ++x->depth);
+		lua_pop(L, 2);
+		return;
+	}
+
+	x->stanza_size = event_bytes(x);
+
+	lua_rawgeti(L, x->state, S_SESSION);
+	lua_getfield(L, -1, "notopen");
+	notopen = lua_toboolean(L, -1);
+	lua_pop(L, 2);
+
+	if(notopen) {
+		if(strcmp(tagname, x->stream_tag) == 0) {
+			x->non_streamns_depth = 0;
+			lua_getfield(L, -1, "xml:lang");
+
+			if(!lua_isnil(L, -1)) {
+				lua_rawseti(L, x->state, S_LANG);
+			} else {
+				lua_pop(L, 1);
+			}
+
+			if(push_callback(x, S_STREAMOPENED)) {
+				progress(x, x->stanza_size);
+				x->stanza_size = 0;
+				lua_pushvalue(L, -3);
+				call_callback(x, 1);
+			}
+		} else {
+			/* Garbage before stream? */
+			stream_error(x, "no-stream", tagname, NULL);
+		}
+
+		lua_pop(L, 1);
+		return;
+	}
+
+	if(ns_len == 13 && memcmp(ns, "jabber:client", 13) == 0
+	        && strcmp(name, "iq") != 0 && strcmp(name, "presence") != 0 && strcmp(name, "message") != 0) {
+		stream_error(x, "invalid-top-level-element", NULL, NULL);
+
+		if(x->failed) {
+			lua_pop(L, 1);
+			return;
+		}
+	}
+
+	push_element(x, name);
+	lua_rawgeti(L, x->state, S_STACK);
+	lua_insert(L, -2);
+	lua_rawseti(L, -2, 1);
+	lua_pop(L, 1);
+	x->depth = 1;
+}
+
+static void on_end_element(void *ud, const XML_Char *tagname) {
+	xmpp_parser *x = ud;
+	lua_State *L = x->L;
+
+	if(x->failed) {
+		return;
+	}
+
+	if(!lua_checkstack(L, 8)) {
+		fail(x, "stack overflow");
+		return;
+	}
+
+	x->stanza_size += event_bytes(x);
+
+	if(x->non_streamns_depth > 0) {
+		x->non_streamns_depth--;
+	}
+
+	if(x->depth == 0) {
+		progress(x, x->stanza_size);
+
+		if(push_callback(x, S_STREAMCLOSED)) {
+			call_callback(x, 0);
+		}
+
+		return;
+	}
+
+	flush_text(x);
+	lua_rawgeti(L, x->state, S_STACK);
+
+	if(x->depth > 1) {
+		lua_pushnil(L);
+		lua_rawseti(L, -2, x->depth--);
+		lua_pop(L, 1);
+		return;
+	}
+
+	/* Complete stanza */
+	progress(x, x->stanza_size);
+	x->stanza_size = 0;
+	x->depth = 0;
+
+	lua_rawgeti(L, -1, 1);
+	lua_pushnil(L);
+	lua_rawseti(L, -3, 1);
+	lua_remove(L, -2);
+
+	lua_getfield(L, -1, "attr");
+	lua_getfield(L, -1, "xml:lang");
+
+	if(lua_isnil(L, -1)) {
+		lua_rawgeti(L, x->state, S_LANG);
+		lua_setfield(L, -3, "xml:lang");
+	}
+
+	lua_pop(L, 2);
+
+	if(strcmp(tagname, x->error_tag) != 0) {
+		if(push_callback(x, S_HANDLESTANZA)) {
+			lua_pushvalue(L, -3);
+			call_callback(x, 1);
+		}
+	} else if(push_callback(x, S_ERROR)) {
+		lua_pushliteral(L, "stream-error");
+		lua_pushvalue(L, -4);
+		call_callback(x, 2);
+	}
+
+	lua_pop(L, 1);
+}
+
+static void on_character_data(void *ud, const XML_Char *s, int len) {
+	xmpp_parser *x = ud;
+
+	if(x->failed) {
+		return;
+	}
+
+	if(x->depth == 0) {
+		progress(x, event_bytes(x));
+		return;
+	}
+
+	x->stanza_size += event_bytes(x);
+
+	if(x->text_alloc - x->text_len < (size_t)len) {
+		size_t alloc = x->text_alloc ? x->text_alloc : 256;
+		char *text;
+
+		while(alloc - x->text_len < (size_t)len) {
+			alloc *= 2;
+		}
+
+		if((text = realloc(x->text, alloc)) == NULL) {
+			fail(x, "not enough memory");
+			return;
+		}
+
+		x->text = text;
+		x->text_alloc = alloc;
+	}
+
+	memcpy(x->text + x->text_len, s, len);
+	x->text_len += len;
+}
+
+static void on_cdata_section(void *ud) {
+	xmpp_parser *x = ud;
+
+	if(x->failed) {
+		return;
+	}
+
+	if(x->depth > 0) {
+		x->stanza_size += event_bytes(x);
+	} else {
+		progress(x, event_bytes(x));
+	}
+}
+
+static void on_xml_decl(void *ud, const XML_Char *version, const XML_Char *encoding, int standalone) {
+	xmpp_parser *x = ud;
+
+	if(x->failed) {
+		return;
+	}
+
+	progress(x, event_bytes(x));
+
+	if((encoding != NULL && !ascii_caseeq(encoding, "utf-8"))
+	        || standalone == 0
+	        || (version != NULL && strcmp(version, "1.0") != 0)) {
+		restricted(x);
+	}
+}
+
+static void on_doctype(void *ud, const XML_Char *name, const XML_Char *sysid, const XML_Char *pubid, int has_internal) {
+	(void)name;
+	(void)sysid;
+	(void)pubid;
+	(void)has_internal;
+
+	if(!((xmpp_parser *)ud)->failed) {
+		restricted(ud);
+	}
+}
+
+static void on_comment(void *ud, const XML_Char *data) {
+	(void)data;
+
+	if(!((xmpp_parser *)ud)->failed) {
+		restricted(ud);
+	}
+}
+
+static void on_processing_instruction(void *ud, const XML_Char *target, const XML_Char *data) {
+	(void)target;
+	(void)data;
+
+	if(!((xmpp_parser *)ud)->failed) {
+		restricted(ud);
+	}
+}
+
+static XML_Parser create_parser(xmpp_parser *x) {
+	XML_Parser p = XML_ParserCreateNS(NULL, NS_SEPARATOR);
+
+	if(p == NULL) {
+		return NULL;
+	}
+
+	XML_SetUserData(p, x);
+	XML_SetElementHandler(p, on_start_element, on_end_element);
+	XML_SetCharacterDataHandler(p, on_character_data);
+	XML_SetCdataSectionHandler(p, on_cdata_section, on_cdata_section);
+	XML_SetXmlDeclHandler(p, on_xml_decl);
+	XML_SetStartDoctypeDeclHandler(p, on_doctype);
+	XML_SetCommentHandler(p, on_comment);
+	XML_SetProcessingInstructionHandler(p, on_processing_instruction);
+	return p;
+}
+
+static xmpp_parser *check_parser(lua_State *L, int idx) {
+	return luaL_checkudata(L, idx, PARSER_MT);
+}
+
+static char *copy_string(lua_State *L, int idx, const char *field, int optional) {
+	const char *s;
+	char *copy;
+	size_t len;
+
+	lua_getfield(L, idx, field);
+
+	if(optional && lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		return NULL;
+	}
+
+	s = lua_tolstring(L, -1, &len);
+
+	if(s == NULL) {
+		luaL_error(L, "bad option '%s' (string expected)", field);
+	}
+
+	if((copy = malloc(len + 1)) == NULL) {
+		luaL_error(L, "not enough memory");
+	}
+
+	memcpy(copy, s, len + 1);
+	lua_pop(L, 1);
+	return copy;
+}
+
+static void copy_field(lua_State *L, int from, const char *field, int to, int slot) {
+	lua_getfield(L, from, field);
+	lua_rawseti(L, to, slot);
+}
+
+/*
+ * Create a parser
+ * (session, table) -> parser
+ *
+ * The table holds the stanza metatable, the full stream and stream error tag
+ * names (namespace, "\1", name), the default namespace and the size limit,
+ * and the callbacks as in util.xmppstream.
+ */
+static int Lnew(lua_State *L) {
+	xmpp_parser *x;
+	int state;
+
+	luaL_checktype(L, 2, LUA_TTABLE);
+	lua_settop(L, 2);
+
+	x = lua_newuserdata(L, sizeof(xmpp_parser));
+	memset(x, 0, sizeof(xmpp_parser));
+	luaL_getmetatable(L, PARSER_MT);
+	lua_setmetatable(L, -2);
+
+	lua_createtable(L, S_PENDING_ERROR, 0);
+	state = lua_gettop(L);
+	lua_pushvalue(L, 1);
+	lua_rawseti(L, state, S_SESSION);
+	lua_getfield(L, 2, "stanza_mt");
+	luaL_argcheck(L, lua_istable(L, -1), 2, "stanza_mt must be a table");
+	lua_rawseti(L, state, S_STANZA_MT);
+	lua_newtable(L);
+	lua_rawseti(L, state, S_STACK);
+	lua_pushliteral(L, "en");
+	lua_rawseti(L, state, S_LANG);
+	copy_field(L, 2, "streamopened", state, S_STREAMOPENED);
+	copy_field(L, 2, "handlestanza", state, S_HANDLESTANZA);
+	copy_field(L, 2, "streamclosed", state, S_STREAMCLOSED);
+	copy_field(L, 2, "error", state, S_ERROR);
+	lua_setuservalue(L, 3);
+
+	x->stream_tag = copy_string(L, 2, "stream_tag", 0);
+	x->error_tag = copy_string(L, 2, "error_tag", 0);
+	x->default_ns = copy_string(L, 2, "default_ns", 1);
+
+	lua_getfield(L, 2, "stanza_size_limit");
+	x->size_limit = luaL_optinteger(L, -1, DEFAULT_SIZE_LIMIT);
+	lua_pop(L, 1);
+
+	if((x->parser = create_parser(x)) == NULL) {
+		return luaL_error(L, "not enough memory");
+	}
+
+	return 1;
+}
+
+/*
+ * Parse some more of the stream
+ * (parser, string) -> true | nil, string
+ *
+ * Errors raised by callbacks are passed on.
+ */
+static int Lfeed(lua_State *L) {
+	xmpp_parser *x = check_parser(L, 1);
+	size_t len;
+	const char *data = luaL_checklstring(L, 2, &len);
+	enum XML_Status status;
+	const char *err = NULL;
+	XML_Parser p;
+
+	if(x->running != NULL) {
+		return luaL_error(L, "parser is already running");
+	}
+
+	luaL_argcheck(L, len <= INT_MAX, 2, "too much data at once");
+
+	lua_settop(L, 2);
+	lua_getuservalue(L, 1);
+	x->state = 3;
+	x->L = L;
+	x->outstanding += len;
+
+	p = x->running = x->parser;
+	status = XML_Parse(p, data, (int)len, 0);
+
+	if(status == XML_STATUS_ERROR) {
+		err = XML_ErrorString(XML_GetErrorCode(p));
+	}
+
+	if(p != x->parser) {
+		/* Reset by a callback, let the old parser finish */
+		XML_Parse(p, NULL, 0, 1);
+		XML_ParserFree(p);
+	}
+
+	x->running = NULL;
+	x->L = NULL;
+
+	if(x->failed) {
+		x->failed = 0;
+
+		if(x->error != NULL) {
+			err = x->error;
+			x->error = NULL;
+			return luaL_error(L, "%s", err);
+		}
+
+		lua_rawgeti(L, 3, S_PENDING_ERROR);
+		lua_pushnil(L);
+		lua_rawseti(L, 3, S_PENDING_ERROR);
+		return lua_error(L);
+	}
+
+	if(x->outstanding > x->size_limit) {
+		err = "stanza-too-large";
+	}
+
+	if(err != NULL) {
+		lua_pushnil(L);
+		lua_pushstring(L, err);
+		return 2;
+	}
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/*
+ * Start over with a new stream, also from within a callback. In that case
+ * the rest of the data being parsed goes through the old stream.
+ */
+static int Lreset(lua_State *L) {
+	xmpp_parser *x = check_parser(L, 1);
+	XML_Parser p = create_parser(x);
+
+	if(p == NULL) {
+		return luaL_error(L, "not enough memory");
+	}
+
+	if(x->parser != NULL && x->parser != x->running) {
+		XML_ParserFree(x->parser);
+	}
+
+	x->parser = p;
+	x->depth = 0;
+	x->stanza_size = 0;
+	x->outstanding = 0;
+	x->text_len = 0;
+
+	lua_getuservalue(L, 1);
+	lua_newtable(L);
+	lua_rawseti(L, -2, S_STACK);
+	return 0;
+}
+
+static int Lset_session(lua_State *L) {
+	check_parser(L, 1);
+	luaL_checkany(L, 2);
+	lua_getuservalue(L, 1);
+	lua_pushvalue(L, 2);
+	lua_rawseti(L, -2, S_SESSION);
+	return 0;
+}
+
+static int Lset_stanza_size_limit(lua_State *L) {
+	xmpp_parser *x = check_parser(L, 1);
+	x->size_limit = luaL_checkinteger(L, 2);
+	return 0;
+}
+
+static int Lgc(lua_State *L) {
+	xmpp_parser *x = check_parser(L, 1);
+
+	if(x->parser != NULL) {
+		XML_ParserFree(x->parser);
+		x->parser = NULL;
+	}
+
+	free(x->stream_tag);
+	free(x->error_tag);
+	free(x->default_ns);
+	free(x->text);
+	x->stream_tag = x->error_tag = x->default_ns = x->text = NULL;
+	x->text_len = x->text_alloc = 0;
+	return 0;
+}
+
+int luaopen_prosody_util_xmppparser(lua_State *L) {
+	luaL_Reg methods[] = {
+		{ "feed", Lfeed },
+		{ "reset", Lreset },
+		{ "set_session", Lset_session },
+		{ "set_stanza_size_limit", Lset_stanza_size_limit },
+		{ NULL, NULL }
+	};
+
+	luaL_checkversion(L);
+
+	if(luaL_newmetatable(L, PARSER_MT)) {
+		lua_pushcfunction(L, Lgc);
+		lua_setfield(L, -2, "__gc");
+		lua_newtable(L);
+		luaL_setfuncs(L, methods, 0);
+		lua_setfield(L, -2, "__index");
+	}
+
+	lua_pop(L, 1);
+
+	lua_createtable(L, 0, 1);
+	lua_pushcfunction(L, Lnew);
+	lua_setfield(L, -2, "new");
+	return 1;
+}
+
+int luaopen_util_xmppparser(lua_State *L) {
+	return luaopen_prosody_util_xmppparser(L);
+}
@@ -11,6 +11,7 @@ local string = string;
 local format = string.format;
 local setmetatable = setmetatable;
 local ipairs = ipairs;
+local pairs = pairs;
 local char = string.char;
 local pcall = pcall;
 local log = require "prosody.util.logger".init("datamanager");
@@ -32,17 +33,20 @@ local path_separator = assert ( package.config:match ( "^([^\n]+)" ) , "package.
 
 local prosody = prosody;
 
---luacheck: ignore 211/blocksize 211/remove_blocks
 local blocksize = 0x1000;
 local raw_mkdir = lfs.mkdir;
 local atomic_append;
+local atomic_append_batch;
+local mmap;
 local remove_blocks;
 local ENOENT = 2;
 pcall(function()
 	local pposix = require "prosody.util.pposix";
 	raw_mkdir = pposix.mkdir or raw_mkdir; -- Doesn't trample on umask
 	atomic_append = pposix.atomic_append;
-	-- remove_blocks = pposix.remove_blocks;
+	atomic_append_batch = pposix.atomic_append_batch;
+	mmap = pposix.mmap;
+	remove_blocks = pposix.remove_blocks;
 	ENOENT = pposix.ENOENT or ENOENT;
 end);
 
@@ -82,6 +86,12 @@ if not atomic_append then
 	end
 end
 
+if not atomic_append_batch then
+	function atomic_append_batch(f, chunks)
+		return atomic_append(f, t_concat(chunks));
+	end
+end
+
 local _mkdir = {};
 local function mkdir(path)
 	path = path:gsub("/", path_separator); -- TODO as an optimization, do this during path creation rather than here
@@ -234,14 +244,21 @@ local function store(username, host, datastore, data)
 	return true;
 end
 
--- Append a blob of data to a file
-local function append(username, host, datastore, ext, data)
-	if type(data) ~= "string" then return; end
+-- Append a blob of data, or an array of them, to a file
+local function append(username, host, datastore, ext, data, sync)
+	local chunks;
+	if type(data) == "table" then
+		chunks = data;
+	elseif type(data) ~= "string" then
+		return;
+	elseif sync then
+		chunks = { data };
+	end
 	local filename = getpath(username, host, datastore, ext, true);
 
 	local f = io_open(filename, "r+");
 	if not f then
-		return atomic_store(filename, data);
+		return atomic_store(filename, chunks and t_concat(chunks) or data);
 		-- File did probably not exist, let's create it
 	end
 
@@ -255,7 +272,12 @@ local function append(username, host, datastore, ext, data)
 	end
 	--]]
 
-	local ok, msg = atomic_append(f, data);
+	local ok, msg;
+	if chunks then
+		ok, msg = atomic_append_batch(f, chunks, sync);
+	else
+		ok, msg = atomic_append(f, data);
+	end
 
 	if not ok then
 		f:close();
@@ -277,13 +299,18 @@ if string.packsize then
 	index_magic = string.pack(index_fmt, 7767639 + 1); -- Magic string: T9 for "prosody", version number
 end
 
-local function list_append(username, host, datastore, data)
-	if not data then return; end
+-- Append several items with one write to the list and one to its index,
+-- optionally waiting for the data to reach the disk
+local function list_append_batch(username, host, datastore, items, sync)
+	if not items or not items[1] then return; end
 	if callback(username, host, datastore) == false then return true; end
 	-- save the datastore
 
-	data = "item(" ..  serialize(data) .. ");\n";
-	local ok, msg, where = append(username, host, datastore, "list", data);
+	local data = {};
+	for i, item in ipairs(items) do
+		data[i] = "item(" ..  serialize(item) .. ");\n";
+	end
+	local ok, msg, where = append(username, host, datastore, "list", data, sync);
 	if not ok then
 		log("error", "Unable to write to %s storage ('%s' in %s) for user: %s@%s",
 			datastore, msg, where, username or "nil", host or "nil");
@@ -291,11 +318,16 @@ local function list_append(username, host, datastore, data)
 	end
 	if string.packsize then
 		local offset = type(msg) == "number" and msg or 0;
-		local index_entry = string.pack(index_fmt, offset + #data);
+		local index_entries = {};
 		if offset == 0 then
-			index_entry = index_magic .. index_entry;
+			index_entries[1] = index_magic;
+		end
+		local item_end = offset;
+		for _, item_data in ipairs(data) do
+			item_end = item_end + #item_data;
+			t_insert(index_entries, string.pack(index_fmt, item_end));
 		end
-		local ok, off = append(username, host, datastore, "lidx", index_entry);
+		local ok, off = append(username, host, datastore, "lidx", index_entries);
 		off = off or 0;
 		-- If this was the first item, then both the data and index offsets should
 		-- be zero, otherwise there's some kind of mismatch and we should drop the
@@ -308,6 +340,11 @@ local function list_append(username, host, datastore, data)
 	return true;
 end
 
+local function list_append(username, host, datastore, data)
+	if not data then return; end
+	return list_append_batch(username, host, datastore, { data });
+end
+
 local function list_store(username, host, datastore, data)
 	if not data then
 		data = {};
@@ -409,6 +446,33 @@ local index_mt = {
 	end;
 }
 
+-- Same as index_mt, but decoding offsets straight out of a mapping of the
+-- index file instead of seeking and reading for each item
+local mapped_index_mt = {
+	__index = function(t, i)
+		if type(i) ~= "number" or i % 1 ~= 0 or i < 0 then
+			return
+		end
+		if i <= 0 then
+			return 0
+		end
+		local map = t.map;
+		local next_pos = map:offset(i);
+		if not next_pos then
+			return nil
+		end
+		local start = 0;
+		if i > 1 then
+			start = map:offset(i - 1);
+		end
+		return { start = start; length = next_pos - start };
+	end;
+	__len = function(t)
+		-- Account for both the header and the fence post error
+		return t.map:entries() - 1;
+	end;
+}
+
 local function get_list_index(username, host, datastore)
 	log("debug", "Loading index for (%s@%s/%s)", username, host, datastore);
 	local index_filename = getpath(username, host, datastore, "lidx");
@@ -423,6 +487,20 @@ local function get_list_index(username, host, datastore)
 		end
 	end
 
+	if ih and mmap then
+		local map = mmap(ih);
+		if map and map:offset(1) then
+			ih:close();
+			return setmetatable({ map = map }, mapped_index_mt);
+		elseif map then
+			-- Too short to hold the first item
+			map:close();
+			ih:close();
+			ih = nil;
+		end
+		-- Otherwise read it through the file handle
+	end
+
 	if ih then
 		local first_length = string.unpack(index_fmt, ih:read(index_item_size));
 		return setmetatable({ file = ih; { start = 0; length = first_length } }, index_mt);
@@ -439,10 +517,14 @@ local function get_list_index(username, host, datastore)
 end
 
 local function list_load_one(fh, start, length)
-	if fh:seek("set", start) ~= start then
+	local raw_data;
+	if fh.sub then -- A mapping rather than a file handle
+		raw_data = fh:sub(start + 1, start + length);
+	elseif fh:seek("set", start) ~= start then
 		return nil
+	else
+		raw_data = fh:read(length);
 	end
-	local raw_data = fh:read(length)
 	if not raw_data or #raw_data ~= length then
 		return
 	end
@@ -462,16 +544,27 @@ local function list_load_one(fh, start, length)
 	return item;
 end
 
+-- Lazily loaded lists that are still open, and the file each one reads
+local open_lists = setmetatable({}, { __mode = "k" });
+
 local function list_close(list)
-	if list.index and list.index.file then
-		list.index.file:close();
+	if list.closed then
+		return true;
+	end
+	list.closed = true;
+	open_lists[list] = nil;
+	if list.index then
+		local ih = list.index.file or list.index.map;
+		if ih then
+			ih:close();
+		end
 	end
 	return list.file:close();
 end
 
 local indexed_list_mt = {
 	__index = function(t, i)
-		if type(i) ~= "number" or i % 1 ~= 0 or i < 1 then
+		if type(i) ~= "number" or i % 1 ~= 0 or i < 1 or t.closed then
 			return
 		end
 		local ix = t.index[i];
@@ -482,6 +575,9 @@ local indexed_list_mt = {
 		return item;
 	end;
 	__len = function(t)
+		if t.closed then
+			return 0;
+		end
 		return #t.index;
 	end;
 	__close = list_close;
@@ -525,13 +621,114 @@ local function list_open(username, host, datastore)
 		file:close()
 		return index, err;
 	end
-	return setmetatable({ file = file; index = index; close = list_close }, indexed_list_mt);
+	if mmap then
+		local map = mmap(file);
+		if map then
+			file:close();
+			file = map;
+		end
+	end
+	local list = setmetatable({ file = file; index = index; close = list_close }, indexed_list_mt);
+	open_lists[list] = filename;
+	return list;
 end
 
-local function shift_index(index_filename, index, trim_to, offset) -- luacheck: ignore 212
-	os_remove(index_filename);
-	return "deleted";
-	-- TODO move and recalculate remaining items
+-- Close the open lists reading a file that is about to change in place.
+-- Their offsets would be wrong afterwards, and a mapping past the new end of
+-- the file would fault.
+local function close_open_lists(filename)
+	for list, list_filename in pairs(open_lists) do
+		if list_filename == filename then
+			list_close(list);
+		end
+	end
+end
+
+-- The raw index entries of items `first` and up, read in one go
+local function index_tail(index, first)
+	if index.map then
+		local map = index.map;
+		return map:sub(first * index_item_size + 1, map:entries() * index_item_size);
+	elseif index.file then
+		index.file:seek("set", first * index_item_size);
+		return index.file:read("*a") or "";
+	end
+	local data = {};
+	for i = first, #index do
+		local item = index[i];
+		data[i - first + 1] = string.pack(index_fmt, item.start + item.length);
+	end
+	return t_concat(data);
+end
+
+-- Write the index for what is left of a list after `offset` bytes were
+-- removed from its front, given the raw old index entries of the remaining
+-- items
+local function shift_index(index_filename, entries, offset)
+	if not index_magic then
+		return "deleted";
+	end
+	local data = { index_magic };
+	local unpack, pack = string.unpack, string.pack;
+	for pos = 1, #entries - index_item_size + 1, index_item_size do
+		data[#data + 1] = pack(index_fmt, unpack(index_fmt, entries, pos) - offset);
+	end
+	local ok, err = atomic_store(index_filename, t_concat(data));
+	if not ok then
+		log("warn", "Could not write the shifted index %q: %s", index_filename, err);
+		os_remove(index_filename);
+		return "deleted";
+	end
+	return "shifted";
+end
+
+-- Drop the first `offset` bytes of a list in place. The whole filesystem
+-- blocks are cut out with a collapse-range, so this costs I/O in proportion
+-- to what is removed rather than to what is left. The rest of the removed
+-- data, which shares a block with the new first item, is overwritten with
+-- newlines. The list format ignores those and the index counts them as part
+-- of the first item.
+-- Returns how many bytes the file shrunk by, nothing if the filesystem can't
+-- do this, or false and an error if the list was left damaged.
+local function collapse_list(list_filename, offset)
+	local block = lfs.attributes(list_filename, "blksize") or blocksize;
+	local block_offset = offset - offset % block;
+
+	local f, err = io_open(list_filename, "r+");
+	if not f then
+		log("warn", "Could not open %q for compaction: %s", list_filename, err);
+		return nil;
+	end
+
+	if block_offset > 0 then
+		local ok, err = remove_blocks(f, 0, block_offset);
+		log("debug", "remove_blocks(%s, 0, %d)", list_filename, block_offset);
+		if not ok then
+			log("debug", "Could not remove blocks from %q[%d, %d]: %s", list_filename, 0, block_offset, err);
+			f:close();
+			return nil;
+		end
+	end
+
+	local diff = offset - block_offset;
+	if diff ~= 0 then
+		local ok, err = f:seek("set", 0);
+		if ok then
+			ok, err = f:write(string.rep("\n", diff));
+		end
+		if not ok then
+			-- Some of the removed items would come back
+			log("error", "Could not blank out %q[%d, %d]: %s", list_filename, 0, diff, err);
+			f:close();
+			return false, err;
+		end
+	end
+
+	local ok, err = f:close();
+	if not ok then
+		return false, err;
+	end
+	return block_offset;
 end
 
 local function list_shift(username, host, datastore, trim_to)
@@ -559,45 +756,24 @@ local function list_shift(username, host, datastore, trim_to)
 		return true;
 	end
 
-	--[[
+	local entries = index_tail(index, trim_to);
+	local ih = index.file or index.map;
+	if ih then
+		ih:close();
+	end
+	-- Until it has been shifted, the index no longer matches the list
+	os_remove(index_filename);
+
 	if remove_blocks then
-		local f, err = io_open(list_filename, "r+");
-		if not f then
-			return f, err;
-		end
-
-		local diff = 0;
-		local block_offset = 0;
-		if offset % 0x1000 ~= 0 then
-			-- Not an even block boundary, we will have to overwrite
-			diff = offset % 0x1000;
-			block_offset = offset - diff;
-		end
-
-		if block_offset == 0 then
-			log("debug", "")
-		else
-			local ok, err = remove_blocks(f, 0, block_offset);
-			log("debug", "remove_blocks(%s, 0, %d)", f, block_offset);
-			if not ok then
-				log("warn", "Could not remove blocks from %q[%d, %d]: %s", list_filename, 0, block_offset, err);
-			else
-				if diff ~= 0 then
-					-- overwrite unaligned leftovers
-					if f:seek("set", 0) then
-						local wrote, err = f:write(string.rep("\n", diff));
-						if not wrote then
-							log("error", "Could not blank out %q[%d, %d]: %s", list_filename, 0, diff, err);
-						end
-					end
-				end
-				local ok, err = f:close();
-				shift_index(index_filename, index, trim_to, offset); -- Shift or delete the index
-				return ok, err;
-			end
+		close_open_lists(list_filename);
+		local removed, err = collapse_list(list_filename, offset);
+		if removed then
+			shift_index(index_filename, entries, removed);
+			return true;
+		elseif removed == false then
+			return nil, err;
 		end
 	end
-	--]]
 
 	local r, err = io_open(list_filename, "r");
 	if not r then
@@ -619,8 +795,12 @@ local function list_shift(username, host, datastore, trim_to)
 	if not ok then
 		return nil, err;
 	end
-	shift_index(index_filename, index, trim_to, offset)
-	return os_rename(list_filename .. "~", list_filename);
+	local ok, err = os_rename(list_filename .. "~", list_filename);
+	if not ok then
+		return nil, err;
+	end
+	shift_index(index_filename, entries, offset);
+	return true;
 end
 
 
@@ -719,6 +899,7 @@ return {
 	append_raw = append;
 	store_raw = atomic_store;
 	list_append = list_append;
+	list_append_batch = list_append_batch;
 	list_store = list_store;
 	list_load = list_load;
 	users = users;
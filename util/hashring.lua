@@ -1,5 +1,7 @@
 local it = require "prosody.util.iterators";
 
+local have_ring, ring_lib = pcall(require, "prosody.util.ring");
+
 local function generate_ring(nodes, num_replicas, hash)
 	local new_ring = {};
 	for _, node_name in ipairs(nodes) do
@@ -13,6 +15,18 @@ local function generate_ring(nodes, num_replicas, hash)
 	return new_ring;
 end
 
+-- Points of one node for the native ring, from its name unless there is a hash function
+local function replica_points(self, node_name)
+	if not self.hash then
+		return self.num_replicas;
+	end
+	local points = {};
+	for replica = 1, self.num_replicas do
+		points[replica] = self.hash(node_name..":"..replica);
+	end
+	return points;
+end
+
 local hashring_methods = {};
 local hashring_mt = {
 	__index = function (self, k)
@@ -26,12 +40,22 @@ local hashring_mt = {
 	end
 };
 
+-- The hash function may be left out when the native ring is available
 local function new(num_replicas, hash_function)
-	return setmetatable({ nodes = {}, num_replicas = num_replicas, hash = hash_function }, hashring_mt);
+	local self = setmetatable({ nodes = {}, num_replicas = num_replicas, hash = hash_function }, hashring_mt);
+	if have_ring then
+		self.points = ring_lib.new();
+	elseif not hash_function then
+		error("hash function required");
+	end
+	return self;
 end;
 
 function hashring_methods:add_node(name, value)
 	self.ring = nil;
+	if self.nodes[name] == nil and self.points then
+		self.points:add(name, replica_points(self, name));
+	end
 	self.nodes[name] = value == nil and true or value;
 	table.insert(self.nodes, name);
 	return true;
@@ -45,6 +69,9 @@ function hashring_methods:add_nodes(nodes)
 	end
 	for node_name, node_value in iter(nodes) do
 		if self.nodes[node_name] == nil then
+			if self.points then
+				self.points:add(node_name, replica_points(self, node_name));
+			end
 			self.nodes[node_name] = node_value == nil and true or node_value;
 			table.insert(self.nodes, node_name);
 		end
@@ -57,6 +84,9 @@ function hashring_methods:remove_node(node_name)
 	if self.nodes[node_name] ~= nil then
 		for i, stored_node_name in ipairs(self.nodes) do
 			if node_name == stored_node_name then
+				if self.points then
+					self.points:remove(node_name);
+				end
 				self.nodes[node_name] = nil;
 				table.remove(self.nodes, i);
 				return true;
@@ -75,8 +105,8 @@ end
 
 function hashring_methods:clone()
 	local clone_hashring = new(self.num_replicas, self.hash);
-	for node_name, node_value in pairs(self.nodes) do
-		clone_hashring.nodes[node_name] = node_value;
+	for _, node_name in ipairs(self.nodes) do
+		clone_hashring:add_node(node_name, self.nodes[node_name]);
 	end
 	clone_hashring.ring = nil;
 	return clone_hashring;
@@ -84,6 +114,14 @@ end
 
 function hashring_methods:get_node(key)
 	local node;
+	if self.points then
+		if self.hash then
+			node = self.points:get_hash(self.hash(key));
+		else
+			node = self.points:get(key);
+		end
+		return node, self.nodes[node];
+	end
 	local key_hash = self.hash(key);
 	for _, replica_hash in ipairs(self.ring) do
 		if key_hash < replica_hash then
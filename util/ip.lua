@@ -7,6 +7,7 @@
 
 local net = require "prosody.util.net";
 local strbit = require "prosody.util.strbitop";
+local iptrie = require "prosody.util.iptrie";
 
 local ip_methods = {};
 
@@ -240,6 +241,54 @@ local function truncate(ip, n_bits)
 	return new_ip(net.ntop(ip.packed:sub(1, n_octets)..("\0"):rep(#ip.packed-n_octets)))
 end
 
+-- A set of addresses and CIDR ranges, looked up in a prefix trie
+local ip_set_methods = {};
+local ip_set_mt = { __index = ip_set_methods };
+
+function ip_set_methods:add(cidr)
+	local ip, bits = parse_cidr(cidr);
+	if not ip then return nil, bits; end
+	if bits then
+		-- Same meaning odd lengths have for match()
+		if bits < 1 then
+			-- Everything, of either family
+			ip, bits = new_ip("::"), 0;
+		else
+			bits = math.min(math.ceil(bits), #ip.packed * 8);
+		end
+	end
+	self.trie:add(ip.packed, bits);
+	return true;
+end
+
+function ip_set_methods:contains(ip)
+	if not is_ip(ip) then
+		local err;
+		ip, err = new_ip(ip);
+		if not ip then return nil, err; end
+	end
+	return self.trie:lookup(ip.packed) ~= nil;
+end
+
+function ip_set_mt:__len()
+	return #self.trie;
+end
+
+-- Takes an array or util.set of addresses and CIDR ranges, invalid ones are skipped
+local function new_set(ranges)
+	local set = setmetatable({ trie = iptrie.new() }, ip_set_mt);
+	if ranges and ranges.items then
+		for cidr in ranges do
+			set:add(cidr);
+		end
+	elseif ranges then
+		for _, cidr in ipairs(ranges) do
+			set:add(cidr);
+		end
+	end
+	return set;
+end
+
 return {
 	new_ip = new_ip,
 	commonPrefixLength = commonPrefixLength,
@@ -247,4 +296,5 @@ return {
 	match = match,
 	is_ip = is_ip;
 	truncate = truncate;
+	new_set = new_set;
 };
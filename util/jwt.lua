@@ -5,6 +5,7 @@ local hashes = require "prosody.util.hashes";
 local base64_encode = require "prosody.util.encodings".base64.encode;
 local base64_decode = require "prosody.util.encodings".base64.decode;
 local secure_equals = require "prosody.util.hashes".equals;
+local new_context_cache = require "prosody.util.sigcache".new;
 
 local b64url_rep = { ["+"] = "-", ["/"] = "_", ["="] = "", ["-"] = "+", ["_"] = "/" };
 local function b64url(data)
@@ -75,15 +76,22 @@ local function new_hmac_algorithm(name)
 	return { sign = sign, verify = verify, load_key = load_key };
 end
 
-local function new_crypto_algorithm(name, key_type, c_sign, c_verify, sig_encode, sig_decode)
+local function new_crypto_algorithm(name, key_type, c_algorithm, sig_encode, sig_decode)
 	local static_header = new_static_header(name);
+	local get_signer = new_context_cache("signer", c_algorithm);
+	local get_verifier = new_context_cache("verifier", c_algorithm);
 
 	return {
 		sign = function (private_key, payload)
 			local encoded_payload = json.encode(payload);
 			local signed = static_header .. b64url(encoded_payload);
 
-			local signature = c_sign(private_key, signed);
+			local signer, err = get_signer(private_key);
+			if not signer then
+				return nil, err;
+			end
+
+			local signature = signer:sign(signed);
 			if sig_encode then
 				signature = sig_encode(signature);
 			end
@@ -103,7 +111,12 @@ local function new_crypto_algorithm(name, key_type, c_sign, c_verify, sig_encode
 				return false, "signature-mismatch";
 			end
 
-			local verify_ok = c_verify(public_key, signed, signature);
+			local verifier, err = get_verifier(public_key);
+			if not verifier then
+				return nil, err;
+			end
+
+			local verify_ok = verifier:verify(signed, signature);
 			if not verify_ok then
 				return false, "signature-mismatch";
 			end
@@ -129,13 +142,11 @@ end
 local rsa_sign_algos = { RS = "rsassa_pkcs1", PS = "rsassa_pss" };
 local function new_rsa_algorithm(name)
 	local family, digest_bits = name:match("^(..)(...)$");
-	local c_sign = crypto[rsa_sign_algos[family].."_sha"..digest_bits.."_sign"];
-	local c_verify = crypto[rsa_sign_algos[family].."_sha"..digest_bits.."_verify"];
-	return new_crypto_algorithm(name, "rsaEncryption", c_sign, c_verify);
+	return new_crypto_algorithm(name, "rsaEncryption", rsa_sign_algos[family].."_sha"..digest_bits);
 end
 
 -- ES***
-local function new_ecdsa_algorithm(name, c_sign, c_verify, sig_bytes)
+local function new_ecdsa_algorithm(name, c_algorithm, sig_bytes)
 	local function encode_ecdsa_sig(der_sig)
 		local r, s = crypto.parse_ecdsa_signature(der_sig, sig_bytes);
 		return r..s;
@@ -148,13 +159,13 @@ local function new_ecdsa_algorithm(name, c_sign, c_verify, sig_bytes)
 		end
 		return crypto.build_ecdsa_signature(jwk_sig:sub(1, sig_bytes), jwk_sig:sub(sig_bytes+1));
 	end
-	return new_crypto_algorithm(name, "id-ecPublicKey", c_sign, c_verify, encode_ecdsa_sig, decode_ecdsa_sig);
+	return new_crypto_algorithm(name, "id-ecPublicKey", c_algorithm, encode_ecdsa_sig, decode_ecdsa_sig);
 end
 
 local algorithms = {
 	HS256 = new_hmac_algorithm("HS256"), HS384 = new_hmac_algorithm("HS384"), HS512 = new_hmac_algorithm("HS512");
-	ES256 = new_ecdsa_algorithm("ES256", crypto.ecdsa_sha256_sign, crypto.ecdsa_sha256_verify, 32);
-	ES512 = new_ecdsa_algorithm("ES512", crypto.ecdsa_sha512_sign, crypto.ecdsa_sha512_verify, 66);
+	ES256 = new_ecdsa_algorithm("ES256", "ecdsa_sha256", 32);
+	ES512 = new_ecdsa_algorithm("ES512", "ecdsa_sha512", 66);
 	RS256 = new_rsa_algorithm("RS256"), RS384 = new_rsa_algorithm("RS384"), RS512 = new_rsa_algorithm("RS512");
 	PS256 = new_rsa_algorithm("PS256"), PS384 = new_rsa_algorithm("PS384"), PS512 = new_rsa_algorithm("PS512");
 };
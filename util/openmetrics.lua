@@ -240,6 +240,49 @@ end
 
 -- END of generic MetricFamily implementation
 
+-- BEGIN of externally kept histograms
+
+-- A histogram whose buckets are counted elsewhere, for example in C, and only
+-- read when rendered. read() returns the number of samples, their sum and the
+-- cumulative count of each bucket, the last one being +Inf.
+local external_histogram_mt = {}
+external_histogram_mt.__name = "external_histogram"
+external_histogram_mt.__index = external_histogram_mt
+
+local function new_external_histogram(buckets, read)
+	local thresholds = {}
+	for i, threshold in ipairs(buckets) do
+		thresholds[i] = render_histogram_le(threshold)
+	end
+	t_insert(thresholds, render_histogram_le(1/0))
+	return setmetatable({ _created = time(), thresholds = thresholds, read = read }, external_histogram_mt)
+end
+
+function external_histogram_mt:iter_samples()
+	local count, sum, counts = self.read()
+	local thresholds, i = self.thresholds, 0
+	local n = #thresholds
+	return function ()
+		i = i + 1
+		if i <= n then
+			return "_bucket", {["le"] = thresholds[i]}, counts[i] or 0
+		elseif i == n + 1 then
+			return "_sum", nil, sum
+		elseif i == n + 2 then
+			return "_count", nil, count
+		elseif i == n + 3 then
+			return "_created", nil, self._created
+		end
+		return nil, nil, nil
+	end
+end
+
+function external_histogram_mt:reset() -- luacheck: ignore 212
+	-- owned by whatever counts the samples
+end
+
+-- END of externally kept histograms
+
 -- BEGIN of MetricRegistry implementation
 
 
@@ -348,6 +391,24 @@ function metric_registry_mt:summary(name, unit, description, labels, extra)
 	return mf
 end
 
+-- A histogram without labels whose samples are counted elsewhere, see
+-- new_external_histogram() above
+function metric_registry_mt:external_histogram(name, unit, description, buckets, read)
+	name = compose_name(name, unit)
+	local mf = setmetatable({
+		family_name = name,
+		data = new_external_histogram(buckets, read),
+		type_ = "histogram",
+		unit = unit,
+		description = description,
+		user_labels = 0,
+		label_keys = {},
+		extra = { buckets = buckets },
+	}, metric_family_mt)
+	mf = self:register_metric_family(name, mf)
+	return mf
+end
+
 function metric_registry_mt:get_metric_families()
 	return self.families
 end
@@ -4,10 +4,11 @@ local hashes = require "prosody.util.hashes";
 local base64_encode = require "prosody.util.encodings".base64.encode;
 local base64_decode = require "prosody.util.encodings".base64.decode;
 local secure_equals = require "prosody.util.hashes".equals;
+local new_context_cache = require "prosody.util.sigcache".new;
 local bit = require "prosody.util.bitcompat";
 local hex = require "prosody.util.hex";
 local rand = require "prosody.util.random";
-local s_pack = require "prosody.util.struct".pack;
+local le64_format = require "prosody.util.struct".compile("<I8");
 
 local s_gsub = string.gsub;
 
@@ -33,7 +34,7 @@ local function unb64url(data)
 end
 
 local function le64(n)
-	return s_pack("<I8", bit.band(n, 0x7F));
+	return le64_format:pack(bit.band(n, 0x7F));
 end
 
 local function pae(parts)
@@ -47,6 +48,9 @@ local function pae(parts)
 	return table.concat(o);
 end
 
+local get_ed25519_signer = new_context_cache("signer", "ed25519");
+local get_ed25519_verifier = new_context_cache("verifier", "ed25519");
+
 function v4_public.sign(m, sk, f, i)
 	if type(m) ~= "table" then
 		return nil, "PASETO payloads must be a table";
@@ -54,7 +58,11 @@ function v4_public.sign(m, sk, f, i)
 	m = json.encode(m);
 	local h = "v4.public.";
 	local m2 = pae({ h, m, f or "", i or "" });
-	local sig = crypto.ed25519_sign(sk, m2);
+	local signer, err = get_ed25519_signer(sk);
+	if not signer then
+		return nil, err;
+	end
+	local sig = signer:sign(m2);
 	if not f or f == "" then
 		return h..b64url(m..sig);
 	else
@@ -79,7 +87,11 @@ function v4_public.verify(tok, pk, expected_f, i)
 	end
 	local s, m = raw_sm:sub(-64), raw_sm:sub(1, -65);
 	local m2 = pae({ h, m, f or "", i or "" });
-	local ok = crypto.ed25519_verify(pk, m2, s);
+	local verifier, verifier_err = get_ed25519_verifier(pk);
+	if not verifier then
+		return nil, verifier_err;
+	end
+	local ok = verifier:verify(m2, s);
 	if not ok then
 		return nil, "invalid-token";
 	end
@@ -0,0 +1,22 @@
+-- Signature contexts keep the key set up between uses, so they are created
+-- once per key and reused for as long as the key is around.
+
+local function new(method, algorithm)
+	local cache = setmetatable({}, { __mode = "k" });
+	return function (key)
+		local ctx = cache[key];
+		if not ctx then
+			local err;
+			ctx, err = key[method](key, algorithm);
+			if not ctx then
+				return nil, err;
+			end
+			cache[key] = ctx;
+		end
+		return ctx;
+	end
+end
+
+return {
+	new = new;
+};
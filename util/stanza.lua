@@ -23,8 +23,21 @@ local s_sub         =    string.sub;
 local s_find        =   string.find;
 local t_move        =    table.move or require "prosody.util.table".move;
 local t_create = require"prosody.util.table".create;
+local t_pool = require"prosody.util.table".pool;
 
-local valid_utf8 = require "prosody.util.encodings".utf8.valid;
+-- Builder stacks handed back by :reset(), and buffers for the Lua serializer
+local last_add_pool = t_pool(4, 0, 256);
+local buffer_pool = t_pool(32, 0, 16);
+-- Pooled tables keep their size, so don't let one huge stanza pin its buffer
+local max_pooled_buffer = 1024;
+
+-- Basic check for valid XML character data, in the same pass as UTF-8 validation.
+-- Disallow control characters.
+-- Tab U+09 and newline U+0A are allowed.
+-- For attributes, allow the \1 separator between namespace and name.
+local valid_xml_cdata = require "prosody.util.encodings".utf8.valid_xml_cdata;
+
+local have_xmlserialize, xmlserialize = pcall(require, "prosody.util.xmlserialize");
 
 local do_pretty_printing, termcolours = pcall(require, "prosody.util.termcolours");
 
@@ -37,14 +50,6 @@ local _ENV = nil;
 local stanza_mt = { __name = "stanza" };
 stanza_mt.__index = stanza_mt;
 
--- Basic check for valid XML character data.
--- Disallow control characters.
--- Tab U+09 and newline U+0A are allowed.
--- For attributes, allow the \1 separator between namespace and name.
-local function valid_xml_cdata(str, attr)
-	return not s_find(str, attr and "[^\1\9\10\13\20-\255]" or "[^\9\10\13\20-\255]");
-end
-
 local function check_name(name, name_type)
 	if type(name) ~= "string" then
 		error("invalid "..name_type.." name: expected string, got "..type(name));
@@ -52,20 +57,20 @@ local function check_name(name, name_type)
 		error("invalid "..name_type.." name: empty string");
 	elseif s_find(name, "[<>& '\"]") then
 		error("invalid "..name_type.." name: contains invalid characters");
-	elseif not valid_xml_cdata(name, name_type == "attribute") then
-		error("invalid "..name_type.." name: contains control characters");
-	elseif not valid_utf8(name) then
-		error("invalid "..name_type.." name: contains invalid utf8");
+	end
+	local ok, err = valid_xml_cdata(name, name_type == "attribute");
+	if not ok then
+		error("invalid "..name_type.." name: contains "..err);
 	end
 end
 
 local function check_text(text, text_type)
 	if type(text) ~= "string" then
 		error("invalid "..text_type.." value: expected string, got "..type(text));
-	elseif not valid_xml_cdata(text, false) then
-		error("invalid "..text_type.." value: contains control characters");
-	elseif not valid_utf8(text) then
-		error("invalid "..text_type.." value: contains invalid utf8");
+	end
+	local ok, err = valid_xml_cdata(text, false);
+	if not ok then
+		error("invalid "..text_type.." value: contains "..err);
 	end
 end
 
@@ -107,7 +112,7 @@ end
 function stanza_mt:tag(name, attr, namespaces)
 	local s = new_stanza(name, attr, namespaces);
 	local last_add = self.last_add;
-	if not last_add then last_add = {}; self.last_add = last_add; end
+	if not last_add then last_add = last_add_pool:get(); self.last_add = last_add; end
 	(last_add[#last_add] or self):add_direct_child(s);
 	t_insert(last_add, s);
 	return self;
@@ -132,7 +137,11 @@ function stanza_mt:at_top()
 end
 
 function stanza_mt:reset()
-	self.last_add = nil;
+	local last_add = self.last_add;
+	if last_add then
+		self.last_add = nil;
+		last_add_pool:put(last_add);
+	end
 	return self;
 end
 
@@ -370,9 +379,19 @@ local function _dostring(t, buf, self, _xml_escape, parentns)
 	end
 end
 function stanza_mt.__tostring(t)
-	local buf = {};
+	local buf = buffer_pool:get();
 	_dostring(t, buf, _dostring, xml_escape, nil);
-	return t_concat(buf);
+	local s = t_concat(buf);
+	if #buf <= max_pooled_buffer then
+		buffer_pool:put(buf);
+	end
+	return s;
+end
+
+if have_xmlserialize then
+	-- Same output in a single pass, without the intermediate strings
+	xml_escape = xmlserialize.escape;
+	stanza_mt.__tostring = xmlserialize.serialize;
 end
 
 function stanza_mt.top_tag(t)
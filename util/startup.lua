@@ -679,6 +679,40 @@ function startup.init_gc()
 	return true;
 end
 
+function startup.init_allocator()
+	-- lua_allocator = "pool" moves small Lua objects into size-class pools,
+	-- memory_accounting = true then counts what each module allocates
+	local allocator = config.get("*", "lua_allocator") or "system";
+	if allocator == "system" then
+		return;
+	elseif allocator ~= "pool" then
+		log("error", "Unknown lua_allocator '%s', keeping the system allocator", allocator);
+		return;
+	end
+	local ok, pposix = pcall(require, "prosody.util.pposix");
+	if not ok or not pposix.pool_allocator then
+		log("warn", "The pooling allocator requires util.pposix, keeping the system allocator");
+		return;
+	end
+	local switched, err = pposix.pool_allocator();
+	if not switched then
+		log("error", "Could not switch to the pooling allocator: %s", err);
+		return;
+	end
+	if config.get("*", "memory_accounting") then
+		prosody.memory_accounting = true;
+	end
+	log("debug", "Using the pooling allocator");
+end
+
+function startup.init_random()
+	-- Buffering is on by default, random_pool = false reads the source every time
+	local ok, crand = pcall(require, "prosody.util.crand");
+	if ok and crand.pool then
+		crand.pool(config.get("*", "random_pool") ~= false);
+	end
+end
+
 function startup.init_errors()
 	require "prosody.util.error".configure(config.get("*", "error_library") or {});
 end
@@ -834,6 +868,19 @@ function startup.hook_posix_signals()
 	end);
 end
 
+function startup.init_workers()
+	prosody.events.add_handler("worker-started", function ()
+		-- The pidfile belongs to the supervisor, don't remove it when a worker stops
+		prosody.events.remove_handler("server-stopped", remove_pidfile);
+		if prosody.pidfile_handle then
+			prosody.pidfile_handle:close();
+		end
+		prosody.pidfile, prosody.pidfile_handle = nil, nil;
+	end);
+	-- Forks the workers once the server is starting, if configured
+	require "prosody.core.workermanager".start();
+end
+
 function startup.notification_socket()
 	local notify_socket_name = os.getenv("NOTIFY_SOCKET");
 	if not notify_socket_name then return end
@@ -924,7 +971,9 @@ function startup.prosody()
 	startup.read_config();
 	startup.check_user();
 	startup.init_logging();
+	startup.init_allocator();
 	startup.init_gc();
+	startup.init_random();
 	startup.init_errors();
 	startup.sanity_check();
 	startup.sandbox_require();
@@ -950,6 +999,7 @@ function startup.prosody()
 	startup.write_pidfile();
 	startup.hook_posix_signals();
 	startup.notification_socket();
+	startup.init_workers();
 	startup.prepare_to_start();
 	startup.notify_started();
 end
@@ -1,5 +1,5 @@
 
-local gettime = require "prosody.util.time".now
+local gettime = require "prosody.util.time".cached_now
 local setmetatable = setmetatable;
 
 local _ENV = nil;
@@ -9,12 +9,14 @@
 local lxp = require "lxp";
 local st = require "prosody.util.stanza";
 local stanza_mt = st.stanza_mt;
+local have_xmppparser, xmppparser = pcall(require, "prosody.util.xmppparser");
 
 local error = error;
 local tostring = tostring;
 local t_insert = table.insert;
 local t_concat = table.concat;
 local t_remove = table.remove;
+local t_clear = require "prosody.util.table".clear;
 local setmetatable = setmetatable;
 
 -- COMPAT: w/LuaExpat 1.1.0
@@ -74,7 +76,7 @@ local function new_sax_handlers(session, stream_callbacks, cb_handleprogress)
 		if stanza and #chardata > 0 then
 			-- We have some character data in the buffer
 			t_insert(stanza, t_concat(chardata));
-			chardata = {};
+			t_clear(chardata);
 		end
 		local curr_ns,name = tagname:match(ns_pattern);
 		if name == "" then
@@ -173,7 +175,7 @@ local function new_sax_handlers(session, stream_callbacks, cb_handleprogress)
 			if #chardata > 0 then
 				-- We have some character data in the buffer
 				t_insert(stanza, t_concat(chardata));
-				chardata = {};
+				t_clear(chardata);
 			end
 			-- Complete stanza
 			if #stack == 0 then
@@ -240,23 +242,7 @@ local function new_sax_handlers(session, stream_callbacks, cb_handleprogress)
 	return xml_handlers, { reset = reset, set_session = set_session };
 end
 
-local function new(session, stream_callbacks, stanza_size_limit)
-	-- Used to track parser progress (e.g. to enforce size limits)
-	local n_outstanding_bytes = 0;
-	local handle_progress;
-	if lxp_supports_bytecount then
-		function handle_progress(n_parsed_bytes)
-			n_outstanding_bytes = n_outstanding_bytes - n_parsed_bytes;
-		end
-		stanza_size_limit = stanza_size_limit or default_stanza_size_limit;
-	elseif stanza_size_limit then
-		error("Stanza size limits are not supported on this version of LuaExpat")
-	end
-
-	local handlers, meta = new_sax_handlers(session, stream_callbacks, handle_progress);
-	local parser = new_parser(handlers, ns_separator, false);
-	local parse = parser.parse;
-
+local function add_open_stream(session, stream_callbacks)
 	function session.open_stream(session, from, to) -- luacheck: ignore 432/session
 		local send = session.sends2s or session.send;
 
@@ -274,6 +260,56 @@ local function new(session, stream_callbacks, stanza_size_limit)
 		send("<?xml version='1.0'?>"..st.stanza("stream:stream", attr):top_tag());
 		return true;
 	end
+end
+
+-- Builds stanzas in C, calling back for each complete one. Behaves the same
+-- as the LuaExpat handlers above, and is used instead of them when available.
+local function new_native(session, stream_callbacks, stanza_size_limit)
+	local stream_ns = stream_callbacks.stream_ns or xmlns_streams;
+	local stream_tag = stream_callbacks.stream_tag or "stream";
+	if stream_ns ~= "" then
+		stream_tag = stream_ns..ns_separator..stream_tag;
+	end
+
+	add_open_stream(session, stream_callbacks);
+
+	return xmppparser.new(session, {
+		stanza_mt = stanza_mt;
+		stream_tag = stream_tag;
+		error_tag = stream_ns..ns_separator..(stream_callbacks.error_tag or "error");
+		default_ns = stream_callbacks.default_ns;
+		stanza_size_limit = stanza_size_limit or default_stanza_size_limit;
+		streamopened = stream_callbacks.streamopened;
+		handlestanza = stream_callbacks.handlestanza;
+		streamclosed = stream_callbacks.streamclosed;
+		error = stream_callbacks.error or function(_, e, stanza)
+			error("XML stream error: "..tostring(e)..(stanza and ": "..tostring(stanza) or ""),2);
+		end;
+	});
+end
+
+local function new(session, stream_callbacks, stanza_size_limit)
+	if have_xmppparser then
+		return new_native(session, stream_callbacks, stanza_size_limit);
+	end
+
+	-- Used to track parser progress (e.g. to enforce size limits)
+	local n_outstanding_bytes = 0;
+	local handle_progress;
+	if lxp_supports_bytecount then
+		function handle_progress(n_parsed_bytes)
+			n_outstanding_bytes = n_outstanding_bytes - n_parsed_bytes;
+		end
+		stanza_size_limit = stanza_size_limit or default_stanza_size_limit;
+	elseif stanza_size_limit then
+		error("Stanza size limits are not supported on this version of LuaExpat")
+	end
+
+	local handlers, meta = new_sax_handlers(session, stream_callbacks, handle_progress);
+	local parser = new_parser(handlers, ns_separator, false);
+	local parse = parser.parse;
+
+	add_open_stream(session, stream_callbacks);
 
 	return {
 		reset = function ()